@@ -0,0 +1,178 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+// odd period so that the pattern doesn't line up with power of two sizes
+#define BENCH_PATTERN_PERIOD 65521
+
+BENCH_OPTIONS g_Bench;
+
+static BYTE *g_Pattern;
+static UINT64 g_Frequency;
+static unsigned int g_Results;
+static unsigned int g_Failures;
+
+void BenchInit(int argc, char **argv, const char *benchmark)
+{
+    LARGE_INTEGER frequency;
+    SYSTEM_INFO systemInfo;
+    UINT64 i;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "--quick") == 0)
+            g_Bench.Quick = TRUE;
+        else if (strcmp(argv[arg], "--verify") == 0)
+            g_Bench.Verify = TRUE;
+        else if (strcmp(argv[arg], "--filter") == 0 && arg + 1 < argc)
+            g_Bench.Filter = argv[++arg];
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--verify] [--filter substring]\n", argv[0]);
+            exit(2);
+        }
+    }
+
+    if (g_Bench.Quick)
+        g_Bench.Verify = TRUE;
+
+    GetSystemInfo(&systemInfo);
+    g_Bench.Cpus = systemInfo.dwNumberOfProcessors;
+    QueryPerformanceFrequency(&frequency);
+    g_Frequency = (UINT64) frequency.QuadPart;
+
+    g_Pattern = (BYTE *) malloc(BENCH_PATTERN_PERIOD + BENCH_PATTERN_MAX);
+    if (!g_Pattern)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    for (i = 0; i < BENCH_PATTERN_PERIOD + BENCH_PATTERN_MAX; i++)
+        g_Pattern[i] = (BYTE) ((i % BENCH_PATTERN_PERIOD) * 2654435761u >> 13);
+
+    if (g_Bench.Cpus < 2)
+        fprintf(stderr, "warning: one CPU, multi-threaded results only show scheduling overhead\n");
+
+    printf("{\"benchmark\": \"%s\", \"cpus\": %u, \"quick\": %s, \"results\": [", benchmark, g_Bench.Cpus,
+           g_Bench.Quick ? "true" : "false");
+    fflush(stdout);
+}
+
+int BenchFinish(void)
+{
+    printf("\n], \"failures\": %u}\n", g_Failures);
+    free(g_Pattern);
+    return g_Failures ? 1 : 0;
+}
+
+UINT64 BenchNowNs(void)
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+    return (UINT64) counter.QuadPart / g_Frequency * 1000000000 + (UINT64) counter.QuadPart % g_Frequency * 1000000000 / g_Frequency;
+}
+
+BOOL BenchSelected(const char *name)
+{
+    return !g_Bench.Filter || strstr(name, g_Bench.Filter) != NULL;
+}
+
+void BenchFail(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    g_Failures++;
+}
+
+void BenchResultBegin(const char *name)
+{
+    printf("%s\n  {\"name\": \"%s\"", g_Results++ ? "," : "", name);
+}
+
+void BenchResultString(const char *key, const char *value)
+{
+    printf(", \"%s\": \"%s\"", key, value);
+}
+
+void BenchResultUInt(const char *key, UINT64 value)
+{
+    printf(", \"%s\": %llu", key, (unsigned long long) value);
+}
+
+void BenchResultDouble(const char *key, double value)
+{
+    printf(", \"%s\": %.6g", key, value);
+}
+
+void BenchResultEnd(UINT64 ops, UINT64 bytes, UINT64 elapsedNs)
+{
+    double seconds = (double) elapsedNs / 1e9;
+
+    if (elapsedNs == 0)
+        elapsedNs = 1;
+
+    BenchResultUInt("ops", ops);
+    BenchResultUInt("bytes", bytes);
+    BenchResultDouble("seconds", seconds);
+    BenchResultDouble("gbps", (double) bytes / (double) elapsedNs);
+    BenchResultDouble("ns_per_op", ops ? (double) elapsedNs / (double) ops : 0.0);
+    printf("}");
+    fflush(stdout);
+}
+
+const BYTE *BenchPattern(UINT64 offset)
+{
+    return g_Pattern + offset % BENCH_PATTERN_PERIOD;
+}
+
+BOOL BenchCheck(const char *what, UINT64 offset, const void *data, UINT64 size)
+{
+    const BYTE *bytes = (const BYTE *) data;
+    UINT64 chunk;
+
+    while (size > 0)
+    {
+        chunk = min(size, BENCH_PATTERN_MAX);
+        if (memcmp(bytes, BenchPattern(offset), (size_t) chunk) != 0)
+        {
+            BenchFail("%s: data mismatch at stream offset 0x%llx", what, (unsigned long long) offset);
+            return FALSE;
+        }
+        bytes += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return TRUE;
+}
@@ -0,0 +1,82 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Benchmark harness shared by the programs in this directory.
+//
+// Every program prints one JSON document to stdout:
+//   {"benchmark": "<name>", "cpus": N, "quick": false, "results": [ {...}, ... ], "failures": 0}
+// Each result has a name, benchmark specific fields and the common measurements
+// "ops", "bytes", "seconds", "gbps" (10^9 bytes/s) and "ns_per_op". Diagnostics go to stderr.
+// The exit code is non-zero if any verification failed, so ctest runs the programs with --quick
+// (small sizes, short runs, data always verified) as smoke tests.
+//
+// Options: --quick, --verify (check transferred data in full runs too), --filter <substring>
+// (only results whose name contains it).
+
+#pragma once
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _BENCH_OPTIONS
+{
+    BOOL Quick;
+    BOOL Verify;
+    const char *Filter;
+    unsigned int Cpus;
+} BENCH_OPTIONS;
+
+extern BENCH_OPTIONS g_Bench;
+
+// Parse the command line and start the JSON document.
+void BenchInit(int argc, char **argv, const char *benchmark);
+
+// End the JSON document, returns the process exit code.
+int BenchFinish(void);
+
+UINT64 BenchNowNs(void);
+
+// Should the result with this name run (--filter)?
+BOOL BenchSelected(const char *name);
+
+// Report a verification failure (printf format), the program will exit with 1.
+void BenchFail(const char *format, ...);
+
+// One result object: Begin, any number of fields, End with the measurements.
+void BenchResultBegin(const char *name);
+void BenchResultString(const char *key, const char *value);
+void BenchResultUInt(const char *key, UINT64 value);
+void BenchResultDouble(const char *key, double value);
+void BenchResultEnd(UINT64 ops, UINT64 bytes, UINT64 elapsedNs);
+
+// Deterministic test stream: BenchPattern(offset) points to the stream bytes starting at 'offset',
+// valid for BENCH_PATTERN_MAX bytes.
+#define BENCH_PATTERN_MAX (4 * 1024 * 1024)
+const BYTE *BenchPattern(UINT64 offset);
+
+// Compare 'size' bytes of received data with the stream at 'offset', reports a failure on mismatch.
+BOOL BenchCheck(const char *what, UINT64 offset, const void *data, UINT64 size);
+
+#ifdef __cplusplus
+}
+#endif
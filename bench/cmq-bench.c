@@ -0,0 +1,250 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// CMQ_BUFFER throughput suite: operation sizes from 1 B to 1 MB through a 4 MB buffer,
+// each with three fill patterns and three threading modes.
+//
+// Patterns, i.e. how many bytes the reader lets pile up before it drains them:
+//   steady - one operation, the buffer stays almost empty while the offsets go around
+//   half   - half the buffer, every drain crosses the end of the storage regularly
+//   full   - as many operations as fit, every pass goes all the way around
+// Modes:
+//   single - one thread adds a batch and reads it back
+//   locked - producer and consumer threads, every call in one critical section
+//            (what the pipe server used to do)
+//   spsc   - producer and consumer threads without a lock, as buffer.h allows
+// Threads block in CmqWaitForSpace/CmqWaitForData instead of spinning.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "buffer.h"
+
+#define CMQ_SUITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct _CMQ_SUITE_RUN
+{
+    CMQ_BUFFER *Buffer;
+    CRITICAL_SECTION Lock;
+    BOOL Locked;
+    UINT64 OpSize;
+    UINT64 BatchOps; // operations the reader waits for before draining
+    UINT64 TotalBytes;
+    BYTE *ReadBuffer;
+} CMQ_SUITE_RUN;
+
+static BOOL CmqSuiteAdd(CMQ_SUITE_RUN *run, UINT64 offset)
+{
+    BOOL success;
+
+    if (run->Locked)
+        EnterCriticalSection(&run->Lock);
+    success = CmqAddData(run->Buffer, BenchPattern(offset), run->OpSize);
+    if (run->Locked)
+        LeaveCriticalSection(&run->Lock);
+    return success;
+}
+
+static BOOL CmqSuiteGet(CMQ_SUITE_RUN *run, UINT64 offset)
+{
+    UINT64 size = run->OpSize;
+    BOOL success;
+
+    if (run->Locked)
+        EnterCriticalSection(&run->Lock);
+    success = CmqGetData(run->Buffer, run->ReadBuffer, &size, CMQ_NO_UNDERFLOW);
+    if (run->Locked)
+        LeaveCriticalSection(&run->Lock);
+
+    if (success && g_Bench.Verify)
+        success = BenchCheck("consumer", offset, run->ReadBuffer, size);
+    return success;
+}
+
+static BOOL CmqSuiteSingle(CMQ_SUITE_RUN *run)
+{
+    UINT64 writeOffset = 0;
+    UINT64 readOffset = 0;
+    UINT64 i;
+
+    while (writeOffset < run->TotalBytes)
+    {
+        for (i = 0; i < run->BatchOps && writeOffset < run->TotalBytes; i++, writeOffset += run->OpSize)
+        {
+            if (!CmqSuiteAdd(run, writeOffset))
+            {
+                BenchFail("CmqAddData failed at 0x%llx", (unsigned long long) writeOffset);
+                return FALSE;
+            }
+        }
+
+        for (; readOffset < writeOffset; readOffset += run->OpSize)
+        {
+            if (!CmqSuiteGet(run, readOffset))
+            {
+                BenchFail("CmqGetData failed at 0x%llx", (unsigned long long) readOffset);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+static DWORD WINAPI CmqSuiteProducer(PVOID parameter)
+{
+    CMQ_SUITE_RUN *run = (CMQ_SUITE_RUN *) parameter;
+    UINT64 offset = 0;
+
+    while (offset < run->TotalBytes)
+    {
+        if (CmqSuiteAdd(run, offset))
+            offset += run->OpSize;
+        else
+            CmqWaitForSpace(run->Buffer, run->OpSize, INFINITE);
+    }
+    return 0;
+}
+
+static BOOL CmqSuiteTwoThreads(CMQ_SUITE_RUN *run)
+{
+    HANDLE producer;
+    UINT64 offset = 0;
+    UINT64 batchEnd;
+
+    producer = CreateThread(NULL, 0, CmqSuiteProducer, run, 0, NULL);
+    if (!producer)
+    {
+        BenchFail("CreateThread failed: %lu", (unsigned long) GetLastError());
+        return FALSE;
+    }
+
+    while (offset < run->TotalBytes)
+    {
+        batchEnd = min(offset + run->BatchOps * run->OpSize, run->TotalBytes);
+        CmqWaitForData(run->Buffer, batchEnd - offset, INFINITE);
+
+        for (; offset < batchEnd; offset += run->OpSize)
+        {
+            if (!CmqSuiteGet(run, offset))
+            {
+                // the producer would never finish, there's nothing sensible to clean up
+                BenchFail("CmqGetData failed at 0x%llx", (unsigned long long) offset);
+                exit(BenchFinish());
+            }
+        }
+    }
+
+    WaitForSingleObject(producer, INFINITE);
+    CloseHandle(producer);
+    return TRUE;
+}
+
+static void CmqSuiteRun(const char *mode, const char *pattern, UINT64 threshold, UINT64 opSize, UINT64 totalBytes)
+{
+    CMQ_SUITE_RUN run;
+    char name[64];
+    BOOL single = (strcmp(mode, "single") == 0);
+    UINT64 start, elapsed;
+    BOOL success;
+
+    snprintf(name, sizeof(name), "%s/%s/%llu", mode, pattern, (unsigned long long) opSize);
+    if (!BenchSelected(name))
+        return;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Buffer = CmqCreate(CMQ_SUITE_BUFFER_SIZE);
+    run.ReadBuffer = (BYTE *) malloc((size_t) opSize);
+    if (!run.Buffer || !run.ReadBuffer)
+    {
+        BenchFail("%s: buffer allocation failed", name);
+        goto cleanup;
+    }
+
+    InitializeCriticalSection(&run.Lock);
+    run.Locked = (strcmp(mode, "locked") == 0);
+    run.OpSize = opSize;
+    run.BatchOps = max(threshold / opSize, 1);
+    run.TotalBytes = totalBytes - totalBytes % opSize;
+
+    start = BenchNowNs();
+    if (single)
+        success = CmqSuiteSingle(&run);
+    else
+        success = CmqSuiteTwoThreads(&run);
+    elapsed = BenchNowNs() - start;
+    DeleteCriticalSection(&run.Lock);
+
+    if (!success)
+        goto cleanup;
+    if (CmqGetUsedSize(run.Buffer) != 0)
+    {
+        BenchFail("%s: buffer not empty after the run", name);
+        goto cleanup;
+    }
+
+    BenchResultBegin(name);
+    BenchResultString("mode", mode);
+    BenchResultString("pattern", pattern);
+    BenchResultUInt("size", opSize);
+    BenchResultUInt("threads", single ? 1 : 2);
+    BenchResultUInt("batch_bytes", run.BatchOps * opSize);
+    BenchResultEnd(run.TotalBytes / opSize, run.TotalBytes, elapsed);
+
+cleanup:
+    if (run.Buffer)
+        CmqDestroy(run.Buffer);
+    free(run.ReadBuffer);
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 1, 8, 64, 512, 4096, 32768, 262144, 1048576 };
+    static const char *modes[] = { "single", "locked", "spsc" };
+    static const char *patterns[] = { "steady", "half", "full" };
+    UINT64 thresholds[ARRAYSIZE(patterns)];
+    UINT64 totalBytes;
+    size_t i, j, k;
+
+    BenchInit(argc, argv, "cmq-bench");
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        thresholds[0] = sizes[i];
+        thresholds[1] = CMQ_SUITE_BUFFER_SIZE / 2;
+        thresholds[2] = CMQ_SUITE_BUFFER_SIZE;
+
+        // enough operations for small sizes and enough passes around the buffer for big ones
+        if (g_Bench.Quick)
+            totalBytes = min(max(sizes[i] * 1024, 256 * 1024), 8 * 1024 * 1024);
+        else
+            totalBytes = min(max(sizes[i] * 256 * 1024, 16 * 1024 * 1024), 1024 * 1024 * 1024);
+
+        for (j = 0; j < ARRAYSIZE(patterns); j++)
+        {
+            for (k = 0; k < ARRAYSIZE(modes); k++)
+                CmqSuiteRun(modes[k], patterns[j], thresholds[j], sizes[i], totalBytes);
+        }
+    }
+
+    return BenchFinish();
+}
@@ -0,0 +1,186 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// CMQ_BUFFER throughput with a producer and a consumer thread moving a byte stream through
+// one buffer: lock-free, as buffer.h allows for one producer and one consumer ("spsc"), versus
+// every call wrapped in a critical section like the pipe server used to do ("locked").
+// Both sides block in CmqWaitForSpace/CmqWaitForData instead of spinning when the buffer
+// is full or empty, so the numbers are meaningful on a single CPU too.
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "buffer.h"
+
+#define CMQ_BENCH_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct _CMQ_BENCH_RUN
+{
+    CMQ_BUFFER *Buffer;
+    CRITICAL_SECTION Lock;
+    BOOL Locked;
+    UINT64 OpSize;
+    UINT64 TotalBytes;
+    BYTE *ReadBuffer;
+} CMQ_BENCH_RUN;
+
+static BOOL CmqBenchAdd(CMQ_BENCH_RUN *run, const void *data, UINT64 size)
+{
+    BOOL success;
+
+    if (run->Locked)
+        EnterCriticalSection(&run->Lock);
+    success = CmqAddData(run->Buffer, data, size);
+    if (run->Locked)
+        LeaveCriticalSection(&run->Lock);
+    return success;
+}
+
+static BOOL CmqBenchGet(CMQ_BENCH_RUN *run, void *data, UINT64 size)
+{
+    BOOL success;
+
+    if (run->Locked)
+        EnterCriticalSection(&run->Lock);
+    success = CmqGetData(run->Buffer, data, &size, CMQ_NO_UNDERFLOW);
+    if (run->Locked)
+        LeaveCriticalSection(&run->Lock);
+    return success;
+}
+
+static DWORD WINAPI CmqBenchProducer(PVOID parameter)
+{
+    CMQ_BENCH_RUN *run = (CMQ_BENCH_RUN *) parameter;
+    UINT64 offset = 0;
+    UINT64 size;
+
+    while (offset < run->TotalBytes)
+    {
+        size = min(run->OpSize, run->TotalBytes - offset);
+        if (CmqBenchAdd(run, BenchPattern(offset), size))
+            offset += size;
+        else
+            CmqWaitForSpace(run->Buffer, size, INFINITE);
+    }
+    return 0;
+}
+
+// Returns elapsed time in ns, 0 on failure.
+static UINT64 CmqBenchTwoThreads(CMQ_BENCH_RUN *run)
+{
+    HANDLE producer;
+    UINT64 start, elapsed;
+    UINT64 offset = 0;
+    UINT64 size;
+
+    start = BenchNowNs();
+    producer = CreateThread(NULL, 0, CmqBenchProducer, run, 0, NULL);
+    if (!producer)
+    {
+        BenchFail("CreateThread failed: %lu", (unsigned long) GetLastError());
+        return 0;
+    }
+
+    while (offset < run->TotalBytes)
+    {
+        size = min(run->OpSize, run->TotalBytes - offset);
+        if (CmqBenchGet(run, run->ReadBuffer, size))
+        {
+            if (g_Bench.Verify)
+                BenchCheck("consumer", offset, run->ReadBuffer, size);
+            offset += size;
+        }
+        else
+        {
+            CmqWaitForData(run->Buffer, size, INFINITE);
+        }
+    }
+
+    WaitForSingleObject(producer, INFINITE);
+    elapsed = BenchNowNs() - start;
+    CloseHandle(producer);
+
+    if (CmqGetUsedSize(run->Buffer) != 0)
+        BenchFail("buffer not empty after the run");
+    return elapsed;
+}
+
+static UINT64 CmqBenchMode(const char *mode, BOOL locked, UINT64 opSize, UINT64 totalBytes, UINT64 lockedNs)
+{
+    CMQ_BENCH_RUN run;
+    char name[64];
+    UINT64 elapsed = 0;
+
+    snprintf(name, sizeof(name), "%s/%llu", mode, (unsigned long long) opSize);
+    if (!BenchSelected(name))
+        return 0;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Buffer = CmqCreate(CMQ_BENCH_BUFFER_SIZE);
+    run.ReadBuffer = (BYTE *) malloc((size_t) opSize);
+    if (!run.Buffer || !run.ReadBuffer)
+    {
+        BenchFail("%s: buffer allocation failed", name);
+        goto cleanup;
+    }
+
+    InitializeCriticalSection(&run.Lock);
+    run.Locked = locked;
+    run.OpSize = opSize;
+    run.TotalBytes = totalBytes;
+
+    elapsed = CmqBenchTwoThreads(&run);
+    DeleteCriticalSection(&run.Lock);
+    if (elapsed == 0)
+        goto cleanup;
+
+    BenchResultBegin(name);
+    BenchResultString("mode", mode);
+    BenchResultUInt("size", opSize);
+    BenchResultUInt("threads", 2);
+    if (lockedNs)
+        BenchResultDouble("speedup_vs_locked", (double) lockedNs / (double) elapsed);
+    BenchResultEnd(totalBytes / opSize, totalBytes, elapsed);
+
+cleanup:
+    if (run.Buffer)
+        CmqDestroy(run.Buffer);
+    free(run.ReadBuffer);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 16, 256, 4096, 65536 };
+    UINT64 totalBytes, lockedNs;
+    size_t i;
+
+    BenchInit(argc, argv, "cmq-contention");
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        totalBytes = g_Bench.Quick ? min(sizes[i] * 4096, 32 * 1024 * 1024) : min(sizes[i] * 4 * 1024 * 1024, 1024 * 1024 * 1024);
+        lockedNs = CmqBenchMode("locked", TRUE, sizes[i], totalBytes, 0);
+        CmqBenchMode("spsc", FALSE, sizes[i], totalBytes, lockedNs);
+    }
+
+    return BenchFinish();
+}
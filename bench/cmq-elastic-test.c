@@ -0,0 +1,266 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Elastic buffer (CMQ_FLAG_ELASTIC) correctness: the storage grows segment by segment up to
+// the buffer size and consumed segments go back to the shared pool, which only keeps
+// 64 of them (the rest are freed). Two buffers of 4 MB (64 segments each) fill and drain
+// several times, so segments move between the buffers, over the pool limit and back from
+// the heap. CmqReserve/CmqCommit spans cross segment boundaries, commits bigger than
+// the reservation (or a second commit of one reservation) must fail without touching the queue.
+// A buffer smaller than a segment (own segment size, never pooled) gets the same treatment.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_BUFFER_SIZE (64 * CMQ_SEGMENT_SIZE)
+#define TEST_MAX_OP 20000
+
+typedef struct _TEST_STREAM
+{
+    const char *Name;
+    CMQ_BUFFER *Buffer;
+    UINT64 Written; // stream offset of the next byte added
+    UINT64 Read;    // stream offset of the next byte read
+    UINT32 AddOps;
+    UINT32 ReadOps;
+    UINT32 SplitReserves; // reservations with a second span (crossing a segment boundary)
+    BYTE Scratch[TEST_MAX_OP];
+} TEST_STREAM;
+
+static UINT32 g_Random = 0x6C078965;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+// add up to 'size' stream bytes, returns the number of bytes added
+static UINT64 TestAdd(TEST_STREAM *stream, UINT32 size)
+{
+    CMQ_SPAN spans[2];
+    UINT64 reserved, used;
+
+    TestFill(stream->Scratch, stream->Written, size);
+    if (stream->AddOps++ % 2 == 0)
+    {
+        if (!CmqAddData(stream->Buffer, stream->Scratch, size))
+            return 0;
+        stream->Written += size;
+        return size;
+    }
+
+    reserved = CmqReserve(stream->Buffer, size, spans);
+    if (reserved == 0)
+        return 0;
+    if (reserved > spans[0].Size)
+        stream->SplitReserves++;
+    memcpy(spans[0].Data, stream->Scratch, (size_t) spans[0].Size);
+    memcpy(spans[1].Data, stream->Scratch + spans[0].Size, (size_t) (reserved - spans[0].Size));
+
+    // more than reserved: the storage past the spans may not exist yet
+    used = CmqGetUsedSize(stream->Buffer);
+    TestCheck(!CmqCommit(stream->Buffer, reserved + 1), "%s: commit past the reservation succeeded", stream->Name);
+    TestCheck(CmqGetUsedSize(stream->Buffer) == used, "%s: failed commit changed the used size", stream->Name);
+
+    if (!TestCheck(CmqCommit(stream->Buffer, reserved), "%s: CmqCommit failed", stream->Name))
+        return 0;
+    stream->Written += reserved;
+
+    // the reservation is used up
+    TestCheck(!CmqCommit(stream->Buffer, 1), "%s: second commit of a reservation succeeded", stream->Name);
+    return reserved;
+}
+
+// read up to 'size' bytes and verify them, returns the number of bytes read
+static UINT64 TestRead(TEST_STREAM *stream, UINT32 size)
+{
+    CMQ_SPAN spans[2];
+    UINT64 dataSize = size;
+
+    if (stream->ReadOps++ % 2 == 0)
+    {
+        if (!TestCheck(CmqGetData(stream->Buffer, stream->Scratch, &dataSize, CMQ_ALLOW_UNDERFLOW),
+                       "%s: CmqGetData failed", stream->Name))
+            return 0;
+    }
+    else
+    {
+        dataSize = CmqPeek(stream->Buffer, size, spans);
+        if (dataSize == 0)
+            return 0;
+        memcpy(stream->Scratch, spans[0].Data, (size_t) spans[0].Size);
+        memcpy(stream->Scratch + spans[0].Size, spans[1].Data, (size_t) (dataSize - spans[0].Size));
+        if (!TestCheck(CmqConsume(stream->Buffer, dataSize), "%s: CmqConsume failed", stream->Name))
+            return 0;
+    }
+
+    TestVerify(stream->Name, stream->Read, stream->Scratch, dataSize);
+    stream->Read += dataSize;
+    return dataSize;
+}
+
+// add until the buffer is full, returns FALSE if it filled up early
+static BOOL TestFillUp(TEST_STREAM *stream, UINT64 bufferSize, UINT32 maxOp)
+{
+    while (TestAdd(stream, 1 + TestRandom(maxOp)) != 0)
+        ;
+    // the last add may have failed with up to maxOp bytes still free
+    return TestCheck(stream->Written - stream->Read > bufferSize - maxOp &&
+                     CmqGetUsedSize(stream->Buffer) == stream->Written - stream->Read,
+                     "%s: full at 0x%llx bytes, used size 0x%llx", stream->Name,
+                     (unsigned long long) (stream->Written - stream->Read),
+                     (unsigned long long) CmqGetUsedSize(stream->Buffer));
+}
+
+static void TestDrain(TEST_STREAM *stream)
+{
+    while (stream->Read < stream->Written && TestRead(stream, 1 + TestRandom(TEST_MAX_OP)) != 0)
+        ;
+    TestCheck(stream->Read == stream->Written && CmqGetUsedSize(stream->Buffer) == 0,
+              "%s: 0x%llx bytes not drained, used size 0x%llx", stream->Name,
+              (unsigned long long) (stream->Written - stream->Read), (unsigned long long) CmqGetUsedSize(stream->Buffer));
+}
+
+static TEST_STREAM *TestOpen(const char *name, UINT64 size)
+{
+    TEST_STREAM *stream = (TEST_STREAM *) calloc(1, sizeof(TEST_STREAM));
+
+    if (!TestCheck(stream != NULL, "%s: out of memory", name))
+        return NULL;
+
+    stream->Name = name;
+    stream->Buffer = CmqCreateEx(size, CMQ_FLAG_ELASTIC);
+    if (!TestCheck(stream->Buffer != NULL, "%s: CmqCreateEx failed", name))
+    {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static void TestClose(TEST_STREAM *stream)
+{
+    if (stream)
+    {
+        CmqDestroy(stream->Buffer);
+        free(stream);
+    }
+}
+
+// two buffers take turns: each drain returns 64 segments, more than the pool keeps
+// together with the other buffer's idle segment
+static void TestRecycle(void)
+{
+    TEST_STREAM *first = TestOpen("elastic-first", TEST_BUFFER_SIZE);
+    TEST_STREAM *second = TestOpen("elastic-second", TEST_BUFFER_SIZE);
+    TEST_STREAM *streams[2] = { first, second };
+    UINT32 cycle, i;
+
+    if (!first || !second)
+        goto cleanup;
+
+    for (cycle = 0; cycle < 6; cycle++)
+    {
+        // both full at once: 128 segments live, half of them can't come from the pool
+        for (i = 0; i < 2; i++)
+        {
+            if (!TestFillUp(streams[(cycle + i) % 2], TEST_BUFFER_SIZE, TEST_MAX_OP))
+                goto cleanup;
+        }
+        for (i = 0; i < 2; i++)
+            TestDrain(streams[(cycle + i) % 2]);
+    }
+
+    // interleaved, the buffers keep growing and shrinking
+    for (i = 0; i < 50000; i++)
+    {
+        TestAdd(streams[i % 2], 1 + TestRandom(TEST_MAX_OP));
+        TestRead(streams[i % 2], i % 4000 < 2500 ? TEST_MAX_OP / 3 : TEST_MAX_OP);
+        TestRead(streams[(i + 1) % 2], TEST_MAX_OP / 4);
+    }
+    TestDrain(first);
+    TestDrain(second);
+
+    TestCheck(first->SplitReserves > 10 && second->SplitReserves > 10, "elastic: only %u and %u reservations crossed a segment",
+              first->SplitReserves, second->SplitReserves);
+
+cleanup:
+    TestClose(first);
+    TestClose(second);
+}
+
+// smaller than a segment: one private segment size, segments bypass the pool
+static void TestSmall(void)
+{
+    TEST_STREAM *stream = TestOpen("elastic-small", 3000);
+    UINT32 i;
+
+    if (!stream)
+        return;
+
+    for (i = 0; i < 20000; i++)
+    {
+        TestAdd(stream, 1 + TestRandom(1000));
+        TestRead(stream, 1 + TestRandom(1200));
+    }
+    TestDrain(stream);
+    TestFillUp(stream, 3000, 1000);
+    TestDrain(stream);
+    TestClose(stream);
+}
+
+// the commit bound holds for the other storage types too
+static void TestCommitBound(const char *name, DWORD flags)
+{
+    CMQ_BUFFER *buffer = CmqCreateEx(4096, flags);
+    CMQ_SPAN spans[2];
+    UINT64 reserved;
+
+    if (!TestCheck(buffer != NULL, "%s: CmqCreateEx failed", name))
+        return;
+
+    TestCheck(!CmqCommit(buffer, 1), "%s: commit without a reservation succeeded", name);
+    reserved = CmqReserve(buffer, 100, spans);
+    TestCheck(reserved == 100, "%s: reserved 0x%llx", name, (unsigned long long) reserved);
+    TestCheck(!CmqCommit(buffer, 101), "%s: commit past the reservation succeeded", name);
+    TestCheck(CmqCommit(buffer, 60), "%s: partial commit failed", name);
+    TestCheck(!CmqCommit(buffer, 40), "%s: second commit of a reservation succeeded", name);
+    TestCheck(CmqCommit(buffer, 0), "%s: empty commit failed", name);
+    TestCheck(CmqGetUsedSize(buffer) == 60, "%s: used size 0x%llx", name, (unsigned long long) CmqGetUsedSize(buffer));
+    CmqDestroy(buffer);
+}
+
+int main(void)
+{
+    TestRecycle();
+    TestSmall();
+    TestCommitBound("commit", 0);
+    TestCommitBound("commit-elastic", CMQ_FLAG_ELASTIC);
+    TestCommitBound("commit-mirrored", CMQ_FLAG_MIRRORED);
+
+    return TestFinish("cmq-elastic-test");
+}
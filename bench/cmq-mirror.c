@@ -0,0 +1,190 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Wrap-heavy single-threaded traffic through a small CMQ_BUFFER, normal storage versus
+// CMQ_FLAG_MIRRORED (on Linux the compat layer maps a memfd twice back to back).
+// Write sizes don't divide the buffer size, so a large share of writes and reads cross the
+// end of the storage. "copy" uses CmqAddData/CmqGetData, "zerocopy" fills CmqReserve spans
+// and reads CmqPeek spans in place; split_ops counts operations that got two spans.
+// Set COMPAT_NO_PLACEHOLDERS to check the fallback to normal storage.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "buffer.h"
+
+#define CMQ_MIRROR_BUFFER_SIZE (64 * 1024)
+
+typedef struct _CMQ_MIRROR_RUN
+{
+    CMQ_BUFFER *Buffer;
+    UINT64 OpSize;
+    UINT64 TotalBytes;
+    BYTE *ReadBuffer;
+    UINT64 SplitOps;
+    UINT64 Checksum; // keeps the zero-copy reads from being optimized away
+} CMQ_MIRROR_RUN;
+
+static BOOL CmqMirrorCopy(CMQ_MIRROR_RUN *run)
+{
+    UINT64 offset, size;
+
+    for (offset = 0; offset < run->TotalBytes; offset += run->OpSize)
+    {
+        size = run->OpSize;
+        if (!CmqAddData(run->Buffer, BenchPattern(offset), size))
+        {
+            BenchFail("CmqAddData failed at 0x%llx", (unsigned long long) offset);
+            return FALSE;
+        }
+
+        if (!CmqGetData(run->Buffer, run->ReadBuffer, &size, CMQ_NO_UNDERFLOW))
+        {
+            BenchFail("CmqGetData failed at 0x%llx", (unsigned long long) offset);
+            return FALSE;
+        }
+
+        if (g_Bench.Verify && !BenchCheck("copy", offset, run->ReadBuffer, size))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL CmqMirrorZeroCopy(CMQ_MIRROR_RUN *run)
+{
+    CMQ_SPAN spans[2];
+    UINT64 offset, size, position;
+    UINT32 i;
+
+    for (offset = 0; offset < run->TotalBytes; offset += run->OpSize)
+    {
+        ZeroMemory(spans, sizeof(spans));
+        if (CmqReserve(run->Buffer, run->OpSize, spans) != run->OpSize)
+        {
+            BenchFail("CmqReserve failed at 0x%llx", (unsigned long long) offset);
+            return FALSE;
+        }
+
+        run->SplitOps += spans[1].Size != 0;
+        position = offset;
+        for (i = 0; i < 2 && spans[i].Size; i++)
+        {
+            memcpy(spans[i].Data, BenchPattern(position), (size_t) spans[i].Size);
+            position += spans[i].Size;
+        }
+        CmqCommit(run->Buffer, run->OpSize);
+
+        ZeroMemory(spans, sizeof(spans));
+        size = CmqPeek(run->Buffer, run->OpSize, spans);
+        if (size != run->OpSize)
+        {
+            BenchFail("CmqPeek returned 0x%llx bytes at 0x%llx", (unsigned long long) size, (unsigned long long) offset);
+            return FALSE;
+        }
+
+        run->SplitOps += spans[1].Size != 0;
+        position = offset;
+        for (i = 0; i < 2 && spans[i].Size; i++)
+        {
+            if (g_Bench.Verify && !BenchCheck("zerocopy", position, spans[i].Data, spans[i].Size))
+                return FALSE;
+            run->Checksum += spans[i].Data[0] + spans[i].Data[spans[i].Size - 1];
+            position += spans[i].Size;
+        }
+        CmqConsume(run->Buffer, run->OpSize);
+    }
+    return TRUE;
+}
+
+static void CmqMirrorRun(const char *method, DWORD flags, UINT64 opSize, UINT64 totalBytes)
+{
+    CMQ_MIRROR_RUN run;
+    char name[64];
+    BOOL mirrored;
+    UINT64 start, elapsed;
+    BOOL success;
+
+    snprintf(name, sizeof(name), "%s/%s/%llu", method, flags ? "mirrored" : "normal", (unsigned long long) opSize);
+    if (!BenchSelected(name))
+        return;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Buffer = CmqCreateEx(CMQ_MIRROR_BUFFER_SIZE, flags);
+    run.ReadBuffer = (BYTE *) malloc((size_t) opSize);
+    if (!run.Buffer || !run.ReadBuffer)
+    {
+        BenchFail("%s: buffer allocation failed", name);
+        goto cleanup;
+    }
+
+    mirrored = (CmqGetFlags(run.Buffer) & CMQ_FLAG_MIRRORED) != 0;
+    run.OpSize = opSize;
+    run.TotalBytes = totalBytes - totalBytes % opSize;
+
+    start = BenchNowNs();
+    success = (method[0] == 'c') ? CmqMirrorCopy(&run) : CmqMirrorZeroCopy(&run);
+    elapsed = BenchNowNs() - start;
+    if (!success)
+        goto cleanup;
+
+    if (mirrored && run.SplitOps != 0)
+        BenchFail("%s: mirrored buffer returned split spans", name);
+
+    BenchResultBegin(name);
+    BenchResultString("method", method);
+    BenchResultString("layout", mirrored ? "mirrored" : "normal");
+    BenchResultUInt("size", opSize);
+    BenchResultUInt("buffer_size", CMQ_MIRROR_BUFFER_SIZE);
+    if (method[0] == 'z')
+    {
+        BenchResultUInt("split_ops", run.SplitOps);
+        BenchResultUInt("checksum", run.Checksum);
+    }
+    BenchResultEnd(run.TotalBytes / opSize, run.TotalBytes, elapsed);
+
+cleanup:
+    if (run.Buffer)
+        CmqDestroy(run.Buffer);
+    free(run.ReadBuffer);
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 100, 1500, 9000, 40000 };
+    static const char *methods[] = { "copy", "zerocopy" };
+    UINT64 totalBytes;
+    size_t i, j;
+
+    BenchInit(argc, argv, "cmq-mirror");
+    totalBytes = g_Bench.Quick ? 16 * 1024 * 1024 : 1024 * 1024 * 1024;
+
+    for (j = 0; j < ARRAYSIZE(methods); j++)
+    {
+        for (i = 0; i < ARRAYSIZE(sizes); i++)
+        {
+            CmqMirrorRun(methods[j], 0, sizes[i], totalBytes);
+            CmqMirrorRun(methods[j], CMQ_FLAG_MIRRORED, sizes[i], totalBytes);
+        }
+    }
+
+    return BenchFinish();
+}
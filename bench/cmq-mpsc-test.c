@@ -0,0 +1,349 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// CMQ_FLAG_MPSC correctness: several producer threads against one consumer. Every write carries
+// its producer and sequence number, a header checksum and a payload derived from both, so the
+// consumer can tell lost, duplicated, reordered (per producer) and torn writes apart. Writes
+// have random sizes so they wrap around the small storage at every alignment; the spill runs
+// make the consumer stall so producers overflow into the spill storage and back, several times.
+// Producers alternate CmqAddData and CmqAddDataV, the consumer CmqGetData, CmqGetDataV and
+// CmqPeek/CmqConsume.
+
+#include <stdio.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_PRODUCERS 4
+#define TEST_MAX_PAYLOAD 700
+
+typedef struct _TEST_WRITE_HEADER
+{
+    UINT32 Producer;
+    UINT32 Sequence;
+    UINT32 Size;
+    UINT32 Check;
+} TEST_WRITE_HEADER;
+
+typedef struct _TEST_RUN
+{
+    const char *Name;
+    CMQ_BUFFER *Buffer;
+    UINT32 Writes; // per producer
+    // Spill runs go in rounds of that many writes per producer: the consumer doesn't read until
+    // the producers have filled the main storage and spilled, the producers don't start the next
+    // round until the consumer has drained everything. 0: no rounds.
+    UINT32 RoundWrites;
+    volatile LONG64 Received;
+    volatile LONG Abort;
+} TEST_RUN;
+
+typedef struct _TEST_PRODUCER
+{
+    TEST_RUN *Run;
+    UINT32 Id;
+} TEST_PRODUCER;
+
+static UINT32 TestHash(UINT32 producer, UINT32 sequence)
+{
+    UINT32 hash = producer * 0x9E3779B1 ^ sequence * 0x85EBCA77;
+
+    hash ^= hash >> 15;
+    hash *= 0xC2B2AE3D;
+    return hash ^ (hash >> 13);
+}
+
+static UINT32 TestPayloadSize(UINT32 producer, UINT32 sequence)
+{
+    UINT32 hash = TestHash(producer, sequence);
+
+    // mostly small writes, some empty, some large
+    if ((hash & 15) == 0)
+        return 0;
+    if ((hash & 15) == 1)
+        return TEST_MAX_PAYLOAD - (hash >> 24);
+    return (hash >> 8) % 64;
+}
+
+static BYTE TestPayloadByte(UINT32 producer, UINT32 sequence, UINT32 i)
+{
+    return (BYTE) (producer * 31 + sequence * 7 + i * 13);
+}
+
+static DWORD WINAPI TestProducer(PVOID parameter)
+{
+    TEST_PRODUCER *producer = (TEST_PRODUCER *) parameter;
+    TEST_RUN *run = producer->Run;
+    BYTE write[sizeof(TEST_WRITE_HEADER) + TEST_MAX_PAYLOAD];
+    TEST_WRITE_HEADER *header = (TEST_WRITE_HEADER *) write;
+    CMQ_SPAN spans[2];
+    UINT32 sequence, i;
+    BOOL added;
+
+    for (sequence = 0; sequence < run->Writes && !ReadAcquire(&run->Abort); sequence++)
+    {
+        while (run->RoundWrites && sequence % run->RoundWrites == 0 &&
+               ReadAcquire64(&run->Received) < (LONG64) sequence * TEST_PRODUCERS && !ReadAcquire(&run->Abort))
+            Sleep(1);
+
+        header->Producer = producer->Id;
+        header->Sequence = sequence;
+        header->Size = TestPayloadSize(producer->Id, sequence);
+        header->Check = TestHash(producer->Id, sequence) ^ header->Size;
+        for (i = 0; i < header->Size; i++)
+            write[sizeof(*header) + i] = TestPayloadByte(producer->Id, sequence, i);
+
+        while (TRUE)
+        {
+            if ((producer->Id + sequence) % 2 == 0)
+            {
+                added = CmqAddData(run->Buffer, write, sizeof(*header) + header->Size);
+            }
+            else
+            {
+                // the header and the payload from different spans still have to be one write
+                spans[0].Data = write;
+                spans[0].Size = sizeof(*header);
+                spans[1].Data = write + sizeof(*header);
+                spans[1].Size = header->Size;
+                added = CmqAddDataV(run->Buffer, spans, 2);
+            }
+
+            if (added)
+                break;
+
+            if (!TestCheck(CmqWaitForSpace(run->Buffer, sizeof(*header) + header->Size, TEST_TIMEOUT) == ERROR_SUCCESS,
+                           "%s: producer %u: timed out waiting for space", run->Name, producer->Id))
+            {
+                InterlockedExchange(&run->Abort, 1);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// consumer side: wait until 'size' bytes can be read
+static BOOL TestWaitForData(TEST_RUN *run, UINT64 size)
+{
+    if (TestCheck(CmqWaitForData(run->Buffer, size, TEST_TIMEOUT) == ERROR_SUCCESS,
+                  "%s: timed out waiting for 0x%llx bytes", run->Name, (unsigned long long) size))
+        return TRUE;
+
+    InterlockedExchange(&run->Abort, 1);
+    return FALSE;
+}
+
+// consumer side: read the payload of one write with one of the read calls
+static BOOL TestReadPayload(TEST_RUN *run, UINT32 method, BYTE *payload, UINT32 size)
+{
+    CMQ_SPAN spans[2];
+    UINT64 dataSize, peeked, done;
+
+    if (size == 0)
+        return TRUE;
+
+    switch (method % 3)
+    {
+    case 0:
+        if (!TestWaitForData(run, size))
+            return FALSE;
+        dataSize = size;
+        return TestCheck(CmqGetData(run->Buffer, payload, &dataSize, CMQ_NO_UNDERFLOW) && dataSize == size,
+                         "%s: CmqGetData failed", run->Name);
+
+    case 1:
+        if (!TestWaitForData(run, size))
+            return FALSE;
+        spans[0].Data = payload;
+        spans[0].Size = size / 3;
+        spans[1].Data = payload + size / 3;
+        spans[1].Size = size - size / 3;
+        return TestCheck(CmqGetDataV(run->Buffer, spans, 2, &dataSize, CMQ_NO_UNDERFLOW) && dataSize == size,
+                         "%s: CmqGetDataV failed", run->Name);
+
+    default:
+        // a peek can return less than the rest of the write (storage end, spill storage)
+        for (done = 0; done < size; done += peeked)
+        {
+            if (!TestWaitForData(run, size - done))
+                return FALSE;
+            peeked = CmqPeek(run->Buffer, size - done, spans);
+            if (!TestCheck(peeked != 0 && peeked <= size - done, "%s: CmqPeek returned 0x%llx",
+                           run->Name, (unsigned long long) peeked))
+                return FALSE;
+            memcpy(payload + done, spans[0].Data, (size_t) spans[0].Size);
+            if (peeked > spans[0].Size)
+                memcpy(payload + done + spans[0].Size, spans[1].Data, (size_t) (peeked - spans[0].Size));
+            if (!TestCheck(CmqConsume(run->Buffer, peeked), "%s: CmqConsume failed", run->Name))
+                return FALSE;
+        }
+        return TRUE;
+    }
+}
+
+// consumer side: wait until the producers have spilled
+static BOOL TestWaitForSpill(TEST_RUN *run)
+{
+    CMQ_SPILL_STATS stats;
+    UINT64 start = GetTickCount64();
+
+    do
+    {
+        CmqGetSpillStats(run->Buffer, &stats);
+        if (stats.SpilledNow != 0)
+            return TRUE;
+        Sleep(1);
+    } while (GetTickCount64() - start < TEST_TIMEOUT && !ReadAcquire(&run->Abort));
+
+    TestCheck(FALSE, "%s: producers didn't spill", run->Name);
+    InterlockedExchange(&run->Abort, 1);
+    return FALSE;
+}
+
+static void TestConsumer(TEST_RUN *run)
+{
+    UINT32 next[TEST_PRODUCERS] = { 0 };
+    BYTE payload[TEST_MAX_PAYLOAD];
+    TEST_WRITE_HEADER header;
+    UINT64 total = (UINT64) run->Writes * TEST_PRODUCERS;
+    UINT64 received, dataSize;
+    UINT32 i;
+
+    for (received = 0; received < total && !ReadAcquire(&run->Abort); WriteRelease64(&run->Received, (LONG64) ++received))
+    {
+        if (run->RoundWrites && received % ((UINT64) run->RoundWrites * TEST_PRODUCERS) == 0 && !TestWaitForSpill(run))
+            return;
+
+        if (!TestWaitForData(run, sizeof(header)))
+            return;
+        dataSize = sizeof(header);
+        if (!TestCheck(CmqGetData(run->Buffer, &header, &dataSize, CMQ_NO_UNDERFLOW), "%s: CmqGetData failed", run->Name))
+            goto abort;
+
+        if (!TestCheck(header.Producer < TEST_PRODUCERS && header.Size <= TEST_MAX_PAYLOAD &&
+                       header.Check == (TestHash(header.Producer, header.Sequence) ^ header.Size),
+                       "%s: write %llu: torn header (producer %u, sequence %u, size %u)",
+                       run->Name, (unsigned long long) received, header.Producer, header.Sequence, header.Size))
+            goto abort;
+
+        if (!TestCheck(header.Sequence == next[header.Producer], "%s: producer %u: got write %u, expected %u",
+                       run->Name, header.Producer, header.Sequence, next[header.Producer]))
+            goto abort;
+        next[header.Producer]++;
+
+        if (!TestReadPayload(run, (UINT32) received, payload, header.Size))
+            goto abort;
+
+        for (i = 0; i < header.Size; i++)
+        {
+            if (!TestCheck(payload[i] == TestPayloadByte(header.Producer, header.Sequence, i),
+                           "%s: producer %u, write %u: payload mismatch at %u", run->Name, header.Producer, header.Sequence, i))
+                goto abort;
+        }
+    }
+    return;
+
+abort:
+    InterlockedExchange(&run->Abort, 1);
+}
+
+static void TestMpsc(const char *name, DWORD flags, UINT64 bufferSize, UINT64 spillSize, UINT32 writes,
+                     UINT32 roundWrites)
+{
+    TEST_PRODUCER producers[TEST_PRODUCERS];
+    HANDLE threads[TEST_PRODUCERS];
+    CMQ_SPILL_STATS spillStats;
+    CMQ_STATS stats;
+    TEST_RUN run;
+    UINT64 expectedBytes = 0;
+    UINT32 i, sequence, started;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Name = name;
+    run.Writes = writes;
+    run.RoundWrites = roundWrites;
+    run.Buffer = CmqCreateEx(bufferSize, CMQ_FLAG_MPSC | flags);
+    if (!TestCheck(run.Buffer != NULL, "%s: CmqCreateEx failed", name))
+        return;
+    if (spillSize)
+        TestCheck(CmqSetSpillSize(run.Buffer, spillSize), "%s: CmqSetSpillSize failed", name);
+
+    for (started = 0; started < TEST_PRODUCERS; started++)
+    {
+        producers[started].Run = &run;
+        producers[started].Id = started;
+        threads[started] = CreateThread(NULL, 0, TestProducer, &producers[started], 0, NULL);
+        if (!TestCheck(threads[started] != NULL, "%s: CreateThread failed", name))
+        {
+            InterlockedExchange(&run.Abort, 1);
+            break;
+        }
+    }
+
+    if (started == TEST_PRODUCERS)
+        TestConsumer(&run);
+
+    for (i = 0; i < started; i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    if (!ReadAcquire(&run.Abort))
+    {
+        for (i = 0; i < TEST_PRODUCERS; i++)
+        {
+            for (sequence = 0; sequence < writes; sequence++)
+                expectedBytes += sizeof(TEST_WRITE_HEADER) + TestPayloadSize(i, sequence);
+        }
+
+        CmqGetStats(run.Buffer, &stats);
+        TestCheck(CmqGetUsedSize(run.Buffer) == 0, "%s: %llu bytes left", name, (unsigned long long) CmqGetUsedSize(run.Buffer));
+        TestCheck(stats.BytesIn == expectedBytes && stats.BytesOut == expectedBytes,
+                  "%s: stats: %llu bytes in, %llu out, expected %llu", name,
+                  (unsigned long long) stats.BytesIn, (unsigned long long) stats.BytesOut, (unsigned long long) expectedBytes);
+        TestCheck(stats.HighWatermark <= bufferSize + spillSize, "%s: high watermark %llu", name, (unsigned long long) stats.HighWatermark);
+
+        if (spillSize)
+        {
+            CmqGetSpillStats(run.Buffer, &spillStats);
+            TestCheck(spillStats.SpillCount >= writes / roundWrites && spillStats.SpilledBytes > 0 && spillStats.SpilledNow == 0,
+                      "%s: spill stats: %llu spills, %llu bytes spilled, %llu now", name,
+                      (unsigned long long) spillStats.SpillCount, (unsigned long long) spillStats.SpilledBytes,
+                      (unsigned long long) spillStats.SpilledNow);
+        }
+    }
+
+    CmqDestroy(run.Buffer);
+}
+
+int main(void)
+{
+    // storage of a few writes: every write contends, wraps often
+    TestMpsc("mpsc", 0, 4096, 0, 20000, 0);
+    TestMpsc("mpsc-timestamps", CMQ_FLAG_TIMESTAMPS, 4096, 0, 20000, 0);
+    // every round fills the main storage and the spill storage, which is drained again
+    TestMpsc("mpsc-spill", 0, 4096, 64 * 1024, 6000, 1000);
+    TestMpsc("mpsc-spill-timestamps", CMQ_FLAG_TIMESTAMPS, 4096, 64 * 1024, 6000, 1000);
+
+    return TestFinish("cmq-mpsc-test");
+}
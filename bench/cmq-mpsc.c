@@ -0,0 +1,210 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// CMQ_FLAG_MPSC scaling: 1 to N producer threads add fixed-size writes to one buffer drained by
+// one consumer thread, lock-free claims ("mpsc") versus a plain buffer with every call in a
+// critical section ("locked"). The consumer reads in large chunks, so the producers' side is what's
+// measured. "scaling" is the throughput relative to one producer in the same mode. Producers and
+// the consumer block in CmqWaitForSpace/CmqWaitForData when the buffer is full or empty. On fewer
+// CPUs than threads the numbers mostly show scheduling, the harness warns about one CPU.
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "buffer.h"
+
+#define CMQ_BENCH_BUFFER_SIZE (4 * 1024 * 1024)
+#define CMQ_BENCH_READ_SIZE (64 * 1024)
+#define CMQ_BENCH_MAX_PRODUCERS 16
+
+typedef struct _CMQ_BENCH_RUN
+{
+    CMQ_BUFFER *Buffer;
+    CRITICAL_SECTION Lock;
+    BOOL Locked;
+    UINT64 OpSize;
+    UINT64 OpsPerProducer;
+    BYTE *ReadBuffer;
+} CMQ_BENCH_RUN;
+
+static BOOL CmqBenchAdd(CMQ_BENCH_RUN *run, const void *data, UINT64 size)
+{
+    BOOL success;
+
+    if (run->Locked)
+        EnterCriticalSection(&run->Lock);
+    success = CmqAddData(run->Buffer, data, size);
+    if (run->Locked)
+        LeaveCriticalSection(&run->Lock);
+    return success;
+}
+
+static UINT64 CmqBenchGet(CMQ_BENCH_RUN *run)
+{
+    UINT64 size = CMQ_BENCH_READ_SIZE;
+
+    if (run->Locked)
+        EnterCriticalSection(&run->Lock);
+    CmqGetData(run->Buffer, run->ReadBuffer, &size, CMQ_ALLOW_UNDERFLOW);
+    if (run->Locked)
+        LeaveCriticalSection(&run->Lock);
+    return size;
+}
+
+static DWORD WINAPI CmqBenchProducer(PVOID parameter)
+{
+    CMQ_BENCH_RUN *run = (CMQ_BENCH_RUN *) parameter;
+    const BYTE *data = BenchPattern(0);
+    UINT64 op = 0;
+
+    while (op < run->OpsPerProducer)
+    {
+        if (CmqBenchAdd(run, data, run->OpSize))
+            op++;
+        else
+            CmqWaitForSpace(run->Buffer, run->OpSize, INFINITE);
+    }
+    return 0;
+}
+
+// Returns elapsed time in ns, 0 on failure.
+static UINT64 CmqBenchProducers(CMQ_BENCH_RUN *run, UINT32 producerCount)
+{
+    HANDLE producers[CMQ_BENCH_MAX_PRODUCERS];
+    UINT64 start, elapsed;
+    UINT64 totalBytes = run->OpSize * run->OpsPerProducer * producerCount;
+    UINT64 received = 0, size;
+    UINT32 i, started;
+
+    start = BenchNowNs();
+    for (started = 0; started < producerCount; started++)
+    {
+        producers[started] = CreateThread(NULL, 0, CmqBenchProducer, run, 0, NULL);
+        if (!producers[started])
+        {
+            BenchFail("CreateThread failed: %lu", (unsigned long) GetLastError());
+            break;
+        }
+    }
+
+    // the producers that did start still have to finish
+    totalBytes = run->OpSize * run->OpsPerProducer * started;
+    while (received < totalBytes)
+    {
+        size = CmqBenchGet(run);
+        if (size != 0)
+            received += size;
+        else
+            CmqWaitForData(run->Buffer, min(run->OpSize, totalBytes - received), INFINITE);
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        WaitForSingleObject(producers[i], INFINITE);
+        CloseHandle(producers[i]);
+    }
+    elapsed = BenchNowNs() - start;
+
+    if (started != producerCount)
+        return 0;
+    if (CmqGetUsedSize(run->Buffer) != 0)
+        BenchFail("buffer not empty after the run");
+    return elapsed;
+}
+
+static UINT64 CmqBenchMode(const char *mode, BOOL locked, UINT64 opSize, UINT32 producerCount, UINT64 totalBytes,
+                           UINT64 singleNs, UINT64 lockedNs)
+{
+    CMQ_BENCH_RUN run;
+    char name[64];
+    UINT64 elapsed = 0;
+
+    snprintf(name, sizeof(name), "%s/%llu/%u", mode, (unsigned long long) opSize, producerCount);
+    if (!BenchSelected(name))
+        return 0;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Buffer = CmqCreateEx(CMQ_BENCH_BUFFER_SIZE, locked ? 0 : CMQ_FLAG_MPSC);
+    run.ReadBuffer = (BYTE *) malloc(CMQ_BENCH_READ_SIZE);
+    if (!run.Buffer || !run.ReadBuffer)
+    {
+        BenchFail("%s: buffer allocation failed", name);
+        goto cleanup;
+    }
+
+    InitializeCriticalSection(&run.Lock);
+    run.Locked = locked;
+    run.OpSize = opSize;
+    run.OpsPerProducer = totalBytes / opSize / producerCount;
+
+    elapsed = CmqBenchProducers(&run, producerCount);
+    DeleteCriticalSection(&run.Lock);
+    if (elapsed == 0)
+        goto cleanup;
+
+    BenchResultBegin(name);
+    BenchResultString("mode", mode);
+    BenchResultUInt("size", opSize);
+    BenchResultUInt("producers", producerCount);
+    // per-run work differs a little from the rounding, compare rates
+    if (singleNs)
+        BenchResultDouble("scaling", (double) singleNs / (double) elapsed * (double) (run.OpsPerProducer * producerCount) /
+                                         (double) (totalBytes / opSize));
+    if (lockedNs)
+        BenchResultDouble("speedup_vs_locked", (double) lockedNs / (double) elapsed);
+    BenchResultEnd(run.OpsPerProducer * producerCount, run.OpsPerProducer * producerCount * opSize, elapsed);
+
+cleanup:
+    if (run.Buffer)
+        CmqDestroy(run.Buffer);
+    free(run.ReadBuffer);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 64, 1024 };
+    static const UINT32 producerCounts[] = { 1, 2, 4, 8, 16 };
+    UINT64 totalBytes, lockedNs, singleLockedNs, singleMpscNs, mpscNs;
+    UINT32 maxProducers;
+    size_t i, j;
+
+    BenchInit(argc, argv, "cmq-mpsc");
+    maxProducers = max(8, min(2 * g_Bench.Cpus, CMQ_BENCH_MAX_PRODUCERS));
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        totalBytes = g_Bench.Quick ? sizes[i] * 16384 : sizes[i] * 4 * 1024 * 1024;
+        singleLockedNs = singleMpscNs = 0;
+        for (j = 0; j < ARRAYSIZE(producerCounts) && producerCounts[j] <= maxProducers; j++)
+        {
+            lockedNs = CmqBenchMode("locked", TRUE, sizes[i], producerCounts[j], totalBytes, singleLockedNs, 0);
+            mpscNs = CmqBenchMode("mpsc", FALSE, sizes[i], producerCounts[j], totalBytes, singleMpscNs, lockedNs);
+            if (j == 0)
+            {
+                singleLockedNs = lockedNs;
+                singleMpscNs = mpscNs;
+            }
+        }
+    }
+
+    return BenchFinish();
+}
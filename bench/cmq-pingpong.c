@@ -0,0 +1,200 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Ping-pong round trip latency between two threads over a pair of CMQ_BUFFERs: the main
+// thread writes a message to one buffer, an echo thread reads it and writes it back to the
+// other. "poll" retries CmqGetData with Sleep(1) in between, the way the pipe server waited
+// before CmqWaitForData existed; "wait" blocks in CmqWaitForData. Besides the mean (ns_per_op)
+// each result has the median, 99th percentile and worst round trip.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "buffer.h"
+
+#define CMQ_PING_BUFFER_SIZE (64 * 1024)
+
+typedef struct _CMQ_PING_RUN
+{
+    CMQ_BUFFER *Request;
+    CMQ_BUFFER *Reply;
+    BOOL Poll;
+    UINT64 MessageSize;
+    UINT64 Rounds;
+    BYTE *EchoBuffer;
+    volatile BOOL EchoFailed;
+} CMQ_PING_RUN;
+
+// Read exactly 'size' bytes, waiting the way the run is configured to.
+static BOOL CmqPingReceive(CMQ_PING_RUN *run, CMQ_BUFFER *buffer, void *data, UINT64 size)
+{
+    UINT64 readSize;
+
+    while (TRUE)
+    {
+        readSize = size;
+        if (CmqGetData(buffer, data, &readSize, CMQ_NO_UNDERFLOW))
+            return TRUE;
+
+        if (run->Poll)
+            Sleep(1);
+        else if (CmqWaitForData(buffer, size, INFINITE) != ERROR_SUCCESS)
+            return FALSE;
+    }
+}
+
+static DWORD WINAPI CmqPingEcho(PVOID parameter)
+{
+    CMQ_PING_RUN *run = (CMQ_PING_RUN *) parameter;
+    UINT64 round;
+
+    for (round = 0; round < run->Rounds; round++)
+    {
+        // messages are smaller than the buffer and only one is in flight, adding can't fail
+        if (!CmqPingReceive(run, run->Request, run->EchoBuffer, run->MessageSize) ||
+            !CmqAddData(run->Reply, run->EchoBuffer, run->MessageSize))
+        {
+            run->EchoFailed = TRUE;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int CmqPingCompare(const void *a, const void *b)
+{
+    UINT64 x = *(const UINT64 *) a;
+    UINT64 y = *(const UINT64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void CmqPingRun(const char *mode, BOOL poll, UINT64 messageSize, UINT64 rounds)
+{
+    CMQ_PING_RUN run;
+    char name[64];
+    HANDLE echo = NULL;
+    BYTE *reply = NULL;
+    UINT64 *latencies = NULL;
+    UINT64 round, start, roundStart, elapsed;
+    BOOL abandoned = FALSE;
+
+    snprintf(name, sizeof(name), "%s/%llu", mode, (unsigned long long) messageSize);
+    if (!BenchSelected(name))
+        return;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Request = CmqCreate(CMQ_PING_BUFFER_SIZE);
+    run.Reply = CmqCreate(CMQ_PING_BUFFER_SIZE);
+    run.EchoBuffer = (BYTE *) malloc((size_t) messageSize);
+    reply = (BYTE *) malloc((size_t) messageSize);
+    latencies = (UINT64 *) malloc((size_t) rounds * sizeof(UINT64));
+    if (!run.Request || !run.Reply || !run.EchoBuffer || !reply || !latencies)
+    {
+        BenchFail("%s: allocation failed", name);
+        goto cleanup;
+    }
+
+    run.Poll = poll;
+    run.MessageSize = messageSize;
+    run.Rounds = rounds;
+
+    echo = CreateThread(NULL, 0, CmqPingEcho, &run, 0, NULL);
+    if (!echo)
+    {
+        BenchFail("CreateThread failed: %lu", (unsigned long) GetLastError());
+        goto cleanup;
+    }
+
+    start = BenchNowNs();
+    for (round = 0; round < rounds; round++)
+    {
+        roundStart = BenchNowNs();
+        if (!CmqAddData(run.Request, BenchPattern(round), messageSize) ||
+            !CmqPingReceive(&run, run.Reply, reply, messageSize))
+        {
+            BenchFail("%s: round %llu failed", name, (unsigned long long) round);
+            break;
+        }
+        latencies[round] = BenchNowNs() - roundStart;
+
+        if (g_Bench.Verify && !BenchCheck(name, round, reply, messageSize))
+            break;
+    }
+    elapsed = BenchNowNs() - start;
+
+    if (round < rounds)
+    {
+        // the echo thread may be stuck waiting for a request that will never come, leave it
+        // and its buffers alone
+        abandoned = TRUE;
+        goto cleanup;
+    }
+
+    WaitForSingleObject(echo, INFINITE);
+    if (run.EchoFailed)
+    {
+        BenchFail("%s: echo thread failed", name);
+        goto cleanup;
+    }
+
+    qsort(latencies, (size_t) rounds, sizeof(UINT64), CmqPingCompare);
+
+    BenchResultBegin(name);
+    BenchResultString("mode", mode);
+    BenchResultUInt("size", messageSize);
+    BenchResultUInt("p50_ns", latencies[rounds / 2]);
+    BenchResultUInt("p99_ns", latencies[rounds * 99 / 100]);
+    BenchResultUInt("max_ns", latencies[rounds - 1]);
+    BenchResultEnd(rounds, 2 * rounds * messageSize, elapsed);
+
+cleanup:
+    if (echo)
+        CloseHandle(echo);
+    if (!abandoned)
+    {
+        if (run.Request)
+            CmqDestroy(run.Request);
+        if (run.Reply)
+            CmqDestroy(run.Reply);
+        free(run.EchoBuffer);
+    }
+    free(reply);
+    free(latencies);
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 16, 4096 };
+    size_t i;
+
+    BenchInit(argc, argv, "cmq-pingpong");
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        // every polled round trip sleeps at least once, keep those runs short
+        CmqPingRun("poll", TRUE, sizes[i], g_Bench.Quick ? 50 : 2000);
+        CmqPingRun("wait", FALSE, sizes[i], g_Bench.Quick ? 2000 : 200000);
+    }
+
+    return BenchFinish();
+}
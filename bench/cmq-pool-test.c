@@ -0,0 +1,265 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Buffer pool (CmqCreatePool) correctness: preallocated slabs are used up, further buffers
+// come from the system, destroyed buffers go back to the free list up to maxFreeCount and
+// the rest are released, with CmqGetPoolStats checked at every step. Buffers from reused slabs
+// must start empty, live buffers must not share storage, MPSC and timestamped buffers reuse
+// slabs of plain ones and the other way around. CmqDestroyPool must refuse while buffers
+// are in use. Several threads create and destroy buffers at once to exercise the free list.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_BUFFER_SIZE 5000
+#define TEST_PREALLOC 4
+#define TEST_MAX_FREE 6
+#define TEST_BUFFERS 10
+#define TEST_THREADS 4
+#define TEST_THREAD_ROUNDS 20000
+
+static CMQ_POOL *g_Pool;
+
+static void TestPoolStats(const char *step, UINT64 allocated, UINT64 released, UINT64 reused, UINT64 inUse, UINT64 freeCount)
+{
+    CMQ_POOL_STATS stats;
+
+    CmqGetPoolStats(g_Pool, &stats);
+    TestCheck(stats.Allocated == allocated && stats.Released == released && stats.Reused == reused &&
+              stats.InUse == inUse && stats.Free == freeCount,
+              "%s: allocated %llu (%llu), released %llu (%llu), reused %llu (%llu), in use %llu (%llu), free %llu (%llu)", step,
+              (unsigned long long) stats.Allocated, (unsigned long long) allocated,
+              (unsigned long long) stats.Released, (unsigned long long) released,
+              (unsigned long long) stats.Reused, (unsigned long long) reused,
+              (unsigned long long) stats.InUse, (unsigned long long) inUse,
+              (unsigned long long) stats.Free, (unsigned long long) freeCount);
+}
+
+// a buffer from a slab must look brand new, whatever the slab held before
+static void TestEmpty(const char *step, CMQ_BUFFER *buffer)
+{
+    CMQ_STATS stats;
+    BYTE data[16];
+    UINT64 dataSize = sizeof(data);
+
+    CmqGetStats(buffer, &stats);
+    TestCheck(CmqGetUsedSize(buffer) == 0 && stats.BytesIn == 0 && stats.HighWatermark == 0 && stats.FailedAdds == 0 &&
+              !CmqGetData(buffer, data, &dataSize, CMQ_NO_UNDERFLOW),
+              "%s: %p not empty: used 0x%llx, 0x%llx bytes in", step, buffer, (unsigned long long) CmqGetUsedSize(buffer),
+              (unsigned long long) stats.BytesIn);
+}
+
+// stream 'rounds' buffer sizes through the buffer (wrapping it), stream 'id' has its own offsets
+static void TestStream(const char *step, CMQ_BUFFER *buffer, UINT32 id, UINT32 rounds)
+{
+    BYTE data[1000];
+    UINT64 written = (UINT64) id << 32, read = written, dataSize;
+    UINT32 i;
+
+    for (i = 0; i < rounds * TEST_BUFFER_SIZE / 700; i++)
+    {
+        TestFill(data, written, 700);
+        if (!TestCheck(CmqAddData(buffer, data, 700), "%s: add failed", step))
+            return;
+        written += 700;
+        dataSize = sizeof(data);
+        if (i % 3 != 0)
+        {
+            if (!TestCheck(CmqGetData(buffer, data, &dataSize, CMQ_ALLOW_UNDERFLOW), "%s: read failed", step))
+                return;
+            TestVerify(step, read, data, dataSize);
+            read += dataSize;
+        }
+    }
+
+    while (read < written)
+    {
+        dataSize = sizeof(data);
+        if (!TestCheck(CmqGetData(buffer, data, &dataSize, CMQ_ALLOW_UNDERFLOW) && dataSize > 0, "%s: read failed", step))
+            return;
+        TestVerify(step, read, data, dataSize);
+        read += dataSize;
+    }
+}
+
+static void TestSequential(void)
+{
+    CMQ_BUFFER *buffers[TEST_BUFFERS];
+    CMQ_POOL_STATS stats;
+    BYTE data[TEST_BUFFER_SIZE];
+    UINT64 dataSize;
+    UINT32 i;
+
+    g_Pool = CmqCreatePool(TEST_BUFFER_SIZE, 0, TEST_PREALLOC, TEST_MAX_FREE);
+    if (!TestCheck(g_Pool != NULL, "CmqCreatePool failed"))
+        return;
+
+    CmqGetPoolStats(g_Pool, &stats);
+    TestCheck(stats.BufferSize >= TEST_BUFFER_SIZE && stats.BufferSize < TEST_BUFFER_SIZE + 32 &&
+              stats.SlabSize > stats.BufferSize && !stats.LargePages,
+              "pool: buffer size 0x%llx, slab size 0x%llx", (unsigned long long) stats.BufferSize,
+              (unsigned long long) stats.SlabSize);
+    TestPoolStats("created", TEST_PREALLOC, 0, 0, 0, TEST_PREALLOC);
+
+    // preallocated slabs first, then new ones
+    for (i = 0; i < TEST_BUFFERS; i++)
+    {
+        buffers[i] = CmqCreateFromPool(g_Pool, 0);
+        if (!TestCheck(buffers[i] != NULL, "CmqCreateFromPool %u failed", i))
+            return;
+        TestEmpty("new", buffers[i]);
+    }
+    TestPoolStats("exhausted", TEST_BUFFERS, 0, TEST_PREALLOC, TEST_BUFFERS, 0);
+
+    // fill all of them at once, storage must not overlap
+    for (i = 0; i < TEST_BUFFERS; i++)
+    {
+        TestFill(data, (UINT64) i << 32, TEST_BUFFER_SIZE);
+        TestCheck(CmqAddData(buffers[i], data, TEST_BUFFER_SIZE), "buffer %u: fill failed", i);
+    }
+    for (i = 0; i < TEST_BUFFERS; i++)
+    {
+        dataSize = 0;
+        TestCheck(CmqGetData(buffers[i], data, &dataSize, CMQ_NO_UNDERFLOW) && dataSize == TEST_BUFFER_SIZE,
+                  "buffer %u: read failed", i);
+        TestVerify("filled", (UINT64) i << 32, data, dataSize);
+        TestStream("wrap", buffers[i], i, 3);
+    }
+
+    // the free list keeps TEST_MAX_FREE slabs, the rest go back to the system
+    for (i = 0; i < TEST_BUFFERS; i++)
+        CmqDestroy(buffers[i]);
+    TestPoolStats("destroyed", TEST_BUFFERS, TEST_BUFFERS - TEST_MAX_FREE, TEST_PREALLOC, 0, TEST_MAX_FREE);
+
+    // reused slabs, with other flags than before
+    buffers[0] = CmqCreateFromPool(g_Pool, CMQ_FLAG_MPSC | CMQ_FLAG_TIMESTAMPS);
+    buffers[1] = CmqCreateFromPool(g_Pool, CMQ_FLAG_TIMESTAMPS);
+    buffers[2] = CmqCreateFromPool(g_Pool, CMQ_FLAG_MPSC);
+    TestPoolStats("reused", TEST_BUFFERS, TEST_BUFFERS - TEST_MAX_FREE, TEST_PREALLOC + 3, 3, TEST_MAX_FREE - 3);
+    for (i = 0; i < 3; i++)
+    {
+        if (!TestCheck(buffers[i] != NULL, "CmqCreateFromPool %u failed", i))
+            return;
+        TestEmpty("reused", buffers[i]);
+        TestStream("reused", buffers[i], i, 3);
+    }
+
+    // refused while buffers are in use, the pool stays usable
+    CmqDestroyPool(g_Pool);
+    TestPoolStats("destroy refused", TEST_BUFFERS, TEST_BUFFERS - TEST_MAX_FREE, TEST_PREALLOC + 3, 3, TEST_MAX_FREE - 3);
+
+    // plain buffers on slabs that held MPSC ones
+    for (i = 0; i < 3; i++)
+        CmqDestroy(buffers[i]);
+    for (i = 0; i < 3; i++)
+    {
+        buffers[i] = CmqCreateFromPool(g_Pool, CMQ_FLAG_MIRRORED);
+        if (!TestCheck(buffers[i] != NULL, "CmqCreateFromPool %u failed", i))
+            return;
+        TestCheck(!(CmqGetFlags(buffers[i]) & CMQ_FLAG_MIRRORED), "pool buffer is mirrored");
+        TestEmpty("reused again", buffers[i]);
+        TestStream("reused again", buffers[i], i, 2);
+    }
+    for (i = 0; i < 3; i++)
+        CmqDestroy(buffers[i]);
+    TestPoolStats("idle", TEST_BUFFERS, TEST_BUFFERS - TEST_MAX_FREE, TEST_PREALLOC + 6, 0, TEST_MAX_FREE);
+
+    CmqDestroyPool(g_Pool);
+    g_Pool = NULL;
+}
+
+static DWORD WINAPI TestWorker(PVOID param)
+{
+    UINT32 id = (UINT32) (ULONG_PTR) param;
+    CMQ_BUFFER *buffers[3] = { NULL };
+    UINT32 i, slot;
+
+    // keep 0-3 buffers alive, so the free list is empty now and then
+    for (i = 0; i < TEST_THREAD_ROUNDS; i++)
+    {
+        slot = (i * 7 + id) % 3;
+        if (buffers[slot])
+        {
+            TestStream("threads", buffers[slot], id, 1);
+            CmqDestroy(buffers[slot]);
+            buffers[slot] = NULL;
+        }
+        else
+        {
+            buffers[slot] = CmqCreateFromPool(g_Pool, i % 5 == 0 ? CMQ_FLAG_MPSC : 0);
+            if (!TestCheck(buffers[slot] != NULL, "thread %u: CmqCreateFromPool failed", id))
+                break;
+            TestEmpty("threads", buffers[slot]);
+        }
+    }
+
+    for (slot = 0; slot < 3; slot++)
+    {
+        if (buffers[slot])
+            CmqDestroy(buffers[slot]);
+    }
+    return 0;
+}
+
+static void TestThreads(void)
+{
+    HANDLE threads[TEST_THREADS];
+    CMQ_POOL_STATS stats;
+    UINT32 i, started;
+
+    g_Pool = CmqCreatePool(TEST_BUFFER_SIZE, 0, 2, TEST_MAX_FREE);
+    if (!TestCheck(g_Pool != NULL, "CmqCreatePool failed"))
+        return;
+
+    for (started = 0; started < TEST_THREADS; started++)
+    {
+        threads[started] = CreateThread(NULL, 0, TestWorker, (PVOID) (ULONG_PTR) started, 0, NULL);
+        if (!TestCheck(threads[started] != NULL, "CreateThread failed"))
+            break;
+    }
+    for (i = 0; i < started; i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    // every slab is accounted for
+    CmqGetPoolStats(g_Pool, &stats);
+    TestCheck(stats.InUse == 0 && stats.Free <= TEST_MAX_FREE && stats.Allocated - stats.Released == stats.Free &&
+              stats.Reused > TEST_THREAD_ROUNDS,
+              "threads: allocated %llu, released %llu, reused %llu, in use %llu, free %llu",
+              (unsigned long long) stats.Allocated, (unsigned long long) stats.Released, (unsigned long long) stats.Reused,
+              (unsigned long long) stats.InUse, (unsigned long long) stats.Free);
+
+    CmqDestroyPool(g_Pool);
+    g_Pool = NULL;
+}
+
+int main(void)
+{
+    TestSequential();
+    TestThreads();
+
+    return TestFinish("cmq-pool-test");
+}
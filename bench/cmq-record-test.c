@@ -0,0 +1,254 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Record queue (CmqAddRecord...) correctness: random records from empty to 20 KB go through
+// a small ring buffer, an elastic buffer and a buffer with spill storage, so headers and payloads
+// are split by the ring wrap and by segment boundaries (checked by counting them). Reads rotate
+// CmqGetRecord, CmqPeekRecordSize + CmqGetRecord, CmqGetRecord with a too small output buffer
+// (the record must stay queued) and CmqGetRecords batches with random output sizes and record limits.
+// Every record must come out whole, in order, with its size and payload intact.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_MAX_RECORD 20000
+#define TEST_MAX_QUEUED (1 << 17) // records in flight, more than fit into any test buffer
+#define TEST_BATCH_SIZE (4 * TEST_MAX_RECORD)
+
+typedef struct _TEST_RECORDS
+{
+    const char *Name;
+    CMQ_BUFFER *Buffer;
+    UINT64 Boundary;     // wrap or segment size, for counting split records
+    UINT64 QueueBytes;   // stream offset of the next record (headers included)
+    UINT64 PayloadIn;    // payload stream offset of the next record added
+    UINT64 PayloadOut;   // payload stream offset of the next record read
+    UINT32 Added;
+    UINT32 Received;
+    UINT32 SplitHeaders; // header crossing the boundary
+    UINT32 SplitPayloads;
+    UINT32 ReadOps;
+    UINT32 Sizes[TEST_MAX_QUEUED];
+    BYTE Scratch[TEST_BATCH_SIZE];
+} TEST_RECORDS;
+
+static UINT32 g_Random = 0x1B873593;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+// mostly small records, some empty, some big
+static UINT32 TestRecordSize(void)
+{
+    UINT32 kind = TestRandom(16);
+
+    if (kind == 0)
+        return 0;
+    if (kind == 1)
+        return TestRandom(TEST_MAX_RECORD + 1);
+    return TestRandom(300);
+}
+
+static BOOL TestAdd(TEST_RECORDS *records)
+{
+    UINT32 size = TestRecordSize();
+    UINT64 start = records->QueueBytes % records->Boundary;
+
+    TestFill(records->Scratch, records->PayloadIn, size);
+    if (!CmqAddRecord(records->Buffer, records->Scratch, size))
+        return FALSE;
+
+    // only meaningful while nothing spills, spilled records start elsewhere
+    if (start + sizeof(CMQ_RECORD_HEADER) > records->Boundary)
+        records->SplitHeaders++;
+    else if (size > 0 && start + sizeof(CMQ_RECORD_HEADER) + size > records->Boundary)
+        records->SplitPayloads++;
+
+    records->Sizes[records->Added++ % TEST_MAX_QUEUED] = size;
+    records->QueueBytes += sizeof(CMQ_RECORD_HEADER) + size;
+    records->PayloadIn += size;
+    return TRUE;
+}
+
+// check the next expected record against 'size' and 'data'
+static void TestReceived(TEST_RECORDS *records, UINT32 size, const BYTE *data)
+{
+    UINT32 expected = records->Sizes[records->Received % TEST_MAX_QUEUED];
+
+    if (!TestCheck(size == expected, "%s: record %u: size 0x%x, expected 0x%x", records->Name,
+                   records->Received, size, expected))
+        return;
+    TestVerify(records->Name, records->PayloadOut, data, size);
+    records->PayloadOut += size;
+    records->Received++;
+}
+
+// read some records, returns the number of records read
+static UINT32 TestRead(TEST_RECORDS *records)
+{
+    UINT32 expected, size, count, i;
+    UINT64 batchSize, offset;
+    CMQ_RECORD_HEADER header;
+
+    if (records->Received == records->Added)
+    {
+        size = TEST_MAX_RECORD;
+        TestCheck(!CmqGetRecord(records->Buffer, records->Scratch, &size) && size == 0,
+                  "%s: CmqGetRecord on an empty queue: size 0x%x", records->Name, size);
+        return 0;
+    }
+
+    expected = records->Sizes[records->Received % TEST_MAX_QUEUED];
+    switch (records->ReadOps++ % 4)
+    {
+    case 0:
+        size = TEST_MAX_RECORD;
+        if (!TestCheck(CmqGetRecord(records->Buffer, records->Scratch, &size), "%s: CmqGetRecord failed", records->Name))
+            return 0;
+        TestReceived(records, size, records->Scratch);
+        return 1;
+
+    case 1:
+        size = 0;
+        if (!TestCheck(CmqPeekRecordSize(records->Buffer, &size) && size == expected,
+                       "%s: CmqPeekRecordSize: 0x%x, expected 0x%x", records->Name, size, expected))
+            return 0;
+        if (!TestCheck(CmqGetRecord(records->Buffer, records->Scratch, &size), "%s: CmqGetRecord failed", records->Name))
+            return 0;
+        TestReceived(records, size, records->Scratch);
+        return 1;
+
+    case 2:
+        // too small: fails with the size, the record stays for the retry
+        if (expected > 0)
+        {
+            size = TestRandom(expected);
+            TestCheck(!CmqGetRecord(records->Buffer, records->Scratch, &size) && size == expected,
+                      "%s: CmqGetRecord with a small buffer: size 0x%x, expected 0x%x", records->Name, size, expected);
+        }
+        size = expected;
+        if (!TestCheck(CmqGetRecord(records->Buffer, records->Scratch, &size), "%s: CmqGetRecord failed", records->Name))
+            return 0;
+        TestReceived(records, size, records->Scratch);
+        return 1;
+
+    default:
+        // a batch never contains a partial record, the first record must fit for a non-empty batch
+        batchSize = TestRandom(TEST_BATCH_SIZE) + 1;
+        count = CmqGetRecords(records->Buffer, records->Scratch, &batchSize, TestRandom(4) == 0 ? 0 : 1 + TestRandom(50));
+        if (count == 0)
+        {
+            TestCheck(batchSize == 0, "%s: empty batch of 0x%llx bytes", records->Name, (unsigned long long) batchSize);
+            return 0;
+        }
+
+        offset = 0;
+        for (i = 0; i < count; i++)
+        {
+            if (!TestCheck(offset + sizeof(header) <= batchSize, "%s: batch of %u records truncated", records->Name, count))
+                return i;
+            memcpy(&header, records->Scratch + offset, sizeof(header));
+            offset += sizeof(header);
+            if (!TestCheck(offset + header.Size <= batchSize, "%s: batch of %u records truncated", records->Name, count))
+                return i;
+            TestReceived(records, header.Size, records->Scratch + offset);
+            offset += header.Size;
+        }
+        TestCheck(offset == batchSize, "%s: batch of %u records: 0x%llx bytes, 0x%llx used", records->Name, count,
+                  (unsigned long long) batchSize, (unsigned long long) offset);
+        return count;
+    }
+}
+
+static void TestRecords(const char *name, UINT64 size, DWORD flags, UINT64 spillSize, UINT64 boundary)
+{
+    TEST_RECORDS *records;
+    CMQ_SPILL_STATS spillStats;
+    UINT32 i, idle;
+
+    records = (TEST_RECORDS *) calloc(1, sizeof(TEST_RECORDS));
+    if (!TestCheck(records != NULL, "%s: out of memory", name))
+        return;
+
+    records->Name = name;
+    records->Boundary = boundary;
+    records->Buffer = CmqCreateEx(size, flags);
+    if (!TestCheck(records->Buffer != NULL, "%s: CmqCreateEx failed", name))
+        goto cleanup;
+    if (spillSize != 0)
+        TestCheck(CmqSetSpillSize(records->Buffer, spillSize), "%s: CmqSetSpillSize failed", name);
+
+    // the producer runs ahead for a while, then the consumer catches up
+    for (i = 0; i < 200000; i++)
+    {
+        if (i % 2000 < 1300 || records->Received == records->Added)
+        {
+            if (!TestAdd(records))
+                TestRead(records);
+        }
+        else
+        {
+            TestRead(records);
+        }
+    }
+
+    idle = 0;
+    while (records->Received < records->Added && idle < 3)
+        idle = TestRead(records) ? 0 : idle + 1;
+
+    TestCheck(records->Received == records->Added && CmqGetUsedSize(records->Buffer) == 0,
+              "%s: %u of %u records received, used size 0x%llx", name, records->Received, records->Added,
+              (unsigned long long) CmqGetUsedSize(records->Buffer));
+
+    if (spillSize != 0)
+    {
+        CmqGetSpillStats(records->Buffer, &spillStats);
+        TestCheck(spillStats.SpillCount > 0 && spillStats.SpilledNow == 0, "%s: %llu spills, 0x%llx bytes left", name,
+                  (unsigned long long) spillStats.SpillCount, (unsigned long long) spillStats.SpilledNow);
+    }
+    else
+    {
+        TestCheck(records->SplitHeaders > 0 && records->SplitPayloads > 100, "%s: only %u split headers, %u split payloads",
+                  name, records->SplitHeaders, records->SplitPayloads);
+    }
+
+cleanup:
+    if (records->Buffer)
+        CmqDestroy(records->Buffer);
+    free(records);
+}
+
+int main(void)
+{
+    TestRecords("records", 3 * TEST_MAX_RECORD, 0, 0, 3 * TEST_MAX_RECORD);
+    TestRecords("records-elastic", 4 * CMQ_SEGMENT_SIZE, CMQ_FLAG_ELASTIC, 0, CMQ_SEGMENT_SIZE);
+    TestRecords("records-spill", 3 * TEST_MAX_RECORD, 0, 8 * 1024 * 1024, 3 * TEST_MAX_RECORD);
+
+    return TestFinish("cmq-record-test");
+}
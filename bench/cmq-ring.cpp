@@ -0,0 +1,155 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Single-threaded per-operation cost of the header-only CmqRing template against CMQ_BUFFER
+// for 16 B, 4 KB and 64 KB operations. Both queues have the same capacity; every pass adds
+// a batch of operations and then reads them all back, so all sizes wrap regularly.
+// The C results are reported first, the CmqRing ones carry "speedup_vs_c".
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "bench.h"
+#include "cmq-ring.hpp"
+
+#define CMQ_RING_CAPACITY (1024 * 1024)
+// bytes added per pass before reading them back
+#define CMQ_RING_BATCH_BYTES (CMQ_RING_CAPACITY / 2 + CMQ_RING_CAPACITY / 8)
+
+typedef CmqRing<BYTE, CMQ_RING_CAPACITY> CMQ_BENCH_RING;
+
+// Runs 'totalBytes' through a queue with 'add' and 'get' callables, returns elapsed ns, 0 on failure.
+template <typename AddFn, typename GetFn>
+static UINT64 CmqRingPasses(const char *name, UINT64 opSize, UINT64 totalBytes, BYTE *readBuffer, AddFn add, GetFn get)
+{
+    UINT64 opsPerPass = std::max<UINT64>(CMQ_RING_BATCH_BYTES / opSize, 1);
+    UINT64 offset = 0;
+    UINT64 start = BenchNowNs();
+    UINT64 i, readOffset;
+
+    while (offset < totalBytes)
+    {
+        readOffset = offset;
+        for (i = 0; i < opsPerPass && offset < totalBytes; i++, offset += opSize)
+        {
+            if (!add(BenchPattern(offset), opSize))
+            {
+                BenchFail("%s: add failed at 0x%llx", name, (unsigned long long) offset);
+                return 0;
+            }
+        }
+
+        for (; readOffset < offset; readOffset += opSize)
+        {
+            if (!get(readBuffer, opSize))
+            {
+                BenchFail("%s: get failed at 0x%llx", name, (unsigned long long) readOffset);
+                return 0;
+            }
+            if (g_Bench.Verify && !BenchCheck(name, readOffset, readBuffer, opSize))
+                return 0;
+        }
+    }
+    return BenchNowNs() - start;
+}
+
+static UINT64 CmqRingRunC(UINT64 opSize, UINT64 totalBytes, BYTE *readBuffer)
+{
+    char name[64];
+    CMQ_BUFFER *buffer;
+    UINT64 elapsed;
+
+    snprintf(name, sizeof(name), "c/%llu", (unsigned long long) opSize);
+    if (!BenchSelected(name))
+        return 0;
+
+    buffer = CmqCreate(CMQ_RING_CAPACITY);
+    if (!buffer)
+    {
+        BenchFail("%s: CmqCreate failed", name);
+        return 0;
+    }
+
+    elapsed = CmqRingPasses(name, opSize, totalBytes, readBuffer,
+        [buffer](const BYTE *data, UINT64 size) { return CmqAddData(buffer, data, size) != FALSE; },
+        [buffer](BYTE *data, UINT64 size) { return CmqGetData(buffer, data, &size, CMQ_NO_UNDERFLOW) != FALSE; });
+    CmqDestroy(buffer);
+    if (elapsed == 0)
+        return 0;
+
+    BenchResultBegin(name);
+    BenchResultString("queue", "CMQ_BUFFER");
+    BenchResultUInt("size", opSize);
+    BenchResultEnd(totalBytes / opSize, totalBytes, elapsed);
+    return elapsed;
+}
+
+static void CmqRingRunCpp(UINT64 opSize, UINT64 totalBytes, BYTE *readBuffer, UINT64 cNs)
+{
+    char name[64];
+    std::unique_ptr<CMQ_BENCH_RING> ring(new CMQ_BENCH_RING());
+    CMQ_BENCH_RING *r = ring.get();
+    UINT64 elapsed;
+
+    snprintf(name, sizeof(name), "ring/%llu", (unsigned long long) opSize);
+    if (!BenchSelected(name))
+        return;
+
+    elapsed = CmqRingPasses(name, opSize, totalBytes, readBuffer,
+        [r](const BYTE *data, UINT64 size) { return r->AddData(data, (size_t) size); },
+        [r](BYTE *data, UINT64 size)
+        {
+            size_t count = (size_t) size;
+            return r->GetData(data, &count, CMQ_NO_UNDERFLOW);
+        });
+    if (elapsed == 0)
+        return;
+
+    BenchResultBegin(name);
+    BenchResultString("queue", "CmqRing");
+    BenchResultUInt("size", opSize);
+    if (cNs)
+        BenchResultDouble("speedup_vs_c", (double) cNs / (double) elapsed);
+    BenchResultEnd(totalBytes / opSize, totalBytes, elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 16, 4096, 65536 };
+    std::unique_ptr<BYTE[]> readBuffer(new BYTE[65536]);
+    UINT64 totalBytes, cNs;
+    size_t i;
+
+    BenchInit(argc, argv, "cmq-ring");
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        // small operations measure per-call overhead, don't make them run for minutes
+        totalBytes = g_Bench.Quick ? 8 * 1024 * 1024 : (sizes[i] < 4096 ? 256 : 4096) * 1024 * 1024ULL;
+        totalBytes -= totalBytes % sizes[i];
+        cNs = CmqRingRunC(sizes[i], totalBytes, readBuffer.get());
+        CmqRingRunCpp(sizes[i], totalBytes, readBuffer.get(), cNs);
+    }
+
+    return BenchFinish();
+}
@@ -0,0 +1,127 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Shared buffers (CmqCreateShared/CmqOpenShared) in one process, several views of one section:
+// a waiter on one view is woken by adds and reads on another, both for data and for space,
+// with more views than the old per-process event cache had slots, and after the creator
+// destroyed its view (the other views keep their own event handles open).
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <strsafe.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_BUFFER_SIZE 4096
+#define TEST_CHUNK 100
+#define TEST_VIEWS 80
+
+typedef struct _TEST_WAITER
+{
+    CMQ_BUFFER *View;
+    BOOL ForData;
+    DWORD Status;
+} TEST_WAITER;
+
+static DWORD WINAPI TestWaiter(PVOID parameter)
+{
+    TEST_WAITER *waiter = (TEST_WAITER *) parameter;
+
+    if (waiter->ForData)
+        waiter->Status = CmqWaitForData(waiter->View, TEST_CHUNK, TEST_TIMEOUT);
+    else
+        waiter->Status = CmqWaitForSpace(waiter->View, TEST_CHUNK, TEST_TIMEOUT);
+    return 0;
+}
+
+// a thread waits on 'waiting' until the main thread makes room or adds data through 'other'
+static void TestWake(const char *name, CMQ_BUFFER *waiting, CMQ_BUFFER *other)
+{
+    TEST_WAITER waiter = { waiting, TRUE, ERROR_SUCCESS };
+    BYTE data[TEST_BUFFER_SIZE];
+    UINT64 dataSize;
+    HANDLE thread;
+
+    // data: the consumer view waits, the other view adds
+    thread = CreateThread(NULL, 0, TestWaiter, &waiter, 0, NULL);
+    if (!TestCheck(thread != NULL, "%s: CreateThread failed", name))
+        return;
+    Sleep(20);
+    TestFill(data, 0, TEST_CHUNK);
+    TestCheck(CmqAddData(other, data, TEST_CHUNK), "%s: add failed", name);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    TestCheck(waiter.Status == ERROR_SUCCESS, "%s: data wait failed: %lu", name, waiter.Status);
+
+    dataSize = TEST_CHUNK;
+    TestCheck(CmqGetData(waiting, data, &dataSize, CMQ_NO_UNDERFLOW), "%s: read failed", name);
+    TestVerify(name, 0, data, dataSize);
+
+    // space: the waiting view is full, the other view reads
+    TestFill(data, 0, TEST_BUFFER_SIZE);
+    TestCheck(CmqAddData(waiting, data, TEST_BUFFER_SIZE), "%s: fill failed", name);
+    waiter.ForData = FALSE;
+    thread = CreateThread(NULL, 0, TestWaiter, &waiter, 0, NULL);
+    if (!TestCheck(thread != NULL, "%s: CreateThread failed", name))
+        return;
+    Sleep(20);
+    dataSize = TEST_BUFFER_SIZE;
+    TestCheck(CmqGetData(other, data, &dataSize, CMQ_NO_UNDERFLOW), "%s: drain failed", name);
+    TestVerify(name, 0, data, dataSize);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    TestCheck(waiter.Status == ERROR_SUCCESS, "%s: space wait failed: %lu", name, waiter.Status);
+}
+
+int main(void)
+{
+    CMQ_BUFFER *views[TEST_VIEWS];
+    CMQ_BUFFER *creator;
+    WCHAR name[64];
+    UINT32 i;
+
+    StringCchPrintfW(name, ARRAYSIZE(name), L"cmq-shared-test-%lu", GetCurrentProcessId());
+    creator = CmqCreateShared(name, TEST_BUFFER_SIZE, NULL);
+    if (!TestCheck(creator != NULL, "CmqCreateShared failed"))
+        return TestFinish("cmq-shared-test");
+
+    for (i = 0; i < TEST_VIEWS; i++)
+    {
+        views[i] = CmqOpenShared(name);
+        if (!TestCheck(views[i] != NULL, "CmqOpenShared %u failed", i))
+            return TestFinish("cmq-shared-test");
+    }
+
+    TestWake("creator adds", views[0], creator);
+    TestWake("creator waits", creator, views[0]);
+    TestWake("last views", views[TEST_VIEWS - 1], views[TEST_VIEWS - 2]);
+    TestCheck(CmqWaitForData(views[1], TEST_BUFFER_SIZE + 1, 0) == ERROR_INVALID_PARAMETER, "waiting for more than the size");
+
+    // the events stay open in the other views
+    CmqDestroy(creator);
+    TestWake("after the creator", views[1], views[2]);
+
+    for (i = 0; i < TEST_VIEWS; i++)
+        CmqDestroy(views[i]);
+    return TestFinish("cmq-shared-test");
+}
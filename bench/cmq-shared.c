@@ -0,0 +1,244 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Two-process throughput of a shared CMQ_BUFFER (CmqCreateShared/CmqOpenShared, a POSIX shared
+// memory object under the compat layer) against a pipe, the kernel copy path local IPC uses now.
+// A forked child produces the byte stream, the parent consumes and (with --verify/--quick)
+// checks it. Both sides of the shared buffer block in CmqWaitForSpace/CmqWaitForData when
+// they have to, a run that never waits makes no system calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <strsafe.h>
+
+#include "bench.h"
+#include "buffer.h"
+
+#define CMQ_SHARED_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct _CMQ_SHARED_RUN
+{
+    const char *Name;
+    WCHAR SectionName[64];
+    UINT64 OpSize;
+    UINT64 TotalBytes;
+    BYTE *ReadBuffer;
+    int Pipe[2];
+} CMQ_SHARED_RUN;
+
+// Child process side, returns the exit code.
+static int CmqSharedProducer(CMQ_SHARED_RUN *run, BOOL shared)
+{
+    CMQ_BUFFER *buffer = NULL;
+    UINT64 offset = 0;
+    ssize_t written;
+
+    if (shared)
+    {
+        buffer = CmqOpenShared(run->SectionName);
+        if (!buffer)
+            return 1;
+    }
+
+    while (offset < run->TotalBytes)
+    {
+        if (shared)
+        {
+            if (CmqAddData(buffer, BenchPattern(offset), run->OpSize))
+                offset += run->OpSize;
+            else
+                CmqWaitForSpace(buffer, run->OpSize, INFINITE);
+        }
+        else
+        {
+            written = write(run->Pipe[1], BenchPattern(offset), (size_t) run->OpSize);
+            if (written <= 0)
+                return 1;
+            offset += (UINT64) written;
+        }
+    }
+
+    if (buffer)
+        CmqDestroy(buffer);
+    return 0;
+}
+
+// Parent process side.
+static BOOL CmqSharedConsumer(CMQ_SHARED_RUN *run, CMQ_BUFFER *buffer)
+{
+    UINT64 offset = 0;
+    UINT64 size;
+    ssize_t got;
+
+    while (offset < run->TotalBytes)
+    {
+        if (buffer)
+        {
+            size = run->OpSize;
+            if (!CmqGetData(buffer, run->ReadBuffer, &size, CMQ_NO_UNDERFLOW))
+            {
+                CmqWaitForData(buffer, run->OpSize, INFINITE);
+                continue;
+            }
+        }
+        else
+        {
+            // pipes return what's there, keep the checked chunks aligned to operations anyway
+            got = read(run->Pipe[0], run->ReadBuffer, (size_t) run->OpSize);
+            if (got <= 0)
+            {
+                BenchFail("%s: pipe closed at 0x%llx", run->Name, (unsigned long long) offset);
+                return FALSE;
+            }
+            size = (UINT64) got;
+        }
+
+        if (g_Bench.Verify && !BenchCheck(run->Name, offset, run->ReadBuffer, size))
+            return FALSE;
+        offset += size;
+    }
+    return TRUE;
+}
+
+static UINT64 CmqSharedRun(const char *transport, UINT64 opSize, UINT64 totalBytes, UINT64 pipeNs)
+{
+    BOOL shared = (transport[0] == 's');
+    CMQ_SHARED_RUN run;
+    char name[64];
+    CMQ_BUFFER *buffer = NULL;
+    UINT64 start, elapsed = 0;
+    pid_t child;
+    int status;
+    BOOL success;
+
+    snprintf(name, sizeof(name), "%s/%llu", transport, (unsigned long long) opSize);
+    if (!BenchSelected(name))
+        return 0;
+
+    ZeroMemory(&run, sizeof(run));
+    run.Name = name;
+    run.OpSize = opSize;
+    run.TotalBytes = totalBytes - totalBytes % opSize;
+    run.Pipe[0] = run.Pipe[1] = -1;
+    run.ReadBuffer = (BYTE *) malloc((size_t) opSize);
+    if (!run.ReadBuffer)
+    {
+        BenchFail("%s: allocation failed", name);
+        goto cleanup;
+    }
+
+    if (shared)
+    {
+        StringCchPrintfW(run.SectionName, ARRAYSIZE(run.SectionName), L"cmq-shared-bench-%lu-%llu",
+            (unsigned long) getpid(), (unsigned long long) opSize);
+        buffer = CmqCreateShared(run.SectionName, CMQ_SHARED_BUFFER_SIZE, NULL);
+        if (!buffer)
+        {
+            BenchFail("%s: CmqCreateShared failed", name);
+            goto cleanup;
+        }
+    }
+    else if (pipe(run.Pipe) != 0)
+    {
+        BenchFail("%s: pipe failed", name);
+        goto cleanup;
+    }
+
+    // the child must not flush the parent's buffered output again
+    fflush(stdout);
+    start = BenchNowNs();
+    child = fork();
+    if (child < 0)
+    {
+        BenchFail("%s: fork failed", name);
+        goto cleanup;
+    }
+    if (child == 0)
+    {
+        if (!shared)
+            close(run.Pipe[0]);
+        _exit(CmqSharedProducer(&run, shared));
+    }
+
+    if (!shared)
+    {
+        close(run.Pipe[1]);
+        run.Pipe[1] = -1;
+    }
+
+    success = CmqSharedConsumer(&run, buffer);
+    if (!success)
+        kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+    elapsed = BenchNowNs() - start;
+
+    if (!success)
+    {
+        elapsed = 0;
+        goto cleanup;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        BenchFail("%s: producer process failed", name);
+        elapsed = 0;
+        goto cleanup;
+    }
+
+    BenchResultBegin(name);
+    BenchResultString("transport", transport);
+    BenchResultUInt("size", opSize);
+    BenchResultUInt("processes", 2);
+    if (pipeNs)
+        BenchResultDouble("speedup_vs_pipe", (double) pipeNs / (double) elapsed);
+    BenchResultEnd(run.TotalBytes / opSize, run.TotalBytes, elapsed);
+
+cleanup:
+    if (buffer)
+        CmqDestroy(buffer);
+    if (run.Pipe[0] >= 0)
+        close(run.Pipe[0]);
+    if (run.Pipe[1] >= 0)
+        close(run.Pipe[1]);
+    free(run.ReadBuffer);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 64, 4096, 65536 };
+    UINT64 totalBytes, pipeNs;
+    size_t i;
+
+    BenchInit(argc, argv, "cmq-shared");
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        totalBytes = g_Bench.Quick ? min(sizes[i] * 4096, 32 * 1024 * 1024) : min(sizes[i] * 4 * 1024 * 1024, 1024 * 1024 * 1024);
+        pipeNs = CmqSharedRun("pipe", sizes[i], totalBytes, 0);
+        CmqSharedRun("shared", sizes[i], totalBytes, pipeNs);
+    }
+
+    return BenchFinish();
+}
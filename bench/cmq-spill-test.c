@@ -0,0 +1,246 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Spill storage (CmqSetSpillSize) correctness: a small main storage overflows into a spill file
+// bigger than one CMQ_SPILL_WINDOW_SIZE (4 MB) mapping window. Every cycle fills the main and spill
+// storage past a window boundary, checks CmqGetSpillStats and drains everything, verifying
+// the byte stream is in order. Later cycles start at other spill file offsets and wrap around
+// the file end. One cycle fills the spill storage until adds fail, one interleaves adds and
+// reads so the spill storage fills and drains partially. Adds alternate CmqAddData, CmqAddDataV
+// and CmqReserve/CmqCommit, reads CmqGetData, CmqGetDataV and CmqPeek/CmqConsume. Runs with
+// normal, elastic and mirrored main storage.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_MAIN_SIZE (64 * 1024)
+#define TEST_SPILL_SIZE (16 * 1024 * 1024)
+#define TEST_FILL_SIZE (6 * 1024 * 1024) // past the first spill window
+#define TEST_MAX_OP 20000
+
+typedef struct _TEST_STREAM
+{
+    const char *Name;
+    CMQ_BUFFER *Buffer;
+    UINT64 Written; // stream offset of the next byte added
+    UINT64 Read;    // stream offset of the next byte read
+    UINT32 AddOps;
+    UINT32 ReadOps;
+    BYTE Scratch[TEST_MAX_OP];
+} TEST_STREAM;
+
+static UINT32 g_Random = 0x2545F491;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+// add the next 'size' stream bytes, FALSE if they didn't fit (CmqReserve/CmqCommit may have
+// added a part of them then, Written says how far it got)
+static BOOL TestAdd(TEST_STREAM *stream, UINT32 size)
+{
+    CMQ_SPAN spans[2];
+    UINT64 reserved, done;
+    BOOL added;
+
+    TestFill(stream->Scratch, stream->Written, size);
+    switch (stream->AddOps++ % 3)
+    {
+    case 0:
+        added = CmqAddData(stream->Buffer, stream->Scratch, size);
+        break;
+
+    case 1:
+        spans[0].Data = stream->Scratch;
+        spans[0].Size = size / 2;
+        spans[1].Data = stream->Scratch + size / 2;
+        spans[1].Size = size - size / 2;
+        added = CmqAddDataV(stream->Buffer, spans, 2);
+        break;
+
+    default:
+        // reservations end at the main storage end (spilling only starts when it's full)
+        // and at spill window ends
+        for (done = 0; done < size; done += reserved)
+        {
+            reserved = CmqReserve(stream->Buffer, size - done, spans);
+            if (reserved == 0)
+                break;
+            memcpy(spans[0].Data, stream->Scratch + done, (size_t) spans[0].Size);
+            memcpy(spans[1].Data, stream->Scratch + done + spans[0].Size, (size_t) (reserved - spans[0].Size));
+            if (!TestCheck(CmqCommit(stream->Buffer, reserved), "%s: CmqCommit failed", stream->Name))
+                break;
+            stream->Written += reserved;
+        }
+        return done == size;
+    }
+
+    if (added)
+        stream->Written += size;
+    return added;
+}
+
+// read up to 'size' bytes and verify them, returns the number of bytes read
+static UINT64 TestRead(TEST_STREAM *stream, UINT32 size)
+{
+    CMQ_SPAN spans[2];
+    UINT64 dataSize = size;
+
+    switch (stream->ReadOps++ % 3)
+    {
+    case 0:
+        if (!TestCheck(CmqGetData(stream->Buffer, stream->Scratch, &dataSize, CMQ_ALLOW_UNDERFLOW),
+                       "%s: CmqGetData failed", stream->Name))
+            return 0;
+        break;
+
+    case 1:
+        spans[0].Data = stream->Scratch;
+        spans[0].Size = size / 3;
+        spans[1].Data = stream->Scratch + size / 3;
+        spans[1].Size = size - size / 3;
+        if (!TestCheck(CmqGetDataV(stream->Buffer, spans, 2, &dataSize, CMQ_ALLOW_UNDERFLOW),
+                       "%s: CmqGetDataV failed", stream->Name))
+            return 0;
+        break;
+
+    default:
+        // may be shorter than what's queued: storage end, spill window end, main/spill boundary
+        dataSize = CmqPeek(stream->Buffer, size, spans);
+        if (dataSize == 0)
+            break;
+        memcpy(stream->Scratch, spans[0].Data, (size_t) spans[0].Size);
+        if (dataSize > spans[0].Size)
+            memcpy(stream->Scratch + spans[0].Size, spans[1].Data, (size_t) (dataSize - spans[0].Size));
+        if (!TestCheck(CmqConsume(stream->Buffer, dataSize), "%s: CmqConsume failed", stream->Name))
+            return 0;
+        break;
+    }
+
+    TestVerify(stream->Name, stream->Read, stream->Scratch, dataSize);
+    stream->Read += dataSize;
+    return dataSize;
+}
+
+static void TestDrain(TEST_STREAM *stream)
+{
+    UINT64 queued = stream->Written - stream->Read;
+    UINT64 idle = 0;
+
+    while (stream->Read < stream->Written && idle < 3)
+        idle = TestRead(stream, 1 + TestRandom(TEST_MAX_OP)) ? 0 : idle + 1;
+
+    TestCheck(stream->Read == stream->Written && CmqGetUsedSize(stream->Buffer) == 0,
+              "%s: drained 0x%llx of 0x%llx bytes, 0x%llx still queued", stream->Name,
+              (unsigned long long) (queued - (stream->Written - stream->Read)), (unsigned long long) queued,
+              (unsigned long long) CmqGetUsedSize(stream->Buffer));
+}
+
+static void TestSpill(const char *name, DWORD flags)
+{
+    TEST_STREAM *stream;
+    CMQ_SPILL_STATS before, after;
+    CMQ_STATS stats;
+    UINT64 spilledAtFull;
+    UINT32 cycle, size, i;
+
+    stream = (TEST_STREAM *) calloc(1, sizeof(TEST_STREAM));
+    if (!TestCheck(stream != NULL, "%s: out of memory", name))
+        return;
+
+    stream->Name = name;
+    stream->Buffer = CmqCreateEx(TEST_MAIN_SIZE, flags);
+    if (!TestCheck(stream->Buffer != NULL, "%s: CmqCreateEx failed", name))
+        goto cleanup;
+    TestCheck(CmqSetSpillSize(stream->Buffer, TEST_SPILL_SIZE), "%s: CmqSetSpillSize failed", name);
+
+    // 3 x 6 MB: the third cycle wraps around the end of the 16 MB spill file
+    for (cycle = 1; cycle <= 3; cycle++)
+    {
+        CmqGetSpillStats(stream->Buffer, &before);
+        while (stream->Written - stream->Read < TEST_FILL_SIZE)
+        {
+            if (!TestCheck(TestAdd(stream, 1 + TestRandom(TEST_MAX_OP)), "%s: cycle %u: add failed at 0x%llx",
+                           name, cycle, (unsigned long long) stream->Written))
+                goto cleanup;
+        }
+
+        CmqGetSpillStats(stream->Buffer, &after);
+        TestCheck(after.SpillSize == TEST_SPILL_SIZE && after.SpillCount == cycle &&
+                  after.SpilledNow > TEST_FILL_SIZE - TEST_MAIN_SIZE - TEST_MAX_OP &&
+                  after.SpilledBytes - before.SpilledBytes == after.SpilledNow,
+                  "%s: cycle %u: spill stats: size 0x%llx, %llu spills, 0x%llx bytes spilled (0x%llx before), 0x%llx now",
+                  name, cycle, (unsigned long long) after.SpillSize, (unsigned long long) after.SpillCount,
+                  (unsigned long long) after.SpilledBytes, (unsigned long long) before.SpilledBytes,
+                  (unsigned long long) after.SpilledNow);
+        TestCheck(CmqGetUsedSize(stream->Buffer) == stream->Written - stream->Read, "%s: cycle %u: used size 0x%llx",
+                  name, cycle, (unsigned long long) CmqGetUsedSize(stream->Buffer));
+
+        TestDrain(stream);
+        CmqGetSpillStats(stream->Buffer, &after);
+        TestCheck(after.SpilledNow == 0, "%s: cycle %u: 0x%llx bytes left in the spill storage",
+                  name, cycle, (unsigned long long) after.SpilledNow);
+    }
+
+    // fill the spill storage until adds fail, everything added must still come out in order
+    CmqGetStats(stream->Buffer, &stats);
+    while (TestAdd(stream, 1 + TestRandom(TEST_MAX_OP)))
+        ;
+    spilledAtFull = stream->Written - stream->Read;
+    TestCheck(spilledAtFull > TEST_SPILL_SIZE - TEST_MAX_OP && spilledAtFull <= TEST_SPILL_SIZE + TEST_MAIN_SIZE,
+              "%s: full at 0x%llx bytes", name, (unsigned long long) spilledAtFull);
+    TestCheck(!CmqAddData(stream->Buffer, stream->Scratch, TEST_MAX_OP), "%s: add succeeded when full", name);
+    TestDrain(stream);
+
+    // producer ahead of the consumer: the spill storage fills and drains partially, several times
+    for (i = 0; i < 20000; i++)
+    {
+        size = 1 + TestRandom(TEST_MAX_OP);
+        TestCheck(TestAdd(stream, size), "%s: interleaved add failed at 0x%llx", name, (unsigned long long) stream->Written);
+        // drain slower than the producer adds, then faster for a while
+        TestRead(stream, i % 1000 < 600 ? size * 3 / 4 : TEST_MAX_OP);
+    }
+    TestDrain(stream);
+
+    CmqGetSpillStats(stream->Buffer, &after);
+    TestCheck(after.SpillCount > 5, "%s: only %llu spills", name, (unsigned long long) after.SpillCount);
+
+cleanup:
+    if (stream->Buffer)
+        CmqDestroy(stream->Buffer);
+    free(stream);
+}
+
+int main(void)
+{
+    TestSpill("spill", 0);
+    TestSpill("spill-elastic", CMQ_FLAG_ELASTIC);
+    TestSpill("spill-mirrored", CMQ_FLAG_MIRRORED);
+
+    return TestFinish("cmq-spill-test");
+}
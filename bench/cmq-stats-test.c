@@ -0,0 +1,169 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// CmqGetStats occupancy histograms: every add and every read lands in the bucket of the occupancy
+// it saw (after an add or failed add, before a read), checked against a plain division for every
+// occupancy of a few odd sizes, with main storage drained while spilling and the spill storage
+// itself in the spill bucket, and with the per-write headers of multi-producer buffers.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_MPSC_SIZE 1024
+#define TEST_MPSC_PAYLOAD 96
+#define TEST_MPSC_RECORD (8 + TEST_MPSC_PAYLOAD) // CMQ_MPSC_HEADER and the payload, already aligned
+
+static UINT64 TestBucket(UINT64 occupancy, UINT64 size)
+{
+    return min(occupancy * (CMQ_STATS_BUCKETS - 1) / size, (UINT64) CMQ_STATS_BUCKETS - 2);
+}
+
+static void TestHistograms(const char *name, CMQ_BUFFER *buffer, const UINT64 *adds, const UINT64 *reads)
+{
+    CMQ_STATS stats;
+    UINT32 i;
+
+    CmqGetStats(buffer, &stats);
+    for (i = 0; i < CMQ_STATS_BUCKETS; i++)
+    {
+        TestCheck(stats.Histogram[i] == adds[i], "%s: %llu adds in bucket %u, expected %llu", name,
+                  (unsigned long long) stats.Histogram[i], i, (unsigned long long) adds[i]);
+        TestCheck(stats.ReadHistogram[i] == reads[i], "%s: %llu reads in bucket %u, expected %llu", name,
+                  (unsigned long long) stats.ReadHistogram[i], i, (unsigned long long) reads[i]);
+    }
+}
+
+static BOOL TestRead(CMQ_BUFFER *buffer, UINT64 size)
+{
+    BYTE data[4096];
+    UINT64 dataSize = size;
+
+    return CmqGetData(buffer, data, &dataSize, CMQ_NO_UNDERFLOW) && dataSize == size;
+}
+
+// fill byte by byte and drain byte by byte: each occupancy once on both sides
+static void TestEveryOccupancy(UINT64 size, DWORD flags)
+{
+    UINT64 adds[CMQ_STATS_BUCKETS] = { 0 };
+    UINT64 reads[CMQ_STATS_BUCKETS] = { 0 };
+    CMQ_BUFFER *buffer = CmqCreateEx(size, flags);
+    char name[64];
+    BYTE byte = 0;
+    UINT64 i;
+
+    snprintf(name, sizeof(name), "size %llu, flags 0x%lx", (unsigned long long) size, (unsigned long) flags);
+    if (!TestCheck(buffer != NULL, "%s: CmqCreateEx failed", name))
+        return;
+
+    for (i = 1; i <= size; i++)
+    {
+        TestCheck(CmqAddData(buffer, &byte, 1), "%s: add %llu failed", name, (unsigned long long) i);
+        adds[TestBucket(i, size)]++;
+    }
+    TestCheck(!CmqAddData(buffer, &byte, 1), "%s: add to a full buffer succeeded", name);
+    adds[TestBucket(size, size)]++;
+
+    for (i = size; i > 0; i--)
+    {
+        TestCheck(TestRead(buffer, 1), "%s: read at %llu failed", name, (unsigned long long) i);
+        reads[TestBucket(i, size)]++;
+    }
+
+    TestHistograms(name, buffer, adds, reads);
+    CmqDestroy(buffer);
+}
+
+static void TestSpill(void)
+{
+    UINT64 adds[CMQ_STATS_BUCKETS] = { 0 };
+    UINT64 reads[CMQ_STATS_BUCKETS] = { 0 };
+    CMQ_BUFFER *buffer = CmqCreate(1000);
+    BYTE data[1000] = { 0 };
+
+    if (!TestCheck(buffer != NULL && CmqSetSpillSize(buffer, 4096), "spill: creating the buffer failed"))
+        return;
+
+    TestCheck(CmqAddData(buffer, data, 1000), "spill: fill failed");
+    adds[9]++;
+    TestCheck(CmqAddData(buffer, data, 100) && CmqAddData(buffer, data, 10), "spill: spilled adds failed");
+    adds[CMQ_STATS_BUCKETS - 1] += 2;
+
+    // main storage drained while the spill storage holds data, then the spill storage
+    TestCheck(TestRead(buffer, 1000), "spill: reading the main storage failed");
+    TestCheck(TestRead(buffer, 110), "spill: reading the spill storage failed");
+    reads[CMQ_STATS_BUCKETS - 1] += 2;
+
+    TestCheck(CmqAddData(buffer, data, 10) && TestRead(buffer, 10), "spill: add after draining failed");
+    adds[0]++;
+    reads[0]++;
+
+    TestHistograms("spill", buffer, adds, reads);
+    CmqDestroy(buffer);
+}
+
+static void TestMpsc(void)
+{
+    UINT64 adds[CMQ_STATS_BUCKETS] = { 0 };
+    UINT64 reads[CMQ_STATS_BUCKETS] = { 0 };
+    CMQ_BUFFER *buffer = CmqCreateEx(TEST_MPSC_SIZE, CMQ_FLAG_MPSC);
+    BYTE data[TEST_MPSC_PAYLOAD] = { 0 };
+    UINT64 occupancy = 0;
+
+    if (!TestCheck(buffer != NULL, "mpsc: CmqCreateEx failed"))
+        return;
+
+    while (occupancy + TEST_MPSC_RECORD <= TEST_MPSC_SIZE)
+    {
+        TestCheck(CmqAddData(buffer, data, sizeof(data)), "mpsc: add at %llu failed", (unsigned long long) occupancy);
+        occupancy += TEST_MPSC_RECORD;
+        adds[TestBucket(occupancy, TEST_MPSC_SIZE)]++;
+    }
+    TestCheck(!CmqAddData(buffer, data, sizeof(data)), "mpsc: add to a full buffer succeeded");
+    adds[TestBucket(occupancy, TEST_MPSC_SIZE)]++;
+
+    while (occupancy > 0)
+    {
+        TestCheck(TestRead(buffer, sizeof(data)), "mpsc: read at %llu failed", (unsigned long long) occupancy);
+        reads[TestBucket(occupancy, TEST_MPSC_SIZE)]++;
+        occupancy -= TEST_MPSC_RECORD;
+    }
+
+    TestHistograms("mpsc", buffer, adds, reads);
+    CmqDestroy(buffer);
+}
+
+int main(void)
+{
+    static const UINT64 sizes[] = { 1, 3, 7, 10, 999, 1000, 4097, 65539 };
+    UINT32 i;
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        TestEveryOccupancy(sizes[i], 0);
+        TestEveryOccupancy(sizes[i], CMQ_FLAG_ELASTIC);
+    }
+    TestSpill();
+    TestMpsc();
+    return TestFinish("cmq-stats-test");
+}
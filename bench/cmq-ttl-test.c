@@ -0,0 +1,163 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Chunk expiry (CmqSetTtl/CmqDropExpired) and latency statistics with a short TTL, for
+// single- and multi-producer buffers, with and without spill storage. Chunks older than the TTL
+// must be dropped whole from the head of the queue (by CmqDropExpired and by the reads),
+// fresh chunks must stay, a partially read chunk blocks expiry until it's read completely,
+// and CmqGetLatencyStats must account dropped and consumed chunks and their delays.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_TTL 50 // ms
+#define TEST_CHUNK 1000
+#define TEST_MAIN_SIZE 8192
+
+typedef struct _TEST_EXPIRY
+{
+    const char *Name;
+    CMQ_BUFFER *Buffer;
+    UINT64 Written; // stream offset of the next byte added
+    UINT64 Read;    // stream offset of the next byte read, dropped bytes are skipped
+    BYTE Scratch[2 * TEST_CHUNK];
+} TEST_EXPIRY;
+
+static void TestAdd(TEST_EXPIRY *test, UINT32 count)
+{
+    UINT32 i;
+
+    for (i = 0; i < count; i++)
+    {
+        TestFill(test->Scratch, test->Written, TEST_CHUNK);
+        if (!TestCheck(CmqAddData(test->Buffer, test->Scratch, TEST_CHUNK), "%s: add failed", test->Name))
+            return;
+        test->Written += TEST_CHUNK;
+    }
+}
+
+static void TestRead(TEST_EXPIRY *test, UINT64 size)
+{
+    UINT64 dataSize = size;
+
+    if (!TestCheck(CmqGetData(test->Buffer, test->Scratch, &dataSize, CMQ_NO_UNDERFLOW), "%s: read of 0x%llx bytes failed",
+                   test->Name, (unsigned long long) size))
+        return;
+    TestVerify(test->Name, test->Read, test->Scratch, dataSize);
+    test->Read += dataSize;
+}
+
+// expect 'bytes' dropped from the head
+static void TestDropped(TEST_EXPIRY *test, const char *step, UINT64 dropped, UINT64 bytes)
+{
+    TestCheck(dropped == bytes, "%s: %s: dropped 0x%llx bytes, expected 0x%llx", test->Name, step,
+              (unsigned long long) dropped, (unsigned long long) bytes);
+    test->Read += dropped;
+}
+
+static void TestTtl(const char *name, DWORD flags, UINT64 spillSize)
+{
+    TEST_EXPIRY test = { name, NULL, 0, 0, { 0 } };
+    CMQ_LATENCY_STATS stats;
+    UINT64 bucketed;
+    UINT32 i;
+
+    test.Buffer = CmqCreateEx(TEST_MAIN_SIZE, flags);
+    if (!TestCheck(test.Buffer != NULL, "%s: CmqCreateEx failed", name))
+        return;
+    if (spillSize != 0)
+        TestCheck(CmqSetSpillSize(test.Buffer, spillSize), "%s: CmqSetSpillSize failed", name);
+
+    // no TTL yet: nothing expires
+    TestAdd(&test, 2);
+    Sleep(2 * TEST_TTL);
+    TestDropped(&test, "no TTL", CmqDropExpired(test.Buffer), 0);
+    TestRead(&test, 2 * TEST_CHUNK);
+
+    TestCheck(CmqSetTtl(test.Buffer, TEST_TTL), "%s: CmqSetTtl failed", name);
+
+    // old chunks go, fresh ones stay (with spill storage most of them are spilled)
+    TestAdd(&test, spillSize ? 20 : 5);
+    Sleep(2 * TEST_TTL);
+    TestAdd(&test, 2);
+    TestDropped(&test, "expired", CmqDropExpired(test.Buffer), (spillSize ? 20 : 5) * TEST_CHUNK);
+    TestDropped(&test, "fresh", CmqDropExpired(test.Buffer), 0);
+    TestRead(&test, 2 * TEST_CHUNK);
+    TestCheck(CmqGetUsedSize(test.Buffer) == 0, "%s: 0x%llx bytes left", name, (unsigned long long) CmqGetUsedSize(test.Buffer));
+
+    // reads drop expired chunks on their own
+    TestAdd(&test, 3);
+    Sleep(2 * TEST_TTL);
+    TestAdd(&test, 1);
+    test.Read += 3 * TEST_CHUNK;
+    TestRead(&test, TEST_CHUNK);
+
+    // a partially read chunk is never dropped, and keeps the ones behind it too
+    TestAdd(&test, 3);
+    TestRead(&test, TEST_CHUNK / 2);
+    Sleep(2 * TEST_TTL);
+    TestDropped(&test, "partially read", CmqDropExpired(test.Buffer), 0);
+    TestRead(&test, TEST_CHUNK / 2);
+    TestDropped(&test, "after partial read", CmqDropExpired(test.Buffer), 2 * TEST_CHUNK);
+
+    // delays: chunks waited at least 2 TTLs (except the fresh ones)
+    TestAdd(&test, 2);
+    Sleep(TEST_TTL / 2);
+    TestRead(&test, 2 * TEST_CHUNK);
+
+    CmqGetLatencyStats(test.Buffer, &stats);
+    bucketed = 0;
+    for (i = 0; i < CMQ_LATENCY_BUCKETS; i++)
+        bucketed += stats.Histogram[i];
+    TestCheck(stats.DroppedChunks == (spillSize ? 20 : 5) + 3 + 2 && stats.DroppedBytes == stats.DroppedChunks * TEST_CHUNK,
+              "%s: dropped %llu chunks, 0x%llx bytes", name, (unsigned long long) stats.DroppedChunks,
+              (unsigned long long) stats.DroppedBytes);
+    TestCheck(stats.Chunks == 2 + 2 + 1 + 1 + 2 && bucketed == stats.Chunks && stats.MaxDelayUs >= 2 * TEST_TTL * 1000 &&
+              stats.TotalDelayUs >= stats.MaxDelayUs + 2 * (TEST_TTL / 2) * 1000,
+              "%s: %llu chunks (%llu in the histogram), delay total %llu us, max %llu us", name,
+              (unsigned long long) stats.Chunks, (unsigned long long) bucketed, (unsigned long long) stats.TotalDelayUs,
+              (unsigned long long) stats.MaxDelayUs);
+    TestCheck(test.Read == test.Written && CmqGetUsedSize(test.Buffer) == 0, "%s: 0x%llx bytes left", name,
+              (unsigned long long) CmqGetUsedSize(test.Buffer));
+
+    CmqDestroy(test.Buffer);
+}
+
+int main(void)
+{
+    CMQ_BUFFER *buffer;
+
+    // needs timestamps
+    buffer = CmqCreateEx(TEST_MAIN_SIZE, 0);
+    TestCheck(buffer && !CmqSetTtl(buffer, TEST_TTL), "CmqSetTtl without timestamps succeeded");
+    if (buffer)
+        CmqDestroy(buffer);
+
+    TestTtl("ttl", CMQ_FLAG_TIMESTAMPS, 0);
+    TestTtl("ttl-mpsc", CMQ_FLAG_TIMESTAMPS | CMQ_FLAG_MPSC, 0);
+    TestTtl("ttl-spill", CMQ_FLAG_TIMESTAMPS, 1024 * 1024);
+    TestTtl("ttl-mpsc-spill", CMQ_FLAG_TIMESTAMPS | CMQ_FLAG_MPSC, 1024 * 1024);
+
+    return TestFinish("cmq-ttl-test");
+}
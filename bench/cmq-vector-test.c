@@ -0,0 +1,226 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Vectored add/read (CmqAddDataV/CmqGetDataV) correctness: up to 8 spans per call, some empty,
+// with ring, mirrored, elastic, spill and multi-producer storage. Reads cross the ring wrap or
+// segment boundaries, several earlier adds, and the main/spill storage boundary (counted to
+// show it happens). Adds must be all or nothing, CMQ_NO_UNDERFLOW reads must fail without
+// removing anything, CMQ_ALLOW_UNDERFLOW reads must fill the spans in order and leave the rest
+// of the spans untouched.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "test.h"
+
+#define TEST_MAX_SPANS 8
+#define TEST_MAX_SPAN 3000
+#define TEST_MAX_OP (TEST_MAX_SPANS * TEST_MAX_SPAN)
+#define TEST_MAX_ADDS (1 << 16) // adds in flight
+#define TEST_UNTOUCHED 0xA5
+
+typedef struct _TEST_VECTOR
+{
+    const char *Name;
+    CMQ_BUFFER *Buffer;
+    UINT64 Boundary;  // wrap or segment size, 0: not counted
+    UINT64 Written;   // stream offset of the next byte added
+    UINT64 Read;      // stream offset of the next byte read
+    UINT64 AddEnd[TEST_MAX_ADDS]; // stream offsets where adds end
+    UINT32 Added;
+    UINT32 Consumed;  // adds read completely
+    UINT32 CrossBoundary;
+    UINT32 CrossAdds;
+    UINT32 CrossSpill;
+    BYTE Scratch[TEST_MAX_OP];
+} TEST_VECTOR;
+
+static UINT32 g_Random = 0x85EBCA6B;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+// random spans over the scratch buffer, returns the total size
+static UINT64 TestSpans(TEST_VECTOR *vector, CMQ_SPAN *spans, UINT32 *spanCount)
+{
+    UINT64 total = 0;
+    UINT32 i;
+
+    *spanCount = 1 + TestRandom(TEST_MAX_SPANS);
+    for (i = 0; i < *spanCount; i++)
+    {
+        spans[i].Data = vector->Scratch + total;
+        spans[i].Size = TestRandom(5) == 0 ? 0 : 1 + TestRandom(TEST_MAX_SPAN);
+        total += spans[i].Size;
+    }
+    return total;
+}
+
+static BOOL TestAdd(TEST_VECTOR *vector)
+{
+    CMQ_SPAN spans[TEST_MAX_SPANS];
+    UINT32 spanCount;
+    UINT64 total, used;
+
+    total = TestSpans(vector, spans, &spanCount);
+    TestFill(vector->Scratch, vector->Written, total);
+    used = CmqGetUsedSize(vector->Buffer);
+    if (!CmqAddDataV(vector->Buffer, spans, spanCount))
+    {
+        TestCheck(total != 0 && CmqGetUsedSize(vector->Buffer) == used, "%s: failed add of 0x%llx bytes changed the used size",
+                  vector->Name, (unsigned long long) total);
+        return FALSE;
+    }
+
+    if (total == 0)
+        return TRUE;
+    vector->Written += total;
+    vector->AddEnd[vector->Added++ % TEST_MAX_ADDS] = vector->Written;
+    return TRUE;
+}
+
+// read with random spans, returns the number of bytes read
+static UINT64 TestRead(TEST_VECTOR *vector)
+{
+    CMQ_SPAN spans[TEST_MAX_SPANS];
+    CMQ_SPILL_STATS spillStats;
+    UINT32 spanCount, i;
+    UINT64 total, used, dataSize, mainSize, start, offset;
+    BOOL underflow = TestRandom(3) != 0;
+
+    total = TestSpans(vector, spans, &spanCount);
+    memset(vector->Scratch, TEST_UNTOUCHED, (size_t) total);
+    used = CmqGetUsedSize(vector->Buffer);
+    CmqGetSpillStats(vector->Buffer, &spillStats);
+    mainSize = used - spillStats.SpilledNow;
+
+    dataSize = ~0ULL;
+    if (!CmqGetDataV(vector->Buffer, spans, spanCount, &dataSize, underflow ? CMQ_ALLOW_UNDERFLOW : CMQ_NO_UNDERFLOW))
+    {
+        TestCheck(!underflow && total > used && dataSize == 0 && CmqGetUsedSize(vector->Buffer) == used,
+                  "%s: CmqGetDataV of 0x%llx bytes failed with 0x%llx queued, 0x%llx now", vector->Name,
+                  (unsigned long long) total, (unsigned long long) used, (unsigned long long) CmqGetUsedSize(vector->Buffer));
+        return 0;
+    }
+
+    if (!TestCheck(dataSize == min(total, used) && (underflow || dataSize == total),
+                   "%s: read 0x%llx bytes of 0x%llx with 0x%llx queued", vector->Name, (unsigned long long) dataSize,
+                   (unsigned long long) total, (unsigned long long) used))
+        return 0;
+
+    // spans are contiguous in the scratch buffer, so the data is too
+    TestVerify(vector->Name, vector->Read, vector->Scratch, dataSize);
+    for (offset = dataSize; offset < total; offset++)
+    {
+        if (!TestCheck(vector->Scratch[offset] == TEST_UNTOUCHED, "%s: span byte 0x%llx past the data overwritten",
+                       vector->Name, (unsigned long long) offset))
+            break;
+    }
+
+    start = vector->Read;
+    vector->Read += dataSize;
+    if (dataSize == 0)
+        return 0;
+
+    if (vector->Boundary != 0 && start / vector->Boundary != (vector->Read - 1) / vector->Boundary)
+        vector->CrossBoundary++;
+    if (mainSize > 0 && spillStats.SpilledNow > 0 && dataSize > mainSize)
+        vector->CrossSpill++;
+
+    i = 0;
+    while (vector->Consumed < vector->Added && vector->AddEnd[vector->Consumed % TEST_MAX_ADDS] <= vector->Read)
+    {
+        vector->Consumed++;
+        i++;
+    }
+    // a read that ends past a finished add and also finished the next one, or one that started inside an add
+    if (i > 1 || (i == 1 && vector->Consumed < vector->Added && vector->AddEnd[(vector->Consumed - 1) % TEST_MAX_ADDS] > start
+                  && vector->AddEnd[(vector->Consumed - 1) % TEST_MAX_ADDS] < vector->Read))
+        vector->CrossAdds++;
+
+    return dataSize;
+}
+
+static void TestVector(const char *name, UINT64 size, DWORD flags, UINT64 spillSize, UINT64 boundary)
+{
+    TEST_VECTOR *vector;
+    UINT32 i, idle;
+
+    vector = (TEST_VECTOR *) calloc(1, sizeof(TEST_VECTOR));
+    if (!TestCheck(vector != NULL, "%s: out of memory", name))
+        return;
+
+    vector->Name = name;
+    vector->Boundary = boundary;
+    vector->Buffer = CmqCreateEx(size, flags);
+    if (!TestCheck(vector->Buffer != NULL, "%s: CmqCreateEx failed", name))
+        goto cleanup;
+    if (spillSize != 0)
+        TestCheck(CmqSetSpillSize(vector->Buffer, spillSize), "%s: CmqSetSpillSize failed", name);
+
+    // the producer runs ahead for a while, then the consumer drains everything
+    for (i = 0; i < 40000; i++)
+    {
+        if (i % 1000 < 600)
+        {
+            if (!TestAdd(vector))
+                TestRead(vector);
+        }
+        else
+        {
+            TestRead(vector);
+            TestRead(vector);
+        }
+    }
+
+    idle = 0;
+    while (vector->Read < vector->Written && idle < 3)
+        idle = TestRead(vector) ? 0 : idle + 1;
+
+    TestCheck(vector->Read == vector->Written && CmqGetUsedSize(vector->Buffer) == 0,
+              "%s: 0x%llx of 0x%llx bytes read, used size 0x%llx", name, (unsigned long long) vector->Read,
+              (unsigned long long) vector->Written, (unsigned long long) CmqGetUsedSize(vector->Buffer));
+    TestCheck((boundary == 0 || vector->CrossBoundary > 100) && vector->CrossAdds > 100 && (spillSize == 0 || vector->CrossSpill > 5),
+              "%s: reads across: %u wraps/segments, %u adds, %u main/spill", name, vector->CrossBoundary,
+              vector->CrossAdds, vector->CrossSpill);
+
+cleanup:
+    if (vector->Buffer)
+        CmqDestroy(vector->Buffer);
+    free(vector);
+}
+
+int main(void)
+{
+    TestVector("vector", 50000, 0, 0, 50000);
+    TestVector("vector-mirrored", 64 * 1024, CMQ_FLAG_MIRRORED, 0, 64 * 1024);
+    TestVector("vector-elastic", 4 * CMQ_SEGMENT_SIZE, CMQ_FLAG_ELASTIC, 0, CMQ_SEGMENT_SIZE);
+    TestVector("vector-spill", 50000, 0, 8 * 1024 * 1024, 50000);
+    TestVector("vector-mpsc", 64 * 1024, CMQ_FLAG_MPSC, 0, 0); // wraps with the write headers
+
+    return TestFinish("cmq-vector-test");
+}
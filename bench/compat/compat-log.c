@@ -0,0 +1,312 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Logging, string and strsafe.h functions for the Linux build, see windows.h.
+// Log messages go to stderr, BENCH_LOG_LEVEL sets the level (default: warnings and errors).
+
+#include <windows.h>
+#include <strsafe.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "log.h"
+
+static int g_LogLevel = -1;
+
+// Format like the Windows CRT: %s and %c take WCHARs, 'l' is 32 bits, 'll' and 'I64' are 64 bits.
+// Returns FALSE if the output was truncated.
+static BOOL CompatFormat(WCHAR *output, size_t outputSize, const WCHAR *format, va_list args)
+{
+    char spec[32];
+    char number[128];
+    size_t specLength;
+    size_t length = 0;
+    int size; // 0: int, 1: long long, 2: size_t
+    const WCHAR *string;
+    const char *p;
+    WCHAR wideChar;
+    BOOL floating;
+
+    if (outputSize == 0)
+        return FALSE;
+
+#define PUT(c) do { if (length + 1 >= outputSize) goto truncated; output[length++] = (WCHAR) (c); } while (0)
+
+    for (; *format; format++)
+    {
+        if (*format != L'%')
+        {
+            PUT(*format);
+            continue;
+        }
+
+        format++;
+        if (*format == L'%')
+        {
+            PUT(L'%');
+            continue;
+        }
+
+        // flags, width and precision are passed through to snprintf
+        spec[0] = '%';
+        specLength = 1;
+        while (*format && *format < 0x80 && strchr("-+ #0123456789.*", (char) *format) && specLength < sizeof(spec) - 8)
+        {
+            if (*format == L'*')
+                specLength += (size_t) snprintf(spec + specLength, sizeof(spec) - specLength, "%d", va_arg(args, int));
+            else
+                spec[specLength++] = (char) *format;
+            format++;
+        }
+
+        size = 0;
+        if (format[0] == L'l' && format[1] == L'l')
+        {
+            size = 1;
+            format += 2;
+        }
+        else if (format[0] == L'I' && format[1] == L'6' && format[2] == L'4')
+        {
+            size = 1;
+            format += 3;
+        }
+        else if (*format == L'z' || *format == L'I')
+        {
+            size = 2;
+            format++;
+        }
+        else if (*format == L'l' || *format == L'h' || *format == L'w')
+        {
+            format++;
+        }
+
+        floating = FALSE;
+        switch (*format)
+        {
+        case L's':
+        case L'S':
+            string = va_arg(args, const WCHAR *);
+            if (!string)
+                string = L"(null)";
+            for (; *string; string++)
+                PUT(*string);
+            continue;
+        case L'c':
+        case L'C':
+            wideChar = (WCHAR) va_arg(args, int);
+            PUT(wideChar);
+            continue;
+        case L'e':
+        case L'E':
+        case L'f':
+        case L'g':
+        case L'G':
+            floating = TRUE;
+            break;
+        case L'd':
+        case L'i':
+        case L'u':
+        case L'x':
+        case L'X':
+        case L'o':
+        case L'p':
+            break;
+        default:
+            // unknown conversion, print it as is
+            PUT(L'%');
+            if (*format)
+                PUT(*format);
+            else
+                format--;
+            continue;
+        }
+
+        if (floating)
+        {
+            spec[specLength++] = (char) *format;
+            spec[specLength] = 0;
+            snprintf(number, sizeof(number), spec, va_arg(args, double));
+        }
+        else if (*format == L'p')
+        {
+            spec[specLength++] = 'p';
+            spec[specLength] = 0;
+            snprintf(number, sizeof(number), spec, va_arg(args, void *));
+        }
+        else
+        {
+            if (size == 1)
+            {
+                spec[specLength++] = 'l';
+                spec[specLength++] = 'l';
+            }
+            else if (size == 2)
+            {
+                spec[specLength++] = 'z';
+            }
+            spec[specLength++] = (char) *format;
+            spec[specLength] = 0;
+            if (size == 1)
+                snprintf(number, sizeof(number), spec, va_arg(args, long long));
+            else if (size == 2)
+                snprintf(number, sizeof(number), spec, va_arg(args, size_t));
+            else
+                snprintf(number, sizeof(number), spec, va_arg(args, int));
+        }
+
+        for (p = number; *p; p++)
+            PUT(*p);
+    }
+
+#undef PUT
+
+    output[length] = 0;
+    return TRUE;
+
+truncated:
+    output[length] = 0;
+    return FALSE;
+}
+
+HRESULT StringCchLengthW(const WCHAR *string, SIZE_T maxLength, SIZE_T *length)
+{
+    SIZE_T i;
+
+    if (!string)
+        return STRSAFE_E_INVALID_PARAMETER;
+
+    for (i = 0; i < maxLength; i++)
+    {
+        if (string[i] == 0)
+        {
+            if (length)
+                *length = i;
+            return S_OK;
+        }
+    }
+    return STRSAFE_E_INVALID_PARAMETER;
+}
+
+size_t CompatWcslen(const WCHAR *string)
+{
+    size_t length = 0;
+
+    while (string[length])
+        length++;
+    return length;
+}
+
+HRESULT StringCchCopyW(WCHAR *destination, SIZE_T destinationSize, const WCHAR *source)
+{
+    SIZE_T i;
+
+    if (destinationSize == 0)
+        return STRSAFE_E_INVALID_PARAMETER;
+
+    for (i = 0; i < destinationSize - 1 && source[i]; i++)
+        destination[i] = source[i];
+    destination[i] = 0;
+    return source[i] ? STRSAFE_E_INSUFFICIENT_BUFFER : S_OK;
+}
+
+HRESULT StringCchVPrintfW(WCHAR *destination, SIZE_T destinationSize, const WCHAR *format, va_list args)
+{
+    if (destinationSize == 0)
+        return STRSAFE_E_INVALID_PARAMETER;
+    return CompatFormat(destination, destinationSize, format, args) ? S_OK : STRSAFE_E_INSUFFICIENT_BUFFER;
+}
+
+HRESULT StringCchPrintfW(WCHAR *destination, SIZE_T destinationSize, const WCHAR *format, ...)
+{
+    va_list args;
+    HRESULT hresult;
+
+    va_start(args, format);
+    hresult = StringCchVPrintfW(destination, destinationSize, format, args);
+    va_end(args);
+    return hresult;
+}
+
+// Logging
+
+void LogSetLevel(IN int level)
+{
+    g_LogLevel = level;
+}
+
+int LogGetLevel(void)
+{
+    const char *level;
+
+    if (g_LogLevel < 0)
+    {
+        level = getenv("BENCH_LOG_LEVEL");
+        g_LogLevel = level ? atoi(level) : LOG_LEVEL_WARNING;
+    }
+    return g_LogLevel;
+}
+
+static void LogWrite(const char *functionName, const WCHAR *message)
+{
+    char line[1024];
+    size_t i;
+
+    for (i = 0; message[i] && i < sizeof(line) - 1; i++)
+        line[i] = message[i] < 0x80 ? (char) message[i] : '?';
+    line[i] = 0;
+
+    if (functionName)
+        fprintf(stderr, "%s: %s\n", functionName, line);
+    else
+        fputs(line, stderr);
+}
+
+void _LogFormat(IN int level, IN BOOL raw, IN const char *functionName, IN const WCHAR *format, ...)
+{
+    WCHAR message[1024];
+    va_list args;
+
+    if (level > LogGetLevel())
+        return;
+
+    va_start(args, format);
+    CompatFormat(message, ARRAYSIZE(message), format, args);
+    va_end(args);
+    LogWrite(raw ? NULL : functionName, message);
+}
+
+DWORD _win_perror(IN const char *functionName, IN const WCHAR *prefix)
+{
+    return _win_perror2(functionName, GetLastError(), prefix);
+}
+
+DWORD _win_perror2(IN const char *functionName, IN DWORD errorCode, IN const WCHAR *prefix)
+{
+    WCHAR message[1024];
+
+    if (LogGetLevel() >= LOG_LEVEL_ERROR)
+    {
+        StringCchPrintfW(message, ARRAYSIZE(message), L"%s failed: error %lu", prefix, errorCode);
+        LogWrite(functionName, message);
+    }
+    SetLastError(errorCode);
+    return errorCode;
+}
@@ -0,0 +1,1353 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Win32 subset on top of POSIX, see windows.h.
+
+#define _GNU_SOURCE
+#include <windows.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum _COMPAT_TYPE
+{
+    COMPAT_FILE = 1,
+    COMPAT_SECTION,
+    COMPAT_EVENT,
+    COMPAT_THREAD,
+} COMPAT_TYPE;
+
+// Kernel object behind a HANDLE. Views hold a reference to their section like on Windows.
+typedef struct _COMPAT_OBJECT
+{
+    COMPAT_TYPE Type;
+    volatile LONG References;
+    int Fd;                   // file, section
+    UINT64 Size;              // section
+    char *Name;               // named section/event created by this process, unlinked with the last reference
+    sem_t *Semaphore;         // event
+    sem_t UnnamedSemaphore;
+    LPTHREAD_START_ROUTINE Start; // thread
+    PVOID Parameter;
+    pthread_mutex_t Mutex;
+    pthread_cond_t ExitedCondition;
+    BOOL Exited;
+} COMPAT_OBJECT;
+
+// Mapped or reserved address range.
+typedef struct _COMPAT_REGION
+{
+    BYTE *Base;
+    SIZE_T Size;
+    COMPAT_OBJECT *Section;   // views only
+    BOOL Placeholder;         // reserved by VirtualAlloc2, not accessible
+    struct _COMPAT_REGION *Next;
+} COMPAT_REGION;
+
+struct _TP_WORK
+{
+    PTP_WORK_CALLBACK Callback;
+    PVOID Context;
+    pthread_mutex_t Mutex;
+    pthread_cond_t IdleCondition;
+    LONG Pending;
+};
+
+static __thread DWORD g_LastError;
+static PFLS_CALLBACK_FUNCTION g_FlsCallbacks[PTHREAD_KEYS_MAX];
+static pthread_mutex_t g_RegionLock = PTHREAD_MUTEX_INITIALIZER;
+static COMPAT_REGION *g_Regions;
+
+static DWORD CompatErrno(int error)
+{
+    switch (error)
+    {
+    case 0:
+        return ERROR_SUCCESS;
+    case ENOENT:
+        return ERROR_FILE_NOT_FOUND;
+    case EACCES:
+    case EPERM:
+        return ERROR_ACCESS_DENIED;
+    case EBADF:
+        return ERROR_INVALID_HANDLE;
+    case ENOMEM:
+        return ERROR_NOT_ENOUGH_MEMORY;
+    case EEXIST:
+        return ERROR_ALREADY_EXISTS;
+    case ETIMEDOUT:
+        return ERROR_TIMEOUT;
+    case ENOSYS:
+    case EOPNOTSUPP:
+        return ERROR_NOT_SUPPORTED;
+    default:
+        return ERROR_INVALID_PARAMETER;
+    }
+}
+
+static void CompatSetErrno(void)
+{
+    g_LastError = CompatErrno(errno);
+}
+
+DWORD GetLastError(void)
+{
+    return g_LastError;
+}
+
+void SetLastError(DWORD error)
+{
+    g_LastError = error;
+}
+
+void RaiseException(DWORD code, DWORD flags, DWORD argumentCount, const ULONG_PTR *arguments)
+{
+    UNREFERENCED_PARAMETER(flags);
+    UNREFERENCED_PARAMETER(argumentCount);
+    UNREFERENCED_PARAMETER(arguments);
+
+    fprintf(stderr, "unhandled exception 0x%x\n", code);
+    abort();
+}
+
+// Locks
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutexattr_t attributes;
+
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&cs->Mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_destroy(&cs->Mutex);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_lock(&cs->Mutex);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_unlock(&cs->Mutex);
+}
+
+void InitializeSRWLock(SRWLOCK *lock)
+{
+    pthread_mutex_init(&lock->Mutex, NULL);
+}
+
+void AcquireSRWLockExclusive(SRWLOCK *lock)
+{
+    pthread_mutex_lock(&lock->Mutex);
+}
+
+void ReleaseSRWLockExclusive(SRWLOCK *lock)
+{
+    pthread_mutex_unlock(&lock->Mutex);
+}
+
+void AcquireSRWLockShared(SRWLOCK *lock)
+{
+    pthread_mutex_lock(&lock->Mutex);
+}
+
+void ReleaseSRWLockShared(SRWLOCK *lock)
+{
+    pthread_mutex_unlock(&lock->Mutex);
+}
+
+BOOL InitOnceExecuteOnce(PINIT_ONCE initOnce, PINIT_ONCE_FN initFn, PVOID parameter, PVOID *context)
+{
+    BOOL success = TRUE;
+
+    if (__atomic_load_n(&initOnce->Done, __ATOMIC_ACQUIRE))
+        return TRUE;
+
+    pthread_mutex_lock(&initOnce->Mutex);
+    if (!initOnce->Done)
+    {
+        success = initFn(initOnce, parameter, context);
+        if (success)
+            __atomic_store_n(&initOnce->Done, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&initOnce->Mutex);
+    return success;
+}
+
+DWORD FlsAlloc(PFLS_CALLBACK_FUNCTION callback)
+{
+    pthread_key_t key;
+    int error = pthread_key_create(&key, callback);
+
+    if (error)
+    {
+        SetLastError(CompatErrno(error));
+        return FLS_OUT_OF_INDEXES;
+    }
+    g_FlsCallbacks[key] = callback;
+    return (DWORD) key;
+}
+
+BOOL FlsFree(DWORD index)
+{
+    pthread_key_t key = (pthread_key_t) index;
+    PFLS_CALLBACK_FUNCTION callback = NULL;
+    PVOID data = pthread_getspecific(key);
+
+    // pthread_key_delete doesn't run destructors, do it at least for this thread
+    if (data)
+    {
+        pthread_setspecific(key, NULL);
+        callback = g_FlsCallbacks[key];
+    }
+    g_FlsCallbacks[key] = NULL;
+    pthread_key_delete(key);
+    if (callback)
+        callback(data);
+    return TRUE;
+}
+
+// Windows runs FLS callbacks before the thread handle is signaled, pthread key destructors
+// only run after the thread function returned (and the handle was signaled)
+static void CompatFlsThreadExit(void)
+{
+    PFLS_CALLBACK_FUNCTION callback;
+    PVOID data;
+    size_t key;
+
+    for (key = 0; key < ARRAYSIZE(g_FlsCallbacks); key++)
+    {
+        callback = g_FlsCallbacks[key];
+        if (!callback)
+            continue;
+
+        data = pthread_getspecific((pthread_key_t) key);
+        if (data)
+        {
+            pthread_setspecific((pthread_key_t) key, NULL);
+            callback(data);
+        }
+    }
+}
+
+PVOID FlsGetValue(DWORD index)
+{
+    return pthread_getspecific((pthread_key_t) index);
+}
+
+BOOL FlsSetValue(DWORD index, PVOID data)
+{
+    int error = pthread_setspecific((pthread_key_t) index, data);
+
+    if (error)
+    {
+        SetLastError(CompatErrno(error));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void InitializeSListHead(PSLIST_HEADER head)
+{
+    pthread_mutex_init(&head->Mutex, NULL);
+    head->First = NULL;
+    head->Depth = 0;
+}
+
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER head, PSLIST_ENTRY entry)
+{
+    PSLIST_ENTRY first;
+
+    pthread_mutex_lock(&head->Mutex);
+    first = head->First;
+    entry->Next = first;
+    head->First = entry;
+    head->Depth++;
+    pthread_mutex_unlock(&head->Mutex);
+    return first;
+}
+
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER head)
+{
+    PSLIST_ENTRY first;
+
+    pthread_mutex_lock(&head->Mutex);
+    first = head->First;
+    if (first)
+    {
+        head->First = first->Next;
+        head->Depth--;
+    }
+    pthread_mutex_unlock(&head->Mutex);
+    return first;
+}
+
+USHORT QueryDepthSList(PSLIST_HEADER head)
+{
+    return head->Depth;
+}
+
+// Time and system information
+
+void Sleep(DWORD milliseconds)
+{
+    struct timespec delay = { milliseconds / 1000, (long) (milliseconds % 1000) * 1000000 };
+
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+        ;
+}
+
+ULONGLONG GetTickCount64(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG) now.tv_sec * 1000 + (ULONGLONG) now.tv_nsec / 1000000;
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = (LONGLONG) now.tv_sec * 1000000000 + now.tv_nsec;
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+    frequency->QuadPart = 1000000000;
+    return TRUE;
+}
+
+void GetSystemInfo(SYSTEM_INFO *systemInfo)
+{
+    ZeroMemory(systemInfo, sizeof(*systemInfo));
+    systemInfo->dwPageSize = (DWORD) sysconf(_SC_PAGESIZE);
+    systemInfo->dwAllocationGranularity = 64 * 1024;
+    systemInfo->dwNumberOfProcessors = (DWORD) sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+DWORD GetCurrentProcessId(void)
+{
+    return (DWORD) getpid();
+}
+
+DWORD GetCurrentThreadId(void)
+{
+    // Windows reads it from the TEB, don't make callers pay for a syscall
+    static __thread DWORD threadId;
+
+    if (threadId == 0)
+        threadId = (DWORD) syscall(SYS_gettid);
+    return threadId;
+}
+
+HANDLE GetCurrentProcess(void)
+{
+    return (HANDLE) (LONG_PTR) -1;
+}
+
+// Objects and names
+
+static COMPAT_OBJECT *CompatNewObject(COMPAT_TYPE type)
+{
+    COMPAT_OBJECT *object = (COMPAT_OBJECT *) calloc(1, sizeof(COMPAT_OBJECT));
+
+    if (!object)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    object->Type = type;
+    object->References = 1;
+    object->Fd = -1;
+    return object;
+}
+
+static void CompatReference(COMPAT_OBJECT *object)
+{
+    InterlockedIncrement(&object->References);
+}
+
+static void CompatRelease(COMPAT_OBJECT *object)
+{
+    if (InterlockedDecrement(&object->References) != 0)
+        return;
+
+    switch (object->Type)
+    {
+    case COMPAT_FILE:
+    case COMPAT_SECTION:
+        close(object->Fd);
+        if (object->Name)
+            shm_unlink(object->Name);
+        break;
+    case COMPAT_EVENT:
+        if (object->Semaphore == &object->UnnamedSemaphore)
+        {
+            sem_destroy(object->Semaphore);
+        }
+        else
+        {
+            sem_close(object->Semaphore);
+            if (object->Name)
+                sem_unlink(object->Name);
+        }
+        break;
+    case COMPAT_THREAD:
+        pthread_cond_destroy(&object->ExitedCondition);
+        pthread_mutex_destroy(&object->Mutex);
+        break;
+    }
+    free(object->Name);
+    free(object);
+}
+
+// "/name" for shm_open/sem_open, backslashes (Local\...) become underscores
+static void CompatObjectName(const WCHAR *name, char *objectName, size_t size)
+{
+    size_t i = 0;
+
+    objectName[i++] = '/';
+    for (; *name && i < size - 1; name++)
+        objectName[i++] = (*name == L'\\' || *name == L'/' || *name > 0x7F) ? '_' : (char) *name;
+    objectName[i] = 0;
+}
+
+static void CompatNarrowPath(const WCHAR *path, char *narrow, size_t size)
+{
+    size_t i;
+
+    for (i = 0; path[i] && i < size - 1; i++)
+        narrow[i] = (path[i] == L'\\') ? '/' : (char) path[i];
+    narrow[i] = 0;
+}
+
+static void CompatWidenPath(const char *narrow, WCHAR *path, size_t size)
+{
+    size_t i;
+
+    for (i = 0; narrow[i] && i < size - 1; i++)
+        path[i] = (WCHAR) (unsigned char) narrow[i];
+    path[i] = 0;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+    if (!handle || handle == INVALID_HANDLE_VALUE)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    CompatRelease((COMPAT_OBJECT *) handle);
+    return TRUE;
+}
+
+// Modules: the placeholder APIs are looked up by name like on Windows, so buffer.c's fallback
+// can be exercised by setting COMPAT_NO_PLACEHOLDERS.
+
+static PVOID WINAPI CompatVirtualAlloc2(HANDLE process, PVOID address, SIZE_T size, ULONG allocationType, ULONG protect,
+                                        MEM_EXTENDED_PARAMETER *parameters, ULONG parameterCount);
+static PVOID WINAPI CompatMapViewOfFile3(HANDLE section, HANDLE process, PVOID address, ULONG64 offset, SIZE_T size,
+                                         ULONG allocationType, ULONG protect, MEM_EXTENDED_PARAMETER *parameters,
+                                         ULONG parameterCount);
+
+HMODULE GetModuleHandleW(const WCHAR *moduleName)
+{
+    UNREFERENCED_PARAMETER(moduleName);
+    return (HMODULE) &g_Regions; // any non-NULL value
+}
+
+FARPROC GetProcAddress(HMODULE module, const char *procName)
+{
+    UNREFERENCED_PARAMETER(module);
+
+    // the environment variables emulate Windows versions without these APIs
+    if (strcmp(procName, "PrefetchVirtualMemory") == 0)
+        return getenv("COMPAT_NO_PREFETCH") ? NULL : (FARPROC) PrefetchVirtualMemory;
+    if (getenv("COMPAT_NO_PLACEHOLDERS"))
+        return NULL;
+    if (strcmp(procName, "VirtualAlloc2") == 0)
+        return (FARPROC) CompatVirtualAlloc2;
+    if (strcmp(procName, "MapViewOfFile3") == 0)
+        return (FARPROC) CompatMapViewOfFile3;
+    return NULL;
+}
+
+// Virtual memory
+
+static void CompatAddRegion(BYTE *base, SIZE_T size, COMPAT_OBJECT *section, BOOL placeholder)
+{
+    COMPAT_REGION *region = (COMPAT_REGION *) malloc(sizeof(COMPAT_REGION));
+
+    if (!region)
+        abort();
+
+    region->Base = base;
+    region->Size = size;
+    region->Section = section;
+    region->Placeholder = placeholder;
+    pthread_mutex_lock(&g_RegionLock);
+    region->Next = g_Regions;
+    g_Regions = region;
+    pthread_mutex_unlock(&g_RegionLock);
+}
+
+// unlink the region starting at 'base', caller holds g_RegionLock
+static COMPAT_REGION *CompatTakeRegion(const BYTE *base)
+{
+    COMPAT_REGION **link;
+    COMPAT_REGION *region;
+
+    for (link = &g_Regions; *link; link = &(*link)->Next)
+    {
+        region = *link;
+        if (region->Base == base)
+        {
+            *link = region->Next;
+            return region;
+        }
+    }
+    return NULL;
+}
+
+static SIZE_T CompatPageRound(SIZE_T size)
+{
+    SIZE_T pageSize = (SIZE_T) sysconf(_SC_PAGESIZE);
+
+    return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+PVOID VirtualAlloc(PVOID address, SIZE_T size, DWORD allocationType, DWORD protect)
+{
+    BYTE *base;
+
+    if (allocationType & MEM_LARGE_PAGES)
+    {
+        // GetLargePageMinimum returns 0, callers shouldn't ask
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+
+    size = CompatPageRound(size);
+    if (address)
+    {
+        // commit within a reserved range
+        if (mprotect(address, size, protect == PAGE_NOACCESS ? PROT_NONE : PROT_READ | PROT_WRITE) != 0)
+        {
+            CompatSetErrno();
+            return NULL;
+        }
+        return address;
+    }
+
+    base = (BYTE *) mmap(NULL, size, (allocationType & MEM_COMMIT) && protect != PAGE_NOACCESS ? PROT_READ | PROT_WRITE : PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        CompatSetErrno();
+        return NULL;
+    }
+
+    CompatAddRegion(base, size, NULL, FALSE);
+    return base;
+}
+
+BOOL VirtualFree(PVOID address, SIZE_T size, DWORD freeType)
+{
+    COMPAT_REGION *region;
+    BOOL success = FALSE;
+
+    if (freeType & MEM_DECOMMIT)
+        return madvise(address, size, MADV_DONTNEED) == 0;
+
+    pthread_mutex_lock(&g_RegionLock);
+    region = CompatTakeRegion((BYTE *) address);
+    if (region && !region->Section)
+    {
+        if (freeType & MEM_PRESERVE_PLACEHOLDER)
+        {
+            // split a placeholder in two
+            if (region->Placeholder && size < region->Size)
+            {
+                COMPAT_REGION *second = (COMPAT_REGION *) malloc(sizeof(COMPAT_REGION));
+
+                if (second)
+                {
+                    second->Base = region->Base + size;
+                    second->Size = region->Size - size;
+                    second->Section = NULL;
+                    second->Placeholder = TRUE;
+                    second->Next = g_Regions;
+                    region->Size = size;
+                    g_Regions = second;
+                    success = TRUE;
+                }
+            }
+            region->Next = g_Regions;
+            g_Regions = region;
+        }
+        else
+        {
+            munmap(region->Base, region->Size);
+            free(region);
+            success = TRUE;
+        }
+    }
+    else if (region)
+    {
+        // views are released with UnmapViewOfFile
+        region->Next = g_Regions;
+        g_Regions = region;
+    }
+    pthread_mutex_unlock(&g_RegionLock);
+
+    if (!success)
+        SetLastError(ERROR_INVALID_PARAMETER);
+    return success;
+}
+
+SIZE_T VirtualQuery(LPCVOID address, MEMORY_BASIC_INFORMATION *info, SIZE_T length)
+{
+    const BYTE *page = (const BYTE *) ((ULONG_PTR) address & ~((ULONG_PTR) sysconf(_SC_PAGESIZE) - 1));
+    COMPAT_REGION *region;
+    SIZE_T result = 0;
+
+    if (length < sizeof(MEMORY_BASIC_INFORMATION))
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_RegionLock);
+    for (region = g_Regions; region; region = region->Next)
+    {
+        if (page >= region->Base && page < region->Base + region->Size)
+        {
+            ZeroMemory(info, sizeof(*info));
+            info->BaseAddress = (PVOID) page;
+            info->AllocationBase = region->Base;
+            info->RegionSize = (SIZE_T) (region->Base + region->Size - page);
+            info->Protect = region->Placeholder ? PAGE_NOACCESS : PAGE_READWRITE;
+            result = sizeof(MEMORY_BASIC_INFORMATION);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_RegionLock);
+
+    if (!result)
+        SetLastError(ERROR_INVALID_PARAMETER);
+    return result;
+}
+
+SIZE_T GetLargePageMinimum(void)
+{
+    return 0;
+}
+
+BOOL PrefetchVirtualMemory(HANDLE process, ULONG_PTR numberOfEntries, WIN32_MEMORY_RANGE_ENTRY *addresses, ULONG flags)
+{
+    ULONG_PTR pageMask = (ULONG_PTR) sysconf(_SC_PAGESIZE) - 1;
+    ULONG_PTR start;
+    ULONG_PTR i;
+
+    UNREFERENCED_PARAMETER(process);
+    UNREFERENCED_PARAMETER(flags);
+
+    for (i = 0; i < numberOfEntries; i++)
+    {
+        start = (ULONG_PTR) addresses[i].VirtualAddress & ~pageMask;
+        madvise((void *) start, (ULONG_PTR) addresses[i].VirtualAddress + addresses[i].NumberOfBytes - start, MADV_WILLNEED);
+    }
+    return TRUE;
+}
+
+static PVOID WINAPI CompatVirtualAlloc2(HANDLE process, PVOID address, SIZE_T size, ULONG allocationType, ULONG protect,
+                                        MEM_EXTENDED_PARAMETER *parameters, ULONG parameterCount)
+{
+    BYTE *base;
+
+    UNREFERENCED_PARAMETER(process);
+    UNREFERENCED_PARAMETER(parameters);
+    UNREFERENCED_PARAMETER(parameterCount);
+
+    if (!(allocationType & MEM_RESERVE_PLACEHOLDER))
+        return VirtualAlloc(address, size, allocationType, protect);
+
+    base = (BYTE *) mmap(address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        CompatSetErrno();
+        return NULL;
+    }
+
+    CompatAddRegion(base, size, NULL, TRUE);
+    return base;
+}
+
+// Sections
+
+HANDLE CreateFileMappingW(HANDLE file, PSECURITY_ATTRIBUTES attributes, DWORD protect, DWORD maximumSizeHigh,
+                          DWORD maximumSizeLow, const WCHAR *name)
+{
+    UINT64 size = ((UINT64) maximumSizeHigh << 32) | maximumSizeLow;
+    COMPAT_OBJECT *section;
+    char objectName[MAX_PATH + 2];
+    struct stat info;
+    BOOL exists = FALSE;
+
+    UNREFERENCED_PARAMETER(attributes);
+    UNREFERENCED_PARAMETER(protect);
+
+    section = CompatNewObject(COMPAT_SECTION);
+    if (!section)
+        return NULL;
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        section->Fd = dup(((COMPAT_OBJECT *) file)->Fd);
+    }
+    else if (name)
+    {
+        CompatObjectName(name, objectName, sizeof(objectName));
+        section->Fd = shm_open(objectName, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (section->Fd >= 0)
+        {
+            section->Name = strdup(objectName);
+        }
+        else if (errno == EEXIST)
+        {
+            section->Fd = shm_open(objectName, O_RDWR, 0);
+            exists = TRUE;
+        }
+    }
+    else
+    {
+        section->Fd = memfd_create("section", MFD_CLOEXEC);
+    }
+
+    if (section->Fd < 0 || fstat(section->Fd, &info) != 0)
+        goto fail;
+
+    // pagefile-backed sections need a size, file sections grow to it
+    if (!exists && size > (UINT64) info.st_size)
+    {
+        if (ftruncate(section->Fd, (off_t) size) != 0)
+            goto fail;
+    }
+    else
+    {
+        size = (UINT64) info.st_size;
+    }
+
+    if (size == 0)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    section->Size = size;
+    SetLastError(exists ? ERROR_ALREADY_EXISTS : ERROR_SUCCESS);
+    return section;
+
+fail:
+    CompatSetErrno();
+    CompatRelease(section);
+    return NULL;
+}
+
+HANDLE OpenFileMappingW(DWORD desiredAccess, BOOL inheritHandle, const WCHAR *name)
+{
+    COMPAT_OBJECT *section;
+    char objectName[MAX_PATH + 2];
+    struct stat info;
+
+    UNREFERENCED_PARAMETER(desiredAccess);
+    UNREFERENCED_PARAMETER(inheritHandle);
+
+    section = CompatNewObject(COMPAT_SECTION);
+    if (!section)
+        return NULL;
+
+    CompatObjectName(name, objectName, sizeof(objectName));
+    section->Fd = shm_open(objectName, O_RDWR, 0);
+    if (section->Fd < 0 || fstat(section->Fd, &info) != 0)
+    {
+        CompatSetErrno();
+        CompatRelease(section);
+        return NULL;
+    }
+
+    section->Size = (UINT64) info.st_size;
+    return section;
+}
+
+static PVOID CompatMapView(COMPAT_OBJECT *section, BYTE *address, UINT64 offset, SIZE_T size, int protection)
+{
+    BYTE *view;
+
+    if (!section || section->Type != COMPAT_SECTION || offset > section->Size)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    if (size == 0)
+        size = (SIZE_T) (section->Size - offset);
+
+    view = (BYTE *) mmap(address, size, protection, MAP_SHARED | (address ? MAP_FIXED : 0), section->Fd, (off_t) offset);
+    if (view == MAP_FAILED)
+    {
+        CompatSetErrno();
+        return NULL;
+    }
+
+    CompatReference(section);
+    CompatAddRegion(view, CompatPageRound(size), section, FALSE);
+    return view;
+}
+
+PVOID MapViewOfFile(HANDLE section, DWORD desiredAccess, DWORD offsetHigh, DWORD offsetLow, SIZE_T size)
+{
+    return CompatMapView((COMPAT_OBJECT *) section, NULL, ((UINT64) offsetHigh << 32) | offsetLow, size,
+                         (desiredAccess & FILE_MAP_WRITE) ? PROT_READ | PROT_WRITE : PROT_READ);
+}
+
+static PVOID WINAPI CompatMapViewOfFile3(HANDLE section, HANDLE process, PVOID address, ULONG64 offset, SIZE_T size,
+                                         ULONG allocationType, ULONG protect, MEM_EXTENDED_PARAMETER *parameters,
+                                         ULONG parameterCount)
+{
+    COMPAT_REGION *region;
+    PVOID view;
+
+    UNREFERENCED_PARAMETER(process);
+    UNREFERENCED_PARAMETER(parameters);
+    UNREFERENCED_PARAMETER(parameterCount);
+
+    if (!(allocationType & MEM_REPLACE_PLACEHOLDER))
+        return CompatMapView((COMPAT_OBJECT *) section, (BYTE *) address, offset, size,
+                             protect == PAGE_READONLY ? PROT_READ : PROT_READ | PROT_WRITE);
+
+    // the view has to replace a whole placeholder
+    pthread_mutex_lock(&g_RegionLock);
+    region = CompatTakeRegion((BYTE *) address);
+    pthread_mutex_unlock(&g_RegionLock);
+    if (!region || !region->Placeholder || region->Size != size)
+    {
+        if (region)
+        {
+            pthread_mutex_lock(&g_RegionLock);
+            region->Next = g_Regions;
+            g_Regions = region;
+            pthread_mutex_unlock(&g_RegionLock);
+        }
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    view = CompatMapView((COMPAT_OBJECT *) section, region->Base, offset, size,
+                         protect == PAGE_READONLY ? PROT_READ : PROT_READ | PROT_WRITE);
+    if (!view)
+    {
+        pthread_mutex_lock(&g_RegionLock);
+        region->Next = g_Regions;
+        g_Regions = region;
+        pthread_mutex_unlock(&g_RegionLock);
+        return NULL;
+    }
+
+    free(region);
+    return view;
+}
+
+BOOL UnmapViewOfFile(LPCVOID address)
+{
+    COMPAT_REGION *region;
+
+    pthread_mutex_lock(&g_RegionLock);
+    region = CompatTakeRegion((const BYTE *) address);
+    if (region && !region->Section)
+    {
+        region->Next = g_Regions;
+        g_Regions = region;
+        region = NULL;
+    }
+    pthread_mutex_unlock(&g_RegionLock);
+
+    if (!region)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    munmap(region->Base, region->Size);
+    CompatRelease(region->Section);
+    free(region);
+    return TRUE;
+}
+
+// Files
+
+HANDLE CreateFileW(const WCHAR *fileName, DWORD desiredAccess, DWORD shareMode, PSECURITY_ATTRIBUTES attributes,
+                   DWORD creationDisposition, DWORD flagsAndAttributes, HANDLE templateFile)
+{
+    COMPAT_OBJECT *file;
+    char path[MAX_PATH * 4];
+    int openFlags;
+
+    UNREFERENCED_PARAMETER(shareMode);
+    UNREFERENCED_PARAMETER(attributes);
+    UNREFERENCED_PARAMETER(templateFile);
+
+    file = CompatNewObject(COMPAT_FILE);
+    if (!file)
+        return INVALID_HANDLE_VALUE;
+
+    openFlags = (desiredAccess & GENERIC_WRITE) ? O_RDWR : O_RDONLY;
+    if (creationDisposition == CREATE_ALWAYS)
+        openFlags |= O_CREAT | O_TRUNC;
+
+    CompatNarrowPath(fileName, path, sizeof(path));
+    file->Fd = open(path, openFlags | O_CLOEXEC, 0600);
+    if (file->Fd < 0)
+    {
+        CompatSetErrno();
+        CompatRelease(file);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (flagsAndAttributes & FILE_FLAG_DELETE_ON_CLOSE)
+        unlink(path);
+    if (flagsAndAttributes & FILE_FLAG_SEQUENTIAL_SCAN)
+        posix_fadvise(file->Fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    SetLastError(ERROR_SUCCESS);
+    return file;
+}
+
+BOOL DeleteFileW(const WCHAR *fileName)
+{
+    char path[MAX_PATH * 4];
+
+    CompatNarrowPath(fileName, path, sizeof(path));
+    if (unlink(path) != 0)
+    {
+        CompatSetErrno();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *fileSize)
+{
+    struct stat info;
+
+    if (fstat(((COMPAT_OBJECT *) file)->Fd, &info) != 0)
+    {
+        CompatSetErrno();
+        return FALSE;
+    }
+
+    fileSize->QuadPart = info.st_size;
+    return TRUE;
+}
+
+DWORD GetTempPathW(DWORD bufferLength, WCHAR *buffer)
+{
+    const char *directory = getenv("TMPDIR");
+    char path[MAX_PATH];
+    size_t length;
+
+    snprintf(path, sizeof(path), "%s/", directory && *directory ? directory : "/tmp");
+    length = strlen(path);
+    if (length + 1 > bufferLength)
+        return (DWORD) length + 1;
+
+    CompatWidenPath(path, buffer, bufferLength);
+    return (DWORD) length;
+}
+
+UINT GetTempFileNameW(const WCHAR *pathName, const WCHAR *prefixString, UINT unique, WCHAR *tempFileName)
+{
+    char directory[MAX_PATH];
+    char prefix[4];
+    char path[MAX_PATH];
+    int fd;
+
+    UNREFERENCED_PARAMETER(unique);
+
+    CompatNarrowPath(pathName, directory, sizeof(directory));
+    CompatNarrowPath(prefixString, prefix, sizeof(prefix));
+    snprintf(path, sizeof(path), "%s%s%sXXXXXX", directory,
+             directory[0] && directory[strlen(directory) - 1] != '/' ? "/" : "", prefix);
+
+    // creates the file like GetTempFileName with unique == 0
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        CompatSetErrno();
+        return 0;
+    }
+
+    close(fd);
+    CompatWidenPath(path, tempFileName, MAX_PATH);
+    return 1;
+}
+
+BOOL DeviceIoControl(HANDLE device, DWORD ioControlCode, PVOID inBuffer, DWORD inBufferSize, PVOID outBuffer,
+                     DWORD outBufferSize, DWORD *bytesReturned, PVOID overlapped)
+{
+    UNREFERENCED_PARAMETER(device);
+    UNREFERENCED_PARAMETER(inBuffer);
+    UNREFERENCED_PARAMETER(inBufferSize);
+    UNREFERENCED_PARAMETER(outBuffer);
+    UNREFERENCED_PARAMETER(outBufferSize);
+    UNREFERENCED_PARAMETER(overlapped);
+
+    // files are sparse anyway
+    if (ioControlCode != FSCTL_SET_SPARSE)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+
+    if (bytesReturned)
+        *bytesReturned = 0;
+    return TRUE;
+}
+
+// Threads and events
+
+static void *CompatThreadStart(void *parameter)
+{
+    COMPAT_OBJECT *thread = (COMPAT_OBJECT *) parameter;
+
+    thread->Start(thread->Parameter);
+    CompatFlsThreadExit();
+
+    pthread_mutex_lock(&thread->Mutex);
+    thread->Exited = TRUE;
+    pthread_cond_broadcast(&thread->ExitedCondition);
+    pthread_mutex_unlock(&thread->Mutex);
+    CompatRelease(thread);
+    return NULL;
+}
+
+HANDLE CreateThread(PSECURITY_ATTRIBUTES attributes, SIZE_T stackSize, LPTHREAD_START_ROUTINE startAddress,
+                    PVOID parameter, DWORD creationFlags, DWORD *threadId)
+{
+    COMPAT_OBJECT *thread;
+    pthread_attr_t threadAttributes;
+    pthread_t id;
+    int status;
+
+    UNREFERENCED_PARAMETER(attributes);
+    UNREFERENCED_PARAMETER(creationFlags);
+
+    thread = CompatNewObject(COMPAT_THREAD);
+    if (!thread)
+        return NULL;
+
+    thread->Start = startAddress;
+    thread->Parameter = parameter;
+    pthread_mutex_init(&thread->Mutex, NULL);
+    pthread_cond_init(&thread->ExitedCondition, NULL);
+    CompatReference(thread); // for the thread itself
+
+    pthread_attr_init(&threadAttributes);
+    pthread_attr_setdetachstate(&threadAttributes, PTHREAD_CREATE_DETACHED);
+    if (stackSize)
+        pthread_attr_setstacksize(&threadAttributes, stackSize);
+    status = pthread_create(&id, &threadAttributes, CompatThreadStart, thread);
+    pthread_attr_destroy(&threadAttributes);
+
+    if (status != 0)
+    {
+        SetLastError(CompatErrno(status));
+        CompatRelease(thread);
+        CompatRelease(thread);
+        return NULL;
+    }
+
+    if (threadId)
+        *threadId = (DWORD) id;
+    return thread;
+}
+
+HANDLE CreateEventW(PSECURITY_ATTRIBUTES attributes, BOOL manualReset, BOOL initialState, const WCHAR *name)
+{
+    COMPAT_OBJECT *event;
+    char objectName[MAX_PATH + 2];
+    BOOL exists = FALSE;
+
+    UNREFERENCED_PARAMETER(attributes);
+
+    if (manualReset)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+
+    event = CompatNewObject(COMPAT_EVENT);
+    if (!event)
+        return NULL;
+
+    if (name)
+    {
+        CompatObjectName(name, objectName, sizeof(objectName));
+        event->Semaphore = sem_open(objectName, O_CREAT | O_EXCL, 0600, initialState ? 1 : 0);
+        if (event->Semaphore != SEM_FAILED)
+        {
+            event->Name = strdup(objectName);
+        }
+        else if (errno == EEXIST)
+        {
+            event->Semaphore = sem_open(objectName, 0);
+            exists = TRUE;
+        }
+
+        if (event->Semaphore == SEM_FAILED)
+        {
+            CompatSetErrno();
+            event->Semaphore = NULL;
+            free(event);
+            return NULL;
+        }
+    }
+    else
+    {
+        event->Semaphore = &event->UnnamedSemaphore;
+        sem_init(event->Semaphore, 0, initialState ? 1 : 0);
+    }
+
+    SetLastError(exists ? ERROR_ALREADY_EXISTS : ERROR_SUCCESS);
+    return event;
+}
+
+HANDLE OpenEventW(DWORD desiredAccess, BOOL inheritHandle, const WCHAR *name)
+{
+    COMPAT_OBJECT *event;
+    char objectName[MAX_PATH + 2];
+
+    UNREFERENCED_PARAMETER(desiredAccess);
+    UNREFERENCED_PARAMETER(inheritHandle);
+
+    event = CompatNewObject(COMPAT_EVENT);
+    if (!event)
+        return NULL;
+
+    CompatObjectName(name, objectName, sizeof(objectName));
+    event->Semaphore = sem_open(objectName, 0);
+    if (event->Semaphore == SEM_FAILED)
+    {
+        CompatSetErrno();
+        free(event);
+        return NULL;
+    }
+    return event;
+}
+
+BOOL SetEvent(HANDLE event)
+{
+    sem_t *semaphore = ((COMPAT_OBJECT *) event)->Semaphore;
+    int value;
+
+    // auto-reset: at most one pending wakeup (racing setters may leave two, waiters recheck anyway)
+    if (sem_getvalue(semaphore, &value) == 0 && value > 0)
+        return TRUE;
+    return sem_post(semaphore) == 0;
+}
+
+static void CompatDeadline(DWORD milliseconds, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += milliseconds / 1000;
+    deadline->tv_nsec += (long) (milliseconds % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+    COMPAT_OBJECT *object = (COMPAT_OBJECT *) handle;
+    struct timespec deadline;
+    int status = 0;
+
+    if (milliseconds != INFINITE)
+        CompatDeadline(milliseconds, &deadline);
+
+    switch (object->Type)
+    {
+    case COMPAT_EVENT:
+        do
+        {
+            status = (milliseconds == INFINITE) ? sem_wait(object->Semaphore) : sem_timedwait(object->Semaphore, &deadline);
+        } while (status != 0 && errno == EINTR);
+        if (status != 0)
+            status = errno;
+        break;
+
+    case COMPAT_THREAD:
+        pthread_mutex_lock(&object->Mutex);
+        while (!object->Exited && status == 0)
+        {
+            if (milliseconds == INFINITE)
+                status = pthread_cond_wait(&object->ExitedCondition, &object->Mutex);
+            else
+                status = pthread_cond_timedwait(&object->ExitedCondition, &object->Mutex, &deadline);
+        }
+        pthread_mutex_unlock(&object->Mutex);
+        break;
+
+    default:
+        SetLastError(ERROR_INVALID_HANDLE);
+        return WAIT_FAILED;
+    }
+
+    if (status == ETIMEDOUT)
+        return WAIT_TIMEOUT;
+    if (status != 0)
+    {
+        SetLastError(CompatErrno(status));
+        return WAIT_FAILED;
+    }
+    return WAIT_OBJECT_0;
+}
+
+BOOL WaitOnAddress(volatile void *address, PVOID compareAddress, SIZE_T addressSize, DWORD milliseconds)
+{
+    struct timespec timeout = { milliseconds / 1000, (long) (milliseconds % 1000) * 1000000 };
+
+    // futexes are 32-bit, wider values are polled
+    if (addressSize != sizeof(int))
+    {
+        if (memcmp((const void *) address, compareAddress, addressSize) == 0)
+            sched_yield();
+        return TRUE;
+    }
+
+    if (syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, *(int *) compareAddress,
+                milliseconds == INFINITE ? NULL : &timeout, NULL, 0) != 0 && errno == ETIMEDOUT)
+    {
+        SetLastError(ERROR_TIMEOUT);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void WakeByAddressSingle(PVOID address)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void WakeByAddressAll(PVOID address)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Thread pool
+
+PTP_WORK CreateThreadpoolWork(PTP_WORK_CALLBACK callback, PVOID context, PTP_CALLBACK_ENVIRON environment)
+{
+    PTP_WORK work = (PTP_WORK) calloc(1, sizeof(TP_WORK));
+
+    UNREFERENCED_PARAMETER(environment);
+
+    if (!work)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    work->Callback = callback;
+    work->Context = context;
+    pthread_mutex_init(&work->Mutex, NULL);
+    pthread_cond_init(&work->IdleCondition, NULL);
+    return work;
+}
+
+static void *CompatWorkThread(void *parameter)
+{
+    PTP_WORK work = (PTP_WORK) parameter;
+
+    work->Callback(NULL, work->Context, work);
+
+    pthread_mutex_lock(&work->Mutex);
+    if (--work->Pending == 0)
+        pthread_cond_broadcast(&work->IdleCondition);
+    pthread_mutex_unlock(&work->Mutex);
+    return NULL;
+}
+
+void SubmitThreadpoolWork(PTP_WORK work)
+{
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    pthread_mutex_lock(&work->Mutex);
+    work->Pending++;
+    pthread_mutex_unlock(&work->Mutex);
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attributes, CompatWorkThread, work) != 0)
+        CompatWorkThread(work); // run it inline rather than lose it
+    pthread_attr_destroy(&attributes);
+}
+
+void WaitForThreadpoolWorkCallbacks(PTP_WORK work, BOOL cancelPendingCallbacks)
+{
+    UNREFERENCED_PARAMETER(cancelPendingCallbacks);
+
+    pthread_mutex_lock(&work->Mutex);
+    while (work->Pending > 0)
+        pthread_cond_wait(&work->IdleCondition, &work->Mutex);
+    pthread_mutex_unlock(&work->Mutex);
+}
+
+void CloseThreadpoolWork(PTP_WORK work)
+{
+    WaitForThreadpoolWorkCallbacks(work, FALSE);
+    pthread_cond_destroy(&work->IdleCondition);
+    pthread_mutex_destroy(&work->Mutex);
+    free(work);
+}
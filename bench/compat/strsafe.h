@@ -0,0 +1,40 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// strsafe.h subset for the Linux build, see windows.h. Formats follow the Windows CRT
+// (%s is a WCHAR string, %l is 32 bits).
+
+#pragma once
+#include <stdarg.h>
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+HRESULT StringCchLengthW(const WCHAR *string, SIZE_T maxLength, SIZE_T *length);
+HRESULT StringCchCopyW(WCHAR *destination, SIZE_T destinationSize, const WCHAR *source);
+HRESULT StringCchVPrintfW(WCHAR *destination, SIZE_T destinationSize, const WCHAR *format, va_list args);
+HRESULT StringCchPrintfW(WCHAR *destination, SIZE_T destinationSize, const WCHAR *format, ...);
+
+#ifdef __cplusplus
+}
+#endif
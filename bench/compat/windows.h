@@ -0,0 +1,418 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Win32 subset for building the library sources and benchmarks on Linux (see bench/README.md).
+// Only what buffer.c, crc32*.c, utf8-conv.c and the benchmarks use, with the same semantics where it matters:
+// - sections are memfd (unnamed) or shm_open (named) objects, MapViewOfFile3 over a placeholder
+//   reserved with VirtualAlloc2 is MAP_FIXED, so mirrored buffers are real double mappings
+// - named events are POSIX semaphores, auto-reset only
+// - WaitOnAddress is a futex wait (4-byte values)
+// - SEH isn't available, __try blocks always run and __except blocks never do
+// Must be built with -fshort-wchar so that WCHAR and L"" literals are UTF-16.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WINAPI
+#define CALLBACK
+#define APIENTRY
+#define IN
+#define OUT
+#define OPTIONAL
+#define __declspec(x)
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef uint8_t BYTE, UCHAR, *PBYTE;
+typedef char CHAR;
+typedef uint16_t WORD, USHORT;
+typedef int32_t LONG, HRESULT;
+typedef uint32_t DWORD, ULONG, UINT32, *LPDWORD;
+typedef int64_t LONGLONG, LONG64;
+typedef uint64_t ULONGLONG, ULONG64, DWORD64, UINT64, *PUINT64;
+typedef size_t SIZE_T;
+typedef uintptr_t ULONG_PTR;
+typedef intptr_t LONG_PTR;
+typedef void VOID, *PVOID, *LPVOID, *HANDLE, *HMODULE;
+typedef const void *LPCVOID;
+typedef void (*FARPROC)(void);
+typedef wchar_t WCHAR, *PWCHAR, *LPWSTR;
+typedef const wchar_t *LPCWSTR;
+
+#ifdef __cplusplus
+static_assert(sizeof(wchar_t) == 2, "build with -fshort-wchar");
+#else
+_Static_assert(sizeof(wchar_t) == 2, "build with -fshort-wchar");
+#endif
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE 1
+#define FALSE 0
+#define INFINITE 0xFFFFFFFF
+#define MAX_PATH 260
+#define MAXUINT32 ((UINT32) ~((UINT32) 0))
+#define MAXUINT64 ((UINT64) ~((UINT64) 0))
+#define INVALID_HANDLE_VALUE ((HANDLE) (LONG_PTR) -1)
+
+#define ERROR_SUCCESS 0
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_INVALID_DATA 13
+#define ERROR_OUTOFMEMORY 14
+#define ERROR_READ_FAULT 30
+#define ERROR_HANDLE_EOF 38
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_BUFFER_OVERFLOW 111
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_NO_MORE_ITEMS 259
+#define ERROR_ARITHMETIC_OVERFLOW 534
+#define ERROR_OPERATION_ABORTED 995
+#define ERROR_NO_UNICODE_TRANSLATION 1113
+#define ERROR_TIMEOUT 1460
+
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS 64
+
+#define FAILED(hr) (((HRESULT) (hr)) < 0)
+#define SUCCEEDED(hr) (((HRESULT) (hr)) >= 0)
+#define S_OK ((HRESULT) 0)
+#define STRSAFE_E_INSUFFICIENT_BUFFER ((HRESULT) 0x8007007A)
+#define STRSAFE_E_INVALID_PARAMETER ((HRESULT) 0x80070057)
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF ARRAYSIZE
+#define UNREFERENCED_PARAMETER(p) ((void) (p))
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+#define MoveMemory(d, s, n) memmove((d), (s), (n))
+#ifndef __cplusplus
+#    define min(a, b) (((a) < (b)) ? (a) : (b))
+#    define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define _aligned_malloc(size, alignment) aligned_alloc((alignment), ((size) + (alignment) - 1) / (alignment) * (alignment))
+#define _aligned_free free
+
+// SEH, see above (C only, libstdc++ uses __try for its own purposes)
+#ifndef __cplusplus
+#    define __try if (1)
+#    define __except(filter) else if (0)
+#endif
+#define EXCEPTION_IN_PAGE_ERROR 0xC0000006
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define EXCEPTION_CONTINUE_SEARCH 0
+#define GetExceptionCode() 0
+void RaiseException(DWORD code, DWORD flags, DWORD argumentCount, const ULONG_PTR *arguments);
+
+// Interlocked and fenced accesses
+
+#if defined(__x86_64__) || defined(__i386__)
+#    define YieldProcessor() __builtin_ia32_pause()
+#else
+#    define YieldProcessor() ((void) 0)
+#endif
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define _ReadWriteBarrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+#define COMPAT_INTERLOCKED(type, suffix)                                                                        \
+    static inline type ReadAcquire##suffix(type const volatile *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); } \
+    static inline type ReadNoFence##suffix(type const volatile *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); } \
+    static inline void WriteRelease##suffix(type volatile *p, type v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); } \
+    static inline void WriteNoFence##suffix(type volatile *p, type v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); } \
+    static inline type InterlockedIncrement##suffix(type volatile *p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedDecrement##suffix(type volatile *p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedAdd##suffix(type volatile *p, type v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedExchangeAdd##suffix(type volatile *p, type v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedExchange##suffix(type volatile *p, type v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedOr##suffix(type volatile *p, type v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedAnd##suffix(type volatile *p, type v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); } \
+    static inline type InterlockedCompareExchange##suffix(type volatile *p, type exchange, type comparand) \
+    {                                                                                                       \
+        __atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);      \
+        return comparand;                                                                                   \
+    }
+
+COMPAT_INTERLOCKED(LONG, )
+COMPAT_INTERLOCKED(LONG64, 64)
+
+static inline PVOID ReadPointerAcquire(PVOID const volatile *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static inline PVOID InterlockedCompareExchangePointer(PVOID volatile *p, PVOID exchange, PVOID comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static inline unsigned char _BitScanReverse64(ULONG *index, UINT64 mask)
+{
+    if (!mask)
+        return 0;
+    *index = 63 - (ULONG) __builtin_clzll(mask);
+    return 1;
+}
+
+// Locks and one-time initialization
+
+typedef struct _CRITICAL_SECTION
+{
+    pthread_mutex_t Mutex; // recursive like the real thing
+} CRITICAL_SECTION;
+
+typedef struct _SRWLOCK
+{
+    pthread_mutex_t Mutex;
+} SRWLOCK;
+
+#define SRWLOCK_INIT { PTHREAD_MUTEX_INITIALIZER }
+
+typedef struct _INIT_ONCE
+{
+    pthread_mutex_t Mutex;
+    volatile int Done;
+} INIT_ONCE, *PINIT_ONCE;
+
+#define INIT_ONCE_STATIC_INIT { PTHREAD_MUTEX_INITIALIZER, 0 }
+
+typedef BOOL (CALLBACK *PINIT_ONCE_FN)(PINIT_ONCE initOnce, PVOID parameter, PVOID *context);
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+void DeleteCriticalSection(CRITICAL_SECTION *cs);
+void EnterCriticalSection(CRITICAL_SECTION *cs);
+void LeaveCriticalSection(CRITICAL_SECTION *cs);
+void InitializeSRWLock(SRWLOCK *lock);
+void AcquireSRWLockExclusive(SRWLOCK *lock);
+void ReleaseSRWLockExclusive(SRWLOCK *lock);
+void AcquireSRWLockShared(SRWLOCK *lock);
+void ReleaseSRWLockShared(SRWLOCK *lock);
+BOOL InitOnceExecuteOnce(PINIT_ONCE initOnce, PINIT_ONCE_FN initFn, PVOID parameter, PVOID *context);
+
+// Fiber local storage: pthread keys, the callback runs when a thread exits with a value set
+// (for CreateThread threads before the handle is signaled, like on Windows).
+// FlsFree only runs it for the calling thread (Windows runs it for every thread).
+
+#define FLS_OUT_OF_INDEXES 0xFFFFFFFF
+
+typedef VOID (WINAPI *PFLS_CALLBACK_FUNCTION)(PVOID flsData);
+
+DWORD FlsAlloc(PFLS_CALLBACK_FUNCTION callback);
+BOOL FlsFree(DWORD index);
+PVOID FlsGetValue(DWORD index);
+BOOL FlsSetValue(DWORD index, PVOID data);
+
+// Interlocked singly linked list (locked here, the API is what matters)
+
+typedef struct __attribute__((aligned(16))) _SLIST_ENTRY
+{
+    struct _SLIST_ENTRY *Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct _SLIST_HEADER
+{
+    pthread_mutex_t Mutex;
+    PSLIST_ENTRY First;
+    USHORT Depth;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+void InitializeSListHead(PSLIST_HEADER head);
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER head, PSLIST_ENTRY entry);
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER head);
+USHORT QueryDepthSList(PSLIST_HEADER head);
+
+// Errors, time and system information
+
+DWORD GetLastError(void);
+void SetLastError(DWORD error);
+void Sleep(DWORD milliseconds);
+ULONGLONG GetTickCount64(void);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency);
+
+typedef struct _SYSTEM_INFO
+{
+    DWORD dwPageSize;
+    DWORD dwAllocationGranularity;
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+void GetSystemInfo(SYSTEM_INFO *systemInfo);
+DWORD GetCurrentProcessId(void);
+DWORD GetCurrentThreadId(void);
+HANDLE GetCurrentProcess(void);
+HMODULE GetModuleHandleW(const WCHAR *moduleName);
+FARPROC GetProcAddress(HMODULE module, const char *procName);
+#define GetModuleHandle GetModuleHandleW
+
+// Strings: the C library's wide string functions work on 32-bit wchar_t whatever -fshort-wchar says
+
+size_t CompatWcslen(const WCHAR *string);
+#define wcslen CompatWcslen
+
+// Virtual memory and sections
+
+#define PAGE_NOACCESS 0x01
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define MEM_COMMIT 0x00001000
+#define MEM_RESERVE 0x00002000
+#define MEM_DECOMMIT 0x00004000
+#define MEM_REPLACE_PLACEHOLDER 0x00004000
+#define MEM_RELEASE 0x00008000
+#define MEM_RESERVE_PLACEHOLDER 0x00040000
+#define MEM_PRESERVE_PLACEHOLDER 0x00000002
+#define MEM_LARGE_PAGES 0x20000000
+#define FILE_MAP_WRITE 0x0002
+#define FILE_MAP_READ 0x0004
+#define FILE_MAP_ALL_ACCESS 0x000F001F
+
+typedef struct _MEM_EXTENDED_PARAMETER
+{
+    UINT64 Type;
+    UINT64 Value;
+} MEM_EXTENDED_PARAMETER;
+
+typedef struct _MEMORY_BASIC_INFORMATION
+{
+    PVOID BaseAddress;
+    PVOID AllocationBase;
+    DWORD AllocationProtect;
+    SIZE_T RegionSize;
+    DWORD State;
+    DWORD Protect;
+    DWORD Type;
+} MEMORY_BASIC_INFORMATION;
+
+typedef struct _WIN32_MEMORY_RANGE_ENTRY
+{
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+} WIN32_MEMORY_RANGE_ENTRY;
+
+typedef struct _SECURITY_ATTRIBUTES
+{
+    DWORD nLength;
+    PVOID lpSecurityDescriptor;
+    BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES, *PSECURITY_ATTRIBUTES;
+
+PVOID VirtualAlloc(PVOID address, SIZE_T size, DWORD allocationType, DWORD protect);
+BOOL VirtualFree(PVOID address, SIZE_T size, DWORD freeType);
+SIZE_T VirtualQuery(LPCVOID address, MEMORY_BASIC_INFORMATION *info, SIZE_T length);
+SIZE_T GetLargePageMinimum(void);
+BOOL PrefetchVirtualMemory(HANDLE process, ULONG_PTR numberOfEntries, WIN32_MEMORY_RANGE_ENTRY *addresses, ULONG flags);
+HANDLE CreateFileMappingW(HANDLE file, PSECURITY_ATTRIBUTES attributes, DWORD protect, DWORD maximumSizeHigh,
+                          DWORD maximumSizeLow, const WCHAR *name);
+HANDLE OpenFileMappingW(DWORD desiredAccess, BOOL inheritHandle, const WCHAR *name);
+PVOID MapViewOfFile(HANDLE section, DWORD desiredAccess, DWORD offsetHigh, DWORD offsetLow, SIZE_T size);
+BOOL UnmapViewOfFile(LPCVOID address);
+#define CreateFileMapping CreateFileMappingW
+#define OpenFileMapping OpenFileMappingW
+// VirtualAlloc2 and MapViewOfFile3 are only reachable through GetProcAddress, as on older Windows SDKs.
+
+// Files
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_TEMPORARY 0x00000100
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define FILE_FLAG_DELETE_ON_CLOSE 0x04000000
+#define FSCTL_SET_SPARSE 0x000900C4
+
+HANDLE CreateFileW(const WCHAR *fileName, DWORD desiredAccess, DWORD shareMode, PSECURITY_ATTRIBUTES attributes,
+                   DWORD creationDisposition, DWORD flagsAndAttributes, HANDLE templateFile);
+BOOL DeleteFileW(const WCHAR *fileName);
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *fileSize);
+DWORD GetTempPathW(DWORD bufferLength, WCHAR *buffer);
+UINT GetTempFileNameW(const WCHAR *pathName, const WCHAR *prefixString, UINT unique, WCHAR *tempFileName);
+BOOL DeviceIoControl(HANDLE device, DWORD ioControlCode, PVOID inBuffer, DWORD inBufferSize, PVOID outBuffer,
+                     DWORD outBufferSize, DWORD *bytesReturned, PVOID overlapped);
+#define CreateFile CreateFileW
+#define DeleteFile DeleteFileW
+#define GetTempPath GetTempPathW
+#define GetTempFileName GetTempFileNameW
+
+// Threads, events and waits
+
+#define SYNCHRONIZE 0x00100000
+#define EVENT_MODIFY_STATE 0x0002
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(PVOID parameter);
+
+HANDLE CreateThread(PSECURITY_ATTRIBUTES attributes, SIZE_T stackSize, LPTHREAD_START_ROUTINE startAddress,
+                    PVOID parameter, DWORD creationFlags, DWORD *threadId);
+HANDLE CreateEventW(PSECURITY_ATTRIBUTES attributes, BOOL manualReset, BOOL initialState, const WCHAR *name);
+HANDLE OpenEventW(DWORD desiredAccess, BOOL inheritHandle, const WCHAR *name);
+BOOL SetEvent(HANDLE event);
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+BOOL CloseHandle(HANDLE handle);
+#define CreateEvent CreateEventW
+#define OpenEvent OpenEventW
+
+BOOL WaitOnAddress(volatile void *address, PVOID compareAddress, SIZE_T addressSize, DWORD milliseconds);
+void WakeByAddressSingle(PVOID address);
+void WakeByAddressAll(PVOID address);
+
+// Thread pool work objects: every submission runs on its own short-lived thread.
+
+typedef struct _TP_WORK TP_WORK, *PTP_WORK;
+typedef struct _TP_CALLBACK_INSTANCE *PTP_CALLBACK_INSTANCE;
+typedef struct _TP_CALLBACK_ENVIRON *PTP_CALLBACK_ENVIRON;
+typedef VOID (CALLBACK *PTP_WORK_CALLBACK)(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work);
+
+PTP_WORK CreateThreadpoolWork(PTP_WORK_CALLBACK callback, PVOID context, PTP_CALLBACK_ENVIRON environment);
+void SubmitThreadpoolWork(PTP_WORK work);
+void WaitForThreadpoolWorkCallbacks(PTP_WORK work, BOOL cancelPendingCallbacks);
+void CloseThreadpoolWork(PTP_WORK work);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,141 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// crc.hpp: CrcEngine for reflected and normal CRCs of 8 to 64 bits against a bit-at-a-time CRC
+// computed straight from the polynomial, catalogue check values, every length and alignment
+// around the 8-byte slicing step, and data streamed in random pieces through Compute. The fast
+// kernels (Crc32, Crc32C, Crc64) must match the engines. ctest runs it with and without
+// -msse4.2, the former takes the CRC32 instruction path of Crc32C without a CPUID check.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc.hpp"
+#include "test.h"
+
+#define TEST_SMALL_LENGTH 80
+#define TEST_ALIGNMENTS 8
+#define TEST_STREAM_LENGTH (256 * 1024 + 5)
+#define TEST_STREAM_ROUNDS 20
+
+static UINT32 g_Random = 0x2468ace1;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+// bit by bit, initial value and final XOR both XorOut
+template <typename Engine, typename T, T Poly, bool Reflected, T XorOut>
+static T RefCrc(const uint8_t *data, size_t size)
+{
+    const int width = Engine::Width;
+    const T topBit = (T) ((T) 1 << (width - 1));
+    T crc = XorOut;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            // next message bit, LSB first if reflected
+            bool in = ((data[i] >> (Reflected ? bit : 7 - bit)) & 1) != 0;
+
+            if (Reflected)
+                crc = ((crc & 1) != 0) != in ? (T) ((crc >> 1) ^ Engine::Reflect(Poly)) : (T) (crc >> 1);
+            else
+                crc = ((crc & topBit) != 0) != in ? (T) ((T) (crc << 1) ^ Poly) : (T) (crc << 1);
+        }
+    }
+    return (T) (crc ^ XorOut);
+}
+
+// 'Fast' is a kernel with the same interface as Engine::Compute (or Engine itself)
+template <typename T, T Poly, bool Reflected, T XorOut, typename Fast = CrcEngine<T, Poly, Reflected, XorOut>>
+static void TestCrc(const char *name, T check, const uint8_t *data)
+{
+    using Engine = CrcEngine<T, Poly, Reflected, XorOut>;
+    const uint8_t catalogue[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    T expected, crc;
+    size_t offset, length, piece;
+
+    TestCheck(Engine::Compute(0, catalogue, sizeof(catalogue)) == check && Fast::Compute(0, catalogue, sizeof(catalogue)) == check,
+              "%s: check value 0x%llx, expected 0x%llx", name,
+              (unsigned long long) Engine::Compute(0, catalogue, sizeof(catalogue)), (unsigned long long) check);
+
+    // the reference is slow, keep it to short buffers
+    for (offset = 0; offset < TEST_ALIGNMENTS; offset++)
+    {
+        for (length = 0; length <= TEST_SMALL_LENGTH; length++)
+        {
+            expected = RefCrc<Engine, T, Poly, Reflected, XorOut>(data + offset, length);
+            TestCheck(Engine::Compute(0, data + offset, length) == expected && Fast::Compute(0, data + offset, length) == expected,
+                      "%s: offset %zu, length %zu: 0x%llx, expected 0x%llx", name, offset, length,
+                      (unsigned long long) Fast::Compute(0, data + offset, length), (unsigned long long) expected);
+        }
+    }
+
+    expected = RefCrc<Engine, T, Poly, Reflected, XorOut>(data, TEST_STREAM_LENGTH);
+    TestCheck(Engine::Compute(0, data, TEST_STREAM_LENGTH) == expected && Fast::Compute(0, data, TEST_STREAM_LENGTH) == expected,
+              "%s: long buffer: 0x%llx, expected 0x%llx", name,
+              (unsigned long long) Fast::Compute(0, data, TEST_STREAM_LENGTH), (unsigned long long) expected);
+
+    // small and large pieces, some empty, alternating between the engine and the fast kernel
+    for (int round = 0; round < TEST_STREAM_ROUNDS; round++)
+    {
+        crc = 0;
+        for (offset = 0; offset < TEST_STREAM_LENGTH; offset += piece)
+        {
+            piece = TestRandom(4) == 0 ? TestRandom(20000) : TestRandom(24);
+            if (piece > TEST_STREAM_LENGTH - offset)
+                piece = TEST_STREAM_LENGTH - offset;
+            crc = (TestRandom(2) == 0) ? Engine::Compute(crc, data + offset, piece) : Fast::Compute(crc, data + offset, piece);
+        }
+        TestCheck(crc == expected, "%s: streamed round %d: 0x%llx, expected 0x%llx", name, round, (unsigned long long) crc,
+                  (unsigned long long) expected);
+    }
+}
+
+int main(void)
+{
+    uint8_t *data = (uint8_t *) malloc(TEST_STREAM_LENGTH + TEST_ALIGNMENTS);
+
+    if (!TestCheck(data != NULL, "out of memory"))
+        return TestFinish("crc-engine-test");
+
+    for (size_t i = 0; i < TEST_STREAM_LENGTH + TEST_ALIGNMENTS; i++)
+        data[i] = (uint8_t) TestRandom(256);
+
+    TestCrc<uint32_t, 0x04C11DB7, true, 0xFFFFFFFF, Crc32>("CRC-32", 0xCBF43926, data);
+    TestCrc<uint32_t, 0x1EDC6F41, true, 0xFFFFFFFF, Crc32C>("CRC-32C", 0xE3069283, data);
+    TestCrc<uint64_t, 0x42F0E1EBA9EA3693, true, 0xFFFFFFFFFFFFFFFF, Crc64>("CRC-64/XZ", 0x995DC9BBDF1939FA, data);
+    // normal (MSB-first) and narrower CRCs
+    TestCrc<uint32_t, 0x04C11DB7, false, 0xFFFFFFFF>("CRC-32/BZIP2", 0xFC891918, data);
+    TestCrc<uint64_t, 0x42F0E1EBA9EA3693, false, 0xFFFFFFFFFFFFFFFF>("CRC-64/WE", 0x62EC59E3F1A4F00A, data);
+    TestCrc<uint16_t, 0x1021, false, 0xFFFF>("CRC-16/GENIBUS", 0xD64E, data);
+    TestCrc<uint16_t, 0x8005, true, 0>("CRC-16/ARC", 0xBB3D, data);
+    TestCrc<uint8_t, 0x07, false, 0>("CRC-8/SMBUS", 0xF4, data);
+
+    free(data);
+    return TestFinish("crc-engine-test");
+}
@@ -0,0 +1,130 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Single-threaded Crc32_ComputeBuf throughput against the original byte-at-a-time loop, for
+// buffers from 64 bytes (per-call overhead) to 16 MB (bigger than the caches). Built twice:
+// crc32-bench uses PCLMULQDQ where the CPU has it, crc32-bench-tables only the slicing-by-8/16
+// tables (CRC32_NO_PCLMUL). Results carry "speedup_vs_bytes".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "crc32.h"
+
+#ifdef CRC32_NO_PCLMUL
+#    define CRC32_BENCH_METHOD "tables"
+#else
+#    define CRC32_BENCH_METHOD "auto"
+#endif
+
+// the loop Crc32_ComputeBuf used to run, with the table it builds the others from
+static unsigned long Crc32BenchBytes(unsigned long inCrc32, const BYTE *data, size_t size)
+{
+    static UINT32 table[256];
+    UINT32 crc32 = (UINT32) inCrc32 ^ 0xFFFFFFFF;
+    UINT32 entry;
+    size_t i;
+    int bit;
+
+    if (table[1] == 0)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            entry = (UINT32) i;
+            for (bit = 0; bit < 8; bit++)
+                entry = (entry & 1) ? (entry >> 1) ^ 0xEDB88320 : entry >> 1;
+            table[i] = entry;
+        }
+    }
+
+    for (i = 0; i < size; i++)
+        crc32 = (crc32 >> 8) ^ table[(crc32 ^ data[i]) & 0xFF];
+    return crc32 ^ 0xFFFFFFFF;
+}
+
+// Returns ns per byte, 0 if the run was skipped or failed.
+static double Crc32BenchRun(const char *method, const BYTE *data, UINT64 size, UINT64 totalBytes, double bytesNsPerByte)
+{
+    BOOL bytes = (strcmp(method, "bytes") == 0);
+    char name[64];
+    unsigned long crc32;
+    UINT64 calls, i, start, elapsed;
+
+    snprintf(name, sizeof(name), "%s/%llu", method, (unsigned long long) size);
+    if (!BenchSelected(name))
+        return 0;
+
+    crc32 = bytes ? Crc32BenchBytes(0, data, (size_t) size) : Crc32_ComputeBuf(0, data, (size_t) size);
+    if (crc32 != Crc32BenchBytes(0, data, (size_t) size))
+    {
+        BenchFail("%s: wrong CRC 0x%08lx", name, crc32);
+        return 0;
+    }
+
+    calls = max(totalBytes / size, 1);
+    start = BenchNowNs();
+    // chained through inCrc32, so the calls can't be hoisted or dropped
+    for (i = 0; i < calls; i++)
+        crc32 = bytes ? Crc32BenchBytes(crc32, data, (size_t) size) : Crc32_ComputeBuf(crc32, data, (size_t) size);
+    elapsed = BenchNowNs() - start;
+
+    BenchResultBegin(name);
+    BenchResultString("method", method);
+    BenchResultUInt("size", size);
+    BenchResultUInt("crc32", crc32);
+    if (bytesNsPerByte != 0)
+        BenchResultDouble("speedup_vs_bytes", bytesNsPerByte * (double) (calls * size) / (double) elapsed);
+    BenchResultEnd(calls, calls * size, elapsed);
+    return (double) elapsed / (double) (calls * size);
+}
+
+int main(int argc, char **argv)
+{
+    static const UINT64 sizes[] = { 64, 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    UINT64 totalBytes;
+    double bytesNsPerByte;
+    BYTE *data;
+    size_t i;
+
+    BenchInit(argc, argv, "crc32-" CRC32_BENCH_METHOD);
+    totalBytes = g_Bench.Quick ? 16 * 1024 * 1024 : 1024 * 1024 * 1024;
+
+    data = (BYTE *) malloc(sizes[ARRAYSIZE(sizes) - 1]);
+    if (!data)
+    {
+        BenchFail("allocation failed");
+        return BenchFinish();
+    }
+    for (i = 0; i < sizes[ARRAYSIZE(sizes) - 1]; i += BENCH_PATTERN_MAX)
+        memcpy(data + i, BenchPattern(i), BENCH_PATTERN_MAX);
+
+    for (i = 0; i < ARRAYSIZE(sizes); i++)
+    {
+        // the byte loop is slow, a fraction of the bytes gives the same rate
+        bytesNsPerByte = Crc32BenchRun("bytes", data, sizes[i], totalBytes / 8, 0);
+        Crc32BenchRun(CRC32_BENCH_METHOD, data, sizes[i], totalBytes, bytesNsPerByte);
+    }
+
+    free(data);
+    return BenchFinish();
+}
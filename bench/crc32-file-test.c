@@ -0,0 +1,146 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Crc32_ComputeFile on a file larger than the 64 MB mapping window, against Crc32_ComputeBuf over
+// the same bytes in memory: the whole file, ranges starting and ending around the window boundary
+// (aligned and not), ranges clamped at the end of the file, chaining, one and several threads.
+// ctest also runs it with COMPAT_NO_PREFETCH, as on Windows versions without PrefetchVirtualMemory.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc32.h"
+#include "test.h"
+
+#define TEST_WINDOW (64 * 1024 * 1024) // CRC32_FILE_WINDOW
+#define TEST_FILE_SIZE (TEST_WINDOW + 6 * 1024 * 1024 + 123)
+#define TEST_RANDOM_RANGES 12
+
+static UINT32 g_Random = 0x7f4a7c15;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+static BYTE *g_Data;
+static WCHAR g_Path[MAX_PATH + 1];
+
+static BOOL TestCreateFile(void)
+{
+    WCHAR tempDir[MAX_PATH + 1];
+    char path[MAX_PATH + 1];
+    FILE *file;
+    size_t i;
+
+    if (!GetTempPathW(ARRAYSIZE(tempDir), tempDir) || !GetTempFileNameW(tempDir, L"crc", 0, g_Path))
+        return FALSE;
+
+    // the temp path is ASCII
+    for (i = 0; g_Path[i] && i < MAX_PATH; i++)
+        path[i] = (char) g_Path[i];
+    path[i] = '\0';
+
+    file = fopen(path, "wb");
+    if (!file)
+        return FALSE;
+    if (fwrite(g_Data, 1, TEST_FILE_SIZE, file) != TEST_FILE_SIZE)
+    {
+        fclose(file);
+        return FALSE;
+    }
+    return fclose(file) == 0;
+}
+
+// length 0: up to the end of the file
+static void TestRange(UINT64 offset, UINT64 length, unsigned int threads)
+{
+    UINT64 end = (length == 0 || offset + length > TEST_FILE_SIZE) ? TEST_FILE_SIZE : offset + length;
+    unsigned long expected = Crc32_ComputeBuf(0, g_Data + offset, (size_t) (end - offset));
+    unsigned long crc32 = 0;
+    CRC32_FILE_STATS stats = { 0 };
+    DWORD status;
+
+    status = Crc32_ComputeFileByName(g_Path, offset, length, threads, &crc32, &stats);
+    TestCheck(status == ERROR_SUCCESS && crc32 == expected && stats.Bytes == end - offset,
+              "offset 0x%llx, length 0x%llx, %u threads: status %lu, CRC 0x%08lx, expected 0x%08lx, 0x%llx bytes",
+              (unsigned long long) offset, (unsigned long long) length, threads, status, crc32, expected,
+              (unsigned long long) stats.Bytes);
+}
+
+static void TestRanges(unsigned int threads)
+{
+    unsigned long crc32 = 0, expected;
+    UINT64 offset, length;
+    int i;
+
+    TestRange(0, 0, threads);
+    TestRange(1, 0, threads);
+    TestRange(TEST_WINDOW - 5, 10, threads);           // a few bytes on both sides
+    TestRange(TEST_WINDOW - 65536 - 1, 2 * 65536 + 3, threads);
+    TestRange(TEST_WINDOW, 0, threads);                 // starts at the second window
+    TestRange(3, TEST_WINDOW, threads);                 // a window worth, unaligned
+    TestRange(TEST_FILE_SIZE - 1, 100, threads);        // clamped at the end
+    TestRange(TEST_FILE_SIZE, 0, threads);              // empty
+
+    for (i = 0; i < TEST_RANDOM_RANGES; i++)
+    {
+        offset = TEST_WINDOW - 1 - TestRandom(TEST_WINDOW / 2);
+        length = TEST_WINDOW - offset + 1 + TestRandom(TEST_FILE_SIZE - TEST_WINDOW);
+        TestRange(offset, length, threads);
+    }
+
+    // chained: first part across the boundary, then the rest
+    expected = Crc32_ComputeBuf(0, g_Data, TEST_FILE_SIZE);
+    TestCheck(Crc32_ComputeFileByName(g_Path, 0, TEST_WINDOW + 777, threads, &crc32, NULL) == ERROR_SUCCESS &&
+              Crc32_ComputeFileByName(g_Path, TEST_WINDOW + 777, 0, threads, &crc32, NULL) == ERROR_SUCCESS &&
+              crc32 == expected, "%u threads: chained CRC 0x%08lx, expected 0x%08lx", threads, crc32, expected);
+
+    // past the end fails and leaves the CRC alone
+    crc32 = 0x1234;
+    TestCheck(Crc32_ComputeFileByName(g_Path, TEST_FILE_SIZE + 1, 0, threads, &crc32, NULL) == ERROR_INVALID_PARAMETER &&
+              crc32 == 0x1234, "%u threads: offset past the end", threads);
+}
+
+int main(void)
+{
+    size_t i;
+
+    g_Data = (BYTE *) malloc(TEST_FILE_SIZE);
+    if (!TestCheck(g_Data != NULL, "out of memory"))
+        return TestFinish("crc32-file-test");
+
+    for (i = 0; i < TEST_FILE_SIZE; i++)
+        g_Data[i] = (BYTE) TestRandom(256);
+
+    if (TestCheck(TestCreateFile(), "creating the test file failed"))
+    {
+        TestRanges(1);
+        TestRanges(4);
+    }
+
+    DeleteFileW(g_Path);
+    free(g_Data);
+    return TestFinish("crc32-file-test");
+}
@@ -0,0 +1,103 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Crc32_ComputeBufParallel scaling from 1 thread to twice the number of CPUs (at least 8)
+// on a 256 MB buffer, every result checked against the serial Crc32_ComputeBuf value.
+// crc32-file.c is Windows code: this target builds it with _WIN32 defined against the compat
+// layer, whose thread pool starts a thread per submitted work item (a little more overhead
+// than the real pool).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "crc32.h"
+
+static UINT64 Crc32ScalingRun(const BYTE *data, UINT64 size, unsigned int threads, unsigned long expected,
+                              UINT64 repeat, UINT64 serialNs)
+{
+    char name[64];
+    unsigned long crc32 = 0;
+    UINT64 i, start, elapsed;
+
+    snprintf(name, sizeof(name), "parallel/%u", threads);
+    if (!BenchSelected(name))
+        return 0;
+
+    start = BenchNowNs();
+    for (i = 0; i < repeat; i++)
+    {
+        crc32 = Crc32_ComputeBufParallel(0, data, (size_t) size, threads);
+        if (crc32 != expected)
+        {
+            BenchFail("%s: CRC 0x%08lx, serial 0x%08lx", name, crc32, expected);
+            return 0;
+        }
+    }
+    elapsed = (BenchNowNs() - start) / repeat;
+
+    BenchResultBegin(name);
+    BenchResultUInt("threads", threads);
+    BenchResultUInt("size", size);
+    if (serialNs)
+    {
+        BenchResultDouble("speedup_vs_1", (double) serialNs / (double) elapsed);
+        BenchResultDouble("efficiency", (double) serialNs / (double) elapsed / threads);
+    }
+    BenchResultEnd(1, size, elapsed);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    UINT64 size, repeat, serialNs;
+    unsigned int threads, maxThreads;
+    unsigned long expected;
+    BYTE *data;
+    UINT64 i;
+
+    BenchInit(argc, argv, "crc32-scaling");
+    size = g_Bench.Quick ? 32 * 1024 * 1024 : 256 * 1024 * 1024;
+    repeat = g_Bench.Quick ? 1 : 4;
+    maxThreads = max(2 * g_Bench.Cpus, 8);
+
+    data = (BYTE *) malloc((size_t) size);
+    if (!data)
+    {
+        BenchFail("allocation failed");
+        return BenchFinish();
+    }
+    for (i = 0; i < size; i += BENCH_PATTERN_MAX)
+        memcpy(data + i, BenchPattern(i), BENCH_PATTERN_MAX);
+    // a different value per 4 MB block, the pattern repeats
+    for (i = 0; i < size; i += BENCH_PATTERN_MAX)
+        data[i] = (BYTE) (i / BENCH_PATTERN_MAX);
+
+    expected = Crc32_ComputeBuf(0, data, (size_t) size);
+
+    serialNs = Crc32ScalingRun(data, size, 1, expected, repeat, 0);
+    for (threads = 2; threads <= maxThreads; threads *= 2)
+        Crc32ScalingRun(data, size, threads, expected, repeat, serialNs);
+
+    free(data);
+    return BenchFinish();
+}
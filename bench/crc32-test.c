@@ -0,0 +1,125 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Crc32_ComputeBuf correctness: every length up to a few KB at every alignment within 16 bytes,
+// chained calls split at every position, Crc32_Combine and a long buffer, against a bit-at-a-time
+// CRC computed straight from the polynomial (independent of the library's tables). ctest runs it
+// against the normal build (PCLMULQDQ where the CPU has it) and the table-only build
+// (CRC32_NO_PCLMUL).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crc32.h"
+
+#define TEST_MAX_LENGTH 4200 // past every threshold and several slicing-by-16 and 64-byte fold blocks
+#define TEST_ALIGNMENTS 16
+#define TEST_LONG_LENGTH (1024 * 1024 + 13)
+
+static unsigned int g_Failures;
+
+// one byte into a non-inverted CRC, bit by bit
+static uint32_t RefByte(uint32_t crc32, uint8_t byte)
+{
+    int bit;
+
+    crc32 ^= byte;
+    for (bit = 0; bit < 8; bit++)
+        crc32 = (crc32 & 1) ? (crc32 >> 1) ^ 0xEDB88320 : crc32 >> 1;
+    return crc32;
+}
+
+static uint32_t RefCrc(const uint8_t *data, size_t size)
+{
+    uint32_t crc32 = 0xFFFFFFFF;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        crc32 = RefByte(crc32, data[i]);
+    return crc32 ^ 0xFFFFFFFF;
+}
+
+static void Expect(const char *what, size_t offset, size_t length, unsigned long actual, uint32_t expected)
+{
+    if ((uint32_t) actual == expected)
+        return;
+
+    // don't flood the output if something is fundamentally broken
+    if (g_Failures++ < 20)
+        fprintf(stderr, "%s: offset %zu, length %zu: 0x%08lx, expected 0x%08lx\n",
+                what, offset, length, actual, (unsigned long) expected);
+}
+
+int main(void)
+{
+    uint8_t *data;
+    uint32_t crc32, seed = 0x12345678;
+    size_t i, offset, length;
+
+    data = (uint8_t *) malloc(TEST_LONG_LENGTH + TEST_ALIGNMENTS);
+    if (!data)
+        return 2;
+    for (i = 0; i < TEST_LONG_LENGTH + TEST_ALIGNMENTS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t) (seed >> 16);
+    }
+
+    Expect("check value", 0, 9, Crc32_ComputeBuf(0, "123456789", 9), 0xCBF43926);
+
+    // every prefix: the reference is extended by one byte per length
+    for (offset = 0; offset < TEST_ALIGNMENTS; offset++)
+    {
+        crc32 = 0xFFFFFFFF;
+        for (length = 0; length <= TEST_MAX_LENGTH; length++)
+        {
+            Expect("prefix", offset, length, Crc32_ComputeBuf(0, data + offset, length), crc32 ^ 0xFFFFFFFF);
+            crc32 = RefByte(crc32, data[offset + length]);
+        }
+    }
+
+    // inCrc32 chaining, the second call starts at every alignment
+    crc32 = RefCrc(data, TEST_MAX_LENGTH);
+    for (i = 0; i <= TEST_MAX_LENGTH; i++)
+        Expect("chained", i, TEST_MAX_LENGTH, Crc32_ComputeBuf(Crc32_ComputeBuf(0, data, i), data + i, TEST_MAX_LENGTH - i), crc32);
+
+    // Crc32_Combine of the two halves, including empty ones and long second parts
+    for (i = 0; i <= TEST_MAX_LENGTH; i += 7)
+        Expect("combine", i, TEST_MAX_LENGTH, Crc32_Combine(Crc32_ComputeBuf(0, data, i),
+               Crc32_ComputeBuf(0, data + i, TEST_MAX_LENGTH - i), TEST_MAX_LENGTH - i), crc32);
+    Expect("combine", 0, 0, Crc32_Combine(crc32, 0, 0), crc32);
+    crc32 = RefCrc(data, TEST_LONG_LENGTH);
+    for (i = 1; i < TEST_LONG_LENGTH; i = i * 5 + 3)
+        Expect("combine", i, TEST_LONG_LENGTH, Crc32_Combine(Crc32_ComputeBuf(0, data, i),
+               Crc32_ComputeBuf(0, data + i, TEST_LONG_LENGTH - i), TEST_LONG_LENGTH - i), crc32);
+
+    for (offset = 0; offset < 4; offset++)
+        Expect("long", offset, TEST_LONG_LENGTH, Crc32_ComputeBuf(0, data + offset, TEST_LONG_LENGTH), RefCrc(data + offset, TEST_LONG_LENGTH));
+
+    free(data);
+    if (g_Failures)
+    {
+        fprintf(stderr, "%u checks failed\n", g_Failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "test.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#define TEST_MAX_REPORTS 20
+
+static volatile LONG g_Failures;
+
+BOOL TestCheck(BOOL condition, const char *format, ...)
+{
+    va_list args;
+
+    if (condition)
+        return TRUE;
+
+    // don't flood the output if something is fundamentally broken
+    if (InterlockedIncrement(&g_Failures) <= TEST_MAX_REPORTS)
+    {
+        va_start(args, format);
+        fprintf(stderr, "FAIL: ");
+        vfprintf(stderr, format, args);
+        fprintf(stderr, "\n");
+        va_end(args);
+    }
+    return FALSE;
+}
+
+LONG TestFailures(void)
+{
+    return ReadAcquire(&g_Failures);
+}
+
+int TestFinish(const char *test)
+{
+    LONG failures = TestFailures();
+
+    if (failures != 0)
+    {
+        fprintf(stderr, "%s: %ld checks failed\n", test, (long) failures);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: passed\n", test);
+    return 0;
+}
+
+BYTE TestPattern(UINT64 offset)
+{
+    // not periodic at powers of two, so data from the wrong place in the stream doesn't match
+    return (BYTE) ((offset ^ (offset >> 7) ^ (offset >> 17) ^ (offset >> 29)) * 167 + 13);
+}
+
+void TestFill(OUT BYTE *data, IN UINT64 offset, IN UINT64 size)
+{
+    UINT64 i;
+
+    for (i = 0; i < size; i++)
+        data[i] = TestPattern(offset + i);
+}
+
+BOOL TestVerify(const char *what, UINT64 offset, const BYTE *data, UINT64 size)
+{
+    UINT64 i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (data[i] != TestPattern(offset + i))
+            return TestCheck(FALSE, "%s: data mismatch at stream offset 0x%llx", what, (unsigned long long) (offset + i));
+    }
+    return TRUE;
+}
@@ -0,0 +1,54 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Helpers for the plain pass/fail test programs (no JSON, see README.md): failed checks are
+// printed to stderr and TestFinish turns them into the exit code ctest looks at.
+
+#pragma once
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Timeout for waits that should finish right away, a hang is reported as a failure instead.
+#define TEST_TIMEOUT 10000
+
+// Report a failure (printf format) unless 'condition' holds, returns 'condition'.
+// Can be called from any thread, only the first failures are printed.
+BOOL TestCheck(BOOL condition, const char *format, ...);
+
+// Number of failed checks so far.
+LONG TestFailures(void);
+
+// Print a summary to stderr, returns the process exit code.
+int TestFinish(const char *test);
+
+// Deterministic test stream: byte at 'offset', any offset.
+BYTE TestPattern(UINT64 offset);
+void TestFill(OUT BYTE *data, IN UINT64 offset, IN UINT64 size);
+
+// Compare 'size' bytes of received data with the stream at 'offset', reports a failure on mismatch.
+BOOL TestVerify(const char *what, UINT64 offset, const BYTE *data, UINT64 size);
+
+#ifdef __cplusplus
+}
+#endif
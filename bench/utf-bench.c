@@ -0,0 +1,221 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// UTF-8 <-> UTF-16 conversion throughput (utf-simd.c) on 1 MB of generated text of different
+// scripts: English (ASCII), French (ASCII with some 2-byte letters), Russian (2-byte words
+// separated by spaces), Chinese (3-byte runs with some ASCII) and mixed text with emoji
+// (4-byte). Built twice: utf-bench uses SSE2, utf-bench-portable the portable code
+// (UTF_NO_SIMD); "gbps" counts input bytes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "utf-simd.h"
+
+#ifdef UTF_NO_SIMD
+#    define UTF_BENCH_BUILD "portable"
+#else
+#    define UTF_BENCH_BUILD "simd"
+#endif
+
+#define UTF_BENCH_TEXT_SIZE (1024 * 1024)
+
+typedef enum _UTF_BENCH_OPERATION
+{
+    UTF_BENCH_UTF8_TO_UTF16,
+    UTF_BENCH_UTF16_TO_UTF8,
+    UTF_BENCH_UTF8_LENGTH,
+} UTF_BENCH_OPERATION;
+
+static const char *g_OperationNames[] = { "utf8to16", "utf16to8", "length8" };
+
+static UINT32 g_Seed = 1;
+
+static UINT32 UtfBenchRandom(UINT32 range)
+{
+    g_Seed = g_Seed * 1103515245 + 12345;
+    return (g_Seed >> 8) % range;
+}
+
+static size_t UtfBenchPut(BYTE *p, UINT32 codePoint)
+{
+    if (codePoint < 0x80)
+    {
+        p[0] = (BYTE) codePoint;
+        return 1;
+    }
+    if (codePoint < 0x800)
+    {
+        p[0] = (BYTE) (0xC0 | (codePoint >> 6));
+        p[1] = (BYTE) (0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+    if (codePoint < 0x10000)
+    {
+        p[0] = (BYTE) (0xE0 | (codePoint >> 12));
+        p[1] = (BYTE) (0x80 | ((codePoint >> 6) & 0x3F));
+        p[2] = (BYTE) (0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+    p[0] = (BYTE) (0xF0 | (codePoint >> 18));
+    p[1] = (BYTE) (0x80 | ((codePoint >> 12) & 0x3F));
+    p[2] = (BYTE) (0x80 | ((codePoint >> 6) & 0x3F));
+    p[3] = (BYTE) (0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+// one character of a script's words
+static UINT32 UtfBenchLetter(const char *script)
+{
+    static const UINT32 accented[] = { 0xE9, 0xE8, 0xE0, 0xE7, 0xEA, 0xF4, 0xFB };
+
+    switch (script[0])
+    {
+    case 'f': // French
+        if (UtfBenchRandom(12) == 0)
+            return accented[UtfBenchRandom(ARRAYSIZE(accented))];
+        return 'a' + UtfBenchRandom(26);
+    case 'r': // Russian
+        return 0x430 + UtfBenchRandom(32);
+    case 'c': // Chinese
+        return 0x4E00 + UtfBenchRandom(0x5200);
+    case 'm': // mixed: mostly ASCII, some emoji
+        if (UtfBenchRandom(8) == 0)
+            return 0x1F600 + UtfBenchRandom(0x50);
+        return 'a' + UtfBenchRandom(26);
+    default: // English
+        return 'a' + UtfBenchRandom(26);
+    }
+}
+
+// Words with spaces and punctuation, Chinese has long runs and CJK punctuation.
+static size_t UtfBenchText(const char *script, BYTE *text, size_t size)
+{
+    size_t length = 0, word, i;
+
+    while (length + 64 < size)
+    {
+        word = script[0] == 'c' ? 8 + UtfBenchRandom(40) : 2 + UtfBenchRandom(9);
+        for (i = 0; i < word; i++)
+            length += UtfBenchPut(text + length, UtfBenchLetter(script));
+
+        if (script[0] == 'c')
+            length += UtfBenchPut(text + length, UtfBenchRandom(4) == 0 ? ',' : 0x3002); // 。
+        else
+            text[length++] = UtfBenchRandom(10) == 0 ? '.' : ' ';
+    }
+    return length;
+}
+
+static void UtfBenchRun(UTF_BENCH_OPERATION operation, const char *script, size_t inputBytes, UINT64 totalBytes,
+                        const BYTE *utf8, size_t utf8Length, const uint16_t *utf16, size_t utf16Length,
+                        BYTE *utf8Out, uint16_t *utf16Out)
+{
+    char name[64];
+    UINT64 calls, i, start, elapsed;
+    size_t length = 0;
+    UTF_STATUS status = UTF_OK;
+
+    snprintf(name, sizeof(name), "%s/%s", g_OperationNames[operation], script);
+    if (!BenchSelected(name))
+        return;
+
+    calls = max(totalBytes / inputBytes, 1);
+    start = BenchNowNs();
+    for (i = 0; i < calls && status == UTF_OK; i++)
+    {
+        switch (operation)
+        {
+        case UTF_BENCH_UTF8_TO_UTF16:
+            status = Utf8ToUtf16((const char *) utf8, utf8Length, utf16Out, utf16Length, &length);
+            break;
+        case UTF_BENCH_UTF16_TO_UTF8:
+            status = Utf16ToUtf8(utf16, utf16Length, (char *) utf8Out, utf8Length, &length);
+            break;
+        default:
+            status = Utf8ToUtf16Length((const char *) utf8, utf8Length, &length);
+            break;
+        }
+    }
+    elapsed = BenchNowNs() - start;
+
+    if (status != UTF_OK)
+    {
+        BenchFail("%s: status %d", name, (int) status);
+        return;
+    }
+
+    BenchResultBegin(name);
+    BenchResultString("operation", g_OperationNames[operation]);
+    BenchResultString("script", script);
+    BenchResultString("build", UTF_BENCH_BUILD);
+    BenchResultUInt("output_units", length);
+    BenchResultEnd(calls, calls * inputBytes, elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *scripts[] = { "english", "french", "russian", "chinese", "mixed" };
+    BYTE *utf8, *utf8Out;
+    uint16_t *utf16, *utf16Out;
+    size_t utf8Length, utf16Length, length, i;
+    UINT64 totalBytes;
+
+    BenchInit(argc, argv, "utf-" UTF_BENCH_BUILD);
+    totalBytes = g_Bench.Quick ? 8 * 1024 * 1024 : 1024 * 1024 * 1024;
+
+    utf8 = (BYTE *) malloc(UTF_BENCH_TEXT_SIZE);
+    utf8Out = (BYTE *) malloc(UTF_BENCH_TEXT_SIZE);
+    utf16 = (uint16_t *) malloc(UTF_BENCH_TEXT_SIZE * sizeof(uint16_t));
+    utf16Out = (uint16_t *) malloc(UTF_BENCH_TEXT_SIZE * sizeof(uint16_t));
+    if (!utf8 || !utf8Out || !utf16 || !utf16Out)
+    {
+        BenchFail("allocation failed");
+        return BenchFinish();
+    }
+
+    for (i = 0; i < ARRAYSIZE(scripts); i++)
+    {
+        utf8Length = UtfBenchText(scripts[i], utf8, UTF_BENCH_TEXT_SIZE);
+        if (Utf8ToUtf16((const char *) utf8, utf8Length, utf16, UTF_BENCH_TEXT_SIZE, &utf16Length) != UTF_OK ||
+            Utf16ToUtf8(utf16, utf16Length, (char *) utf8Out, UTF_BENCH_TEXT_SIZE, &length) != UTF_OK ||
+            length != utf8Length || memcmp(utf8, utf8Out, length) != 0)
+        {
+            BenchFail("%s: round trip failed", scripts[i]);
+            continue;
+        }
+
+        UtfBenchRun(UTF_BENCH_UTF8_TO_UTF16, scripts[i], utf8Length, totalBytes, utf8, utf8Length, utf16, utf16Length,
+                    utf8Out, utf16Out);
+        UtfBenchRun(UTF_BENCH_UTF16_TO_UTF8, scripts[i], utf16Length * sizeof(uint16_t), totalBytes, utf8, utf8Length, utf16,
+                    utf16Length, utf8Out, utf16Out);
+        UtfBenchRun(UTF_BENCH_UTF8_LENGTH, scripts[i], utf8Length, totalBytes, utf8, utf8Length, utf16, utf16Length,
+                    utf8Out, utf16Out);
+    }
+
+    free(utf8);
+    free(utf8Out);
+    free(utf16);
+    free(utf16Out);
+    return BenchFinish();
+}
@@ -0,0 +1,478 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Differential test of the UTF transcoder (utf-simd.c) against a straightforward one-character-
+// at-a-time reference written from Unicode table 3-7: random strings built from long and short
+// runs of ASCII, 2-, 3- and 4-byte characters and malformed input (overlong forms, encoded
+// surrogates, stray continuation bytes, truncated sequences, unpaired surrogates), so the vector
+// blocks start, stop and fail at every position. Every function is compared on status, output
+// length and output, with a full and several short output buffers; the streaming decoder with
+// random chunk boundaries. ctest runs it against the SSE2 build and the portable build (UTF_NO_SIMD).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf-simd.h"
+
+#define TEST_ITERATIONS 20000
+#define TEST_MAX_INPUT 400
+
+static unsigned int g_Failures;
+static uint32_t g_Seed = 1;
+
+static uint32_t Random(uint32_t range)
+{
+    g_Seed = g_Seed * 1103515245 + 12345;
+    return (g_Seed >> 8) % range;
+}
+
+static void Fail(const char *what, size_t iteration, const char *detail)
+{
+    if (g_Failures++ < 20)
+        fprintf(stderr, "%s, iteration %zu: %s\n", what, iteration, detail);
+}
+
+/*
+ * Reference
+ */
+
+// Returns the sequence length, 0 if input[0] doesn't start a well-formed sequence (then
+// *subpart is the length of the maximal ill-formed subpart, Unicode 3.9).
+static size_t RefDecode8(const uint8_t *input, size_t length, uint32_t *codePoint, size_t *subpart)
+{
+    static const struct { uint8_t LeadMin, LeadMax, SecondMin, SecondMax, Length; } forms[] = {
+        { 0x00, 0x7F, 0, 0, 1 },
+        { 0xC2, 0xDF, 0x80, 0xBF, 2 },
+        { 0xE0, 0xE0, 0xA0, 0xBF, 3 },
+        { 0xE1, 0xEC, 0x80, 0xBF, 3 },
+        { 0xED, 0xED, 0x80, 0x9F, 3 },
+        { 0xEE, 0xEF, 0x80, 0xBF, 3 },
+        { 0xF0, 0xF0, 0x90, 0xBF, 4 },
+        { 0xF1, 0xF3, 0x80, 0xBF, 4 },
+        { 0xF4, 0xF4, 0x80, 0x8F, 4 },
+    };
+    size_t form, i;
+    uint32_t value;
+
+    *subpart = 1;
+    for (form = 0; form < sizeof(forms) / sizeof(forms[0]); form++)
+    {
+        if (input[0] >= forms[form].LeadMin && input[0] <= forms[form].LeadMax)
+            break;
+    }
+    if (form == sizeof(forms) / sizeof(forms[0]))
+        return 0;
+
+    if (forms[form].Length == 1)
+    {
+        *codePoint = input[0];
+        return 1;
+    }
+
+    value = input[0] & (0xFF >> (forms[form].Length + 1));
+    for (i = 1; i < forms[form].Length; i++)
+    {
+        if (i == length)
+            return 0;
+        if (i == 1 ? (input[1] < forms[form].SecondMin || input[1] > forms[form].SecondMax) : (input[i] & 0xC0) != 0x80)
+            return 0;
+        value = (value << 6) | (input[i] & 0x3F);
+        *subpart = i + 1;
+    }
+
+    *codePoint = value;
+    return forms[form].Length;
+}
+
+static UTF_STATUS RefUtf8ToUtf16(const uint8_t *input, size_t length, uint16_t *output, size_t outputSize,
+                                 int lossy, size_t *outputLength, size_t *replacements)
+{
+    size_t in = 0, out = 0, sequence, subpart;
+    uint32_t codePoint;
+    int invalid;
+
+    *replacements = 0;
+    while (in < length)
+    {
+        sequence = RefDecode8(input + in, length - in, &codePoint, &subpart);
+        invalid = (sequence == 0);
+        if (invalid)
+        {
+            if (!lossy)
+            {
+                *outputLength = out;
+                return UTF_INVALID_INPUT;
+            }
+            sequence = subpart;
+            codePoint = 0xFFFD;
+        }
+
+        if (outputSize - out < (codePoint >= 0x10000 ? 2u : 1u))
+        {
+            *outputLength = out;
+            return UTF_BUFFER_TOO_SMALL;
+        }
+
+        if (codePoint >= 0x10000)
+        {
+            output[out++] = (uint16_t) (0xD800 + ((codePoint - 0x10000) >> 10));
+            output[out++] = (uint16_t) (0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+        }
+        else
+        {
+            output[out++] = (uint16_t) codePoint;
+        }
+        in += sequence;
+        *replacements += invalid;
+    }
+
+    *outputLength = out;
+    return UTF_OK;
+}
+
+static UTF_STATUS RefUtf16ToUtf8(const uint16_t *input, size_t length, uint8_t *output, size_t outputSize,
+                                 int lossy, size_t *outputLength, size_t *replacements)
+{
+    size_t in = 0, out = 0, units, bytes;
+    uint32_t codePoint;
+    int invalid;
+
+    *replacements = 0;
+    while (in < length)
+    {
+        codePoint = input[in];
+        units = 1;
+        invalid = 0;
+        if (codePoint >= 0xD800 && codePoint <= 0xDBFF && in + 1 < length && input[in + 1] >= 0xDC00 && input[in + 1] <= 0xDFFF)
+        {
+            codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (input[in + 1] - 0xDC00);
+            units = 2;
+        }
+        else if (codePoint >= 0xD800 && codePoint <= 0xDFFF)
+        {
+            if (!lossy)
+            {
+                *outputLength = out;
+                return UTF_INVALID_INPUT;
+            }
+            codePoint = 0xFFFD;
+            invalid = 1;
+        }
+
+        bytes = codePoint < 0x80 ? 1 : codePoint < 0x800 ? 2 : codePoint < 0x10000 ? 3 : 4;
+        if (outputSize - out < bytes)
+        {
+            *outputLength = out;
+            return UTF_BUFFER_TOO_SMALL;
+        }
+
+        if (bytes == 1)
+        {
+            output[out++] = (uint8_t) codePoint;
+        }
+        else
+        {
+            output[out++] = (uint8_t) ((0xF00 >> bytes) | (codePoint >> (6 * (bytes - 1))));
+            for (; bytes > 1; bytes--)
+                output[out++] = (uint8_t) (0x80 | ((codePoint >> (6 * (bytes - 2))) & 0x3F));
+        }
+        in += units;
+        *replacements += invalid;
+    }
+
+    *outputLength = out;
+    return UTF_OK;
+}
+
+/*
+ * Input generators
+ */
+
+static size_t PutUtf8(uint8_t *p, uint32_t codePoint)
+{
+    uint16_t unit[2];
+    size_t length, replacements;
+
+    // the reference encoder is tested against the library too, good enough to build input
+    if (codePoint >= 0x10000)
+    {
+        unit[0] = (uint16_t) (0xD800 + ((codePoint - 0x10000) >> 10));
+        unit[1] = (uint16_t) (0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+        RefUtf16ToUtf8(unit, 2, p, 4, 0, &length, &replacements);
+    }
+    else
+    {
+        unit[0] = (uint16_t) codePoint;
+        RefUtf16ToUtf8(unit, 1, p, 4, 0, &length, &replacements);
+    }
+    return length;
+}
+
+// random code point of a class: 0 ASCII, 1 two bytes, 2 three bytes, 3 four bytes;
+// class boundaries come up often
+static uint32_t RandomCodePoint(int class)
+{
+    static const uint32_t low[] = { 0x00, 0x80, 0x800, 0x10000 };
+    static const uint32_t high[] = { 0x7F, 0x7FF, 0xFFFF, 0x10FFFF };
+    uint32_t codePoint;
+
+    do
+    {
+        switch (Random(8))
+        {
+        case 0:
+            codePoint = low[class];
+            break;
+        case 1:
+            codePoint = high[class];
+            break;
+        case 2:
+            codePoint = (class == 2) ? 0xD7FF + Random(2) * 0x801 : low[class] + Random(16); // around the surrogates
+            break;
+        default:
+            codePoint = low[class] + Random(high[class] - low[class] + 1);
+            break;
+        }
+    } while (codePoint >= 0xD800 && codePoint <= 0xDFFF);
+    return codePoint;
+}
+
+static size_t RandomUtf8(uint8_t *output, size_t maxLength)
+{
+    static const uint8_t malformed[][4] = {
+        { 0x80 }, { 0xBF }, { 0xC0, 0x80 }, { 0xC1, 0xBF }, { 0xC3, 0x41 }, { 0xC3 }, { 0xE0, 0x80, 0x80 },
+        { 0xE0, 0x9F, 0xBF }, { 0xED, 0xA0, 0x80 }, { 0xED, 0xBF, 0xBF }, { 0xE3, 0x81 }, { 0xE3, 0x81, 0x41 },
+        { 0xF0, 0x8F, 0xBF, 0xBF }, { 0xF4, 0x90, 0x80, 0x80 }, { 0xF0, 0x9F, 0x98 }, { 0xF5, 0x80 }, { 0xFE }, { 0xFF },
+    };
+    static const size_t malformedLength[] = { 1, 1, 2, 2, 2, 1, 3, 3, 3, 3, 2, 3, 4, 4, 3, 2, 1, 1 };
+    int bad = Random(4) == 0;
+    size_t length = 0, run, i, m;
+    int class;
+
+    while (length + 4 * 40 < maxLength && Random(12) != 0)
+    {
+        if (bad && Random(10) == 0)
+        {
+            m = Random(sizeof(malformedLength) / sizeof(malformedLength[0]));
+            memcpy(output + length, malformed[m], malformedLength[m]);
+            length += malformedLength[m];
+            continue;
+        }
+
+        class = (int) Random(4);
+        run = 1 + Random(class == 3 || Random(2) ? 4 : 40); // short runs mix classes in a block
+        for (i = 0; i < run; i++)
+            length += PutUtf8(output + length, RandomCodePoint(class));
+    }
+
+    // sometimes cut the last character
+    if (bad && length > 0 && Random(4) == 0)
+        length--;
+    return length;
+}
+
+static size_t RandomUtf16(uint16_t *output, size_t maxLength)
+{
+    int bad = Random(4) == 0;
+    size_t length = 0, run, i;
+    uint32_t codePoint;
+    int class;
+
+    while (length + 2 * 40 < maxLength && Random(12) != 0)
+    {
+        if (bad && Random(10) == 0)
+        {
+            output[length++] = (uint16_t) (0xD800 + Random(0x800)); // unpaired, either half
+            continue;
+        }
+
+        class = (int) Random(4);
+        run = 1 + Random(class == 3 || Random(2) ? 4 : 40); // short runs mix classes in a block
+        for (i = 0; i < run; i++)
+        {
+            codePoint = RandomCodePoint(class);
+            if (codePoint >= 0x10000)
+            {
+                output[length++] = (uint16_t) (0xD800 + ((codePoint - 0x10000) >> 10));
+                output[length++] = (uint16_t) (0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+            }
+            else
+            {
+                output[length++] = (uint16_t) codePoint;
+            }
+        }
+    }
+
+    if (bad && length > 0 && Random(4) == 0)
+        length--;
+    return length;
+}
+
+/*
+ * Comparisons
+ */
+
+#define TEST_GUARD 64
+#define TEST_GUARD_BYTE 0x5A
+
+// Output buffers are followed by a guard that must stay untouched.
+static int GuardIntact(const void *buffer, size_t size)
+{
+    const uint8_t *guard = (const uint8_t *) buffer + size;
+    size_t i;
+
+    for (i = 0; i < TEST_GUARD; i++)
+    {
+        if (guard[i] != TEST_GUARD_BYTE)
+            return 0;
+    }
+    return 1;
+}
+
+static void Compare(const char *what, size_t iteration, UTF_STATUS status, UTF_STATUS refStatus,
+                    size_t length, size_t refLength, const void *output, const void *refOutput, size_t unitSize,
+                    size_t replacements, size_t refReplacements)
+{
+    char detail[128];
+
+    if (status != refStatus || length != refLength || replacements != refReplacements)
+    {
+        snprintf(detail, sizeof(detail), "status %d length %zu replacements %zu, expected %d %zu %zu",
+                 status, length, replacements, refStatus, refLength, refReplacements);
+        Fail(what, iteration, detail);
+    }
+    else if (output && memcmp(output, refOutput, length * unitSize) != 0)
+    {
+        Fail(what, iteration, "different output");
+    }
+}
+
+static void TestUtf8(size_t iteration, const uint8_t *input, size_t length)
+{
+    static uint16_t refOutput[TEST_MAX_INPUT + 8];
+    static uint16_t output[TEST_MAX_INPUT + 8 + TEST_GUARD / 2];
+    UTF8_DECODER decoder;
+    UTF_STATUS status, refStatus;
+    size_t outputLength, refLength, replacements, refReplacements, fullLength;
+    size_t outputSize, pass, position, chunk, used, streamLength;
+    int lossy;
+
+    refStatus = RefUtf8ToUtf16(input, length, refOutput, (size_t) -1, 0, &fullLength, &refReplacements);
+    status = Utf8ToUtf16Length((const char *) input, length, &outputLength);
+    Compare("Utf8ToUtf16Length", iteration, status, refStatus, outputLength, fullLength, NULL, NULL, 0, 0, 0);
+
+    for (lossy = 0; lossy < 2; lossy++)
+    {
+        RefUtf8ToUtf16(input, length, refOutput, (size_t) -1, lossy, &fullLength, &refReplacements);
+        for (pass = 0; pass < 4; pass++)
+        {
+            outputSize = pass == 0 ? fullLength + 8 : Random((uint32_t) fullLength + 1);
+            memset(output, TEST_GUARD_BYTE, sizeof(output));
+            refStatus = RefUtf8ToUtf16(input, length, refOutput, outputSize, lossy, &refLength, &refReplacements);
+            replacements = 0;
+            if (lossy)
+                status = Utf8ToUtf16Lossy((const char *) input, length, output, outputSize, &outputLength, &replacements);
+            else
+                status = Utf8ToUtf16((const char *) input, length, output, outputSize, &outputLength);
+            Compare(lossy ? "Utf8ToUtf16Lossy" : "Utf8ToUtf16", iteration, status, refStatus, outputLength, refLength,
+                    output, refOutput, sizeof(uint16_t), replacements, lossy ? refReplacements : 0);
+            if (!GuardIntact(output, outputSize * sizeof(uint16_t)))
+                Fail("Utf8ToUtf16", iteration, "wrote past the output buffer");
+        }
+    }
+
+    // streaming, random chunks, enough output
+    refStatus = RefUtf8ToUtf16(input, length, refOutput, (size_t) -1, 0, &refLength, &refReplacements);
+    Utf8DecoderInit(&decoder);
+    status = UTF_OK;
+    streamLength = 0;
+    for (position = 0; position < length && status == UTF_OK; position += chunk)
+    {
+        chunk = 1 + Random((uint32_t) (length - position < 40 ? length - position : 40));
+        status = Utf8DecoderConvert(&decoder, (const char *) input + position, chunk, output + streamLength,
+                                    TEST_MAX_INPUT + 8 - streamLength, &used, &outputLength);
+        streamLength += outputLength;
+        if (status == UTF_OK && used != chunk)
+            Fail("Utf8DecoderConvert", iteration, "input not consumed");
+    }
+    if (status == UTF_OK)
+        status = Utf8DecoderFinish(&decoder);
+
+    if (status != refStatus)
+        Fail("Utf8DecoderConvert", iteration, "different status");
+    else if (status == UTF_OK && (streamLength != refLength || memcmp(output, refOutput, refLength * sizeof(uint16_t)) != 0))
+        Fail("Utf8DecoderConvert", iteration, "different output");
+}
+
+static void TestUtf16(size_t iteration, const uint16_t *input, size_t length)
+{
+    static uint8_t refOutput[4 * TEST_MAX_INPUT];
+    static uint8_t output[4 * TEST_MAX_INPUT + TEST_GUARD];
+    UTF_STATUS status, refStatus;
+    size_t outputLength, refLength, replacements, refReplacements, fullLength;
+    size_t outputSize, pass;
+    int lossy;
+
+    refStatus = RefUtf16ToUtf8(input, length, refOutput, (size_t) -1, 0, &fullLength, &refReplacements);
+    status = Utf16ToUtf8Length(input, length, &outputLength);
+    Compare("Utf16ToUtf8Length", iteration, status, refStatus, outputLength, fullLength, NULL, NULL, 0, 0, 0);
+
+    for (lossy = 0; lossy < 2; lossy++)
+    {
+        RefUtf16ToUtf8(input, length, refOutput, (size_t) -1, lossy, &fullLength, &refReplacements);
+        for (pass = 0; pass < 4; pass++)
+        {
+            outputSize = pass == 0 ? fullLength : Random((uint32_t) fullLength + 1);
+            memset(output, TEST_GUARD_BYTE, sizeof(output));
+            refStatus = RefUtf16ToUtf8(input, length, refOutput, outputSize, lossy, &refLength, &refReplacements);
+            replacements = 0;
+            if (lossy)
+                status = Utf16ToUtf8Lossy(input, length, (char *) output, outputSize, &outputLength, &replacements);
+            else
+                status = Utf16ToUtf8(input, length, (char *) output, outputSize, &outputLength);
+            Compare(lossy ? "Utf16ToUtf8Lossy" : "Utf16ToUtf8", iteration, status, refStatus, outputLength, refLength,
+                    output, refOutput, 1, replacements, lossy ? refReplacements : 0);
+            if (!GuardIntact(output, outputSize))
+                Fail("Utf16ToUtf8", iteration, "wrote past the output buffer");
+        }
+    }
+}
+
+int main(void)
+{
+    static uint8_t utf8[TEST_MAX_INPUT];
+    static uint16_t utf16[TEST_MAX_INPUT];
+    size_t iteration;
+
+    for (iteration = 0; iteration < TEST_ITERATIONS; iteration++)
+    {
+        TestUtf8(iteration, utf8, RandomUtf8(utf8, sizeof(utf8)));
+        TestUtf16(iteration, utf16, RandomUtf16(utf16, TEST_MAX_INPUT));
+    }
+
+    if (g_Failures)
+    {
+        fprintf(stderr, "%u checks failed\n", g_Failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,521 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Win32 wrappers of the UTF transcoder (utf8-conv.c), built against the compat layer and CMQ.
+// The transcoder itself is covered by utf-test, this checks what the wrappers add on top:
+// - ConvertUTF8ToUTF16Cmq copies converted text into reserved queue spans, a UTF-16 unit or
+//   a surrogate pair may be split between the spans at the ring wrap or a segment boundary:
+//   text is converted at every byte position around the boundary and read back
+// - with an almost full queue it must stop with ERROR_INSUFFICIENT_BUFFER (not earlier), report
+//   how much input it used and resume exactly there, including a surrogate pair that doesn't fit
+// - the Alloc functions allocate the exact size, NULL-terminate and fail cleanly
+// - converter contexts reuse their buffers, the *Static functions give every thread its own
+//   converter (threads convert at once and check their output stays intact), freed when the
+//   thread exits: free() is wrapped (-Wl,--wrap=free) to see the converter buffers go
+// The expected output is generated together with the input, not by the transcoder.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utf8-conv.h"
+#include "test.h"
+
+#define TEST_MAX_CHARS 2000
+
+typedef struct _TEST_TEXT
+{
+    char Utf8[4 * TEST_MAX_CHARS];
+    size_t Utf8Length;
+    WCHAR Utf16[2 * TEST_MAX_CHARS];
+    size_t Utf16Length; // in WCHARs
+} TEST_TEXT;
+
+static UINT32 g_Random = 0x27D4EB2F;
+
+static UINT32 TestRandom(UINT32 limit)
+{
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random % limit;
+}
+
+static void TestAppend(TEST_TEXT *text, UINT32 codePoint)
+{
+    char *utf8 = text->Utf8 + text->Utf8Length;
+
+    if (codePoint < 0x80)
+    {
+        utf8[0] = (char) codePoint;
+        text->Utf8Length += 1;
+    }
+    else if (codePoint < 0x800)
+    {
+        utf8[0] = (char) (0xC0 | (codePoint >> 6));
+        utf8[1] = (char) (0x80 | (codePoint & 0x3F));
+        text->Utf8Length += 2;
+    }
+    else if (codePoint < 0x10000)
+    {
+        utf8[0] = (char) (0xE0 | (codePoint >> 12));
+        utf8[1] = (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        utf8[2] = (char) (0x80 | (codePoint & 0x3F));
+        text->Utf8Length += 3;
+    }
+    else
+    {
+        utf8[0] = (char) (0xF0 | (codePoint >> 18));
+        utf8[1] = (char) (0x80 | ((codePoint >> 12) & 0x3F));
+        utf8[2] = (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        utf8[3] = (char) (0x80 | (codePoint & 0x3F));
+        text->Utf8Length += 4;
+    }
+
+    if (codePoint < 0x10000)
+    {
+        text->Utf16[text->Utf16Length++] = (WCHAR) codePoint;
+    }
+    else
+    {
+        text->Utf16[text->Utf16Length++] = (WCHAR) (0xD800 + ((codePoint - 0x10000) >> 10));
+        text->Utf16[text->Utf16Length++] = (WCHAR) (0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+    }
+}
+
+// random valid text, 'supplementary' in 256: share of characters outside the BMP
+static void TestText(TEST_TEXT *text, size_t chars, UINT32 supplementary)
+{
+    UINT32 codePoint;
+    size_t i;
+
+    text->Utf8Length = 0;
+    text->Utf16Length = 0;
+    for (i = 0; i < chars; i++)
+    {
+        if (TestRandom(256) < supplementary)
+        {
+            codePoint = 0x10000 + TestRandom(0x100000);
+        }
+        else
+        {
+            switch (TestRandom(3))
+            {
+            case 0:
+                codePoint = 0x20 + TestRandom(0x5F);
+                break;
+            case 1:
+                codePoint = 0x80 + TestRandom(0x780);
+                break;
+            default:
+                // no surrogates
+                codePoint = 0x800 + TestRandom(0xF800 - 0x800);
+                if (codePoint >= 0xD800)
+                    codePoint += 0x800;
+                break;
+            }
+        }
+        TestAppend(text, codePoint);
+    }
+}
+
+// read everything queued into 'output' (bytes), returns the number of bytes read
+static UINT64 TestDrain(CMQ_BUFFER *buffer, BYTE *output, UINT64 outputSize)
+{
+    UINT64 dataSize = outputSize;
+
+    if (!CmqGetData(buffer, output, &dataSize, CMQ_ALLOW_UNDERFLOW))
+        return 0;
+    return dataSize;
+}
+
+// convert the text starting at every byte position around a storage boundary
+static void TestCmqBoundary(const char *name, UINT64 size, DWORD flags, UINT64 boundary)
+{
+    static TEST_TEXT text;
+    static BYTE output[sizeof(text.Utf16)];
+    UTF8_DECODER decoder;
+    CMQ_BUFFER *buffer;
+    UINT64 written = 0, pad, read;
+    UINT32 position, round;
+    size_t used;
+    DWORD status;
+
+    buffer = CmqCreateEx(size, flags);
+    if (!TestCheck(buffer != NULL, "%s: CmqCreateEx failed", name))
+        return;
+
+    for (round = 0; round < 4; round++)
+    {
+        // only supplementary characters: surrogate pairs at every offset, then mixed text
+        TestText(&text, 100, round < 2 ? 256 : 64);
+        for (position = 0; position < 40; position++)
+        {
+            // move the write position to 20 bytes before the boundary and further
+            pad = (boundary - 20 + position - written % boundary) % boundary;
+            while (pad > 0)
+            {
+                read = min(pad, sizeof(output));
+                TestCheck(CmqAddData(buffer, output, read), "%s: pad failed", name);
+                TestCheck(TestDrain(buffer, output, read) == read, "%s: pad read failed", name);
+                written += read;
+                pad -= read;
+            }
+
+            Utf8DecoderInit(&decoder);
+            status = ConvertUTF8ToUTF16Cmq(&decoder, text.Utf8, text.Utf8Length, buffer, &used);
+            if (!TestCheck(status == ERROR_SUCCESS && used == text.Utf8Length && ConvertUTF8ToUTF16Finish(&decoder) == ERROR_SUCCESS,
+                           "%s: position %u: status %lu, used %zu of %zu", name, position, status, used, text.Utf8Length))
+                continue;
+
+            read = TestDrain(buffer, output, sizeof(output));
+            TestCheck(read == text.Utf16Length * sizeof(WCHAR) && memcmp(output, text.Utf16, (size_t) read) == 0,
+                      "%s: round %u, position %u: wrong output (0x%llx bytes)", name, round, position, (unsigned long long) read);
+            written += read;
+        }
+    }
+
+    CmqDestroy(buffer);
+}
+
+// convert into a 64 byte queue that's emptied only when the conversion stops, input in random pieces
+static void TestCmqFull(void)
+{
+    static TEST_TEXT text;
+    static BYTE output[sizeof(text.Utf16)];
+    UTF8_DECODER decoder;
+    CMQ_BUFFER *buffer;
+    size_t offset = 0, piece, used;
+    UINT64 outputSize = 0, read;
+    UINT32 stops = 0;
+    DWORD status;
+
+    buffer = CmqCreateEx(64, 0);
+    if (!TestCheck(buffer != NULL, "full: CmqCreateEx failed"))
+        return;
+
+    TestText(&text, TEST_MAX_CHARS, 64);
+    Utf8DecoderInit(&decoder);
+    while (offset < text.Utf8Length)
+    {
+        // pieces split sequences too, the decoder carries them over
+        piece = min(text.Utf8Length - offset, 1 + TestRandom(50));
+        status = ConvertUTF8ToUTF16Cmq(&decoder, text.Utf8 + offset, piece, buffer, &used);
+        offset += used;
+        if (status == ERROR_SUCCESS)
+        {
+            TestCheck(used == piece, "full: used %zu of %zu", used, piece);
+            continue;
+        }
+
+        // only stops when not even a surrogate pair fits
+        if (!TestCheck(status == ERROR_INSUFFICIENT_BUFFER && GetLastError() == ERROR_INSUFFICIENT_BUFFER &&
+                       64 - CmqGetUsedSize(buffer) < 2 * sizeof(WCHAR),
+                       "full: status %lu, stopped with 0x%llx bytes free", status,
+                       (unsigned long long) (64 - CmqGetUsedSize(buffer))))
+            break;
+        stops++;
+
+        // odd sizes too, so the next reservation starts in the middle of a unit
+        read = TestDrain(buffer, output + outputSize, 1 + TestRandom(64));
+        outputSize += read;
+    }
+
+    TestCheck(ConvertUTF8ToUTF16Finish(&decoder) == ERROR_SUCCESS, "full: decoder not finished");
+    outputSize += TestDrain(buffer, output + outputSize, sizeof(output) - outputSize);
+    TestCheck(outputSize == text.Utf16Length * sizeof(WCHAR) && memcmp(output, text.Utf16, (size_t) outputSize) == 0,
+              "full: wrong output (0x%llx bytes, expected 0x%llx)", (unsigned long long) outputSize,
+              (unsigned long long) (text.Utf16Length * sizeof(WCHAR)));
+    TestCheck(stops > 100, "full: only %u stops", stops);
+
+    CmqDestroy(buffer);
+}
+
+// the exact edge cases: a surrogate pair with 2 and 3 bytes free, 1 and 2 bytes free, invalid input
+static void TestCmqEdges(void)
+{
+    static const char pair[] = "\xF0\x9F\x98\x80"; // U+1F600
+    BYTE data[64];
+    UTF8_DECODER decoder;
+    CMQ_BUFFER *buffer;
+    size_t used;
+    DWORD status;
+    UINT64 read;
+
+    buffer = CmqCreateEx(64, 0);
+    if (!TestCheck(buffer != NULL, "edges: CmqCreateEx failed"))
+        return;
+
+    Utf8DecoderInit(&decoder);
+    memset(data, 0, sizeof(data));
+    TestCheck(CmqAddData(buffer, data, 62), "edges: fill failed");
+
+    status = ConvertUTF8ToUTF16Cmq(&decoder, pair, 4, buffer, &used);
+    TestCheck(status == ERROR_INSUFFICIENT_BUFFER && used == 0 && CmqGetUsedSize(buffer) == 62,
+              "edges: pair with 2 bytes free: status %lu, used %zu, queued 0x%llx", status, used,
+              (unsigned long long) CmqGetUsedSize(buffer));
+    TestDrain(buffer, data, 1);
+    status = ConvertUTF8ToUTF16Cmq(&decoder, pair, 4, buffer, &used);
+    TestCheck(status == ERROR_INSUFFICIENT_BUFFER && used == 0 && CmqGetUsedSize(buffer) == 61,
+              "edges: pair with 3 bytes free: status %lu, used %zu", status, used);
+    TestDrain(buffer, data, 1);
+    status = ConvertUTF8ToUTF16Cmq(&decoder, pair, 4, buffer, &used);
+    TestCheck(status == ERROR_SUCCESS && used == 4 && CmqGetUsedSize(buffer) == 64, "edges: pair with 4 bytes free: status %lu", status);
+
+    read = TestDrain(buffer, data, 63);
+    // U+1F600 is D83D DE00, one byte stays queued
+    TestCheck(read == 63 && data[60] == 0x3D && data[61] == 0xD8 && data[62] == 0x00, "edges: pair not queued at the end");
+    TestCheck(CmqAddData(buffer, data, 62), "edges: fill failed");
+    status = ConvertUTF8ToUTF16Cmq(&decoder, "a", 1, buffer, &used);
+    TestCheck(status == ERROR_INSUFFICIENT_BUFFER && used == 0, "edges: 1 byte free: status %lu, used %zu", status, used);
+    TestDrain(buffer, data, 1);
+    status = ConvertUTF8ToUTF16Cmq(&decoder, "\xC3\xA9", 2, buffer, &used);
+    TestCheck(status == ERROR_SUCCESS && used == 2 && CmqGetUsedSize(buffer) == 64, "edges: 2 bytes free: status %lu, used %zu",
+              status, used);
+    TestDrain(buffer, data, sizeof(data));
+
+    // valid text before the error is queued, the error is the last error too
+    status = ConvertUTF8ToUTF16Cmq(&decoder, "ab\xFF" "cd", 5, buffer, &used);
+    read = TestDrain(buffer, data, sizeof(data));
+    TestCheck(status == ERROR_NO_UNICODE_TRANSLATION && GetLastError() == ERROR_NO_UNICODE_TRANSLATION && used == 2 &&
+              read == 4 && data[0] == 'a' && data[2] == 'b',
+              "edges: invalid input: status %lu, used %zu, 0x%llx bytes queued", status, used, (unsigned long long) read);
+
+    // a stream that ends in the middle of a sequence
+    Utf8DecoderInit(&decoder);
+    status = ConvertUTF8ToUTF16Cmq(&decoder, pair, 2, buffer, &used);
+    TestCheck(status == ERROR_SUCCESS && used == 2 && CmqGetUsedSize(buffer) == 0, "edges: partial sequence: status %lu", status);
+    TestCheck(ConvertUTF8ToUTF16Finish(&decoder) == ERROR_NO_UNICODE_TRANSLATION, "edges: truncated stream finished");
+
+    CmqDestroy(buffer);
+}
+
+static void TestAlloc(void)
+{
+    static TEST_TEXT text;
+    static const WCHAR unpaired[] = { L'a', 0xD800, L'b' };
+    WCHAR *utf16;
+    char *utf8;
+    size_t length;
+    DWORD status;
+    UINT32 i;
+
+    for (i = 0; i < 200; i++)
+    {
+        TestText(&text, TestRandom(i < 100 ? 20 : TEST_MAX_CHARS), 32);
+
+        length = ~(size_t) 0;
+        status = ConvertUTF8ToUTF16Alloc(text.Utf8, text.Utf8Length, &utf16, &length);
+        if (TestCheck(status == ERROR_SUCCESS && utf16 != NULL, "alloc: UTF-8 to UTF-16 failed (%lu)", status))
+        {
+            TestCheck(length == text.Utf16Length && memcmp(utf16, text.Utf16, length * sizeof(WCHAR)) == 0 && utf16[length] == 0,
+                      "alloc: wrong UTF-16 output (%zu characters, expected %zu)", length, text.Utf16Length);
+            free(utf16);
+        }
+
+        length = ~(size_t) 0;
+        status = ConvertUTF16ToUTF8Alloc(text.Utf16, text.Utf16Length, &utf8, &length);
+        if (TestCheck(status == ERROR_SUCCESS && utf8 != NULL, "alloc: UTF-16 to UTF-8 failed (%lu)", status))
+        {
+            TestCheck(length == text.Utf8Length && memcmp(utf8, text.Utf8, length) == 0 && utf8[length] == 0,
+                      "alloc: wrong UTF-8 output (%zu bytes, expected %zu)", length, text.Utf8Length);
+            free(utf8);
+        }
+    }
+
+    // invalid input: no output, the error is the last error too
+    length = 1;
+    status = ConvertUTF8ToUTF16Alloc("a\xC0\x80", 3, &utf16, &length);
+    TestCheck(status == ERROR_NO_UNICODE_TRANSLATION && GetLastError() == status && utf16 == NULL && length == 0,
+              "alloc: invalid UTF-8: status %lu", status);
+    length = 1;
+    status = ConvertUTF16ToUTF8Alloc(unpaired, ARRAYSIZE(unpaired), &utf8, &length);
+    TestCheck(status == ERROR_NO_UNICODE_TRANSLATION && GetLastError() == status && utf8 == NULL && length == 0,
+              "alloc: unpaired surrogate: status %lu", status);
+}
+
+#define TEST_THREADS 8
+
+// converter buffers of the test threads, watched in __wrap_free
+static PVOID volatile g_ThreadBuffers[TEST_THREADS + 1][2];
+static volatile LONG g_BuffersFreed;
+static volatile LONG g_ThreadsReady;
+
+void __real_free(void *p);
+
+void __wrap_free(void *p)
+{
+    int i;
+
+    if (p)
+    {
+        for (i = 0; i < (int) (2 * ARRAYSIZE(g_ThreadBuffers)); i++)
+        {
+            if (InterlockedCompareExchangePointer(&g_ThreadBuffers[i / 2][i % 2], NULL, p) == p)
+                InterlockedIncrement(&g_BuffersFreed);
+        }
+    }
+    __real_free(p);
+}
+
+// 'id'-specific text through both *Static functions, output buffers are remembered in 'buffers'
+static BOOL TestStaticConvert(UINT32 id, UINT32 iteration, PVOID buffers[2])
+{
+    char utf8[64];
+    WCHAR expected[64];
+    WCHAR *utf16;
+    char *back;
+    size_t length, i;
+
+    length = (size_t) sprintf(utf8, "thread %u, iteration %u", id, iteration);
+    for (i = 0; i <= length; i++)
+        expected[i] = (WCHAR) utf8[i];
+
+    if (!TestCheck(ConvertUTF8ToUTF16Static(utf8, &utf16, &length) == ERROR_SUCCESS && length == strlen(utf8) &&
+                   memcmp(utf16, expected, (length + 1) * sizeof(WCHAR)) == 0, "static %u: UTF-8 to UTF-16 failed", id))
+        return FALSE;
+    if (!TestCheck(ConvertUTF16ToUTF8Static(utf16, &back, &length) == ERROR_SUCCESS && length == strlen(utf8) &&
+                   strcmp(back, utf8) == 0, "static %u: UTF-16 to UTF-8 failed", id))
+        return FALSE;
+
+    // the same buffers every time
+    if (buffers[0])
+        TestCheck(buffers[0] == utf16 && buffers[1] == back, "static %u: output buffers changed", id);
+    buffers[0] = utf16;
+    buffers[1] = back;
+
+    // other threads convert meanwhile, this thread's output must stay
+    Sleep(0);
+    return TestCheck(memcmp(utf16, expected, (length + 1) * sizeof(WCHAR)) == 0 && strcmp(back, utf8) == 0,
+                     "static %u: output overwritten", id);
+}
+
+static DWORD WINAPI TestStaticThread(PVOID param)
+{
+    UINT32 id = (UINT32) (ULONG_PTR) param;
+    PVOID buffers[2] = { NULL, NULL };
+    UINT32 i;
+
+    if (!TestStaticConvert(id, 0, buffers))
+        return 1;
+    g_ThreadBuffers[id][0] = buffers[0];
+    g_ThreadBuffers[id][1] = buffers[1];
+
+    // all converters alive at once, so they can't share memory
+    InterlockedIncrement(&g_ThreadsReady);
+    for (i = 0; i < TEST_TIMEOUT && ReadAcquire(&g_ThreadsReady) < TEST_THREADS; i++)
+        Sleep(1);
+
+    for (i = 1; i < 500; i++)
+    {
+        if (!TestStaticConvert(id, i, buffers))
+            break;
+    }
+    return 0;
+}
+
+// Called from DllMain on DLL_PROCESS_DETACH, not exported.
+void ThreadConvertersFree(void);
+
+static void TestStatic(void)
+{
+    HANDLE threads[TEST_THREADS];
+    PVOID buffers[2] = { NULL, NULL };
+    UINT32 i, j, started;
+
+    // this thread's converter lives until ThreadConvertersFree
+    TestStaticConvert(TEST_THREADS, 0, buffers);
+    g_ThreadBuffers[TEST_THREADS][0] = buffers[0];
+    g_ThreadBuffers[TEST_THREADS][1] = buffers[1];
+
+    for (started = 0; started < TEST_THREADS; started++)
+    {
+        threads[started] = CreateThread(NULL, 0, TestStaticThread, (PVOID) (ULONG_PTR) started, 0, NULL);
+        if (!TestCheck(threads[started] != NULL, "static: CreateThread failed"))
+            break;
+    }
+
+    for (i = 0; i < 100; i++)
+        TestStaticConvert(TEST_THREADS, i, buffers);
+
+    for (i = 0; i < started; i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    // distinct while they were all alive
+    for (i = 0; i < started; i++)
+    {
+        for (j = 0; j < i; j++)
+            TestCheck(g_ThreadBuffers[i][0] == NULL || g_ThreadBuffers[i][0] != g_ThreadBuffers[j][0],
+                      "static: threads %u and %u share a converter", i, j);
+    }
+
+    // freed at thread exit, before the thread handle is signaled
+    TestCheck(g_BuffersFreed == 2 * (LONG) started && g_ThreadBuffers[TEST_THREADS][0] != NULL,
+              "static: %ld of %u converter buffers freed", g_BuffersFreed, 2 * started);
+
+    ThreadConvertersFree();
+    TestCheck(g_BuffersFreed == 2 * (LONG) started + 2, "static: this thread's converter not freed");
+}
+
+static void TestContext(void)
+{
+    static WCHAR tooLong[CONVERT_MAX_BUFFER_LENGTH + 1];
+    UTF_CONVERTER *converter = UtfConverterCreate();
+    WCHAR *utf16, *first;
+    char *utf8;
+    size_t length, i;
+    DWORD status;
+
+    if (!TestCheck(converter != NULL, "context: UtfConverterCreate failed"))
+        return;
+
+    status = ConvertUTF8ToUTF16Context(converter, "abc\xC3\xA9", &first, &length);
+    TestCheck(status == ERROR_SUCCESS && length == 4 && first[3] == 0xE9 && first[4] == 0, "context: UTF-8 to UTF-16 failed");
+    status = ConvertUTF8ToUTF16Context(converter, "xy", &utf16, &length);
+    TestCheck(status == ERROR_SUCCESS && length == 2 && utf16 == first && utf16[2] == 0, "context: buffer not reused");
+
+    status = ConvertUTF16ToUTF8Context(converter, L"ab\x00E9", &utf8, &length);
+    TestCheck(status == ERROR_SUCCESS && length == 4 && strcmp(utf8, "ab\xC3\xA9") == 0, "context: UTF-16 to UTF-8 failed");
+
+    // too long for the fixed buffers: no output, nothing overflows
+    for (i = 0; i < CONVERT_MAX_BUFFER_LENGTH; i++)
+        tooLong[i] = L'x';
+    status = ConvertUTF16ToUTF8Context(converter, tooLong, &utf8, &length);
+    TestCheck(status == ERROR_INSUFFICIENT_BUFFER && utf8 == NULL && length == 0, "context: too long input: status %lu", status);
+
+    UtfConverterDestroy(converter);
+    UtfConverterDestroy(NULL);
+}
+
+int main(void)
+{
+    TestCmqBoundary("ring", 4096, 0, 4096);
+    TestCmqBoundary("elastic", 4 * CMQ_SEGMENT_SIZE, CMQ_FLAG_ELASTIC, CMQ_SEGMENT_SIZE);
+    TestCmqFull();
+    TestCmqEdges();
+    TestAlloc();
+    TestContext();
+    TestStatic();
+
+    return TestFinish("utf8-conv-test");
+}
@@ -23,6 +23,11 @@
 #include <windows.h>
 
 // Circular memory queue implementation.
+//
+// One producer thread (CmqAddData) and one consumer thread (CmqGetData) can use
+// the same queue concurrently without any locking. Multiple producers or multiple
+// consumers need to serialize among themselves. CmqClear and CmqDestroy need
+// exclusive access.
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,6 +42,13 @@ extern "C" {
 struct _CMQ_BUFFER;
 typedef struct _CMQ_BUFFER CMQ_BUFFER;
 
+// Contiguous region of the queue storage, see CmqReserve/CmqPeek.
+typedef struct _CMQ_SPAN
+{
+    BYTE *Data;
+    UINT64 Size;
+} CMQ_SPAN;
+
 // Underflow mode for read operations.
 typedef enum _CMQ_UNDERFLOW_MODE
 {
@@ -48,6 +60,44 @@ typedef enum _CMQ_UNDERFLOW_MODE
 WINDOWSUTILS_API
 CMQ_BUFFER *CmqCreate(IN UINT64 bufferSize);
 
+// CmqCreateEx flags.
+
+// Map the storage twice back to back so that free space and queued data are always
+// a single contiguous range (CmqReserve/CmqPeek never return a second span).
+// Buffer size is rounded up to the system allocation granularity.
+// Falls back to normal storage if the system doesn't support placeholder mappings.
+#define CMQ_FLAG_MIRRORED 0x00000001
+
+// Build the storage from a chain of segments allocated on demand instead of one block.
+// Buffer size is the maximum amount of queued data. Segments are returned to a pool shared
+// by all elastic buffers as soon as they're consumed, so an idle buffer holds one segment.
+// CmqReserve/CmqPeek spans are limited to two segments. Can't be combined with CMQ_FLAG_MIRRORED.
+#define CMQ_FLAG_ELASTIC  0x00000002
+
+// Allow any number of concurrent producers (CmqAddData/CmqAddDataV) with a single consumer.
+// Producers only serialize for a few instructions to claim space, copying and publishing
+// run in parallel. Each write is stored with a small header, so free space shrinks
+// by up to 15 bytes per write. Records (CmqAddRecord...) and CmqReserve/CmqCommit
+// aren't supported. Can't be combined with CMQ_FLAG_ELASTIC.
+#define CMQ_FLAG_MPSC     0x00000004
+
+// Timestamp every add (a chunk: CmqAddData, CmqAddDataV, CmqCommit, CmqAddRecord) when it's published,
+// so the consumer can measure queueing delay (CmqGetLatencyStats) and drop stale chunks (CmqSetTtl).
+// Multi-producer buffers keep the timestamp in the write header, which makes it 16 bytes
+// (free space shrinks by up to 31 bytes per write).
+#define CMQ_FLAG_TIMESTAMPS 0x00000008
+
+// Segment size for elastic buffers (smaller if the buffer size is smaller).
+#define CMQ_SEGMENT_SIZE  (64 * 1024)
+
+// allocate memory and initialize with CMQ_FLAG_* options, return 0 = failure
+WINDOWSUTILS_API
+CMQ_BUFFER *CmqCreateEx(IN UINT64 bufferSize, IN DWORD flags);
+
+// returns CMQ_FLAG_* options actually in effect
+WINDOWSUTILS_API
+DWORD CmqGetFlags(IN const CMQ_BUFFER *buffer);
+
 // free memory and deinitialize
 WINDOWSUTILS_API
 void CmqDestroy(IN CMQ_BUFFER *buffer);
@@ -60,11 +110,43 @@ BOOL CmqAddData(IN CMQ_BUFFER *buffer, IN const void *data, IN UINT64 dataSize);
 WINDOWSUTILS_API
 BOOL CmqGetData(IN CMQ_BUFFER *buffer, OUT void *data, IN OUT UINT64 *dataSize, CMQ_UNDERFLOW_MODE underflowMode);
 
+// Vectored "push": queue data from all spans in order, either everything or nothing.
+// The data becomes visible to the consumer at once.
+WINDOWSUTILS_API
+BOOL CmqAddDataV(IN CMQ_BUFFER *buffer, IN const CMQ_SPAN *spans, IN UINT32 spanCount);
+
+// Vectored "pop": fill all spans in order. dataSize receives the total number of bytes read.
+// CMQ_NO_UNDERFLOW: fail without removing anything unless all spans can be filled.
+// CMQ_ALLOW_UNDERFLOW: read what's available, the last spans may be partially filled or untouched.
+WINDOWSUTILS_API
+BOOL CmqGetDataV(IN CMQ_BUFFER *buffer, IN const CMQ_SPAN *spans, IN UINT32 spanCount, OUT UINT64 *dataSize, CMQ_UNDERFLOW_MODE underflowMode);
+
+// Zero-copy producer interface: get up to two spans of free storage (in order) with the total size
+// of at most maxSize bytes (maxSize=0: all free space). Returns the total size of the spans, 0 if the queue is full.
+// Fill the spans in order and call CmqCommit with the number of bytes actually written to make them visible.
+WINDOWSUTILS_API
+UINT64 CmqReserve(IN CMQ_BUFFER *buffer, IN UINT64 maxSize, OUT CMQ_SPAN spans[2]);
+
+// Publish 'dataSize' bytes written into spans returned by CmqReserve.
+// Fails if dataSize is larger than the last reservation, each reservation can be committed once.
+WINDOWSUTILS_API
+BOOL CmqCommit(IN CMQ_BUFFER *buffer, IN UINT64 dataSize);
+
+// Zero-copy consumer interface: get up to two spans of queued data (in order) with the total size
+// of at most maxSize bytes (maxSize=0: all data). Returns the total size of the spans, 0 if the queue is empty.
+// The data stays in the queue until CmqConsume is called.
+WINDOWSUTILS_API
+UINT64 CmqPeek(IN const CMQ_BUFFER *buffer, IN UINT64 maxSize, OUT CMQ_SPAN spans[2]);
+
+// Remove 'dataSize' bytes previously returned by CmqPeek from the queue.
+WINDOWSUTILS_API
+BOOL CmqConsume(IN CMQ_BUFFER *buffer, IN UINT64 dataSize);
+
 // returns bytes used by data
 WINDOWSUTILS_API
 UINT64 CmqGetUsedSize(IN const CMQ_BUFFER *buffer);
 
-// returns free space
+// returns free space (size of the largest write that would succeed now)
 WINDOWSUTILS_API
 UINT64 CmqGetFreeSize(IN const CMQ_BUFFER *buffer);
 
@@ -72,6 +154,189 @@ UINT64 CmqGetFreeSize(IN const CMQ_BUFFER *buffer);
 WINDOWSUTILS_API
 void CmqClear(IN CMQ_BUFFER *buffer);
 
+// Block until at least minSize bytes are queued (minSize=0 returns immediately).
+// Returns ERROR_SUCCESS, ERROR_TIMEOUT or ERROR_OPERATION_ABORTED (see CmqAbortWaits), or
+// ERROR_INVALID_PARAMETER right away if minSize is larger than the main and spill storage together
+// (the buffer size plus CmqSetSpillSize), since that would never be satisfied.
+// Waiting doesn't consume anything: with multiple consumers the data may be gone by the time this returns.
+WINDOWSUTILS_API
+DWORD CmqWaitForData(IN CMQ_BUFFER *buffer, IN UINT64 minSize, IN DWORD timeout);
+
+// Block until at least 'size' bytes are free. Return values as above, including ERROR_INVALID_PARAMETER
+// for a 'size' larger than the main and spill storage together.
+WINDOWSUTILS_API
+DWORD CmqWaitForSpace(IN CMQ_BUFFER *buffer, IN UINT64 size, IN DWORD timeout);
+
+// Wake all threads waiting on the buffer, current and future waits fail with ERROR_OPERATION_ABORTED.
+// Use before tearing down the producer/consumer threads.
+WINDOWSUTILS_API
+void CmqAbortWaits(IN CMQ_BUFFER *buffer);
+
+// Record queue: length-prefixed records on top of the byte queue. A record is published as a whole,
+// so the consumer never sees a header without its payload. Don't mix with byte operations on the same buffer.
+// Single producer/single consumer rules apply as for the byte queue.
+
+// Record layout in the queue and in CmqGetRecords output: header followed by the payload.
+typedef struct _CMQ_RECORD_HEADER
+{
+    UINT32 Size; // payload size
+} CMQ_RECORD_HEADER;
+
+// Queue a record, fails if there's not enough space for the header and payload.
+WINDOWSUTILS_API
+BOOL CmqAddRecord(IN CMQ_BUFFER *buffer, IN const void *data, IN UINT32 dataSize);
+
+// Get payload size of the next record, fails if no complete record is queued.
+WINDOWSUTILS_API
+BOOL CmqPeekRecordSize(IN const CMQ_BUFFER *buffer, OUT UINT32 *recordSize);
+
+// Dequeue the next record's payload. dataSize: on input the output buffer size, on output the payload size.
+// Fails with dataSize=0 if there's no record, or with dataSize set to the payload size if the output buffer
+// is too small (the record stays queued).
+WINDOWSUTILS_API
+BOOL CmqGetRecord(IN CMQ_BUFFER *buffer, OUT void *data, IN OUT UINT32 *dataSize);
+
+// Dequeue as many whole records (header + payload) as fit into the output buffer, at most maxRecords
+// (0 = no limit), with a single copy. dataSize: on input the output buffer size, on output bytes copied.
+// Returns number of records dequeued.
+WINDOWSUTILS_API
+UINT32 CmqGetRecords(IN CMQ_BUFFER *buffer, OUT void *data, IN OUT UINT64 *dataSize, IN UINT32 maxRecords);
+
+// Overflow (spill) storage: when the buffer is full, further data goes to a memory-mapped temp file
+// of up to spillSize bytes, and keeps going there until the consumer drains it, so the data stays in order.
+// The file is created on first use and deleted with the buffer. Memory use stays bounded: file pages
+// can be written out and dropped by the system, and only a few MB of the file are mapped at a time
+// (spans from CmqReserve/CmqPeek may be shorter there). Reads transparently continue from the spill storage.
+// Call before the buffer is used, spillSize=0 disables spilling (default).
+WINDOWSUTILS_API
+BOOL CmqSetSpillSize(IN CMQ_BUFFER *buffer, IN UINT64 spillSize);
+
+typedef struct _CMQ_SPILL_STATS
+{
+    UINT64 SpillSize;    // spill storage capacity
+    UINT64 SpilledBytes; // total bytes queued to the spill storage
+    UINT64 SpilledNow;   // bytes currently in the spill storage
+    UINT64 SpillCount;   // number of times the buffer overflowed to the spill storage
+    UINT64 SpillTimeMs;  // total time the spill storage held data
+} CMQ_SPILL_STATS;
+
+WINDOWSUTILS_API
+void CmqGetSpillStats(IN const CMQ_BUFFER *buffer, OUT CMQ_SPILL_STATS *stats);
+
+// Occupancy histogram buckets: [0..9] storage occupancy in 10% steps (100% falls in [9]),
+// [10] spill storage holds data.
+#define CMQ_STATS_BUCKETS 11
+
+// Always-on usage counters, updated by producers (multi-producer buffers keep them per producer
+// thread and sum them up here) except ReadHistogram, which only the consumer updates.
+// Occupancy is storage in use including per-write overhead (record/MPSC headers), sampled by
+// producers after each add and by the consumer before each release (reads spanning the main
+// and the spill storage count twice).
+typedef struct _CMQ_STATS
+{
+    UINT64 Size;          // main storage capacity
+    UINT64 BytesIn;       // total bytes queued
+    UINT64 BytesOut;      // total bytes consumed (or discarded by CmqClear)
+    UINT64 HighWatermark; // highest occupancy (bytes), can exceed Size when spilling
+    UINT64 FailedAdds;    // adds rejected because the buffer was full (including CmqReserve with no space)
+    UINT64 Histogram[CMQ_STATS_BUCKETS]; // number of adds per occupancy bucket
+    UINT64 ReadHistogram[CMQ_STATS_BUCKETS]; // number of reads per occupancy bucket
+} CMQ_STATS;
+
+WINDOWSUTILS_API
+void CmqGetStats(IN const CMQ_BUFFER *buffer, OUT CMQ_STATS *stats);
+
+// Drop chunks that have been queued for longer than ttlMs (0 = keep forever, default).
+// Needs CMQ_FLAG_TIMESTAMPS. The consumer drops whole chunks from the head of the queue
+// (never a partially read one): CmqGetData, CmqGetDataV, CmqGetRecord and CmqGetRecords do it
+// automatically, CmqPeek users call CmqDropExpired first.
+WINDOWSUTILS_API
+BOOL CmqSetTtl(IN CMQ_BUFFER *buffer, IN DWORD ttlMs);
+
+// Consumer side: drop expired chunks (see CmqSetTtl), returns the number of bytes dropped.
+WINDOWSUTILS_API
+UINT64 CmqDropExpired(IN CMQ_BUFFER *buffer);
+
+// Queueing delay histogram buckets: [0] under 1 us, [i] from 2^(i-1) to 2^i us, the last one is open-ended.
+#define CMQ_LATENCY_BUCKETS 32
+
+// CMQ_FLAG_TIMESTAMPS statistics, a chunk is accounted when it's consumed completely.
+typedef struct _CMQ_LATENCY_STATS
+{
+    UINT64 Chunks;          // chunks consumed
+    UINT64 TotalDelayUs;    // sum of their queueing delays
+    UINT64 MaxDelayUs;      // longest queueing delay
+    UINT64 DroppedChunks;   // chunks dropped because of the TTL
+    UINT64 DroppedBytes;
+    UINT64 UntrackedChunks; // single-producer buffers: chunks published while too many were queued
+                            // to timestamp them, they're accounted with the next timestamped one
+    UINT64 Histogram[CMQ_LATENCY_BUCKETS]; // number of chunks per delay bucket
+} CMQ_LATENCY_STATS;
+
+WINDOWSUTILS_API
+void CmqGetLatencyStats(IN const CMQ_BUFFER *buffer, OUT CMQ_LATENCY_STATS *stats);
+
+// Cross-process queue: counters and storage live in a named shared memory section, so a producer
+// and a consumer in different processes can stream data without any system calls while neither
+// of them waits. CmqWaitForData/CmqWaitForSpace use named events ("<name>-data", "<name>-space")
+// that are only signalled if the other side is waiting. Byte and record operations work as usual;
+// CMQ_FLAG_* options, spill storage and TTLs aren't available. Both processes call CmqDestroy
+// when done, the section is freed with the last view. The processes must trust each other,
+// counters in the section aren't validated.
+
+// Create the section and its wait events (both with securityAttributes), fails if they already exist.
+// Storage is committed up front. Every view holds the events open until CmqDestroy.
+WINDOWSUTILS_API
+CMQ_BUFFER *CmqCreateShared(IN const WCHAR *name, IN UINT64 bufferSize, IN PSECURITY_ATTRIBUTES securityAttributes OPTIONAL);
+
+// Map a section created by CmqCreateShared (possibly in another process) and open its wait events.
+// If they're already gone (every view that had them is destroyed), the buffer still works but
+// CmqWaitForData/CmqWaitForSpace on this view fail with the OpenEvent error.
+WINDOWSUTILS_API
+CMQ_BUFFER *CmqOpenShared(IN const WCHAR *name);
+
+// Buffer pool: recycles storage of equally sized buffers, so creating and destroying buffers
+// (e.g. per connection) is a pop/push on a lock-free free list instead of heap allocations.
+// A slab holds the buffer's bookkeeping and storage in one block of virtual memory.
+struct _CMQ_POOL;
+typedef struct _CMQ_POOL CMQ_POOL;
+
+// CmqCreatePool flags.
+
+// Back slabs with large pages (the caller needs SeLockMemoryPrivilege enabled).
+// Slab size is rounded up to the large page size. Falls back to normal pages if large pages
+// aren't available.
+#define CMQ_POOL_LARGE_PAGES 0x00000001
+
+// Create a pool for buffers of bufferSize bytes. preallocCount slabs are allocated up front,
+// at most maxFreeCount free slabs are kept for reuse (the rest are released to the system).
+WINDOWSUTILS_API
+CMQ_POOL *CmqCreatePool(IN UINT64 bufferSize, IN DWORD flags, IN DWORD preallocCount, IN DWORD maxFreeCount);
+
+// Release the pool and its free slabs. All buffers created from the pool must be destroyed first.
+WINDOWSUTILS_API
+void CmqDestroyPool(IN CMQ_POOL *pool);
+
+// Like CmqCreateEx with the pool's buffer size. CmqDestroy returns the slab to the pool.
+// CMQ_FLAG_MIRRORED and CMQ_FLAG_ELASTIC are not supported (ignored).
+WINDOWSUTILS_API
+CMQ_BUFFER *CmqCreateFromPool(IN CMQ_POOL *pool, IN DWORD flags);
+
+typedef struct _CMQ_POOL_STATS
+{
+    UINT64 BufferSize; // storage size of pool buffers
+    UINT64 SlabSize;   // bytes per slab
+    BOOL LargePages;   // slabs are allocated with large pages
+    UINT64 Allocated;  // slabs allocated from the system
+    UINT64 Released;   // slabs returned to the system
+    UINT64 Reused;     // buffers created from a free slab
+    UINT64 InUse;      // slabs currently used by buffers
+    UINT64 Free;       // slabs currently in the free list
+} CMQ_POOL_STATS;
+
+WINDOWSUTILS_API
+void CmqGetPoolStats(IN const CMQ_POOL *pool, OUT CMQ_POOL_STATS *stats);
+
 #ifdef __cplusplus
 }
 #endif
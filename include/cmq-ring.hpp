@@ -0,0 +1,164 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+#include "buffer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Header-only counterpart of CMQ_BUFFER for C++ code.
+//
+// Capacity (in elements) and element type are compile-time parameters: storage is part of the object
+// (allocate big rings on the heap), capacity must be a power of two so that counter -> offset
+// is a mask, and there's no logging. AddData/GetData have the same semantics as CmqAddData/CmqGetData
+// (sizes are in elements) and the same threading rules: one producer and one consumer thread
+// can use the ring concurrently without locking.
+template <typename T, size_t Capacity>
+class CmqRing
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "elements are copied with memcpy");
+
+public:
+    static constexpr size_t Mask = Capacity - 1;
+
+    static constexpr size_t GetSize() noexcept
+    {
+        return Capacity;
+    }
+
+    // "push" data to the ring, all or nothing
+    bool AddData(const T *data, size_t count) noexcept
+    {
+        uint64_t writeCount = m_WriteCount.load(std::memory_order_relaxed); // we're the only writer of this one
+        uint64_t readCount = m_ReadCount.load(std::memory_order_acquire); // consumer is done with storage below this
+
+        if (count > Capacity - (size_t) (writeCount - readCount))
+            return false;
+
+        CopyIn(writeCount, data, count);
+        m_WriteCount.store(writeCount + count, std::memory_order_release);
+        return true;
+    }
+
+    // "pop" data from the ring, count=0: get all data (make sure you have the space for it)
+    bool GetData(T *data, size_t *count, CMQ_UNDERFLOW_MODE underflowMode) noexcept
+    {
+        uint64_t readCount = m_ReadCount.load(std::memory_order_relaxed); // we're the only writer of this one
+        uint64_t writeCount = m_WriteCount.load(std::memory_order_acquire); // producer's data below this is visible
+        size_t usedSize = (size_t) (writeCount - readCount);
+
+        if (usedSize == 0)
+        {
+            bool ok = (underflowMode == CMQ_ALLOW_UNDERFLOW) || (*count == 0);
+            *count = 0;
+            return ok;
+        }
+
+        if (*count == 0) // "read all"
+        {
+            *count = usedSize;
+        }
+        else if (*count > usedSize) // underflow
+        {
+            if (underflowMode != CMQ_ALLOW_UNDERFLOW)
+            {
+                *count = 0;
+                return false;
+            }
+            *count = usedSize;
+        }
+
+        CopyOut(readCount, data, *count);
+        m_ReadCount.store(readCount + *count, std::memory_order_release);
+        return true;
+    }
+
+    size_t GetUsedSize() const noexcept
+    {
+        // consumer's counter first, see CmqGetUsedSize
+        uint64_t readCount = m_ReadCount.load(std::memory_order_acquire);
+        uint64_t writeCount = m_WriteCount.load(std::memory_order_acquire);
+
+        return (size_t) (writeCount - readCount);
+    }
+
+    size_t GetFreeSize() const noexcept
+    {
+        return Capacity - GetUsedSize();
+    }
+
+    // needs exclusive access
+    void Clear() noexcept
+    {
+        m_ReadCount.store(0, std::memory_order_relaxed);
+        m_WriteCount.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    void CopyIn(uint64_t counter, const T *data, size_t count) noexcept
+    {
+        size_t offset = (size_t) counter & Mask;
+        size_t toEnd = Capacity - offset;
+
+        if (count <= toEnd)
+        {
+            memcpy(&m_Storage[offset], data, count * sizeof(T));
+        }
+        else
+        {
+            memcpy(&m_Storage[offset], data, toEnd * sizeof(T));
+            memcpy(&m_Storage[0], data + toEnd, (count - toEnd) * sizeof(T));
+        }
+    }
+
+    void CopyOut(uint64_t counter, T *data, size_t count) const noexcept
+    {
+        size_t offset = (size_t) counter & Mask;
+        size_t toEnd = Capacity - offset;
+
+        if (count <= toEnd)
+        {
+            memcpy(data, &m_Storage[offset], count * sizeof(T));
+        }
+        else
+        {
+            memcpy(data, &m_Storage[offset], toEnd * sizeof(T));
+            memcpy(data + toEnd, &m_Storage[0], (count - toEnd) * sizeof(T));
+        }
+    }
+
+    static constexpr size_t CacheLineSize = 64;
+
+    // Counters only grow and are on separate cache lines, same as in CMQ_BUFFER
+    // (padding instead of alignas to avoid C4324).
+    T m_Storage[Capacity];
+    uint8_t m_Padding1[CacheLineSize];
+    std::atomic<uint64_t> m_ReadCount{ 0 }; // only written by the consumer
+    uint8_t m_Padding2[CacheLineSize];
+    std::atomic<uint64_t> m_WriteCount{ 0 }; // only written by the producer
+    uint8_t m_Padding3[CacheLineSize];
+};
@@ -0,0 +1,265 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#pragma once
+#include <windows.h>
+#include "crc32.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+// CRC32 instruction: always there if the compiler targets SSE4.2 (any compiler), otherwise checked
+// at run time on x86 MSVC builds
+#if defined(__SSE4_2__)
+#    include <nmmintrin.h>
+#    define CRC_HW_CRC32C
+#    define CRC_HW_CRC32C_ALWAYS
+#elif defined(_M_X64) || defined(_M_IX86)
+#    include <intrin.h>
+#    include <nmmintrin.h>
+#    define CRC_HW_CRC32C
+#endif
+
+// Header-only table-driven CRC for arbitrary polynomials, tables are built at compile time.
+//
+// The width is that of T (8 to 64 bits). Poly is in normal (MSB-first) notation as in CRC catalogues,
+// e.g. 0x04C11DB7 for CRC-32; Reflected selects LSB-first processing of input and output (refin = refout).
+// Compute has the same semantics as Crc32_ComputeBuf: pass 0 for the first buffer and the previous
+// result for the next ones. That's only possible if the initial value equals the final XOR, so both
+// are XorOut. Both reflected and normal CRCs use slicing-by-8.
+template <typename T, T Poly, bool Reflected, T XorOut>
+class CrcEngine
+{
+    static_assert(std::is_unsigned<T>::value && sizeof(T) <= 8, "T must be an unsigned integer of 8 to 64 bits");
+
+public:
+    static constexpr int Width = sizeof(T) * 8;
+
+    static T Compute(T inCrc, const void *buffer, size_t size) noexcept
+    {
+        return Update((T) (inCrc ^ XorOut), (const uint8_t *) buffer, size) ^ XorOut;
+    }
+
+    // raw register update without the initial/final XOR
+    static T Update(T crc, const uint8_t *data, size_t size) noexcept
+    {
+        return Update(crc, data, size, std::integral_constant<bool, Reflected>());
+    }
+
+    static constexpr T Reflect(T value) noexcept
+    {
+        T result = 0;
+
+        for (int i = 0; i < Width; i++)
+        {
+            result = (T) ((result << 1) | (value & 1));
+            value >>= 1;
+        }
+        return result;
+    }
+
+private:
+    // Table[k][b] is the register after byte 'b' followed by 'k' zero bytes
+    struct TableSet
+    {
+        T Table[8][256];
+    };
+
+    // Reflected/normal variants are overloads rather than 'if (Reflected)' to avoid C4127.
+    // Shifts by 8 are fine for 8-bit CRCs, T is promoted to int.
+
+    // slicing-by-8, the CRC register is at most 64 bits so it fits in the first word
+    // (the lowest bytes for reflected CRCs, the highest ones for normal CRCs)
+    static T Update(T crc, const uint8_t *data, size_t size, std::true_type) noexcept
+    {
+        uint64_t value;
+
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            memcpy(&value, data, sizeof(value)); // little-endian
+            value ^= crc;
+            crc = Tables.Table[7][value & 0xFF] ^ Tables.Table[6][(value >> 8) & 0xFF] ^
+                  Tables.Table[5][(value >> 16) & 0xFF] ^ Tables.Table[4][(value >> 24) & 0xFF] ^
+                  Tables.Table[3][(value >> 32) & 0xFF] ^ Tables.Table[2][(value >> 40) & 0xFF] ^
+                  Tables.Table[1][(value >> 48) & 0xFF] ^ Tables.Table[0][value >> 56];
+        }
+
+        for (; size > 0; size--, data++)
+            crc = (T) ((crc >> 8) ^ Tables.Table[0][(crc ^ *data) & 0xFF]);
+        return crc;
+    }
+
+    static T Update(T crc, const uint8_t *data, size_t size, std::false_type) noexcept
+    {
+        uint64_t value;
+
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            memcpy(&value, data, sizeof(value));
+            value = ByteSwap(value) ^ ((uint64_t) crc << (64 - Width)); // big-endian
+            crc = Tables.Table[7][value >> 56] ^ Tables.Table[6][(value >> 48) & 0xFF] ^
+                  Tables.Table[5][(value >> 40) & 0xFF] ^ Tables.Table[4][(value >> 32) & 0xFF] ^
+                  Tables.Table[3][(value >> 24) & 0xFF] ^ Tables.Table[2][(value >> 16) & 0xFF] ^
+                  Tables.Table[1][(value >> 8) & 0xFF] ^ Tables.Table[0][value & 0xFF];
+        }
+
+        for (; size > 0; size--, data++)
+            crc = (T) ((T) (crc << 8) ^ Tables.Table[0][((crc >> (Width - 8)) ^ *data) & 0xFF]);
+        return crc;
+    }
+
+    static uint64_t ByteSwap(uint64_t value) noexcept
+    {
+#ifdef _MSC_VER
+        return _byteswap_uint64(value);
+#else
+        return __builtin_bswap64(value);
+#endif
+    }
+
+    static constexpr T TableEntry(int index, std::true_type) noexcept
+    {
+        T crc = (T) index;
+
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (T) ((crc >> 1) ^ Reflect(Poly)) : (T) (crc >> 1);
+        return crc;
+    }
+
+    static constexpr T TableEntry(int index, std::false_type) noexcept
+    {
+        T crc = (T) ((T) index << (Width - 8));
+
+        for (int bit = 0; bit < 8; bit++)
+            crc = ((crc >> (Width - 1)) & 1) ? (T) ((T) (crc << 1) ^ Poly) : (T) (crc << 1);
+        return crc;
+    }
+
+    // one more zero byte after 'crc'
+    static constexpr T ZeroByte(const TableSet &tables, T crc, std::true_type) noexcept
+    {
+        return (T) ((crc >> 8) ^ tables.Table[0][crc & 0xFF]);
+    }
+
+    static constexpr T ZeroByte(const TableSet &tables, T crc, std::false_type) noexcept
+    {
+        return (T) ((T) (crc << 8) ^ tables.Table[0][(crc >> (Width - 8)) & 0xFF]);
+    }
+
+    static constexpr TableSet MakeTables() noexcept
+    {
+        TableSet tables{};
+
+        for (int i = 0; i < 256; i++)
+            tables.Table[0][i] = TableEntry(i, std::integral_constant<bool, Reflected>());
+
+        for (int k = 1; k < 8; k++)
+        {
+            for (int i = 0; i < 256; i++)
+                tables.Table[k][i] = ZeroByte(tables, tables.Table[k - 1][i], std::integral_constant<bool, Reflected>());
+        }
+        return tables;
+    }
+
+    static constexpr TableSet Tables = MakeTables();
+};
+
+template <typename T, T Poly, bool Reflected, T XorOut>
+constexpr typename CrcEngine<T, Poly, Reflected, XorOut>::TableSet CrcEngine<T, Poly, Reflected, XorOut>::Tables;
+
+// CRC-32 (gzip, same as Crc32_ComputeBuf), CRC-32C (Castagnoli, iSCSI/ext4) and CRC-64/XZ (ECMA-182 polynomial)
+using Crc32Engine = CrcEngine<uint32_t, 0x04C11DB7, true, 0xFFFFFFFF>;
+using Crc32CEngine = CrcEngine<uint32_t, 0x1EDC6F41, true, 0xFFFFFFFF>;
+using Crc64Engine = CrcEngine<uint64_t, 0x42F0E1EBA9EA3693, true, 0xFFFFFFFFFFFFFFFF>;
+
+// Fastest available kernel for each variant, same interface as CrcEngine::Compute.
+
+// PCLMULQDQ folding or slicing tables in crc32.c
+struct Crc32
+{
+    static uint32_t Compute(uint32_t inCrc, const void *buffer, size_t size) noexcept
+    {
+        return (uint32_t) Crc32_ComputeBuf(inCrc, buffer, size);
+    }
+};
+
+// SSE4.2 CRC32 instruction if the CPU has it
+struct Crc32C
+{
+    static uint32_t Compute(uint32_t inCrc, const void *buffer, size_t size) noexcept
+    {
+#if defined(CRC_HW_CRC32C_ALWAYS)
+        return ~ComputeSse42(~inCrc, (const uint8_t *) buffer, size);
+#else
+#    ifdef CRC_HW_CRC32C
+        static const bool hasSse42 = HasSse42();
+
+        if (hasSse42)
+            return ~ComputeSse42(~inCrc, (const uint8_t *) buffer, size);
+#    endif
+        return Crc32CEngine::Compute(inCrc, buffer, size);
+#endif
+    }
+
+#ifdef CRC_HW_CRC32C
+private:
+#    ifndef CRC_HW_CRC32C_ALWAYS
+    static bool HasSse42() noexcept
+    {
+        int cpuInfo[4];
+
+        // leaf 1: ECX bit 20 is SSE4.2
+        __cpuid(cpuInfo, 1);
+        return (cpuInfo[2] & (1 << 20)) != 0;
+    }
+#    endif
+
+    static uint32_t ComputeSse42(uint32_t crc, const uint8_t *data, size_t size) noexcept
+    {
+#    if defined(_M_X64) || defined(__x86_64__)
+        uint64_t value;
+
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            memcpy(&value, data, sizeof(value));
+            crc = (uint32_t) _mm_crc32_u64(crc, value);
+        }
+#    else
+        uint32_t value;
+
+        for (; size >= 4; size -= 4, data += 4)
+        {
+            memcpy(&value, data, sizeof(value));
+            crc = _mm_crc32_u32(crc, value);
+        }
+#    endif
+        for (; size > 0; size--, data++)
+            crc = _mm_crc32_u8(crc, *data);
+        return crc;
+    }
+#endif
+};
+
+// CRC-64/XZ is reflected: slicing-by-8 tables, 8 bytes per step
+using Crc64 = Crc64Engine;
@@ -19,21 +19,63 @@
  *
  */
 
+// Crc32_ComputeBuf and Crc32_Combine (crc32.c) are portable C and build on Linux too,
+// the multi-threaded and file functions (crc32-file.c) are Windows only.
+
 #pragma once
+#include <stddef.h>
+#ifdef _WIN32
+#    include <windows.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#ifdef WINDOWSUTILS_EXPORTS
-#    define WINDOWSUTILS_API __declspec(dllexport)
+#ifdef _WIN32
+#    ifdef WINDOWSUTILS_EXPORTS
+#        define WINDOWSUTILS_API __declspec(dllexport)
+#    else
+#        define WINDOWSUTILS_API __declspec(dllimport)
+#    endif
 #else
-#    define WINDOWSUTILS_API __declspec(dllimport)
+#    define WINDOWSUTILS_API
 #endif
 
 WINDOWSUTILS_API
 unsigned long Crc32_ComputeBuf(unsigned long inCrc32, const void *buffer, size_t bufferSize);
 
+// CRC-32 of buffer A followed by buffer B, given the CRCs of both and the length of B.
+WINDOWSUTILS_API
+unsigned long Crc32_Combine(unsigned long crcA, unsigned long crcB, unsigned long long lenB);
+
+#ifdef _WIN32
+// Same result as Crc32_ComputeBuf, big buffers are split between the calling thread and thread
+// pool workers, up to 'threadCount' threads (0: number of processors).
+WINDOWSUTILS_API
+unsigned long Crc32_ComputeBufParallel(unsigned long inCrc32, const void *buffer, size_t bufferSize, unsigned int threadCount);
+
+typedef struct _CRC32_FILE_STATS
+{
+    UINT64 Bytes;          // bytes checksummed
+    UINT64 TimeUs;         // wall time including I/O
+    UINT64 BytesPerSecond;
+} CRC32_FILE_STATS;
+
+// CRC-32 of 'length' bytes of a file starting at 'offset' (length 0: up to the end of the file).
+// The file is read through memory-mapped windows with readahead (Windows 8+), each window is checksummed
+// by up to 'threadCount' threads (see Crc32_ComputeBufParallel) set up once per call. '*crc32'
+// is the accumulated value like inCrc32 (0 on first call) and is only updated on success.
+// Returns a Win32 error code, ERROR_READ_FAULT if the file couldn't be read.
+WINDOWSUTILS_API
+DWORD Crc32_ComputeFile(IN HANDLE file, IN UINT64 offset, IN UINT64 length, IN unsigned int threadCount,
+                        IN OUT unsigned long *crc32, OUT CRC32_FILE_STATS *stats OPTIONAL);
+
+WINDOWSUTILS_API
+DWORD Crc32_ComputeFileByName(IN const WCHAR *path, IN UINT64 offset, IN UINT64 length, IN unsigned int threadCount,
+                              IN OUT unsigned long *crc32, OUT CRC32_FILE_STATS *stats OPTIONAL);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
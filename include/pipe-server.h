@@ -98,7 +98,7 @@ WINDOWSUTILS_API
 DWORD QpsCreate(
     IN  PWCHAR PipeName, // This is a client->server pipe name (clients write, server reads). server->client pipes have "-%PID%" appended.
     IN  DWORD PipeBufferSize, // Pipe read/write buffer size. Shouldn't be too big.
-    IN  DWORD ReadBufferSize, // Read buffer (per client). The server enqueues all received data here until it's read by QpsRead().
+    IN  DWORD ReadBufferSize, // Read buffer limit (per client). The server enqueues all received data here until it's read by QpsRead(). Memory is allocated on demand.
     IN  DWORD WriteTimeout, // If a client doesn't read written data in this amount of milliseconds, it's disconnected.
     IN  QPS_CLIENT_CONNECTED ConnectCallback, // "Client connected" callback.
     IN  QPS_CLIENT_DISCONNECTED DisconnectCallback OPTIONAL, // "Client disconnected" callback.
@@ -108,6 +108,36 @@ DWORD QpsCreate(
     OUT PIPE_SERVER *Server // Server object.
     );
 
+// Default per-client spill storage limit, see QpsSetSpillSize. Disabled: QpsWrite() fails with
+// ERROR_BUFFER_OVERFLOW when the internal buffer is full, so callers notice slow clients.
+#define QPS_DEFAULT_SPILL_SIZE 0
+
+// Set the limit of a temp file used per client buffer when its internal buffer is full (0 = disabled, default).
+// Only applies to clients connected after the call.
+WINDOWSUTILS_API
+void QpsSetSpillSize(
+    IN  PIPE_SERVER Server,
+    IN  UINT64 SpillSize
+    );
+
+// Drop data written by QpsWrite() that couldn't be sent to a client within TtlMs (0 = never, default).
+// Whole QpsWrite() chunks are dropped, use it for streams where stale data is useless (e.g. input events).
+// Only applies to clients connected after the call.
+WINDOWSUTILS_API
+void QpsSetWriteTtl(
+    IN  PIPE_SERVER Server,
+    IN  DWORD TtlMs
+    );
+
+// Measure how long data written by QpsWrite() waits before it's sent (logged with the buffer
+// statistics when the client disconnects). Off by default, a write TTL enables it too.
+// Only applies to clients connected after the call.
+WINDOWSUTILS_API
+void QpsSetLatencyStats(
+    IN  PIPE_SERVER Server,
+    IN  BOOL Enable
+    );
+
 // Destroy the server, disconnect all clients, deallocate memory.
 WINDOWSUTILS_API
 void QpsDestroy(
@@ -123,6 +153,9 @@ DWORD QpsMainLoop(
 
 // Blocking read from a client.
 // Returns immediately if the internal read queue has enough data.
+// Fails with ERROR_BROKEN_PIPE if the client disconnected before sending enough data, and passes
+// CmqWaitForData errors through: ERROR_INVALID_PARAMETER if DataSize is larger than the read buffer
+// (ReadBufferSize in QpsCreate plus the spill size, see QpsSetSpillSize), such a read can never complete.
 WINDOWSUTILS_API
 DWORD QpsRead(
     IN  PIPE_SERVER Server,
@@ -0,0 +1,109 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Portable UTF-8 <-> UTF-16 transcoder: no Windows headers, builds on Linux too.
+// Validation is as strict as MultiByteToWideChar(MB_ERR_INVALID_CHARS) and
+// WideCharToMultiByte(WC_ERR_INVALID_CHARS): overlong forms, encoded surrogates, code points
+// above U+10FFFF, truncated sequences and unpaired surrogates are errors. With SSE2 runs of
+// ASCII are converted 16 characters at a time and runs of 2- and 3-byte characters (Latin,
+// Cyrillic, CJK...) 8 at a time; output after *outputLength may be overwritten.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#    ifdef WINDOWSUTILS_EXPORTS
+#        define WINDOWSUTILS_API __declspec(dllexport)
+#    else
+#        define WINDOWSUTILS_API __declspec(dllimport)
+#    endif
+#elif !defined(WINDOWSUTILS_API)
+#    define WINDOWSUTILS_API
+#endif
+
+typedef enum _UTF_STATUS
+{
+    UTF_OK = 0,
+    UTF_INVALID_INPUT,    // malformed input, nothing after it was converted
+    UTF_BUFFER_TOO_SMALL, // output full, everything before it was converted
+} UTF_STATUS;
+
+// Lengths are in code units (bytes for UTF-8, 16-bit units for UTF-16), a NUL is converted
+// like any other character. On return *outputLength is the number of units written, on error
+// that's the output of the input before the failing character.
+WINDOWSUTILS_API
+UTF_STATUS Utf8ToUtf16(const char *input, size_t inputLength, uint16_t *output, size_t outputSize, size_t *outputLength);
+
+WINDOWSUTILS_API
+UTF_STATUS Utf16ToUtf8(const uint16_t *input, size_t inputLength, char *output, size_t outputSize, size_t *outputLength);
+
+// Lossy variants: instead of failing, replace invalid input with U+FFFD like MultiByteToWideChar/
+// WideCharToMultiByte without the *_ERR_INVALID_CHARS flags. In UTF-8 each maximal ill-formed
+// subpart (Unicode 3.9) becomes one U+FFFD, in UTF-16 each unpaired surrogate.
+// *replacements is the number of U+FFFD inserted. Never return UTF_INVALID_INPUT.
+WINDOWSUTILS_API
+UTF_STATUS Utf8ToUtf16Lossy(const char *input, size_t inputLength, uint16_t *output, size_t outputSize, size_t *outputLength,
+                            size_t *replacements);
+
+WINDOWSUTILS_API
+UTF_STATUS Utf16ToUtf8Lossy(const uint16_t *input, size_t inputLength, char *output, size_t outputSize, size_t *outputLength,
+                            size_t *replacements);
+
+// Validate the input and count the units the conversion would produce, without writing anything.
+// On error *outputLength is the output size of the input before the failing character.
+WINDOWSUTILS_API
+UTF_STATUS Utf8ToUtf16Length(const char *input, size_t inputLength, size_t *outputLength);
+
+WINDOWSUTILS_API
+UTF_STATUS Utf16ToUtf8Length(const uint16_t *input, size_t inputLength, size_t *outputLength);
+
+// Streaming UTF-8 -> UTF-16 conversion of input that arrives in chunks split at arbitrary byte
+// boundaries (pipes, vchan). A sequence cut at the end of a chunk is kept in the decoder and
+// completed by the next one.
+typedef struct _UTF8_DECODER
+{
+    uint8_t Pending[4];    // incomplete sequence from the previous chunk
+    uint8_t PendingLength;
+} UTF8_DECODER;
+
+WINDOWSUTILS_API
+void Utf8DecoderInit(UTF8_DECODER *decoder);
+
+// Convert a chunk. *inputUsed is the number of bytes consumed including a kept incomplete
+// sequence; with UTF_BUFFER_TOO_SMALL call again with the rest of the input once there's space.
+// UTF_INVALID_INPUT: *inputUsed is the offset of the malformed sequence (or 0 if it started
+// in a previous chunk).
+WINDOWSUTILS_API
+UTF_STATUS Utf8DecoderConvert(UTF8_DECODER *decoder, const char *input, size_t inputLength,
+                              uint16_t *output, size_t outputSize, size_t *inputUsed, size_t *outputLength);
+
+// End of stream: UTF_INVALID_INPUT if it ended inside a sequence. Resets the decoder.
+WINDOWSUTILS_API
+UTF_STATUS Utf8DecoderFinish(UTF8_DECODER *decoder);
+
+#ifdef __cplusplus
+}
+#endif
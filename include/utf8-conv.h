@@ -22,6 +22,9 @@
 #pragma once
 #include <windef.h>
 
+#include "buffer.h"
+#include "utf-simd.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,16 +39,37 @@ extern "C" {
 #define CONVERT_MAX_BUFFER_SIZE_UTF8   CONVERT_MAX_BUFFER_LENGTH
 #define CONVERT_MAX_BUFFER_SIZE_UTF16  (CONVERT_MAX_BUFFER_LENGTH * sizeof(WCHAR))
 
-// Uses a static output buffer that's overwritten with each call.
+// Uses a per-thread output buffer that's overwritten with each call from that thread
+// (and freed when the thread exits), threads can convert concurrently.
 // cchOutput is the number of characters in the output buffer, without terminating NULL.
 WINDOWSUTILS_API
 DWORD ConvertUTF8ToUTF16Static(IN const char *inputUtf8, OUT WCHAR **outputUtf16, OUT size_t *cchOutput OPTIONAL);
 
-// Uses a static output buffer that's overwritten with each call.
+// Uses a per-thread output buffer that's overwritten with each call from that thread
+// (and freed when the thread exits), threads can convert concurrently.
 // cchOutput is the number of characters in the output buffer, without terminating NULL.
 WINDOWSUTILS_API
 DWORD ConvertUTF16ToUTF8Static(IN const WCHAR *inputUtf16, OUT char **outputUtf8, OUT size_t *cchOutput OPTIONAL);
 
+// Converter context: output buffers owned by the caller instead of the thread, allocated
+// on first use and reused by later calls. A context must not be used by two threads at once.
+typedef struct _UTF_CONVERTER UTF_CONVERTER;
+
+WINDOWSUTILS_API
+UTF_CONVERTER *UtfConverterCreate(void);
+
+WINDOWSUTILS_API
+void UtfConverterDestroy(IN UTF_CONVERTER *converter OPTIONAL);
+
+// Same as the *Static functions, the output is valid until the next call with the same context.
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Context(IN UTF_CONVERTER *converter, IN const char *inputUtf8, OUT WCHAR **outputUtf16,
+                                OUT size_t *cchOutput OPTIONAL);
+
+WINDOWSUTILS_API
+DWORD ConvertUTF16ToUTF8Context(IN UTF_CONVERTER *converter, IN const WCHAR *inputUtf16, OUT char **outputUtf8,
+                                OUT size_t *cchOutput OPTIONAL);
+
 // outputUtf16 must be at least CONVERT_MAX_BUFFER_LENGTH WCHARs.
 // cchOutput is the number of characters in the output buffer, without terminating NULL.
 WINDOWSUTILS_API
@@ -56,6 +80,55 @@ DWORD ConvertUTF8ToUTF16(IN const char* inputUtf8, OUT WCHAR* outputUtf16, OUT s
 WINDOWSUTILS_API
 DWORD ConvertUTF16ToUTF8(IN const WCHAR* inputUtf16, OUT char* outputUtf8, OUT size_t* cchOutput OPTIONAL);
 
+// Length-delimited variants: no size limit, the input doesn't need to be NULL-terminated
+// and the output isn't (NULLs in the input are converted like other characters).
+// cchOutputSize is the size of the output buffer in characters,
+// cchOutput is the number of characters written.
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Ex(IN const char *inputUtf8, IN size_t cchInput, OUT WCHAR *outputUtf16, IN size_t cchOutputSize,
+                           OUT size_t *cchOutput OPTIONAL);
+
+WINDOWSUTILS_API
+DWORD ConvertUTF16ToUTF8Ex(IN const WCHAR *inputUtf16, IN size_t cchInput, OUT char *outputUtf8, IN size_t cchOutputSize,
+                           OUT size_t *cchOutput OPTIONAL);
+
+// Lossy variants of the above: invalid input is replaced with U+FFFD instead of failing
+// the whole conversion (see Utf8ToUtf16Lossy). cReplacements is the number of replacements.
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Lossy(IN const char *inputUtf8, IN size_t cchInput, OUT WCHAR *outputUtf16, IN size_t cchOutputSize,
+                              OUT size_t *cchOutput OPTIONAL, OUT size_t *cReplacements OPTIONAL);
+
+WINDOWSUTILS_API
+DWORD ConvertUTF16ToUTF8Lossy(IN const WCHAR *inputUtf16, IN size_t cchInput, OUT char *outputUtf8, IN size_t cchOutputSize,
+                              OUT size_t *cchOutput OPTIONAL, OUT size_t *cReplacements OPTIONAL);
+
+// Allocate an output buffer of the exact size (after a validating counting pass) and convert.
+// The output is NULL-terminated, cchOutput doesn't include the NULL. Free with free().
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Alloc(IN const char *inputUtf8, IN size_t cchInput, OUT WCHAR **outputUtf16, OUT size_t *cchOutput OPTIONAL);
+
+WINDOWSUTILS_API
+DWORD ConvertUTF16ToUTF8Alloc(IN const WCHAR *inputUtf16, IN size_t cchInput, OUT char **outputUtf8, OUT size_t *cchOutput OPTIONAL);
+
+// Streaming conversion of UTF-8 input that arrives in arbitrary chunks, a sequence split
+// between chunks is completed on the next call. Initialize the decoder with Utf8DecoderInit.
+// cchInputUsed is the number of bytes consumed, with ERROR_INSUFFICIENT_BUFFER call again
+// with the rest of the input once there's space for the output.
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Chunk(IN OUT UTF8_DECODER *decoder, IN const char *inputUtf8, IN size_t cchInput,
+                              OUT WCHAR *outputUtf16, IN size_t cchOutputSize, OUT size_t *cchInputUsed, OUT size_t *cchOutput);
+
+// Same as ConvertUTF8ToUTF16Chunk but the output is added to a queue (not CMQ_FLAG_MPSC) as it's
+// converted. ERROR_INSUFFICIENT_BUFFER: the queue is full, cchInputUsed is how far it got.
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Cmq(IN OUT UTF8_DECODER *decoder, IN const char *inputUtf8, IN size_t cchInput,
+                            IN CMQ_BUFFER *output, OUT size_t *cchInputUsed);
+
+// End of the stream: ERROR_NO_UNICODE_TRANSLATION if it ended in the middle of a sequence.
+// Resets the decoder.
+WINDOWSUTILS_API
+DWORD ConvertUTF8ToUTF16Finish(IN OUT UTF8_DECODER *decoder);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,228 +23,2945 @@
 #include "log.h"
 
 #include <stdlib.h>
+#include <malloc.h>
+#include <strsafe.h>
+
+#define CMQ_CACHE_LINE_SIZE 64
+
+// Maximum number of free CMQ_SEGMENT_SIZE segments kept for reuse by all elastic buffers.
+#define CMQ_SEGMENT_POOL_MAX 64
+
+// Spill storage is accessed through one mapped window per side instead of mapping the whole
+// temp file, which could take gigabytes of address space. Multiple of the allocation granularity.
+#define CMQ_SPILL_WINDOW_SIZE (4 * 1024 * 1024)
+
+// Per-operation tracing. Even a filtered out log call costs more than queueing a few bytes,
+// so it's only compiled in with CMQ_TRACE defined.
+#ifdef CMQ_TRACE
+#    define CmqTrace(format, ...) LogVerbose(format, ##__VA_ARGS__)
+#else
+#    define CmqTrace(format, ...)
+#endif
+
+// Internal flag: storage is a view of a temp file (spill storage of another buffer).
+#define CMQ_FLAG_SPILL_STORAGE 0x80000000
+
+// Internal flag: the buffer itself is a view of a named section (CmqCreateShared/CmqOpenShared).
+#define CMQ_FLAG_SHARED 0x40000000
+
+// Header of a write in a CMQ_FLAG_MPSC buffer. Writes start at multiples of the header size
+// (MpscHeaderSize) so headers never wrap around the storage end.
+typedef struct _CMQ_MPSC_HEADER
+{
+    UINT32 Size; // payload size
+    volatile LONG Busy; // set when space is claimed, cleared when the payload is complete
+} CMQ_MPSC_HEADER;
+
+// Header of a write in a CMQ_FLAG_MPSC | CMQ_FLAG_TIMESTAMPS buffer.
+typedef struct _CMQ_MPSC_STAMPED_HEADER
+{
+    CMQ_MPSC_HEADER Header;
+    LONG64 Time; // QPC when the payload was complete
+} CMQ_MPSC_STAMPED_HEADER;
+
+#define CMQ_MPSC_RECORD_SIZE(buffer, size) ((buffer)->MpscHeaderSize + (((size) + (buffer)->MpscHeaderSize - 1) & ~((buffer)->MpscHeaderSize - 1)))
+
+// Publish time of a chunk in a single-producer CMQ_FLAG_TIMESTAMPS buffer.
+typedef struct _CMQ_TIMESTAMP
+{
+    UINT64 End; // write count after the chunk
+    LONG64 Time; // QPC
+} CMQ_TIMESTAMP;
+
+// Timestamp ring size of single-producer buffers: chunks published while that many are queued aren't timestamped.
+#define CMQ_TIMESTAMP_COUNT 1024
+
+// Storage segment of an elastic buffer. Segment N holds stream bytes [N * SegmentSize, (N + 1) * SegmentSize).
+typedef struct _CMQ_SEGMENT
+{
+    SLIST_ENTRY PoolEntry; // must be first (alignment)
+    struct _CMQ_SEGMENT *volatile Next;
+    BYTE *Data;
+} CMQ_SEGMENT;
+
+// Consumer position in the segment chain kept across reads of one batch, so walking records
+// doesn't restart from the head segment for every header. Zero-initialize before the first read.
+typedef struct _CMQ_READ_CURSOR
+{
+    CMQ_SEGMENT *Segment; // NULL: start at the head segment
+    UINT64 Index;
+} CMQ_READ_CURSOR;
+
+// Mapped part of the spill storage: [Offset, Offset + CMQ_SPILL_WINDOW_SIZE) or less at the storage end.
+typedef struct _CMQ_SPILL_WINDOW
+{
+    BYTE *View; // NULL if nothing is mapped
+    UINT64 Offset;
+} CMQ_SPILL_WINDOW;
+
+// CmqGetStats counters of a producer. Multi-producer buffers have CMQ_STATS_SHARDS of them,
+// each on its own cache lines, and a producer updates the one its thread ID hashes to,
+// so producers don't convoy on shared counters.
+typedef struct _CMQ_STATS_SHARD
+{
+    volatile LONG64 BytesIn;
+    volatile LONG64 FailedAdds;
+    volatile LONG64 HighWatermark;
+    volatile LONG64 Histogram[CMQ_STATS_BUCKETS];
+    BYTE Padding[2 * CMQ_CACHE_LINE_SIZE - (3 + CMQ_STATS_BUCKETS) * sizeof(LONG64)];
+} CMQ_STATS_SHARD;
+
+#define CMQ_STATS_SHARD_BITS 4
+#define CMQ_STATS_SHARDS (1 << CMQ_STATS_SHARD_BITS)
 
 // internal data structure
 struct _CMQ_BUFFER
 {
-    UINT64 Size;       // buffer size
-    BYTE *BufferStart; // start of storage memory
-    BYTE *DataStart;   // pointer to the first byte of data. null = buffer empty
-    BYTE *DataEnd;     // pointer to the last data byte
+    UINT64 Size;       // buffer size (maximum queued data for elastic buffers)
+    BYTE *BufferStart; // start of storage memory (NULL for elastic buffers)
+    DWORD Flags;       // CMQ_FLAG_*
+    UINT64 SegmentSize; // elastic buffers: bytes per segment
+    volatile LONG WaitsAborted; // set by CmqAbortWaits
+    struct _CMQ_POOL *Pool; // buffer and storage are a slab of this pool
+    UINT64 MpscHeaderSize; // CMQ_FLAG_MPSC: size (and alignment) of write headers
+    CMQ_STATS_SHARD *StatShards; // CMQ_FLAG_MPSC: producer statistics, NULL: ProducerStats
+    // occupancy histogram bucket without a division, see CmqStatsBucket
+    UINT64 StatsScale;
+    // CMQ_FLAG_TIMESTAMPS: single-producer buffers keep timestamps of chunks in a ring,
+    // entries [TimestampRead, TimestampWrite) are valid
+    CMQ_TIMESTAMP *Timestamps;
+    LONG64 TimestampFrequency; // QPC ticks per second
+    volatile LONG64 Ttl; // QPC ticks, 0 = no expiry
+
+    // Overflow storage (see CmqSetSpillSize), created by the producer on first use.
+    // Once it holds any data, the producer keeps appending there until the consumer drains it,
+    // so anything in the main storage is older than anything in the spill storage.
+    UINT64 SpillSize;
+    struct _CMQ_BUFFER *volatile Spill;
+    HANDLE SpillFile; // spill storage only: backing temp file
+    HANDLE SpillSection; // spill storage only: section of SpillFile, mapped by windows
+    volatile LONG Spilling; // set while the spill storage holds data
+    volatile LONG64 SpillStartTime; // QPC, start of the current spill
+
+    // Both counters only grow, storage offset of a counter is (counter % Size).
+    // ReadCount is only written by the consumer and WriteCount only by the producer,
+    // so one producer and one consumer thread can work concurrently without a lock.
+    // Keep them on separate cache lines so the two sides don't bounce one line between them.
+    BYTE Padding1[CMQ_CACHE_LINE_SIZE];
+    volatile LONG64 ReadCount;  // total bytes consumed
+    // Consumer's segment, advanced lazily: it holds the last consumed byte until
+    // a byte in a later segment is consumed. Segments before it are freed.
+    CMQ_SEGMENT *HeadSegment;
+    UINT64 HeadIndex;
+    // Threads blocked in CmqWaitForSpace. The consumer only bumps SpaceSignal (waited on)
+    // if there are any, so there is no wakeup cost when nobody waits.
+    volatile LONG SpaceWaiters;
+    volatile LONG SpaceSignal;
+    UINT64 ReadOffset; // MPSC: payload bytes already consumed from the write at ReadCount
+    volatile LONG64 MpscConsumed; // MPSC: payload bytes consumed (or dropped) from the main storage
+    // CMQ_FLAG_TIMESTAMPS, consumer side: timestamps retired so far, end of the last retired chunk
+    // and CmqGetLatencyStats counters
+    volatile LONG64 TimestampRead;
+    UINT64 ChunkStart;
+    volatile LONG64 Chunks;
+    volatile LONG64 TotalDelay; // QPC ticks
+    volatile LONG64 MaxDelay;   // QPC ticks
+    volatile LONG64 DroppedChunks;
+    volatile LONG64 DroppedBytes;
+    volatile LONG64 DelayHistogram[CMQ_LATENCY_BUCKETS];
+    volatile LONG64 SpillTime; // QPC ticks spent spilling (finished spills)
+    volatile LONG64 ReadHistogram[CMQ_STATS_BUCKETS]; // CmqGetStats: releases per occupancy bucket
+    CMQ_SPILL_WINDOW ReadWindow; // spill storage: consumer's window
+    BYTE Padding2[CMQ_CACHE_LINE_SIZE];
+    volatile LONG64 WriteCount; // total bytes produced
+    // Producer's segment, holds the last produced byte. Later segments may be already linked
+    // (allocated by CmqReserve but not committed yet).
+    CMQ_SEGMENT *TailSegment;
+    UINT64 TailIndex;
+    // Same as above for CmqWaitForData.
+    volatile LONG DataWaiters;
+    volatile LONG DataSignal;
+    BOOL ReserveSpill; // last CmqReserve returned spill storage
+    UINT64 ReservedSize; // size returned by the last CmqReserve, upper bound for CmqCommit
+    CMQ_SPILL_WINDOW WriteWindow; // spill storage: producer's window
+    // MPSC: producers claim space (advance WriteCount) under ClaimLock and use the spill storage
+    // under SpillLock
+    SRWLOCK ClaimLock;
+    SRWLOCK SpillLock;
+    volatile LONG64 SpilledBytes; // total bytes written to the spill storage
+    volatile LONG64 SpillCount; // number of times the spill storage started to fill
+    // CmqGetStats counters, producer side only so the consumer doesn't pay for them
+    CMQ_STATS_SHARD ProducerStats;
+    // CMQ_FLAG_TIMESTAMPS, producer side
+    volatile LONG64 TimestampWrite;
+    volatile LONG64 UntrackedChunks;
+    BYTE Padding3[CMQ_CACHE_LINE_SIZE];
+};
+
+// Shared buffer layout: CMQ_BUFFER, CMQ_SHARED_HEADER, storage at CMQ_SHARED_STORAGE_OFFSET.
+// Only fields that don't point into a process are used in shared buffers.
+typedef struct _CMQ_SHARED_HEADER
+{
+    volatile LONG Magic; // written last by the creator
+    UINT32 BufferSize;   // sizeof(CMQ_BUFFER), both processes need the same layout
+    WCHAR Name[MAX_PATH]; // section name, wait events are named after it (see CMQ_SHARED_EVENTS)
+} CMQ_SHARED_HEADER;
+
+#define CMQ_SHARED_MAGIC 0x53514d43 // 'CMQS'
+#define CMQ_SHARED_STORAGE_OFFSET ((sizeof(CMQ_BUFFER) + sizeof(CMQ_SHARED_HEADER) + CMQ_CACHE_LINE_SIZE - 1) & ~((SIZE_T) CMQ_CACHE_LINE_SIZE - 1))
+
+// storage of ring buffers, a shared buffer is mapped at different addresses in each process
+static BYTE *CmqStorage(IN const CMQ_BUFFER *buffer)
+{
+    if (buffer->Flags & CMQ_FLAG_SHARED)
+        return (BYTE *) buffer + CMQ_SHARED_STORAGE_OFFSET;
+    return buffer->BufferStart;
+}
+
+// Buffer pool, a slab is the CMQ_BUFFER followed by storage at SlabHeaderSize.
+// Free slabs are linked through their first bytes.
+struct _CMQ_POOL
+{
+    SLIST_HEADER FreeSlabs; // must be first (alignment)
+    UINT64 BufferSize;
+    SIZE_T SlabSize;
+    SIZE_T SlabHeaderSize;
+    DWORD MaxFree;
+    BOOL LargePages;
+    volatile LONG64 Allocated;
+    volatile LONG64 Released;
+    volatile LONG64 Reused;
+    volatile LONG64 InUse;
 };
 
+// Wait events of shared buffers mapped in this process. Handles are only valid in the process that
+// owns them, so they're kept here rather than in the section: the creator's entry holds the events
+// it created, CmqOpenShared opens them by name once. An open handle keeps an event alive even after
+// the creator is gone.
+typedef struct _CMQ_SHARED_EVENTS
+{
+    struct _CMQ_SHARED_EVENTS *Next;
+    const CMQ_BUFFER *View;
+    HANDLE Events[2]; // space, data, NULL if they were gone when the view was opened
+    DWORD Error; // OpenEvent error in that case
+} CMQ_SHARED_EVENTS;
+
+static CMQ_SHARED_EVENTS *g_SharedEvents;
+static SRWLOCK g_SharedEventsLock = SRWLOCK_INIT;
+
+static void CmqSharedEventName(IN const CMQ_SHARED_HEADER *header, IN BOOL data, OUT WCHAR name[MAX_PATH + 8])
+{
+    StringCchPrintfW(name, MAX_PATH + 8, L"%s-%s", header->Name, data ? L"data" : L"space");
+}
+
+// take over the wait events of a view until CmqDestroy
+static BOOL CmqSharedEventsAdd(IN const CMQ_BUFFER *buffer, IN HANDLE events[2], IN DWORD error)
+{
+    CMQ_SHARED_EVENTS *entry = (CMQ_SHARED_EVENTS *) malloc(sizeof(CMQ_SHARED_EVENTS));
+
+    if (!entry)
+    {
+        LogError("out of memory");
+        return FALSE;
+    }
+
+    entry->View = buffer;
+    entry->Events[0] = events[0];
+    entry->Events[1] = events[1];
+    entry->Error = error;
+    AcquireSRWLockExclusive(&g_SharedEventsLock);
+    entry->Next = g_SharedEvents;
+    g_SharedEvents = entry;
+    ReleaseSRWLockExclusive(&g_SharedEventsLock);
+    return TRUE;
+}
+
+// Get a wait event of a shared buffer view, NULL (and the error in GetLastError) if the events
+// were gone when it was opened. That was logged once then, callers don't log again.
+static HANDLE CmqSharedEvent(IN const CMQ_BUFFER *buffer, IN BOOL data)
+{
+    CMQ_SHARED_EVENTS *entry;
+    HANDLE event = NULL;
+    DWORD error = ERROR_INVALID_HANDLE;
+
+    AcquireSRWLockShared(&g_SharedEventsLock);
+    for (entry = g_SharedEvents; entry; entry = entry->Next)
+    {
+        if (entry->View == buffer)
+        {
+            event = entry->Events[data ? 1 : 0];
+            error = entry->Error;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&g_SharedEventsLock);
+
+    if (!event)
+        SetLastError(error);
+    return event;
+}
+
+// close the wait events of a shared buffer view
+static void CmqSharedEventsRelease(IN const CMQ_BUFFER *buffer)
+{
+    CMQ_SHARED_EVENTS **link, *entry = NULL;
+
+    AcquireSRWLockExclusive(&g_SharedEventsLock);
+    for (link = &g_SharedEvents; *link; link = &(*link)->Next)
+    {
+        if ((*link)->View == buffer)
+        {
+            entry = *link;
+            *link = entry->Next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_SharedEventsLock);
+
+    if (!entry)
+        return;
+
+    if (entry->Events[0])
+        CloseHandle(entry->Events[0]);
+    if (entry->Events[1])
+        CloseHandle(entry->Events[1]);
+    free(entry);
+}
+
+// free CMQ_SEGMENT_SIZE segments shared by all elastic buffers
+static SLIST_HEADER g_SegmentPool;
+static INIT_ONCE g_SegmentPoolInit = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK CmqInitSegmentPool(PINIT_ONCE initOnce, PVOID param, PVOID *context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(param);
+    UNREFERENCED_PARAMETER(context);
+
+    InitializeSListHead(&g_SegmentPool);
+    return TRUE;
+}
+
+static CMQ_SEGMENT *CmqAllocSegment(IN const CMQ_BUFFER *buffer)
+{
+    CMQ_SEGMENT *segment = NULL;
+
+    if (buffer->SegmentSize == CMQ_SEGMENT_SIZE)
+        segment = (CMQ_SEGMENT *) InterlockedPopEntrySList(&g_SegmentPool);
+
+    if (!segment)
+    {
+        segment = (CMQ_SEGMENT *) _aligned_malloc(sizeof(CMQ_SEGMENT) + (size_t) buffer->SegmentSize, MEMORY_ALLOCATION_ALIGNMENT);
+        if (!segment)
+        {
+            LogWarning("%p: out of memory", buffer);
+            return NULL;
+        }
+        segment->Data = (BYTE *) (segment + 1);
+    }
+
+    segment->Next = NULL;
+    return segment;
+}
+
+// return the segment to the shared pool, or to the heap if the pool is full
+static void CmqFreeSegment(IN const CMQ_BUFFER *buffer, IN CMQ_SEGMENT *segment)
+{
+    if (buffer->SegmentSize == CMQ_SEGMENT_SIZE && QueryDepthSList(&g_SegmentPool) < CMQ_SEGMENT_POOL_MAX)
+        InterlockedPushEntrySList(&g_SegmentPool, &segment->PoolEntry);
+    else
+        _aligned_free(segment);
+}
+
+static BYTE *CmqPoolAllocSlab(IN CMQ_POOL *pool)
+{
+    BYTE *slab = NULL;
+
+    if (pool->LargePages)
+    {
+        slab = (BYTE *) VirtualAlloc(NULL, pool->SlabSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (!slab)
+            LogWarning("%p: large page allocation failed (%lu), using normal pages", pool, GetLastError());
+    }
+
+    if (!slab)
+        slab = (BYTE *) VirtualAlloc(NULL, pool->SlabSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (!slab)
+    {
+        LogWarning("%p: out of memory", pool);
+        return NULL;
+    }
+
+    InterlockedIncrement64(&pool->Allocated);
+    return slab;
+}
+
+// return the slab to the free list, or to the system if the list is full
+static void CmqPoolFreeSlab(IN CMQ_POOL *pool, IN BYTE *slab)
+{
+    if (QueryDepthSList(&pool->FreeSlabs) < pool->MaxFree)
+    {
+        InterlockedPushEntrySList(&pool->FreeSlabs, (PSLIST_ENTRY) slab);
+    }
+    else
+    {
+        VirtualFree(slab, 0, MEM_RELEASE);
+        InterlockedIncrement64(&pool->Released);
+    }
+}
+
+typedef PVOID (WINAPI *PFN_VIRTUALALLOC2)(HANDLE, PVOID, SIZE_T, ULONG, ULONG, MEM_EXTENDED_PARAMETER *, ULONG);
+typedef PVOID (WINAPI *PFN_MAPVIEWOFFILE3)(HANDLE, HANDLE, PVOID, ULONG64, SIZE_T, ULONG, ULONG, MEM_EXTENDED_PARAMETER *, ULONG);
+
+// Map the same section twice back to back, storage at BufferStart + Size aliases BufferStart.
+// Placeholder APIs are only present on Windows 10 1803+, resolve them dynamically.
+static BOOL CmqMapMirrored(IN OUT CMQ_BUFFER *buffer)
+{
+    PFN_VIRTUALALLOC2 virtualAlloc2;
+    PFN_MAPVIEWOFFILE3 mapViewOfFile3;
+    HMODULE kernelBase;
+    SYSTEM_INFO si;
+    HANDLE section = NULL;
+    BYTE *placeholder1 = NULL;
+    BYTE *placeholder2 = NULL;
+    BYTE *view1 = NULL;
+    BYTE *view2 = NULL;
+    UINT64 size;
+
+    kernelBase = GetModuleHandle(L"kernelbase.dll");
+    if (!kernelBase)
+        return FALSE;
+
+    virtualAlloc2 = (PFN_VIRTUALALLOC2) GetProcAddress(kernelBase, "VirtualAlloc2");
+    mapViewOfFile3 = (PFN_MAPVIEWOFFILE3) GetProcAddress(kernelBase, "MapViewOfFile3");
+    if (!virtualAlloc2 || !mapViewOfFile3)
+    {
+        LogDebug("placeholder mappings not supported");
+        return FALSE;
+    }
+
+    GetSystemInfo(&si);
+    size = (buffer->Size + si.dwAllocationGranularity - 1) & ~((UINT64) si.dwAllocationGranularity - 1);
+
+    // reserve address space for both views and split it into two placeholders
+    placeholder1 = (BYTE *) virtualAlloc2(NULL, NULL, (SIZE_T) (2 * size), MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, NULL, 0);
+    if (!placeholder1)
+    {
+        win_perror("VirtualAlloc2");
+        goto fail;
+    }
+
+    if (!VirtualFree(placeholder1, (SIZE_T) size, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+    {
+        win_perror("VirtualFree(split placeholder)");
+        goto fail;
+    }
+    placeholder2 = placeholder1 + size;
+
+    section = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, NULL);
+    if (!section)
+    {
+        win_perror("CreateFileMapping");
+        goto fail;
+    }
+
+    view1 = (BYTE *) mapViewOfFile3(section, NULL, placeholder1, 0, (SIZE_T) size, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, NULL, 0);
+    if (!view1)
+    {
+        win_perror("MapViewOfFile3(1)");
+        goto fail;
+    }
+    placeholder1 = NULL;
+
+    view2 = (BYTE *) mapViewOfFile3(section, NULL, placeholder2, 0, (SIZE_T) size, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, NULL, 0);
+    if (!view2)
+    {
+        win_perror("MapViewOfFile3(2)");
+        goto fail;
+    }
+
+    // views keep the section alive
+    CloseHandle(section);
+
+    buffer->Size = size;
+    buffer->BufferStart = view1;
+    return TRUE;
+
+fail:
+    if (view1)
+        UnmapViewOfFile(view1);
+    if (placeholder1)
+        VirtualFree(placeholder1, 0, MEM_RELEASE);
+    if (placeholder2)
+        VirtualFree(placeholder2, 0, MEM_RELEASE);
+    if (section)
+        CloseHandle(section);
+    return FALSE;
+}
+
+// Fixed-point bits of StatsScale: (CMQ_STATS_BUCKETS - 1) << CMQ_STATS_SCALE_BITS still fits 64 bits,
+// and so does occupancy * StatsScale as long as occupancy <= Size.
+#define CMQ_STATS_SCALE_BITS 59
+
+// Once the storage size is final: occupancy buckets are a multiplication by the reciprocal of the size,
+// rounded up so exact 10% steps land in the upper bucket. The rounding error is below a byte
+// for sizes up to 2GB.
+static void CmqInitStatsScale(IN OUT CMQ_BUFFER *buffer)
+{
+    buffer->StatsScale = (((UINT64) (CMQ_STATS_BUCKETS - 1) << CMQ_STATS_SCALE_BITS) + buffer->Size - 1) / buffer->Size;
+}
+
+// occupancy (bytes in the storage) to a histogram bucket, CMQ_STATS_BUCKETS - 1 is for spilling
+static UINT32 CmqStatsBucket(IN const CMQ_BUFFER *buffer, IN UINT64 occupancy)
+{
+    UINT64 bucket = (occupancy * buffer->StatsScale) >> CMQ_STATS_SCALE_BITS;
+
+    return (UINT32) min(bucket, (UINT64) CMQ_STATS_BUCKETS - 2);
+}
+
+// Create spill storage backed by a temp file. The file is deleted when closed and marked
+// temporary and sparse, so pages only reach the disk under memory pressure.
+static CMQ_BUFFER *CmqCreateSpill(IN UINT64 size)
+{
+    WCHAR tempDir[MAX_PATH + 1];
+    WCHAR tempPath[MAX_PATH + 1];
+    CMQ_BUFFER *spill = NULL;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE section = NULL;
+    DWORD returned;
+
+    if (!GetTempPath(ARRAYSIZE(tempDir), tempDir) || !GetTempFileName(tempDir, L"cmq", 0, tempPath))
+    {
+        win_perror("GetTempFileName");
+        return NULL;
+    }
+
+    file = CreateFile(tempPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                      FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        win_perror("CreateFile");
+        DeleteFile(tempPath);
+        return NULL;
+    }
+
+    if (!DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL))
+        LogDebug("failed to make '%s' sparse", tempPath);
+
+    section = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, NULL);
+    if (!section)
+    {
+        win_perror("CreateFileMapping");
+        goto fail;
+    }
+
+    spill = (CMQ_BUFFER *) malloc(sizeof(CMQ_BUFFER));
+    if (!spill)
+    {
+        LogError("out of memory");
+        goto fail;
+    }
+
+    ZeroMemory(spill, sizeof(CMQ_BUFFER));
+    spill->Size = size;
+    spill->Flags = CMQ_FLAG_SPILL_STORAGE;
+    spill->SpillFile = file;
+    spill->SpillSection = section; // windows are mapped on first access
+    CmqInitStatsScale(spill);
+
+    LogDebug("created spill storage %p (0x%llx bytes) in '%s'", spill, size, tempPath);
+    return spill;
+
+fail:
+    if (section)
+        CloseHandle(section);
+    CloseHandle(file);
+    return NULL;
+}
+
+static BOOL CmqInitMpsc(IN OUT CMQ_BUFFER *buffer, IN DWORD flags)
+{
+    buffer->StatShards = (CMQ_STATS_SHARD *) _aligned_malloc(CMQ_STATS_SHARDS * sizeof(CMQ_STATS_SHARD), CMQ_CACHE_LINE_SIZE);
+    if (!buffer->StatShards)
+        return FALSE;
+    ZeroMemory(buffer->StatShards, CMQ_STATS_SHARDS * sizeof(CMQ_STATS_SHARD));
+
+    buffer->MpscHeaderSize = (flags & CMQ_FLAG_TIMESTAMPS) ? sizeof(CMQ_MPSC_STAMPED_HEADER) : sizeof(CMQ_MPSC_HEADER);
+    // no partial headers at the storage end
+    buffer->Size = (buffer->Size + buffer->MpscHeaderSize - 1) & ~(buffer->MpscHeaderSize - 1);
+    buffer->Flags |= CMQ_FLAG_MPSC;
+    InitializeSRWLock(&buffer->ClaimLock);
+    InitializeSRWLock(&buffer->SpillLock);
+    return TRUE;
+}
+
+// after CmqInitMpsc
+static BOOL CmqInitTimestamps(IN OUT CMQ_BUFFER *buffer)
+{
+    LARGE_INTEGER frequency;
+
+    // multi-producer buffers keep timestamps in write headers
+    if (!(buffer->Flags & CMQ_FLAG_MPSC))
+    {
+        buffer->Timestamps = (CMQ_TIMESTAMP *) malloc(CMQ_TIMESTAMP_COUNT * sizeof(CMQ_TIMESTAMP));
+        if (!buffer->Timestamps)
+            return FALSE;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    buffer->TimestampFrequency = frequency.QuadPart;
+    buffer->Flags |= CMQ_FLAG_TIMESTAMPS;
+    return TRUE;
+}
+
+// producer side: statistics counters of the calling producer
+static CMQ_STATS_SHARD *CmqStatShard(IN CMQ_BUFFER *buffer)
+{
+    if (!buffer->StatShards)
+        return &buffer->ProducerStats;
+    // Fibonacci hashing, Windows thread IDs are multiples of 4
+    return &buffer->StatShards[(GetCurrentThreadId() * 2654435761u) >> (32 - CMQ_STATS_SHARD_BITS)];
+}
+
+// sum of all producers' counters, HighWatermark is the largest one
+static void CmqSumStats(IN const CMQ_BUFFER *buffer, OUT CMQ_STATS_SHARD *total)
+{
+    const CMQ_STATS_SHARD *shard;
+    UINT32 count = buffer->StatShards ? CMQ_STATS_SHARDS : 1;
+    UINT32 i, j;
+
+    ZeroMemory(total, sizeof(*total));
+    for (i = 0; i < count; i++)
+    {
+        shard = buffer->StatShards ? &buffer->StatShards[i] : &buffer->ProducerStats;
+        total->BytesIn += ReadNoFence64(&shard->BytesIn);
+        total->FailedAdds += ReadNoFence64(&shard->FailedAdds);
+        total->HighWatermark = max(total->HighWatermark, ReadNoFence64(&shard->HighWatermark));
+        for (j = 0; j < CMQ_STATS_BUCKETS; j++)
+            total->Histogram[j] += ReadNoFence64(&shard->Histogram[j]);
+    }
+}
+
 // allocate memory and set variables
+CMQ_BUFFER *CmqCreateEx(IN UINT64 bufferSize, IN DWORD flags)
+{
+    CMQ_BUFFER *buffer = NULL;
+    LogDebug("size: 0x%llx bytes, flags 0x%lx", bufferSize, flags);
+
+    if (bufferSize == 0)
+    {
+        LogWarning("size == 0");
+        return NULL;
+    }
+
+    buffer = (CMQ_BUFFER *) malloc(sizeof(CMQ_BUFFER));
+    if (!buffer)
+    {
+        LogError("out of memory");
+        return NULL;
+    }
+
+    ZeroMemory(buffer, sizeof(CMQ_BUFFER));
+    buffer->Size = bufferSize;
+
+    if (flags & CMQ_FLAG_MPSC)
+    {
+        if (flags & CMQ_FLAG_ELASTIC)
+        {
+            LogWarning("elastic storage is not supported for multi-producer buffers, ignoring");
+            flags &= ~CMQ_FLAG_ELASTIC;
+        }
+
+        if (!CmqInitMpsc(buffer, flags))
+        {
+            free(buffer);
+            LogError("out of memory");
+            return NULL;
+        }
+    }
+
+    if ((flags & CMQ_FLAG_TIMESTAMPS) && !CmqInitTimestamps(buffer))
+    {
+        _aligned_free(buffer->StatShards);
+        free(buffer);
+        LogError("out of memory");
+        return NULL;
+    }
+
+    if (flags & CMQ_FLAG_ELASTIC)
+    {
+        if (flags & CMQ_FLAG_MIRRORED)
+            LogWarning("mirrored storage is not supported for elastic buffers, ignoring");
+
+        InitOnceExecuteOnce(&g_SegmentPoolInit, CmqInitSegmentPool, NULL, NULL);
+        buffer->Flags |= CMQ_FLAG_ELASTIC;
+        buffer->SegmentSize = min(bufferSize, CMQ_SEGMENT_SIZE);
+        buffer->HeadSegment = buffer->TailSegment = CmqAllocSegment(buffer);
+        if (!buffer->HeadSegment)
+        {
+            free(buffer->Timestamps);
+            free(buffer);
+            LogError("out of memory");
+            return NULL;
+        }
+
+        CmqInitStatsScale(buffer);
+        LogDebug("created %p (elastic)", buffer);
+        return buffer;
+    }
+
+    if (flags & CMQ_FLAG_MIRRORED)
+    {
+        if (CmqMapMirrored(buffer))
+        {
+            buffer->Flags |= CMQ_FLAG_MIRRORED;
+        }
+        else
+        {
+            LogWarning("mirrored mapping not available, using normal storage");
+        }
+    }
+
+    if (!(buffer->Flags & CMQ_FLAG_MIRRORED))
+    {
+        buffer->BufferStart = (BYTE *) malloc(buffer->Size);
+        if (buffer->BufferStart == 0)
+        {
+            free(buffer->Timestamps);
+            _aligned_free(buffer->StatShards);
+            free(buffer);
+            LogError("out of memory");
+            return NULL;
+        }
+    }
+
+    CmqInitStatsScale(buffer);
+    LogDebug("created %p", buffer);
+    return buffer;
+}
+
 CMQ_BUFFER *CmqCreate(IN UINT64 bufferSize)
 {
-    CMQ_BUFFER *buffer = NULL;
-    LogDebug("size: 0x%llx bytes", bufferSize);
+    return CmqCreateEx(bufferSize, 0);
+}
+
+// free memory and deinitialize
+void CmqDestroy(IN CMQ_BUFFER *buffer)
+{
+    CMQ_SEGMENT *segment, *next;
+
+    LogDebug("%p", buffer);
+
+    if (buffer->Spill)
+        CmqDestroy(buffer->Spill);
+
+    free(buffer->Timestamps);
+    _aligned_free(buffer->StatShards);
+
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+    {
+        // free everything including segments linked by CmqReserve but not used yet
+        for (segment = buffer->HeadSegment; segment; segment = next)
+        {
+            next = segment->Next;
+            CmqFreeSegment(buffer, segment);
+        }
+    }
+    else if (buffer->Flags & CMQ_FLAG_MIRRORED)
+    {
+        UnmapViewOfFile(buffer->BufferStart + buffer->Size);
+        UnmapViewOfFile(buffer->BufferStart);
+    }
+    else if (buffer->Flags & CMQ_FLAG_SPILL_STORAGE)
+    {
+        if (buffer->ReadWindow.View)
+            UnmapViewOfFile(buffer->ReadWindow.View);
+        if (buffer->WriteWindow.View)
+            UnmapViewOfFile(buffer->WriteWindow.View);
+        CloseHandle(buffer->SpillSection);
+        CloseHandle(buffer->SpillFile); // deletes the file
+    }
+    else if (buffer->Flags & CMQ_FLAG_SHARED)
+    {
+        CmqSharedEventsRelease(buffer);
+        // the buffer itself is part of the view
+        UnmapViewOfFile(buffer);
+        return;
+    }
+    else if (buffer->Pool)
+    {
+        // the buffer itself is part of the slab
+        InterlockedDecrement64(&buffer->Pool->InUse);
+        CmqPoolFreeSlab(buffer->Pool, (BYTE *) buffer);
+        return;
+    }
+    else
+    {
+        free(buffer->BufferStart);
+    }
+    free(buffer);
+}
+
+DWORD CmqGetFlags(IN const CMQ_BUFFER *buffer)
+{
+    return buffer->Flags;
+}
+
+// zero-fill buffer, rewind internal pointer
+void CmqClear(IN CMQ_BUFFER *buffer)
+{
+    CMQ_SEGMENT *segment, *next;
+    CMQ_STATS_SHARD total;
+
+    LogDebug("%p", buffer);
+
+    WriteNoFence64(&buffer->ReadCount, 0);
+    WriteNoFence64(&buffer->WriteCount, 0);
+    buffer->ReadOffset = 0;
+    WriteNoFence64(&buffer->TimestampRead, 0);
+    WriteNoFence64(&buffer->TimestampWrite, 0);
+    buffer->ChunkStart = 0;
+    if (buffer->Spill)
+    {
+        CmqClear(buffer->Spill);
+        buffer->Spilling = 0;
+    }
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        // everything added so far is gone, see CmqGetUsedSize
+        CmqSumStats(buffer, &total);
+        WriteNoFence64(&buffer->MpscConsumed, total.BytesIn - ReadNoFence64(&buffer->SpilledBytes));
+    }
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+    {
+        // keep just the first segment
+        for (segment = buffer->HeadSegment->Next; segment; segment = next)
+        {
+            next = segment->Next;
+            CmqFreeSegment(buffer, segment);
+        }
+        buffer->HeadSegment->Next = NULL;
+        buffer->TailSegment = buffer->HeadSegment;
+        buffer->HeadIndex = buffer->TailIndex = 0;
+        ZeroMemory(buffer->HeadSegment->Data, buffer->SegmentSize);
+    }
+    else if (!(buffer->Flags & CMQ_FLAG_SPILL_STORAGE)) // don't pull the whole temp file into memory
+    {
+        ZeroMemory(CmqStorage(buffer), buffer->Size);
+    }
+}
+
+// copy data into the storage starting at the position of the 'counter' byte, wrapping if needed
+static void CmqRingCopyIn(IN CMQ_BUFFER *buffer, IN UINT64 counter, IN const BYTE *data, IN UINT64 dataSize)
+{
+    UINT64 offset = counter % buffer->Size;
+    UINT64 toEnd = buffer->Size - offset;
+
+    if (dataSize <= toEnd || (buffer->Flags & CMQ_FLAG_MIRRORED))
+    {
+        memcpy(CmqStorage(buffer) + offset, data, dataSize);
+    }
+    else
+    {
+        memcpy(CmqStorage(buffer) + offset, data, toEnd);
+        memcpy(CmqStorage(buffer), data + toEnd, dataSize - toEnd);
+    }
+}
+
+// copy data out of the storage starting at the position of the 'counter' byte, wrapping if needed
+static void CmqRingCopyOut(IN const CMQ_BUFFER *buffer, IN UINT64 counter, OUT BYTE *data, IN UINT64 dataSize)
+{
+    UINT64 offset = counter % buffer->Size;
+    UINT64 toEnd = buffer->Size - offset;
+
+    if (dataSize <= toEnd || (buffer->Flags & CMQ_FLAG_MIRRORED))
+    {
+        memcpy(data, CmqStorage(buffer) + offset, dataSize);
+    }
+    else
+    {
+        memcpy(data, CmqStorage(buffer) + offset, toEnd);
+        memcpy(data + toEnd, CmqStorage(buffer), dataSize - toEnd);
+    }
+}
+
+// split 'size' bytes of storage starting at the position of the 'counter' byte into (up to) two spans
+static void CmqRingSpans(IN const CMQ_BUFFER *buffer, IN UINT64 counter, IN UINT64 size, OUT CMQ_SPAN spans[2])
+{
+    UINT64 offset = counter % buffer->Size;
+    UINT64 toEnd = buffer->Size - offset;
+
+    spans[0].Data = CmqStorage(buffer) + offset;
+    if (size <= toEnd || (buffer->Flags & CMQ_FLAG_MIRRORED))
+    {
+        spans[0].Size = size;
+        spans[1].Data = NULL;
+        spans[1].Size = 0;
+    }
+    else
+    {
+        spans[0].Size = toEnd;
+        spans[1].Data = CmqStorage(buffer);
+        spans[1].Size = size - toEnd;
+    }
+}
+
+// map the window of spill storage holding the 'counter' byte (unless it's mapped already),
+// returns the byte's address and the number of bytes up to the window end, NULL on failure
+static BYTE *CmqSpillMap(IN const CMQ_BUFFER *spill, IN OUT CMQ_SPILL_WINDOW *window, IN UINT64 counter, OUT UINT64 *available)
+{
+    UINT64 offset = counter % spill->Size;
+    UINT64 windowOffset = offset - offset % CMQ_SPILL_WINDOW_SIZE;
+    UINT64 windowSize = min(CMQ_SPILL_WINDOW_SIZE, spill->Size - windowOffset);
+
+    if (!window->View || window->Offset != windowOffset)
+    {
+        if (window->View)
+            UnmapViewOfFile(window->View);
+
+        window->View = (BYTE *) MapViewOfFile(spill->SpillSection, FILE_MAP_WRITE, (DWORD) (windowOffset >> 32),
+                                              (DWORD) windowOffset, (SIZE_T) windowSize);
+        if (!window->View)
+        {
+            win_perror("MapViewOfFile");
+            return NULL;
+        }
+        window->Offset = windowOffset;
+    }
+
+    *available = windowSize - (offset - windowOffset);
+    return window->View + (offset - windowOffset);
+}
+
+// spill storage version of CmqRingCopyIn, FALSE if the storage can't be mapped
+static BOOL CmqSpillCopyIn(IN CMQ_BUFFER *spill, IN UINT64 counter, IN const BYTE *data, IN UINT64 dataSize)
+{
+    UINT64 available, chunk;
+    BYTE *view;
+
+    while (dataSize > 0)
+    {
+        view = CmqSpillMap(spill, &spill->WriteWindow, counter, &available);
+        if (!view)
+            return FALSE;
+
+        chunk = min(dataSize, available);
+        memcpy(view, data, chunk);
+        data += chunk;
+        counter += chunk;
+        dataSize -= chunk;
+    }
+    return TRUE;
+}
+
+// spill storage version of CmqRingCopyOut
+static void CmqSpillCopyOut(IN const CMQ_BUFFER *spill, IN UINT64 counter, OUT BYTE *data, IN UINT64 dataSize)
+{
+    // the window is just the consumer's mapping cache
+    CMQ_SPILL_WINDOW *window = (CMQ_SPILL_WINDOW *) &spill->ReadWindow;
+    UINT64 available, chunk;
+    BYTE *view;
+
+    while (dataSize > 0)
+    {
+        view = CmqSpillMap(spill, window, counter, &available);
+        if (!view)
+        {
+            // the data is lost, at least don't hand out stale memory
+            LogError("%p: failed to map spill storage, 0x%llx bytes lost", spill, dataSize);
+            ZeroMemory(data, dataSize);
+            return;
+        }
+
+        chunk = min(dataSize, available);
+        memcpy(data, view, chunk);
+        data += chunk;
+        counter += chunk;
+        dataSize -= chunk;
+    }
+}
+
+// spill storage version of CmqRingSpans for the side owning 'window', the span ends at the window end
+static UINT64 CmqSpillSpans(IN const CMQ_BUFFER *spill, IN OUT CMQ_SPILL_WINDOW *window, IN UINT64 counter,
+                            IN UINT64 size, OUT CMQ_SPAN spans[2])
+{
+    UINT64 available;
+
+    ZeroMemory(spans, 2 * sizeof(CMQ_SPAN));
+    if (size == 0)
+        return 0;
+
+    spans[0].Data = CmqSpillMap(spill, window, counter, &available);
+    if (!spans[0].Data)
+        return 0;
+
+    spans[0].Size = min(size, available);
+    return spans[0].Size;
+}
+
+// producer side: get segment number 'index' (not before the current tail segment),
+// allocating and linking segments after the tail if needed
+static CMQ_SEGMENT *CmqChainWriteSegment(IN CMQ_BUFFER *buffer, IN UINT64 index)
+{
+    CMQ_SEGMENT *segment = buffer->TailSegment;
+    CMQ_SEGMENT *next;
+    UINT64 i;
+
+    for (i = buffer->TailIndex; i < index; i++)
+    {
+        next = segment->Next;
+        if (!next)
+        {
+            next = CmqAllocSegment(buffer);
+            if (!next)
+                return NULL;
+            // the consumer only follows the link after seeing data in the new segment,
+            // WriteCount release orders this anyway
+            segment->Next = next;
+        }
+        segment = next;
+    }
+    return segment;
+}
+
+// consumer side: get segment number 'index' (not before the current head segment), it must contain published data
+// starts from the cursor if it's not past 'index' and leaves it at the returned segment
+static CMQ_SEGMENT *CmqChainReadSegment(IN const CMQ_BUFFER *buffer, IN UINT64 index, IN OUT CMQ_READ_CURSOR *cursor OPTIONAL)
+{
+    CMQ_SEGMENT *segment = buffer->HeadSegment;
+    UINT64 i = buffer->HeadIndex;
+
+    if (cursor && cursor->Segment && cursor->Index <= index)
+    {
+        segment = cursor->Segment;
+        i = cursor->Index;
+    }
+
+    for (; i < index; i++)
+        segment = segment->Next;
+
+    if (cursor)
+    {
+        cursor->Segment = segment;
+        cursor->Index = index;
+    }
+    return segment;
+}
+
+// producer side: advance the tail segment to the one holding the last produced byte
+static void CmqChainAdvanceTail(IN CMQ_BUFFER *buffer, IN UINT64 writeCount)
+{
+    UINT64 index;
+
+    if (writeCount == 0)
+        return;
+
+    index = (writeCount - 1) / buffer->SegmentSize;
+    buffer->TailSegment = CmqChainWriteSegment(buffer, index); // already allocated
+    buffer->TailIndex = index;
+}
+
+// consumer side: return segments before the one holding the last consumed byte to the pool
+// the producer never goes back to segments before its tail, which is at least at the same position
+static void CmqChainAdvanceHead(IN CMQ_BUFFER *buffer, IN UINT64 readCount)
+{
+    CMQ_SEGMENT *segment;
+    UINT64 index;
+
+    if (readCount == 0)
+        return;
+
+    index = (readCount - 1) / buffer->SegmentSize;
+    while (buffer->HeadIndex < index)
+    {
+        segment = buffer->HeadSegment;
+        buffer->HeadSegment = segment->Next;
+        buffer->HeadIndex++;
+        CmqFreeSegment(buffer, segment);
+    }
+}
+
+// elastic version of CmqRingCopyIn, segments must be allocated already
+static void CmqChainCopyIn(IN CMQ_BUFFER *buffer, IN UINT64 counter, IN const BYTE *data, IN UINT64 dataSize)
+{
+    CMQ_SEGMENT *segment = CmqChainWriteSegment(buffer, counter / buffer->SegmentSize);
+    UINT64 offset = counter % buffer->SegmentSize;
+    UINT64 chunk;
+
+    while (dataSize > 0)
+    {
+        chunk = min(dataSize, buffer->SegmentSize - offset);
+        memcpy(segment->Data + offset, data, chunk);
+        data += chunk;
+        dataSize -= chunk;
+        segment = segment->Next;
+        offset = 0;
+    }
+}
+
+// elastic version of CmqRingCopyOut
+static void CmqChainCopyOut(IN const CMQ_BUFFER *buffer, IN UINT64 counter, OUT BYTE *data, IN UINT64 dataSize,
+                            IN OUT CMQ_READ_CURSOR *cursor OPTIONAL)
+{
+    CMQ_SEGMENT *segment = CmqChainReadSegment(buffer, counter / buffer->SegmentSize, cursor);
+    UINT64 offset = counter % buffer->SegmentSize;
+    UINT64 chunk;
+
+    while (dataSize > 0)
+    {
+        chunk = min(dataSize, buffer->SegmentSize - offset);
+        memcpy(data, segment->Data + offset, chunk);
+        data += chunk;
+        dataSize -= chunk;
+        segment = segment->Next;
+        offset = 0;
+    }
+}
+
+// elastic version of CmqRingSpans for the producer, spans cover at most two segments
+static UINT64 CmqChainReserveSpans(IN CMQ_BUFFER *buffer, IN UINT64 counter, IN UINT64 size, OUT CMQ_SPAN spans[2])
+{
+    UINT64 index = counter / buffer->SegmentSize;
+    UINT64 offset = counter % buffer->SegmentSize;
+    CMQ_SEGMENT *segment;
+
+    ZeroMemory(spans, 2 * sizeof(CMQ_SPAN));
+    if (size == 0)
+        return 0;
+
+    segment = CmqChainWriteSegment(buffer, index);
+    if (!segment)
+        return 0;
+
+    spans[0].Data = segment->Data + offset;
+    spans[0].Size = min(size, buffer->SegmentSize - offset);
+
+    if (size > spans[0].Size)
+    {
+        segment = CmqChainWriteSegment(buffer, index + 1);
+        if (segment) // if not, return what we have
+        {
+            spans[1].Data = segment->Data;
+            spans[1].Size = min(size - spans[0].Size, buffer->SegmentSize);
+        }
+    }
+
+    return spans[0].Size + spans[1].Size;
+}
+
+// elastic version of CmqRingSpans for the consumer, spans cover at most two segments
+static UINT64 CmqChainPeekSpans(IN const CMQ_BUFFER *buffer, IN UINT64 counter, IN UINT64 size, OUT CMQ_SPAN spans[2])
+{
+    UINT64 offset = counter % buffer->SegmentSize;
+    CMQ_SEGMENT *segment;
+
+    ZeroMemory(spans, 2 * sizeof(CMQ_SPAN));
+    if (size == 0)
+        return 0;
+
+    segment = CmqChainReadSegment(buffer, counter / buffer->SegmentSize, NULL);
+    spans[0].Data = segment->Data + offset;
+    spans[0].Size = min(size, buffer->SegmentSize - offset);
+
+    if (size > spans[0].Size)
+    {
+        spans[1].Data = segment->Next->Data;
+        spans[1].Size = min(size - spans[0].Size, buffer->SegmentSize);
+    }
+
+    return spans[0].Size + spans[1].Size;
+}
+
+// wake a waiter of a shared buffer, it may be in another process
+static void CmqSharedWake(IN const CMQ_BUFFER *buffer, IN BOOL data)
+{
+    HANDLE event = CmqSharedEvent(buffer, data);
+
+    if (event)
+        SetEvent(event);
+}
+
+// wake threads waiting for the counter that was just updated
+static void CmqSignal(IN CMQ_BUFFER *buffer, IN volatile LONG *waiters, IN volatile LONG *signal)
+{
+    // Pairs with the interlocked waiter count increment in CmqWait: either we see the waiter
+    // or the waiter sees the updated counter before going to sleep.
+    MemoryBarrier();
+    if (ReadNoFence(waiters) != 0)
+    {
+        InterlockedIncrement(signal);
+        if (buffer->Flags & CMQ_FLAG_SHARED)
+            CmqSharedWake(buffer, signal == &buffer->DataSignal);
+        else
+            WakeByAddressAll((PVOID) signal);
+    }
+}
+
+// Producer side building blocks: make sure storage for 'dataSize' bytes at 'writeCount' exists,
+// write (possibly in several pieces) and publish everything at once.
+
+static BOOL CmqPrepareWrite(IN CMQ_BUFFER *buffer, IN UINT64 writeCount, IN UINT64 dataSize)
+{
+    if (dataSize == 0 || !(buffer->Flags & CMQ_FLAG_ELASTIC))
+        return TRUE;
+
+    return CmqChainWriteSegment(buffer, (writeCount + dataSize - 1) / buffer->SegmentSize) != NULL;
+}
+
+// FALSE if the storage isn't accessible (spill storage only), nothing may be published then
+static BOOL CmqWriteAt(IN CMQ_BUFFER *buffer, IN UINT64 counter, IN const void *data, IN UINT64 dataSize)
+{
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+        CmqChainCopyIn(buffer, counter, (const BYTE *) data, dataSize);
+    else if (buffer->Flags & CMQ_FLAG_SPILL_STORAGE)
+        return CmqSpillCopyIn(buffer, counter, (const BYTE *) data, dataSize);
+    else
+        CmqRingCopyIn(buffer, counter, (const BYTE *) data, dataSize);
+    return TRUE;
+}
+
+// producer side: timestamp a chunk that ends at writeCount (single-producer buffers)
+static void CmqStampChunk(IN CMQ_BUFFER *buffer, IN UINT64 writeCount)
+{
+    UINT64 index = (UINT64) ReadNoFence64(&buffer->TimestampWrite); // we're the only writer of this one
+    CMQ_TIMESTAMP *entry;
+    LARGE_INTEGER now;
+
+    if (index - (UINT64) ReadAcquire64(&buffer->TimestampRead) == CMQ_TIMESTAMP_COUNT)
+    {
+        // ring full, the chunk will be accounted with the next timestamped one
+        WriteNoFence64(&buffer->UntrackedChunks, ReadNoFence64(&buffer->UntrackedChunks) + 1);
+        return;
+    }
+
+    QueryPerformanceCounter(&now);
+    entry = &buffer->Timestamps[index % CMQ_TIMESTAMP_COUNT];
+    entry->End = writeCount;
+    entry->Time = now.QuadPart;
+    WriteRelease64(&buffer->TimestampWrite, (LONG64) (index + 1));
+}
+
+// consumer side: account a chunk that spent 'delay' QPC ticks in the queue
+static void CmqChunkConsumed(IN CMQ_BUFFER *buffer, IN LONG64 delay)
+{
+    UINT64 delayUs;
+    UINT64 bucket = 0;
+    ULONG bit;
+
+    delay = max(delay, 0);
+    delayUs = (UINT64) delay * 1000000 / (UINT64) buffer->TimestampFrequency;
+    if (_BitScanReverse64(&bit, delayUs))
+        bucket = min((UINT64) bit + 1, (UINT64) CMQ_LATENCY_BUCKETS - 1);
+
+    // we're the only writer of these
+    WriteNoFence64(&buffer->Chunks, ReadNoFence64(&buffer->Chunks) + 1);
+    WriteNoFence64(&buffer->TotalDelay, ReadNoFence64(&buffer->TotalDelay) + delay);
+    if (delay > ReadNoFence64(&buffer->MaxDelay))
+        WriteNoFence64(&buffer->MaxDelay, delay);
+    WriteNoFence64(&buffer->DelayHistogram[bucket], ReadNoFence64(&buffer->DelayHistogram[bucket]) + 1);
+}
+
+// consumer side: account timestamped chunks consumed completely (single-producer buffers)
+static void CmqRetireChunks(IN CMQ_BUFFER *buffer, IN UINT64 readCount)
+{
+    UINT64 index = (UINT64) ReadNoFence64(&buffer->TimestampRead);
+    UINT64 end = (UINT64) ReadAcquire64(&buffer->TimestampWrite);
+    CMQ_TIMESTAMP *entry;
+    LARGE_INTEGER now;
+
+    if (index == end || buffer->Timestamps[index % CMQ_TIMESTAMP_COUNT].End > readCount)
+        return;
+
+    QueryPerformanceCounter(&now);
+    for (; index != end; index++)
+    {
+        entry = &buffer->Timestamps[index % CMQ_TIMESTAMP_COUNT];
+        if (entry->End > readCount)
+            break;
+
+        CmqChunkConsumed(buffer, now.QuadPart - entry->Time);
+        buffer->ChunkStart = entry->End;
+    }
+
+    WriteRelease64(&buffer->TimestampRead, (LONG64) index);
+}
+
+static void CmqPublish(IN CMQ_BUFFER *buffer, IN UINT64 writeCount)
+{
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+        CmqChainAdvanceTail(buffer, writeCount);
+
+    // before the data, the consumer must not see a chunk without its timestamp
+    if (buffer->Timestamps)
+        CmqStampChunk(buffer, writeCount);
+
+    // release semantics make the data visible before the new count
+    WriteRelease64(&buffer->WriteCount, (LONG64) writeCount);
+    CmqSignal(buffer, &buffer->DataWaiters, &buffer->DataSignal);
+}
+
+// Consumer side building blocks: read (possibly in several pieces) and release everything at once.
+
+// 'cursor' speeds up consecutive reads of elastic buffers, see CMQ_READ_CURSOR
+static void CmqReadAt(IN const CMQ_BUFFER *buffer, IN UINT64 counter, OUT void *data, IN UINT64 dataSize,
+                      IN OUT CMQ_READ_CURSOR *cursor OPTIONAL)
+{
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+        CmqChainCopyOut(buffer, counter, (BYTE *) data, dataSize, cursor);
+    else if (buffer->Flags & CMQ_FLAG_SPILL_STORAGE)
+        CmqSpillCopyOut(buffer, counter, (BYTE *) data, dataSize);
+    else
+        CmqRingCopyOut(buffer, counter, (BYTE *) data, dataSize);
+}
+
+static void CmqRelease(IN CMQ_BUFFER *buffer, IN UINT64 readCount)
+{
+    // occupancy seen by the consumer: sampled before the release, main storage drained while
+    // spilling counts as spilling. The spill storage is sampled by CmqSpillConsumed.
+    UINT64 occupancy = (UINT64) ReadNoFence64(&buffer->WriteCount) - (UINT64) ReadNoFence64(&buffer->ReadCount);
+    UINT32 bucket = ReadNoFence(&buffer->Spilling) ? CMQ_STATS_BUCKETS - 1 : CmqStatsBucket(buffer, occupancy);
+
+    if (!(buffer->Flags & CMQ_FLAG_SPILL_STORAGE))
+        WriteNoFence64(&buffer->ReadHistogram[bucket], ReadNoFence64(&buffer->ReadHistogram[bucket]) + 1);
+
+    // the reads must be complete before the producer may overwrite the storage
+    WriteRelease64(&buffer->ReadCount, (LONG64) readCount);
+    CmqSignal(buffer, &buffer->SpaceWaiters, &buffer->SpaceSignal);
+
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+        CmqChainAdvanceHead(buffer, readCount);
+
+    if (buffer->Timestamps)
+        CmqRetireChunks(buffer, readCount);
+}
+
+// bytes queued in the buffer's own storage
+static UINT64 CmqUsed(IN const CMQ_BUFFER *buffer)
+{
+    // read the consumer's counter first: the producer's counter can only be larger,
+    // so the result is never negative even if both sides are running
+    UINT64 readCount = (UINT64) ReadAcquire64(&buffer->ReadCount);
+    UINT64 writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
+
+    return writeCount - readCount;
+}
+
+static CMQ_BUFFER *CmqGetSpill(IN const CMQ_BUFFER *buffer)
+{
+    return (CMQ_BUFFER *) ReadPointerAcquire((PVOID const volatile *) &buffer->Spill);
+}
+
+// producer side: update a statistics counter, interlocked only if there can be multiple producers
+static void CmqStatAdd(IN CMQ_BUFFER *buffer, IN volatile LONG64 *counter, IN LONG64 value)
+{
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+        InterlockedAdd64(counter, value);
+    else
+        WriteNoFence64(counter, ReadNoFence64(counter) + value);
+}
+
+// producer side: account an add of 'size' bytes that succeeded or failed, returns the status
+static BOOL CmqAccount(IN CMQ_BUFFER *buffer, IN BOOL status, IN UINT64 size, IN UINT64 occupancy, IN UINT32 bucket)
+{
+    CMQ_STATS_SHARD *stats = CmqStatShard(buffer);
+    LONG64 previous, current;
+
+    if (status)
+        CmqStatAdd(buffer, &stats->BytesIn, (LONG64) size);
+    else
+        CmqStatAdd(buffer, &stats->FailedAdds, 1);
+
+    CmqStatAdd(buffer, &stats->Histogram[bucket], 1);
+
+    previous = ReadNoFence64(&stats->HighWatermark);
+    while ((UINT64) previous < occupancy)
+    {
+        if (!(buffer->Flags & CMQ_FLAG_MPSC))
+        {
+            WriteNoFence64(&stats->HighWatermark, (LONG64) occupancy);
+            break;
+        }
+
+        current = InterlockedCompareExchange64(&stats->HighWatermark, (LONG64) occupancy, previous);
+        if (current == previous)
+            break;
+        previous = current;
+    }
+
+    return status;
+}
+
+// producer side: CmqAccount for the main storage, 'occupancy' is what the caller saw in it after
+// the add (before it if it failed). The spill storage is empty, see CmqSpillTarget.
+static BOOL CmqAdded(IN CMQ_BUFFER *buffer, IN BOOL status, IN UINT64 size, IN UINT64 occupancy)
+{
+    return CmqAccount(buffer, status, size, occupancy, CmqStatsBucket(buffer, occupancy));
+}
+
+// producer side: pick the spill storage for writing 'size' bytes or NULL for the main storage
+static CMQ_BUFFER *CmqSpillTarget(IN CMQ_BUFFER *buffer, IN UINT64 size)
+{
+    CMQ_BUFFER *spill = buffer->Spill; // we're the only writer of this one
+
+    if (buffer->SpillSize == 0)
+        return NULL;
+
+    if (spill && CmqUsed(spill) != 0)
+        return spill; // keep the order
+
+    if (size <= buffer->Size - CmqUsed(buffer))
+        return NULL;
+
+    if (!spill)
+    {
+        spill = CmqCreateSpill(buffer->SpillSize);
+        if (!spill)
+        {
+            LogError("%p: failed to create spill storage, spilling disabled", buffer);
+            buffer->SpillSize = 0;
+            return NULL;
+        }
+        if ((buffer->Flags & CMQ_FLAG_TIMESTAMPS) && !CmqInitTimestamps(spill))
+            LogWarning("%p: out of memory, spilled data won't be timestamped", buffer);
+        InterlockedExchangePointer((PVOID volatile *) &buffer->Spill, spill);
+    }
+    return spill;
+}
+
+// producer side: about to publish 'size' bytes to the spill storage, enter the spilling state
+// if they're the first ones. Called before publishing, so the consumer can't drain the data first.
+// Writes that won't be stored (empty or too big) don't count as spilling.
+static void CmqSpillStart(IN CMQ_BUFFER *buffer, IN CMQ_BUFFER *spill, IN UINT64 size)
+{
+    LARGE_INTEGER now;
+
+    if (size == 0 || size > spill->Size - CmqUsed(spill))
+        return;
+
+    if (InterlockedCompareExchange(&buffer->Spilling, 1, 0) == 0)
+    {
+        QueryPerformanceCounter(&now);
+        WriteNoFence64(&buffer->SpillStartTime, now.QuadPart);
+        WriteNoFence64(&buffer->SpillCount, ReadNoFence64(&buffer->SpillCount) + 1);
+        LogDebug("%p: main storage full, spilling", buffer);
+    }
+}
+
+// producer side: account data written to the spill storage, returns 'status'
+static BOOL CmqSpillProduced(IN CMQ_BUFFER *buffer, IN BOOL status, IN UINT64 size)
+{
+    UINT64 spillUsed, occupancy;
+    CMQ_BUFFER *spill;
+
+    if (status)
+    {
+        WriteNoFence64(&buffer->SpilledBytes, ReadNoFence64(&buffer->SpilledBytes) + (LONG64) size);
+        // the spill storage doesn't have waiters of its own
+        CmqSignal(buffer, &buffer->DataWaiters, &buffer->DataSignal);
+    }
+
+    // slow path anyway, look at both storages
+    spill = CmqGetSpill(buffer);
+    spillUsed = spill ? CmqUsed(spill) : 0;
+    occupancy = CmqUsed(buffer) + spillUsed;
+    return CmqAccount(buffer, status, size, occupancy,
+                      spillUsed != 0 ? CMQ_STATS_BUCKETS - 1 : CmqStatsBucket(buffer, occupancy));
+}
+
+// consumer side: queued size, '*mainSize' of it in the main storage (older) and the rest in the spill storage
+static UINT64 CmqGetQueued(IN const CMQ_BUFFER *buffer, OUT CMQ_BUFFER **spill, OUT UINT64 *mainSize)
+{
+    UINT64 spillSize = 0;
+
+    // check the spill storage first: main storage data seen after that is older than anything in the spill
+    *spill = CmqGetSpill(buffer);
+    if (*spill)
+        spillSize = CmqUsed(*spill);
+
+    *mainSize = CmqUsed(buffer);
+    return *mainSize + spillSize;
+}
+
+// consumer side: the spill storage if it holds the oldest data, NULL for the main storage
+static CMQ_BUFFER *CmqSpillSource(IN const CMQ_BUFFER *buffer)
+{
+    CMQ_BUFFER *spill;
+    UINT64 mainSize;
+
+    if (CmqGetQueued(buffer, &spill, &mainSize) > mainSize && mainSize == 0)
+        return spill;
+    return NULL;
+}
+
+// consumer side: data was removed from the spill storage
+static void CmqSpillConsumed(IN CMQ_BUFFER *buffer, IN CMQ_BUFFER *spill)
+{
+    volatile LONG64 *sample = &buffer->ReadHistogram[CMQ_STATS_BUCKETS - 1];
+    LARGE_INTEGER now;
+
+    WriteNoFence64(sample, ReadNoFence64(sample) + 1);
+    CmqSignal(buffer, &buffer->SpaceWaiters, &buffer->SpaceSignal);
+
+    if (CmqUsed(spill) == 0 && InterlockedCompareExchange(&buffer->Spilling, 0, 1) == 1)
+    {
+        QueryPerformanceCounter(&now);
+        WriteNoFence64(&buffer->SpillTime, ReadNoFence64(&buffer->SpillTime) + now.QuadPart - ReadNoFence64(&buffer->SpillStartTime));
+        LogDebug("%p: spill storage drained", buffer);
+    }
+}
+
+// consumer side: copy 'size' bytes starting 'offset' bytes into the queued data, see CmqGetQueued
+static void CmqReadQueued(IN const CMQ_BUFFER *buffer, IN const CMQ_BUFFER *spill, IN UINT64 mainSize,
+                          IN UINT64 offset, OUT BYTE *data, IN UINT64 size)
+{
+    UINT64 chunk;
+
+    if (offset < mainSize)
+    {
+        chunk = min(size, mainSize - offset);
+        CmqReadAt(buffer, (UINT64) ReadNoFence64(&buffer->ReadCount) + offset, data, chunk, NULL);
+        data += chunk;
+        size -= chunk;
+        offset += chunk;
+    }
+
+    if (size > 0)
+        CmqReadAt(spill, (UINT64) ReadNoFence64(&spill->ReadCount) + offset - mainSize, data, size, NULL);
+}
+
+// consumer side: remove 'size' bytes of queued data, see CmqGetQueued
+static void CmqReleaseQueued(IN CMQ_BUFFER *buffer, IN CMQ_BUFFER *spill, IN UINT64 mainSize, IN UINT64 size)
+{
+    UINT64 chunk = min(size, mainSize);
+
+    if (chunk > 0)
+        CmqRelease(buffer, (UINT64) ReadNoFence64(&buffer->ReadCount) + chunk);
+
+    if (size > chunk)
+    {
+        CmqRelease(spill, (UINT64) ReadNoFence64(&spill->ReadCount) + size - chunk);
+        CmqSpillConsumed(buffer, spill);
+    }
+}
+
+// Multi-producer (CMQ_FLAG_MPSC) buffers.
+//
+// A producer claims space for a header and the payload and writes the header with Busy set,
+// all under ClaimLock, so the consumer never sees a claimed write without a valid header.
+// The payload is copied outside the lock and published by clearing Busy.
+// The consumer walks writes from ReadCount and stops at the first busy one.
+
+static CMQ_MPSC_HEADER *CmqMpscHeader(IN const CMQ_BUFFER *buffer, IN UINT64 counter)
+{
+    return (CMQ_MPSC_HEADER *) (CmqStorage(buffer) + counter % buffer->Size);
+}
+
+// '*occupancy' is the storage in use after the claim (before it if it failed)
+static BOOL CmqMpscClaim(IN CMQ_BUFFER *buffer, IN UINT64 dataSize, OUT UINT64 *counter, OUT UINT64 *occupancy)
+{
+    UINT64 recordSize = CMQ_MPSC_RECORD_SIZE(buffer, dataSize);
+    UINT64 readCount, writeCount;
+    CMQ_MPSC_HEADER *header;
+
+    AcquireSRWLockExclusive(&buffer->ClaimLock);
+    readCount = (UINT64) ReadAcquire64(&buffer->ReadCount);
+    writeCount = (UINT64) ReadNoFence64(&buffer->WriteCount);
+
+    *occupancy = writeCount - readCount;
+    if (recordSize > buffer->Size - *occupancy)
+    {
+        ReleaseSRWLockExclusive(&buffer->ClaimLock);
+        return FALSE;
+    }
+
+    header = CmqMpscHeader(buffer, writeCount);
+    header->Size = (UINT32) dataSize;
+    header->Busy = 1;
+    // the consumer looks at the header as soon as it sees the new count
+    WriteRelease64(&buffer->WriteCount, (LONG64) (writeCount + recordSize));
+    ReleaseSRWLockExclusive(&buffer->ClaimLock);
+
+    *counter = writeCount;
+    *occupancy += recordSize;
+    return TRUE;
+}
+
+// producer side: queue data from all spans as one write
+static BOOL CmqMpscAdd(IN CMQ_BUFFER *buffer, IN const CMQ_SPAN *spans, IN UINT32 spanCount, IN UINT64 dataSize)
+{
+    CMQ_MPSC_HEADER *header;
+    CMQ_BUFFER *spill;
+    LARGE_INTEGER now;
+    UINT64 counter, occupancy = 0;
+    BOOL status;
+    UINT32 i;
+
+    if (dataSize > MAXUINT32)
+        return FALSE;
+
+    while (TRUE)
+    {
+        spill = CmqGetSpill(buffer);
+        // anything in the spill storage means the main storage has to wait, see CmqSpillTarget
+        if ((!spill || CmqUsed(spill) == 0) && CmqMpscClaim(buffer, dataSize, &counter, &occupancy))
+            break;
+
+        if (buffer->SpillSize == 0)
+        {
+            LogDebug("(%p, %llx): buffer too small", buffer, dataSize);
+            return CmqAdded(buffer, FALSE, dataSize, occupancy);
+        }
+
+        // spill storage is single-producer
+        AcquireSRWLockExclusive(&buffer->SpillLock);
+        spill = CmqSpillTarget(buffer, CMQ_MPSC_RECORD_SIZE(buffer, dataSize));
+        if (spill)
+        {
+            CmqSpillStart(buffer, spill, dataSize);
+            status = CmqSpillProduced(buffer, CmqAddDataV(spill, spans, spanCount), dataSize);
+            ReleaseSRWLockExclusive(&buffer->SpillLock);
+            return status;
+        }
+        ReleaseSRWLockExclusive(&buffer->SpillLock);
+        // the main storage has space again (or spilling failed), retry
+    }
+
+    header = CmqMpscHeader(buffer, counter);
+    counter += buffer->MpscHeaderSize;
+    for (i = 0; i < spanCount; i++)
+    {
+        CmqRingCopyIn(buffer, counter, spans[i].Data, spans[i].Size);
+        counter += spans[i].Size;
+    }
+
+    if (buffer->Flags & CMQ_FLAG_TIMESTAMPS)
+    {
+        QueryPerformanceCounter(&now);
+        ((CMQ_MPSC_STAMPED_HEADER *) header)->Time = now.QuadPart;
+    }
+
+    WriteRelease(&header->Busy, 0);
+    CmqSignal(buffer, &buffer->DataWaiters, &buffer->DataSignal);
+    return CmqAdded(buffer, TRUE, dataSize, occupancy);
+}
+
+// consumer side: walk complete writes starting at 'counter'/'offset' and copy (data != NULL)
+// or just count up to 'size' payload bytes, returns the number of bytes processed
+static UINT64 CmqMpscRead(IN const CMQ_BUFFER *buffer, OUT BYTE *data OPTIONAL, IN UINT64 size,
+                          IN OUT UINT64 *counter, IN OUT UINT64 *offset)
+{
+    UINT64 claimed = (UINT64) ReadAcquire64(&buffer->WriteCount);
+    CMQ_MPSC_HEADER *header;
+    UINT64 done = 0;
+    UINT64 chunk;
+
+    while (done < size && *counter != claimed)
+    {
+        header = CmqMpscHeader(buffer, *counter);
+        if (ReadAcquire(&header->Busy))
+            break; // later writes have to wait for this one
+
+        chunk = min(size - done, header->Size - *offset);
+        if (data)
+            CmqRingCopyOut(buffer, *counter + buffer->MpscHeaderSize + *offset, data + done, chunk);
+        done += chunk;
+        *offset += chunk;
+
+        if (*offset == header->Size)
+        {
+            *counter += CMQ_MPSC_RECORD_SIZE(buffer, header->Size);
+            *offset = 0;
+        }
+    }
+    return done;
+}
+
+// consumer side: move the read position to 'counter'/'offset' after consuming (or dropping) 'size' bytes
+static void CmqMpscRelease(IN CMQ_BUFFER *buffer, IN UINT64 counter, IN UINT64 offset, IN UINT64 size, IN BOOL expired)
+{
+    UINT64 readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    CMQ_MPSC_STAMPED_HEADER *header;
+    LARGE_INTEGER now;
+    UINT64 walk;
+
+    // account writes consumed completely, headers stay intact until ReadCount moves
+    if ((buffer->Flags & CMQ_FLAG_TIMESTAMPS) && !expired && counter != readCount)
+    {
+        QueryPerformanceCounter(&now);
+        for (walk = readCount; walk != counter; walk += CMQ_MPSC_RECORD_SIZE(buffer, header->Header.Size))
+        {
+            header = (CMQ_MPSC_STAMPED_HEADER *) CmqMpscHeader(buffer, walk);
+            CmqChunkConsumed(buffer, now.QuadPart - header->Time);
+        }
+    }
+
+    buffer->ReadOffset = offset;
+    WriteNoFence64(&buffer->MpscConsumed, ReadNoFence64(&buffer->MpscConsumed) + (LONG64) size);
+
+    if (counter != readCount)
+        CmqRelease(buffer, counter);
+}
+
+// consumer side: bytes that can be read in order (up to 'limit'), including the spill storage
+// if all writes in the main storage are complete
+static UINT64 CmqMpscAvailable(IN const CMQ_BUFFER *buffer, IN UINT64 limit)
+{
+    CMQ_BUFFER *spill = CmqGetSpill(buffer);
+    UINT64 spillSize = spill ? CmqUsed(spill) : 0; // first, see CmqGetQueued
+    UINT64 counter = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    UINT64 offset = buffer->ReadOffset;
+    UINT64 available = CmqMpscRead(buffer, NULL, limit, &counter, &offset);
+
+    if (available < limit && counter == (UINT64) ReadAcquire64(&buffer->WriteCount))
+        available += min(spillSize, limit - available);
+
+    return available;
+}
+
+// consumer side: copy out 'size' bytes into the spans (in order) and remove them, they must be
+// available (CmqMpscAvailable). Each storage is released once, after all copying is done.
+static void CmqMpscGet(IN CMQ_BUFFER *buffer, IN const CMQ_SPAN *spans, IN UINT32 spanCount, IN UINT64 size)
+{
+    UINT64 counter = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    UINT64 offset = buffer->ReadOffset;
+    UINT64 done = 0, mainDone, spanDone = 0, chunk, spillRead = 0;
+    CMQ_BUFFER *spill = NULL;
+    UINT32 i;
+
+    for (i = 0; i < spanCount && done < size; i++)
+    {
+        chunk = min(spans[i].Size, size - done);
+        spanDone = CmqMpscRead(buffer, spans[i].Data, chunk, &counter, &offset);
+        done += spanDone;
+        if (spanDone < chunk)
+            break; // the rest is in the spill storage, continue in this span
+        spanDone = 0;
+    }
+    mainDone = done;
+
+    if (done < size)
+    {
+        spill = CmqGetSpill(buffer);
+        spillRead = (UINT64) ReadNoFence64(&spill->ReadCount);
+        for (; i < spanCount && done < size; i++)
+        {
+            chunk = min(spans[i].Size - spanDone, size - done);
+            CmqReadAt(spill, spillRead + done - mainDone, spans[i].Data + spanDone, chunk, NULL);
+            done += chunk;
+            spanDone = 0;
+        }
+    }
+
+    if (mainDone > 0)
+        CmqMpscRelease(buffer, counter, offset, mainDone, FALSE);
+
+    if (spill)
+    {
+        CmqRelease(spill, spillRead + done - mainDone);
+        CmqSpillConsumed(buffer, spill);
+    }
+}
+
+// queue data to the buffer
+// producer side: only touches WriteCount, ReadCount is just observed
+BOOL CmqAddData(IN CMQ_BUFFER *buffer, IN const void *inputData, IN UINT64 inputDataSize)
+{
+    UINT64 readCount, writeCount, freeSize;
+    CMQ_BUFFER *spill;
+
+    CmqTrace("(%p, %p, %llx)", buffer, inputData, inputDataSize);
+
+    if (inputDataSize == 0)
+        return TRUE;
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        CMQ_SPAN span = { (BYTE *) inputData, inputDataSize };
+        return CmqMpscAdd(buffer, &span, 1, inputDataSize);
+    }
+
+    spill = CmqSpillTarget(buffer, inputDataSize);
+    if (spill)
+    {
+        CmqSpillStart(buffer, spill, inputDataSize);
+        return CmqSpillProduced(buffer, CmqAddData(spill, inputData, inputDataSize), inputDataSize);
+    }
+
+    writeCount = (UINT64) ReadNoFence64(&buffer->WriteCount); // we're the only writer of this one
+    readCount = (UINT64) ReadAcquire64(&buffer->ReadCount); // consumer is done with storage below this
+    freeSize = buffer->Size - (writeCount - readCount);
+
+    if (inputDataSize > freeSize)
+    {
+        LogDebug("(%p, %p, %llx): buffer too small (free: %llx)", buffer, inputData, inputDataSize, freeSize);
+        return CmqAdded(buffer, FALSE, inputDataSize, writeCount - readCount);
+    }
+
+    if (!CmqPrepareWrite(buffer, writeCount, inputDataSize))
+        return CmqAdded(buffer, FALSE, inputDataSize, writeCount - readCount);
+
+    if (!CmqWriteAt(buffer, writeCount, inputData, inputDataSize))
+        return CmqAdded(buffer, FALSE, inputDataSize, writeCount - readCount);
+    CmqPublish(buffer, writeCount + inputDataSize);
+
+    CmqTrace("%p: read count %llx, write count %llx", buffer, readCount, writeCount + inputDataSize);
+    return CmqAdded(buffer, TRUE, inputDataSize, writeCount + inputDataSize - readCount);
+}
+
+// dequeue data from the buffer
+// underflow = true: don't treat underflow as errors (reading empty buffer is ok etc)
+// dataSize = 0: read all (use carefully in case of buffer overruns)
+// consumer side: only touches ReadCount, WriteCount is just observed
+BOOL CmqGetData(IN CMQ_BUFFER *buffer, OUT void *outputData, IN OUT UINT64 *dataSize, CMQ_UNDERFLOW_MODE underflowMode)
+{
+    UINT64 usedSize, mainSize = 0;
+    CMQ_BUFFER *spill = NULL;
+
+    CmqTrace("(%p, %p, %llx, %d)", buffer, outputData, *dataSize, underflowMode);
+
+    CmqDropExpired(buffer);
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+        usedSize = CmqMpscAvailable(buffer, *dataSize ? *dataSize : MAXUINT64);
+    else
+        usedSize = CmqGetQueued(buffer, &spill, &mainSize);
+
+    if (usedSize == 0)  // buffer empty
+    {
+        if ((underflowMode == CMQ_ALLOW_UNDERFLOW) || (*dataSize == 0))
+        {
+            *dataSize = 0;
+            return TRUE;
+        }
+        else
+        {
+            *dataSize = 0;
+            return FALSE;
+        }
+    }
+
+    if (*dataSize == 0)   // "read all"
+    {
+        *dataSize = usedSize;
+    }
+    else
+    {
+        if (*dataSize > usedSize) // underflow
+        {
+            if (underflowMode == CMQ_ALLOW_UNDERFLOW)
+            {
+                *dataSize = usedSize;
+            }
+            else
+            {
+                LogDebug("%p: underflow (requested %llx, got %llx)", buffer, *dataSize, usedSize);
+                *dataSize = 0;
+                return FALSE;
+            }
+        }
+    }
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        CMQ_SPAN span = { (BYTE *) outputData, *dataSize };
+        CmqMpscGet(buffer, &span, 1, *dataSize);
+    }
+    else
+    {
+        CmqReadQueued(buffer, spill, mainSize, 0, (BYTE *) outputData, *dataSize);
+        CmqReleaseQueued(buffer, spill, mainSize, *dataSize);
+    }
+
+    CmqTrace("%p: read %llx, %llx left", buffer, *dataSize, usedSize - *dataSize);
+    return TRUE;
+}
+
+// total size of the spans, FALSE on overflow
+static BOOL CmqGetSpansSize(IN const CMQ_SPAN *spans, IN UINT32 spanCount, OUT UINT64 *totalSize)
+{
+    UINT64 size = 0;
+    UINT32 i;
+
+    for (i = 0; i < spanCount; i++)
+    {
+        if (spans[i].Size > MAXUINT64 - size)
+            return FALSE;
+        size += spans[i].Size;
+    }
+
+    *totalSize = size;
+    return TRUE;
+}
+
+// queue data from multiple spans with a single free space check and a single publish
+BOOL CmqAddDataV(IN CMQ_BUFFER *buffer, IN const CMQ_SPAN *spans, IN UINT32 spanCount)
+{
+    UINT64 readCount, writeCount, totalSize, counter;
+    CMQ_BUFFER *spill;
+    UINT32 i;
+
+    CmqTrace("(%p, %p, %lu)", buffer, spans, spanCount);
+
+    if (!CmqGetSpansSize(spans, spanCount, &totalSize))
+        return FALSE;
+
+    if (totalSize == 0)
+        return TRUE;
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+        return CmqMpscAdd(buffer, spans, spanCount, totalSize);
+
+    spill = CmqSpillTarget(buffer, totalSize);
+    if (spill)
+    {
+        CmqSpillStart(buffer, spill, totalSize);
+        return CmqSpillProduced(buffer, CmqAddDataV(spill, spans, spanCount), totalSize);
+    }
+
+    writeCount = (UINT64) ReadNoFence64(&buffer->WriteCount);
+    readCount = (UINT64) ReadAcquire64(&buffer->ReadCount);
+
+    if (totalSize > buffer->Size - (writeCount - readCount))
+    {
+        LogDebug("(%p, %p, %lu): buffer too small (need %llx)", buffer, spans, spanCount, totalSize);
+        return CmqAdded(buffer, FALSE, totalSize, writeCount - readCount);
+    }
+
+    if (!CmqPrepareWrite(buffer, writeCount, totalSize))
+        return CmqAdded(buffer, FALSE, totalSize, writeCount - readCount);
+
+    counter = writeCount;
+    for (i = 0; i < spanCount; i++)
+    {
+        if (!CmqWriteAt(buffer, counter, spans[i].Data, spans[i].Size))
+            return CmqAdded(buffer, FALSE, totalSize, writeCount - readCount);
+        counter += spans[i].Size;
+    }
+
+    CmqPublish(buffer, counter);
+    return CmqAdded(buffer, TRUE, totalSize, writeCount + totalSize - readCount);
+}
+
+// dequeue data into multiple spans with a single release
+BOOL CmqGetDataV(IN CMQ_BUFFER *buffer, IN const CMQ_SPAN *spans, IN UINT32 spanCount, OUT UINT64 *dataSize, CMQ_UNDERFLOW_MODE underflowMode)
+{
+    UINT64 usedSize, mainSize = 0, totalSize, offset, chunk;
+    CMQ_BUFFER *spill = NULL;
+    UINT32 i;
+
+    CmqTrace("(%p, %p, %lu, %d)", buffer, spans, spanCount, underflowMode);
+
+    *dataSize = 0;
+    CmqDropExpired(buffer);
+    if (!CmqGetSpansSize(spans, spanCount, &totalSize))
+        return FALSE;
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+        usedSize = CmqMpscAvailable(buffer, totalSize);
+    else
+        usedSize = CmqGetQueued(buffer, &spill, &mainSize);
+
+    if (totalSize > usedSize)
+    {
+        if (underflowMode != CMQ_ALLOW_UNDERFLOW)
+        {
+            LogDebug("%p: underflow (requested %llx, got %llx)", buffer, totalSize, usedSize);
+            return FALSE;
+        }
+        totalSize = usedSize;
+    }
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        if (totalSize > 0)
+            CmqMpscGet(buffer, spans, spanCount, totalSize);
+        *dataSize = totalSize;
+        return TRUE;
+    }
+
+    offset = 0;
+    for (i = 0; i < spanCount && offset < totalSize; i++)
+    {
+        chunk = min(spans[i].Size, totalSize - offset);
+        CmqReadQueued(buffer, spill, mainSize, offset, spans[i].Data, chunk);
+        offset += chunk;
+    }
+
+    if (totalSize > 0)
+        CmqReleaseQueued(buffer, spill, mainSize, totalSize);
+
+    *dataSize = totalSize;
+    return TRUE;
+}
+
+// producer side: hand out free storage
+UINT64 CmqReserve(IN CMQ_BUFFER *buffer, IN UINT64 maxSize, OUT CMQ_SPAN spans[2])
+{
+    UINT64 writeCount, readCount, freeSize;
+    CMQ_BUFFER *spill;
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        LogWarning("%p: not supported for multi-producer buffers", buffer);
+        ZeroMemory(spans, 2 * sizeof(CMQ_SPAN));
+        return 0;
+    }
+
+    // CmqCommit needs to know where to publish, spilling starts there if anything is committed
+    spill = CmqSpillTarget(buffer, 1);
+    buffer->ReserveSpill = (spill != NULL);
+    if (spill)
+    {
+        freeSize = CmqReserve(spill, maxSize, spans);
+        buffer->ReservedSize = freeSize;
+        if (freeSize == 0)
+            CmqSpillProduced(buffer, FALSE, 0);
+        return freeSize;
+    }
+
+    writeCount = (UINT64) ReadNoFence64(&buffer->WriteCount);
+    readCount = (UINT64) ReadAcquire64(&buffer->ReadCount);
+    freeSize = buffer->Size - (writeCount - readCount);
+
+    if (maxSize != 0 && maxSize < freeSize)
+        freeSize = maxSize;
+
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+        freeSize = CmqChainReserveSpans(buffer, writeCount, freeSize, spans);
+    else if (buffer->Flags & CMQ_FLAG_SPILL_STORAGE)
+        freeSize = CmqSpillSpans(buffer, &buffer->WriteWindow, writeCount, freeSize, spans);
+    else
+        CmqRingSpans(buffer, writeCount, freeSize, spans);
+
+    buffer->ReservedSize = freeSize;
+    if (freeSize == 0) // counts as a failed add
+        CmqAdded(buffer, FALSE, 0, writeCount - readCount);
+
+    CmqTrace("(%p, %llx): %llx", buffer, maxSize, freeSize);
+    return freeSize;
+}
+
+// producer side: publish data written to reserved storage
+BOOL CmqCommit(IN CMQ_BUFFER *buffer, IN UINT64 dataSize)
+{
+    UINT64 writeCount;
+
+    CmqTrace("(%p, %llx)", buffer, dataSize);
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        LogWarning("%p: not supported for multi-producer buffers", buffer);
+        return FALSE;
+    }
+
+    // free space alone isn't enough: elastic buffers only have segments linked for the reserved spans
+    if (dataSize > buffer->ReservedSize)
+    {
+        LogWarning("%p: committing more than reserved (%llx > %llx)", buffer, dataSize, buffer->ReservedSize);
+        return FALSE;
+    }
+
+    // one commit per reservation
+    buffer->ReservedSize = 0;
+
+    if (buffer->ReserveSpill)
+    {
+        CmqSpillStart(buffer, buffer->Spill, dataSize);
+        return CmqSpillProduced(buffer, CmqCommit(buffer->Spill, dataSize), dataSize);
+    }
+
+    writeCount = (UINT64) ReadNoFence64(&buffer->WriteCount);
+    CmqPublish(buffer, writeCount + dataSize);
+    // the statistics can live with a stale read count
+    return CmqAdded(buffer, TRUE, dataSize, writeCount + dataSize - (UINT64) ReadNoFence64(&buffer->ReadCount));
+}
+
+// consumer side: hand out queued data without copying
+UINT64 CmqPeek(IN const CMQ_BUFFER *buffer, IN UINT64 maxSize, OUT CMQ_SPAN spans[2])
+{
+    UINT64 readCount, writeCount, usedSize;
+    CMQ_BUFFER *spill = CmqSpillSource(buffer);
+    CMQ_MPSC_HEADER *header;
+
+    if (spill)
+        return CmqPeek(spill, maxSize, spans);
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        // only the rest of the oldest write, the next one is behind a header
+        readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+        writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
+        header = CmqMpscHeader(buffer, readCount);
+        if (readCount == writeCount || ReadAcquire(&header->Busy))
+            usedSize = 0;
+        else
+            usedSize = header->Size - buffer->ReadOffset;
+
+        if (maxSize != 0 && maxSize < usedSize)
+            usedSize = maxSize;
+
+        CmqRingSpans(buffer, readCount + buffer->MpscHeaderSize + buffer->ReadOffset, usedSize, spans);
+        return usedSize;
+    }
+
+    readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
+    usedSize = writeCount - readCount;
+
+    if (maxSize != 0 && maxSize < usedSize)
+        usedSize = maxSize;
+
+    if (buffer->Flags & CMQ_FLAG_ELASTIC)
+        usedSize = CmqChainPeekSpans(buffer, readCount, usedSize, spans);
+    else if (buffer->Flags & CMQ_FLAG_SPILL_STORAGE) // the window is just the consumer's mapping cache
+        usedSize = CmqSpillSpans(buffer, (CMQ_SPILL_WINDOW *) &buffer->ReadWindow, readCount, usedSize, spans);
+    else
+        CmqRingSpans(buffer, readCount, usedSize, spans);
+
+    CmqTrace("(%p, %llx): %llx", buffer, maxSize, usedSize);
+    return usedSize;
+}
+
+// consumer side: release peeked data
+BOOL CmqConsume(IN CMQ_BUFFER *buffer, IN UINT64 dataSize)
+{
+    UINT64 readCount, writeCount, offset;
+    CMQ_BUFFER *spill;
+
+    CmqTrace("(%p, %llx)", buffer, dataSize);
+
+    // same choice as in CmqPeek: the main storage doesn't get new data while the spill storage isn't empty
+    spill = CmqSpillSource(buffer);
+    if (spill)
+    {
+        if (!CmqConsume(spill, dataSize))
+            return FALSE;
+        CmqSpillConsumed(buffer, spill);
+        return TRUE;
+    }
+
+    readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        offset = buffer->ReadOffset;
+        if (CmqMpscRead(buffer, NULL, dataSize, &readCount, &offset) != dataSize)
+        {
+            LogWarning("%p: consuming more than queued (%llx)", buffer, dataSize);
+            return FALSE;
+        }
+
+        CmqMpscRelease(buffer, readCount, offset, dataSize, FALSE);
+        return TRUE;
+    }
+
+    writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
+    if (dataSize > writeCount - readCount)
+    {
+        LogWarning("%p: consuming more than queued (%llx)", buffer, dataSize);
+        return FALSE;
+    }
+
+    CmqRelease(buffer, readCount + dataSize);
+    return TRUE;
+}
+
+// get used data size
+UINT64 CmqGetUsedSize(IN const CMQ_BUFFER *buffer)
+{
+    CMQ_BUFFER *spill;
+    CMQ_STATS_SHARD total;
+    UINT64 mainSize;
+    UINT64 usedSize = CmqGetQueued(buffer, &spill, &mainSize);
+    LONG64 queued;
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
+    {
+        // count payload of complete writes instead of claimed storage: bytes added to the main storage
+        // minus bytes consumed from it. The consumer can get ahead of a producer's count for a moment.
+        CmqSumStats(buffer, &total);
+        queued = total.BytesIn - ReadNoFence64(&buffer->SpilledBytes) - ReadNoFence64(&buffer->MpscConsumed);
+        usedSize = usedSize - mainSize + (queued > 0 ? (UINT64) queued : 0);
+    }
+
+    return usedSize;
+}
+
+// largest write that can succeed now
+UINT64 CmqGetFreeSize(IN const CMQ_BUFFER *buffer)
+{
+    CMQ_BUFFER *spill = CmqGetSpill(buffer);
+    UINT64 mainFree = buffer->Size - CmqUsed(buffer);
+
+    if (buffer->Flags & CMQ_FLAG_MPSC) // largest payload that still fits with a header
+        mainFree = mainFree >= buffer->MpscHeaderSize ? (mainFree - buffer->MpscHeaderSize) & ~(buffer->MpscHeaderSize - 1) : 0;
+
+    if (!spill)
+        return max(mainFree, buffer->SpillSize); // spill storage is created on demand
+
+    if (CmqUsed(spill) != 0)
+        return spill->Size - CmqUsed(spill);
+
+    return max(mainFree, spill->Size);
+}
+
+// block until used (data wait) or free (space wait) size is at least 'size'
+static DWORD CmqWait(IN CMQ_BUFFER *buffer, IN UINT64 size, IN DWORD timeout, IN BOOL waitForData)
+{
+    volatile LONG *waiters = waitForData ? &buffer->DataWaiters : &buffer->SpaceWaiters;
+    volatile LONG *signal = waitForData ? &buffer->DataSignal : &buffer->SpaceSignal;
+    ULONGLONG deadline = GetTickCount64() + timeout;
+    ULONGLONG now;
+    DWORD status = ERROR_SUCCESS;
+    LONG signalValue;
+    UINT64 available;
+    HANDLE event = NULL;
+
+    if (size > buffer->Size + buffer->SpillSize)
+    {
+        LogWarning("%p: waiting for %llx bytes, buffer size is %llx", buffer, size, buffer->Size + buffer->SpillSize);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (buffer->Flags & CMQ_FLAG_SHARED)
+    {
+        // before registering as a waiter, so a failure doesn't need undoing
+        event = CmqSharedEvent(buffer, waitForData);
+        if (!event)
+            return GetLastError();
+    }
+
+    InterlockedIncrement(waiters);
+    while (TRUE)
+    {
+        // read the signal before checking the condition, if it changes after that WaitOnAddress won't sleep
+        signalValue = ReadAcquire(signal);
+
+        if (!waitForData)
+            available = CmqGetFreeSize(buffer);
+        else if (buffer->Flags & CMQ_FLAG_MPSC) // data behind an incomplete write can't be read yet
+            available = CmqMpscAvailable(buffer, size);
+        else
+            available = CmqGetUsedSize(buffer);
+        if (available >= size)
+            break;
+
+        if (ReadAcquire(&buffer->WaitsAborted))
+        {
+            status = ERROR_OPERATION_ABORTED;
+            break;
+        }
+
+        if (timeout == INFINITE)
+        {
+            now = deadline = 0;
+        }
+        else
+        {
+            now = GetTickCount64();
+            if (now >= deadline)
+            {
+                status = ERROR_TIMEOUT;
+                break;
+            }
+        }
+
+        // auto-reset event: a signal while we weren't waiting yet leaves it set
+        if (event)
+            WaitForSingleObject(event, timeout == INFINITE ? INFINITE : (DWORD) (deadline - now));
+        else
+            WaitOnAddress(signal, &signalValue, sizeof(signalValue), timeout == INFINITE ? INFINITE : (DWORD) (deadline - now));
+    }
+    InterlockedDecrement(waiters);
+    return status;
+}
+
+DWORD CmqWaitForData(IN CMQ_BUFFER *buffer, IN UINT64 minSize, IN DWORD timeout)
+{
+    LogVerbose("(%p, %llx, %lu)", buffer, minSize, timeout);
+    return CmqWait(buffer, minSize, timeout, TRUE);
+}
+
+DWORD CmqWaitForSpace(IN CMQ_BUFFER *buffer, IN UINT64 size, IN DWORD timeout)
+{
+    LogVerbose("(%p, %llx, %lu)", buffer, size, timeout);
+    return CmqWait(buffer, size, timeout, FALSE);
+}
+
+void CmqAbortWaits(IN CMQ_BUFFER *buffer)
+{
+    LogDebug("%p", buffer);
+    InterlockedExchange(&buffer->WaitsAborted, TRUE);
+    InterlockedIncrement(&buffer->DataSignal);
+    WakeByAddressAll((PVOID) &buffer->DataSignal);
+    InterlockedIncrement(&buffer->SpaceSignal);
+    WakeByAddressAll((PVOID) &buffer->SpaceSignal);
+
+    if (buffer->Flags & CMQ_FLAG_SHARED)
+    {
+        CmqSharedWake(buffer, TRUE);
+        CmqSharedWake(buffer, FALSE);
+    }
+}
+
+// queue a whole record, it becomes visible to the consumer at once
+BOOL CmqAddRecord(IN CMQ_BUFFER *buffer, IN const void *data, IN UINT32 dataSize)
+{
+    CMQ_RECORD_HEADER header;
+    UINT64 readCount, writeCount, recordSize;
+    CMQ_BUFFER *spill;
 
-    if (bufferSize == 0)
+    CmqTrace("(%p, %p, %lx)", buffer, data, dataSize);
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
     {
-        LogWarning("size == 0");
-        return NULL;
+        LogWarning("%p: not supported for multi-producer buffers", buffer);
+        return FALSE;
     }
 
-    buffer = (CMQ_BUFFER *) malloc(sizeof(CMQ_BUFFER));
-    if (!buffer)
+    recordSize = sizeof(header) + (UINT64) dataSize;
+    spill = CmqSpillTarget(buffer, recordSize);
+    if (spill)
     {
-        LogError("out of memory");
-        return NULL;
+        CmqSpillStart(buffer, spill, recordSize);
+        return CmqSpillProduced(buffer, CmqAddRecord(spill, data, dataSize), recordSize);
     }
 
-    buffer->Size = bufferSize;
-    buffer->BufferStart = (BYTE *) malloc(buffer->Size);
-    buffer->DataStart = buffer->DataEnd = 0;
-    if (buffer->BufferStart == 0)
+    writeCount = (UINT64) ReadNoFence64(&buffer->WriteCount);
+    readCount = (UINT64) ReadAcquire64(&buffer->ReadCount);
+
+    if (recordSize > buffer->Size - (writeCount - readCount))
     {
-        free(buffer);
-        LogError("out of memory");
-        return NULL;
+        LogDebug("(%p, %p, %lx): buffer too small", buffer, data, dataSize);
+        return CmqAdded(buffer, FALSE, recordSize, writeCount - readCount);
     }
 
-    LogDebug("created %p", buffer);
-    return buffer;
+    if (!CmqPrepareWrite(buffer, writeCount, recordSize))
+        return CmqAdded(buffer, FALSE, recordSize, writeCount - readCount);
+
+    header.Size = dataSize;
+    if (!CmqWriteAt(buffer, writeCount, &header, sizeof(header))
+        || !CmqWriteAt(buffer, writeCount + sizeof(header), data, dataSize))
+        return CmqAdded(buffer, FALSE, recordSize, writeCount - readCount);
+    CmqPublish(buffer, writeCount + recordSize);
+    return CmqAdded(buffer, TRUE, recordSize, writeCount + recordSize - readCount);
 }
 
-// free memory and deinitialize
-void CmqDestroy(IN CMQ_BUFFER *buffer)
+// read the header of the record starting at 'readCount', FALSE if there's no complete record
+static BOOL CmqReadRecordHeader(IN const CMQ_BUFFER *buffer, IN UINT64 readCount, IN UINT64 writeCount,
+                                OUT CMQ_RECORD_HEADER *header, IN OUT CMQ_READ_CURSOR *cursor OPTIONAL)
 {
-    LogDebug("%p", buffer);
+    if (writeCount - readCount < sizeof(*header))
+        return FALSE;
 
-    free(buffer->BufferStart);
-    free(buffer);
+    CmqReadAt(buffer, readCount, header, sizeof(*header), cursor);
+    return writeCount - readCount >= sizeof(*header) + (UINT64) header->Size;
 }
 
-// zero-fill buffer, rewind internal pointer
-void CmqClear(IN CMQ_BUFFER *buffer)
+// records are never split between the main and spill storage
+BOOL CmqPeekRecordSize(IN const CMQ_BUFFER *buffer, OUT UINT32 *recordSize)
 {
-    LogDebug("%p", buffer);
+    UINT64 readCount, writeCount;
+    CMQ_RECORD_HEADER header;
+    CMQ_BUFFER *spill = CmqSpillSource(buffer);
+
+    if (spill)
+        return CmqPeekRecordSize(spill, recordSize);
+
+    readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
 
-    buffer->DataStart = buffer->DataEnd = 0;
-    ZeroMemory(buffer->BufferStart, buffer->Size);
+    if (!CmqReadRecordHeader(buffer, readCount, writeCount, &header, NULL))
+        return FALSE;
+
+    *recordSize = header.Size;
+    return TRUE;
 }
 
-// queue data to the buffer
-BOOL CmqAddData(IN CMQ_BUFFER *buffer, IN const void *inputData, IN UINT64 inputDataSize)
+// dequeue one record
+BOOL CmqGetRecord(IN CMQ_BUFFER *buffer, OUT void *data, IN OUT UINT32 *dataSize)
 {
-    BYTE *data = (BYTE *) inputData, *destination;
-    UINT64 freeSize, startToEnd, endToEnd;
+    UINT64 readCount, writeCount;
+    CMQ_RECORD_HEADER header;
+    CMQ_BUFFER *spill;
 
-    LogVerbose("(%p, %p, %llx)", buffer, data, inputDataSize);
+    CmqTrace("(%p, %p, %lx)", buffer, data, *dataSize);
 
-    if (buffer->DataEnd == NULL && buffer->DataStart != NULL)  // buffer full
+    CmqDropExpired(buffer);
+    spill = CmqSpillSource(buffer);
+    if (spill)
     {
-        LogDebug("(%p, %p, %llx): buffer full", buffer, data, inputDataSize);
-        return FALSE;
+        if (!CmqGetRecord(spill, data, dataSize))
+            return FALSE;
+        CmqSpillConsumed(buffer, spill);
+        return TRUE;
     }
 
-    if (inputDataSize == 0)
-        return TRUE;
+    readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
 
-    freeSize = CmqGetFreeSize(buffer);
+    if (!CmqReadRecordHeader(buffer, readCount, writeCount, &header, NULL))
+    {
+        *dataSize = 0;
+        return FALSE;
+    }
 
-    if (inputDataSize > freeSize)
+    if (header.Size > *dataSize)
     {
-        LogDebug("(%p, %p, %llx): buffer too small (free: %llx)", buffer, data, inputDataSize, freeSize);
+        LogDebug("%p: record too big (%lx > %lx)", buffer, header.Size, *dataSize);
+        *dataSize = header.Size;
         return FALSE;
     }
 
-    if (buffer->DataStart == NULL) // empty, initialize pointers
+    CmqReadAt(buffer, readCount + sizeof(header), data, header.Size, NULL);
+    CmqRelease(buffer, readCount + sizeof(header) + header.Size);
+    *dataSize = header.Size;
+    return TRUE;
+}
+
+// dequeue as many whole records as fit, with a single copy
+UINT32 CmqGetRecords(IN CMQ_BUFFER *buffer, OUT void *data, IN OUT UINT64 *dataSize, IN UINT32 maxRecords)
+{
+    UINT64 readCount, writeCount;
+    CMQ_RECORD_HEADER header;
+    UINT64 batchSize = 0;
+    UINT64 recordSize;
+    UINT32 count = 0;
+    CMQ_BUFFER *spill;
+    CMQ_READ_CURSOR cursor = { 0 };
+
+    CmqTrace("(%p, %p, %llx, %lu)", buffer, data, *dataSize, maxRecords);
+
+    CmqDropExpired(buffer);
+    // a batch comes from one storage only
+    spill = CmqSpillSource(buffer);
+    if (spill)
     {
-        buffer->DataStart = buffer->BufferStart;
-        buffer->DataEnd = buffer->BufferStart + inputDataSize - 1;
-        memcpy(buffer->BufferStart, data, inputDataSize);
-        return TRUE;
+        count = CmqGetRecords(spill, data, dataSize, maxRecords);
+        if (count > 0)
+            CmqSpillConsumed(buffer, spill);
+        return count;
     }
 
-    startToEnd = buffer->BufferStart + buffer->Size - 1 - buffer->DataStart;
-    endToEnd = buffer->BufferStart + buffer->Size - 1 - buffer->DataEnd;
+    readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
+
+    // just walk the headers to find out how much to copy
+    while (maxRecords == 0 || count < maxRecords)
+    {
+        if (!CmqReadRecordHeader(buffer, readCount + batchSize, writeCount, &header, &cursor))
+            break;
+
+        recordSize = sizeof(header) + (UINT64) header.Size;
+        if (batchSize + recordSize > *dataSize)
+            break;
 
-    destination = buffer->DataEnd + 1;
-    if (destination > buffer->BufferStart + buffer->Size - 1)
-        destination -= buffer->Size;
+        batchSize += recordSize;
+        count++;
+    }
 
-    if (buffer->DataStart == buffer->BufferStart ||
-        buffer->DataEnd == buffer->BufferStart + buffer->Size - 1 ||
-        endToEnd > startToEnd)
+    if (count > 0)
     {
-        // free space is contiguous
-        memcpy(destination, data, inputDataSize);
+        CmqReadAt(buffer, readCount, data, batchSize, NULL);
+        CmqRelease(buffer, readCount + batchSize);
     }
-    else
+
+    *dataSize = batchSize;
+    return count;
+}
+
+BOOL CmqSetSpillSize(IN CMQ_BUFFER *buffer, IN UINT64 spillSize)
+{
+    LogDebug("(%p, %llx)", buffer, spillSize);
+
+    if (buffer->Spill)
     {
-        // possibly two writes
-        if (inputDataSize <= endToEnd)
-        {
-            // just one, we fit in the tail free region
-            memcpy(destination, data, inputDataSize);
-        }
-        else
-        {
-            memcpy(destination, data, endToEnd);
-            memcpy(buffer->BufferStart, data + endToEnd, inputDataSize - endToEnd);
-        }
+        LogWarning("%p: spill storage already in use", buffer);
+        return FALSE;
     }
 
-    buffer->DataEnd += inputDataSize;
-    if (buffer->DataEnd > buffer->BufferStart + buffer->Size - 1)
-        buffer->DataEnd -= buffer->Size;
+    if (buffer->Flags & CMQ_FLAG_SHARED)
+    {
+        LogWarning("%p: spill storage is not supported for shared buffers", buffer);
+        return FALSE;
+    }
 
-    LogVerbose("%p: data start %llx, data end %llx", buffer, buffer->DataStart - buffer->BufferStart, buffer->DataEnd - buffer->BufferStart);
+    buffer->SpillSize = spillSize;
     return TRUE;
 }
 
-// dequeue data from the buffer
-// underflow = true: don't treat underflow as errors (reading empty buffer is ok etc)
-// dataSize = 0: read all (use carefully in case of buffer overruns)
-BOOL CmqGetData(IN CMQ_BUFFER *buffer, OUT void *outputData, IN OUT UINT64 *dataSize, CMQ_UNDERFLOW_MODE underflowMode)
+void CmqGetSpillStats(IN const CMQ_BUFFER *buffer, OUT CMQ_SPILL_STATS *stats)
 {
-    BYTE *data = (BYTE *) outputData;
-    UINT64 usedSize, usedAtEnd;
+    CMQ_BUFFER *spill = CmqGetSpill(buffer);
+    LARGE_INTEGER now, frequency;
+    LONG64 spillTime = ReadNoFence64(&buffer->SpillTime);
 
-    LogVerbose("(%p, %p, %llx, %d)", buffer, data, *dataSize, underflowMode);
-    if (buffer->DataStart == NULL)  // buffer empty
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    if (ReadAcquire(&buffer->Spilling))
+        spillTime += now.QuadPart - ReadNoFence64(&buffer->SpillStartTime);
+
+    stats->SpillSize = spill ? spill->Size : buffer->SpillSize;
+    stats->SpilledBytes = (UINT64) ReadNoFence64(&buffer->SpilledBytes);
+    stats->SpilledNow = spill ? CmqUsed(spill) : 0;
+    stats->SpillCount = (UINT64) ReadNoFence64(&buffer->SpillCount);
+    stats->SpillTimeMs = (UINT64) (spillTime * 1000 / frequency.QuadPart);
+}
+
+void CmqGetStats(IN const CMQ_BUFFER *buffer, OUT CMQ_STATS *stats)
+{
+    CMQ_STATS_SHARD total;
+    UINT64 queued;
+    UINT32 i;
+
+    CmqSumStats(buffer, &total);
+    stats->Size = buffer->Size;
+    stats->BytesIn = (UINT64) total.BytesIn;
+    // everything queued is either still there or gone, so the consumer doesn't need a counter
+    queued = CmqGetUsedSize(buffer);
+    stats->BytesOut = stats->BytesIn > queued ? stats->BytesIn - queued : 0;
+    stats->HighWatermark = (UINT64) total.HighWatermark;
+    stats->FailedAdds = (UINT64) total.FailedAdds;
+    for (i = 0; i < CMQ_STATS_BUCKETS; i++)
     {
-        if ((underflowMode == CMQ_ALLOW_UNDERFLOW) || (*dataSize == 0))
+        stats->Histogram[i] = (UINT64) total.Histogram[i];
+        stats->ReadHistogram[i] = (UINT64) ReadNoFence64(&buffer->ReadHistogram[i]);
+    }
+}
+
+CMQ_POOL *CmqCreatePool(IN UINT64 bufferSize, IN DWORD flags, IN DWORD preallocCount, IN DWORD maxFreeCount)
+{
+    CMQ_POOL *pool;
+    SIZE_T largePageSize;
+    BYTE *slab;
+    DWORD i;
+
+    LogDebug("size: 0x%llx bytes, flags 0x%lx, prealloc %lu, max free %lu", bufferSize, flags, preallocCount, maxFreeCount);
+
+    if (bufferSize == 0)
+    {
+        LogWarning("size == 0");
+        return NULL;
+    }
+
+    pool = (CMQ_POOL *) _aligned_malloc(sizeof(CMQ_POOL), MEMORY_ALLOCATION_ALIGNMENT);
+    if (!pool)
+    {
+        LogError("out of memory");
+        return NULL;
+    }
+
+    ZeroMemory(pool, sizeof(CMQ_POOL));
+    InitializeSListHead(&pool->FreeSlabs);
+    // storage size and offset stay aligned for CMQ_FLAG_MPSC headers
+    pool->BufferSize = (bufferSize + sizeof(CMQ_MPSC_STAMPED_HEADER) - 1) & ~((UINT64) sizeof(CMQ_MPSC_STAMPED_HEADER) - 1);
+    pool->SlabHeaderSize = (sizeof(CMQ_BUFFER) + CMQ_CACHE_LINE_SIZE - 1) & ~((SIZE_T) CMQ_CACHE_LINE_SIZE - 1);
+    pool->SlabSize = pool->SlabHeaderSize + (SIZE_T) pool->BufferSize;
+    pool->MaxFree = maxFreeCount;
+
+    if (flags & CMQ_POOL_LARGE_PAGES)
+    {
+        largePageSize = GetLargePageMinimum();
+        if (largePageSize == 0)
         {
-            *dataSize = 0;
-            return TRUE;
+            LogWarning("large pages not supported, using normal pages");
         }
         else
         {
-            *dataSize = 0;
-            return FALSE;
+            pool->SlabSize = (pool->SlabSize + largePageSize - 1) & ~(largePageSize - 1);
+            pool->LargePages = TRUE;
         }
     }
 
-    usedSize = CmqGetUsedSize(buffer);
+    for (i = 0; i < preallocCount; i++)
+    {
+        slab = CmqPoolAllocSlab(pool);
+        if (!slab)
+            break; // not fatal, buffers will be allocated on demand
 
-    if (*dataSize == 0)   // "read all"
+        InterlockedPushEntrySList(&pool->FreeSlabs, (PSLIST_ENTRY) slab);
+    }
+
+    LogDebug("created pool %p (slab size 0x%zx)", pool, pool->SlabSize);
+    return pool;
+}
+
+void CmqDestroyPool(IN CMQ_POOL *pool)
+{
+    PSLIST_ENTRY slab;
+
+    LogDebug("%p", pool);
+
+    if (ReadNoFence64(&pool->InUse) != 0)
     {
-        *dataSize = usedSize;
+        // better leak than free storage that's still in use
+        LogError("%p: %lld buffers still in use, not destroying", pool, ReadNoFence64(&pool->InUse));
+        return;
+    }
+
+    while ((slab = InterlockedPopEntrySList(&pool->FreeSlabs)) != NULL)
+        VirtualFree(slab, 0, MEM_RELEASE);
+
+    _aligned_free(pool);
+}
+
+CMQ_BUFFER *CmqCreateFromPool(IN CMQ_POOL *pool, IN DWORD flags)
+{
+    CMQ_BUFFER *buffer;
+    BYTE *slab;
+
+    CmqTrace("(%p, 0x%lx)", pool, flags);
+
+    if (flags & (CMQ_FLAG_MIRRORED | CMQ_FLAG_ELASTIC))
+        LogWarning("%p: mirrored/elastic storage is not supported for pool buffers, ignoring", pool);
+
+    slab = (BYTE *) InterlockedPopEntrySList(&pool->FreeSlabs);
+    if (slab)
+    {
+        InterlockedIncrement64(&pool->Reused);
     }
     else
     {
-        if (*dataSize > usedSize) // underflow
-        {
-            if (underflowMode == CMQ_ALLOW_UNDERFLOW)
-            {
-                *dataSize = usedSize;
-            }
-            else
-            {
-                LogDebug("%p: underflow (requested %llx, got %llx)", buffer, *dataSize, usedSize);
-                *dataSize = 0;
-                return FALSE;
-            }
-        }
+        slab = CmqPoolAllocSlab(pool);
+        if (!slab)
+            return NULL;
+    }
+
+    InterlockedIncrement64(&pool->InUse);
+
+    buffer = (CMQ_BUFFER *) slab;
+    ZeroMemory(buffer, sizeof(CMQ_BUFFER));
+    buffer->Size = pool->BufferSize;
+    buffer->BufferStart = slab + pool->SlabHeaderSize;
+    buffer->Pool = pool;
+
+    if (((flags & CMQ_FLAG_MPSC) && !CmqInitMpsc(buffer, flags)) ||
+        ((flags & CMQ_FLAG_TIMESTAMPS) && !CmqInitTimestamps(buffer)))
+    {
+        LogError("out of memory");
+        _aligned_free(buffer->StatShards);
+        InterlockedDecrement64(&pool->InUse);
+        CmqPoolFreeSlab(pool, slab);
+        return NULL;
+    }
+
+    CmqInitStatsScale(buffer);
+    CmqTrace("created %p", buffer);
+    return buffer;
+}
+
+void CmqGetPoolStats(IN const CMQ_POOL *pool, OUT CMQ_POOL_STATS *stats)
+{
+    stats->BufferSize = pool->BufferSize;
+    stats->SlabSize = pool->SlabSize;
+    stats->LargePages = pool->LargePages;
+    stats->Allocated = (UINT64) ReadNoFence64(&pool->Allocated);
+    stats->Released = (UINT64) ReadNoFence64(&pool->Released);
+    stats->Reused = (UINT64) ReadNoFence64(&pool->Reused);
+    stats->InUse = (UINT64) ReadNoFence64(&pool->InUse);
+    stats->Free = QueryDepthSList((PSLIST_HEADER) &pool->FreeSlabs);
+}
+
+BOOL CmqSetTtl(IN CMQ_BUFFER *buffer, IN DWORD ttlMs)
+{
+    LogDebug("(%p, %lu)", buffer, ttlMs);
+
+    if (!(buffer->Flags & CMQ_FLAG_TIMESTAMPS))
+    {
+        LogWarning("%p: not a timestamped buffer", buffer);
+        return FALSE;
     }
 
-    if (buffer->DataStart <= buffer->DataEnd)
+    WriteNoFence64(&buffer->Ttl, (LONG64) ttlMs * buffer->TimestampFrequency / 1000);
+    return TRUE;
+}
+
+// consumer side: drop whole chunks older than 'ttl' from the head of one storage, returns bytes dropped
+static UINT64 CmqExpire(IN CMQ_BUFFER *buffer, IN LONG64 ttl)
+{
+    UINT64 readCount = (UINT64) ReadNoFence64(&buffer->ReadCount);
+    UINT64 writeCount = (UINT64) ReadAcquire64(&buffer->WriteCount);
+    UINT64 counter = readCount;
+    UINT64 dropped = 0;
+    UINT64 index, end;
+    LONG64 chunks = 0;
+    CMQ_MPSC_STAMPED_HEADER *header;
+    CMQ_TIMESTAMP *entry;
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    if (buffer->Flags & CMQ_FLAG_MPSC)
     {
-        // contiguous data region
-        memcpy(data, buffer->DataStart, *dataSize);
+        if (buffer->ReadOffset != 0)
+            return 0; // partially consumed
+
+        while (counter != writeCount)
+        {
+            header = (CMQ_MPSC_STAMPED_HEADER *) CmqMpscHeader(buffer, counter);
+            if (ReadAcquire(&header->Header.Busy) || now.QuadPart - header->Time <= ttl)
+                break;
+
+            dropped += header->Header.Size;
+            counter += CMQ_MPSC_RECORD_SIZE(buffer, header->Header.Size);
+            chunks++;
+        }
+
+        if (chunks > 0)
+            CmqMpscRelease(buffer, counter, 0, dropped, TRUE);
     }
     else
     {
-        usedAtEnd = buffer->BufferStart + buffer->Size - buffer->DataStart;
-        if (*dataSize <= usedAtEnd)
+        if (!buffer->Timestamps || readCount != buffer->ChunkStart)
+            return 0; // partially consumed
+
+        index = (UINT64) ReadNoFence64(&buffer->TimestampRead);
+        end = (UINT64) ReadAcquire64(&buffer->TimestampWrite);
+        for (; index != end; index++)
         {
-            memcpy(data, buffer->DataStart, *dataSize);
+            entry = &buffer->Timestamps[index % CMQ_TIMESTAMP_COUNT];
+            // the timestamp is published before the data
+            if (entry->End > writeCount || now.QuadPart - entry->Time <= ttl)
+                break;
+
+            counter = entry->End;
+            chunks++;
         }
-        else
+
+        if (chunks > 0)
         {
-            memcpy(data, buffer->DataStart, usedAtEnd);
-            memcpy((data + usedAtEnd), buffer->BufferStart, *dataSize - usedAtEnd);
+            dropped = counter - readCount;
+            buffer->ChunkStart = counter;
+            // before CmqRelease so the dropped chunks aren't accounted as consumed
+            WriteRelease64(&buffer->TimestampRead, (LONG64) index);
+            CmqRelease(buffer, counter);
         }
     }
 
-    buffer->DataStart += *dataSize;
-    if (buffer->DataStart > buffer->BufferStart + buffer->Size - 1)
-        buffer->DataStart -= buffer->Size;
+    WriteNoFence64(&buffer->DroppedChunks, ReadNoFence64(&buffer->DroppedChunks) + chunks);
+    WriteNoFence64(&buffer->DroppedBytes, ReadNoFence64(&buffer->DroppedBytes) + (LONG64) dropped);
+    return dropped;
+}
+
+UINT64 CmqDropExpired(IN CMQ_BUFFER *buffer)
+{
+    LONG64 ttl = ReadNoFence64(&buffer->Ttl);
+    CMQ_BUFFER *spill;
+    UINT64 dropped, spillDropped;
+
+    if (ttl == 0)
+        return 0;
+
+    dropped = CmqExpire(buffer, ttl);
 
-    if (usedSize - *dataSize == 0) // buffer empty
+    // spilled data is newer, it can only expire if the main storage is empty
+    spill = CmqSpillSource(buffer);
+    if (spill && (spill->Flags & CMQ_FLAG_TIMESTAMPS))
     {
-        buffer->DataStart = NULL;
+        spillDropped = CmqExpire(spill, ttl);
+        if (spillDropped > 0)
+        {
+            dropped += spillDropped;
+            CmqSpillConsumed(buffer, spill);
+        }
     }
 
-    LogVerbose("%p: data start %llx, data end %llx", buffer, buffer->DataStart - buffer->BufferStart, buffer->DataEnd - buffer->BufferStart);
-    return TRUE;
+    if (dropped > 0)
+        LogDebug("%p: dropped 0x%llx expired bytes", buffer, dropped);
+    return dropped;
 }
 
-// get used data size
-UINT64 CmqGetUsedSize(IN const CMQ_BUFFER *buffer)
+static void CmqAddLatencyStats(IN const CMQ_BUFFER *buffer, IN OUT CMQ_LATENCY_STATS *stats)
 {
-    if (buffer->DataStart == NULL || buffer->BufferStart == NULL || buffer->Size == 0)
-        return 0;
+    UINT64 maxDelayUs;
+    UINT32 i;
 
-    if (buffer->DataStart <= buffer->DataEnd) // data in one consecutive block
-        return (buffer->DataEnd - buffer->DataStart + 1);
-    else
-        return (buffer->DataEnd + buffer->Size - buffer->DataStart + 1);
+    if (!(buffer->Flags & CMQ_FLAG_TIMESTAMPS))
+        return;
+
+    stats->Chunks += (UINT64) ReadNoFence64(&buffer->Chunks);
+    stats->TotalDelayUs += (UINT64) ReadNoFence64(&buffer->TotalDelay) * 1000000 / (UINT64) buffer->TimestampFrequency;
+    maxDelayUs = (UINT64) ReadNoFence64(&buffer->MaxDelay) * 1000000 / (UINT64) buffer->TimestampFrequency;
+    stats->MaxDelayUs = max(stats->MaxDelayUs, maxDelayUs);
+    stats->DroppedChunks += (UINT64) ReadNoFence64(&buffer->DroppedChunks);
+    stats->DroppedBytes += (UINT64) ReadNoFence64(&buffer->DroppedBytes);
+    stats->UntrackedChunks += (UINT64) ReadNoFence64(&buffer->UntrackedChunks);
+    for (i = 0; i < CMQ_LATENCY_BUCKETS; i++)
+        stats->Histogram[i] += (UINT64) ReadNoFence64(&buffer->DelayHistogram[i]);
 }
 
-UINT64 CmqGetFreeSize(IN const CMQ_BUFFER *buffer)
+void CmqGetLatencyStats(IN const CMQ_BUFFER *buffer, OUT CMQ_LATENCY_STATS *stats)
+{
+    CMQ_BUFFER *spill = CmqGetSpill(buffer);
+
+    ZeroMemory(stats, sizeof(CMQ_LATENCY_STATS));
+    CmqAddLatencyStats(buffer, stats);
+    if (spill)
+        CmqAddLatencyStats(spill, stats);
+}
+
+CMQ_BUFFER *CmqCreateShared(IN const WCHAR *name, IN UINT64 bufferSize, IN PSECURITY_ATTRIBUTES securityAttributes OPTIONAL)
+{
+    UINT64 sectionSize = CMQ_SHARED_STORAGE_OFFSET + bufferSize;
+    CMQ_SHARED_HEADER *header;
+    CMQ_BUFFER *buffer;
+    HANDLE section;
+    HANDLE events[2] = { NULL, NULL };
+    WCHAR eventName[MAX_PATH + 8];
+    DWORD i;
+
+    LogDebug("'%s', size 0x%llx", name, bufferSize);
+
+    if (bufferSize == 0)
+    {
+        LogWarning("size == 0");
+        return NULL;
+    }
+
+    // room for the event name suffix
+    if (FAILED(StringCchLengthW(name, MAX_PATH - 6, NULL)))
+    {
+        LogWarning("name too long");
+        return NULL;
+    }
+
+    section = CreateFileMappingW(INVALID_HANDLE_VALUE, securityAttributes, PAGE_READWRITE,
+                                 (DWORD) (sectionSize >> 32), (DWORD) sectionSize, name);
+    if (!section)
+    {
+        win_perror("CreateFileMapping");
+        return NULL;
+    }
+
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        LogError("section '%s' already exists", name);
+        CloseHandle(section);
+        return NULL;
+    }
+
+    buffer = (CMQ_BUFFER *) MapViewOfFile(section, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    CloseHandle(section); // the views keep the section alive
+    if (!buffer)
+    {
+        win_perror("MapViewOfFile");
+        return NULL;
+    }
+
+    // the section is zero-filled, so are counters and stats
+    buffer->Size = bufferSize;
+    buffer->Flags = CMQ_FLAG_SHARED;
+    CmqInitStatsScale(buffer);
+    header = (CMQ_SHARED_HEADER *) (buffer + 1);
+    header->BufferSize = sizeof(CMQ_BUFFER);
+    StringCchCopyW(header->Name, ARRAYSIZE(header->Name), name);
+
+    // same access rules as the section, waiters and signalers only open them
+    for (i = 0; i < ARRAYSIZE(events); i++)
+    {
+        CmqSharedEventName(header, i != 0, eventName);
+        events[i] = CreateEventW(securityAttributes, FALSE, FALSE, eventName);
+        if (!events[i])
+        {
+            win_perror("CreateEvent");
+            goto fail;
+        }
+
+        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            LogError("event '%s' already exists", eventName);
+            goto fail;
+        }
+    }
+    if (!CmqSharedEventsAdd(buffer, events, ERROR_SUCCESS))
+        goto fail;
+
+    // CmqOpenShared checks this first
+    WriteRelease(&header->Magic, CMQ_SHARED_MAGIC);
+
+    LogDebug("created %p", buffer);
+    return buffer;
+
+fail:
+    for (i = 0; i < ARRAYSIZE(events); i++)
+    {
+        if (events[i])
+            CloseHandle(events[i]);
+    }
+    UnmapViewOfFile(buffer);
+    return NULL;
+}
+
+CMQ_BUFFER *CmqOpenShared(IN const WCHAR *name)
 {
-    return buffer->Size - CmqGetUsedSize(buffer);
+    MEMORY_BASIC_INFORMATION info;
+    CMQ_SHARED_HEADER *header;
+    CMQ_BUFFER *buffer;
+    HANDLE section;
+    HANDLE events[2] = { NULL, NULL };
+    WCHAR eventName[MAX_PATH + 8];
+    DWORD error = ERROR_SUCCESS;
+    DWORD i;
+
+    LogDebug("'%s'", name);
+
+    section = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+    if (!section)
+    {
+        win_perror("OpenFileMapping");
+        return NULL;
+    }
+
+    buffer = (CMQ_BUFFER *) MapViewOfFile(section, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    CloseHandle(section);
+    if (!buffer)
+    {
+        win_perror("MapViewOfFile");
+        return NULL;
+    }
+
+    // the view is the whole section, storage must fit in it
+    header = (CMQ_SHARED_HEADER *) (buffer + 1);
+    if (VirtualQuery(buffer, &info, sizeof(info)) == 0
+        || info.RegionSize < CMQ_SHARED_STORAGE_OFFSET
+        || ReadAcquire(&header->Magic) != CMQ_SHARED_MAGIC
+        || header->BufferSize != sizeof(CMQ_BUFFER)
+        || buffer->Flags != CMQ_FLAG_SHARED
+        || buffer->Size == 0
+        || buffer->Size > info.RegionSize - CMQ_SHARED_STORAGE_OFFSET)
+    {
+        LogError("'%s' is not a compatible shared buffer", name);
+        UnmapViewOfFile(buffer);
+        return NULL;
+    }
+
+    // Open the events now and keep them: they're gone once the creator and all other views
+    // closed them. The buffer still works without them, only waits fail.
+    for (i = 0; i < ARRAYSIZE(events); i++)
+    {
+        CmqSharedEventName(header, i != 0, eventName);
+        events[i] = OpenEventW(SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, eventName);
+        if (!events[i])
+        {
+            error = GetLastError();
+            LogWarning("'%s': wait events are gone (error %lu), waits on %p will fail", name, error, buffer);
+            if (events[0])
+                CloseHandle(events[0]);
+            events[0] = NULL;
+            break;
+        }
+    }
+
+    if (!CmqSharedEventsAdd(buffer, events, error))
+    {
+        if (events[0])
+            CloseHandle(events[0]);
+        if (events[1])
+            CloseHandle(events[1]);
+        UnmapViewOfFile(buffer);
+        return NULL;
+    }
+
+    LogDebug("opened %p, size 0x%llx", buffer, buffer->Size);
+    return buffer;
 }
@@ -0,0 +1,332 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// Multi-threaded and file checksums on top of the portable CRC core in crc32.c.
+// Chunks are checksummed by thread pool workers and merged with Crc32_Combine.
+
+#include <windows.h>
+#include "crc32.h"
+
+#define CRC32_MAX_THREADS 64
+#define CRC32_PARALLEL_MIN_CHUNK (4 * 1024 * 1024) // smaller chunks aren't worth a worker
+#define CRC32_FILE_WINDOW (64 * 1024 * 1024)       // multiple of the allocation granularity
+
+// Work shared by the calling thread and the pool workers. Set up once and reused for every
+// buffer, each buffer is split into ChunkCount chunks that are claimed through NextChunk.
+typedef struct _CRC32_JOB
+{
+    PTP_WORK Work;             // NULL if only the calling thread is used
+    unsigned int ThreadCount;
+    const unsigned char *Buffer;
+    size_t Size;
+    size_t ChunkSize;
+    LONG ChunkCount;
+    volatile LONG NextChunk;
+    volatile LONG PageError;   // a chunk is in a view of a file that couldn't be read
+    unsigned long Crc32[CRC32_MAX_THREADS];
+} CRC32_JOB;
+
+static void Crc32_RunChunks(CRC32_JOB *job)
+{
+    LONG i;
+    size_t size;
+
+    for (;;)
+    {
+        i = InterlockedIncrement(&job->NextChunk) - 1;
+        if (i >= job->ChunkCount)
+            break;
+
+        size = (i == job->ChunkCount - 1) ? job->Size - i * job->ChunkSize : job->ChunkSize;
+        __try
+        {
+            job->Crc32[i] = Crc32_ComputeBuf(0, job->Buffer + i * job->ChunkSize, size);
+        }
+        __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+        {
+            InterlockedExchange(&job->PageError, TRUE);
+        }
+    }
+}
+
+static VOID CALLBACK Crc32_WorkCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work)
+{
+    UNREFERENCED_PARAMETER(instance);
+    UNREFERENCED_PARAMETER(work);
+
+    Crc32_RunChunks((CRC32_JOB *) context);
+}
+
+static void Crc32_JobInit(CRC32_JOB *job, unsigned int threadCount)
+{
+    SYSTEM_INFO systemInfo;
+
+    if (threadCount == 0)
+    {
+        GetSystemInfo(&systemInfo);
+        threadCount = systemInfo.dwNumberOfProcessors;
+    }
+
+    ZeroMemory(job, sizeof(*job));
+    job->ThreadCount = (unsigned int) min(threadCount, CRC32_MAX_THREADS);
+    if (job->ThreadCount > 1)
+        job->Work = CreateThreadpoolWork(Crc32_WorkCallback, job, NULL);
+
+    // no pool work object, checksum everything in the calling thread
+    if (!job->Work)
+        job->ThreadCount = 1;
+}
+
+static void Crc32_JobClose(CRC32_JOB *job)
+{
+    if (job->Work)
+        CloseThreadpoolWork(job->Work);
+}
+
+// Accumulate the CRC of 'buffer' into '*crc32'. The calling thread processes chunks along with
+// the workers. Returns FALSE if a chunk couldn't be read, '*crc32' is unchanged then.
+// In the single chunk case a page error is raised in the calling thread as usual.
+static BOOL Crc32_JobRun(CRC32_JOB *job, unsigned long *crc32, const void *buffer, size_t bufferSize)
+{
+    unsigned long crc;
+    LONG chunkCount;
+    LONG i;
+
+    chunkCount = (LONG) min(job->ThreadCount, bufferSize / CRC32_PARALLEL_MIN_CHUNK);
+    if (chunkCount <= 1)
+    {
+        *crc32 = Crc32_ComputeBuf(*crc32, buffer, bufferSize);
+        return TRUE;
+    }
+
+    job->Buffer = (const unsigned char *) buffer;
+    job->Size = bufferSize;
+    job->ChunkSize = bufferSize / chunkCount;
+    job->ChunkCount = chunkCount;
+    job->NextChunk = 0;
+    job->PageError = FALSE;
+
+    for (i = 1; i < chunkCount; i++)
+        SubmitThreadpoolWork(job->Work);
+
+    Crc32_RunChunks(job);
+    WaitForThreadpoolWorkCallbacks(job->Work, FALSE);
+
+    if (job->PageError)
+        return FALSE;
+
+    crc = *crc32;
+    for (i = 0; i < chunkCount; i++)
+        crc = Crc32_Combine(crc, job->Crc32[i], (i == chunkCount - 1) ? bufferSize - i * job->ChunkSize : job->ChunkSize);
+    *crc32 = crc;
+    return TRUE;
+}
+
+/*----------------------------------------------------------------------------*\
+ *  NAME:
+ *     Crc32_ComputeBufParallel() - computes the CRC-32 value of a memory
+ *                                  buffer using multiple threads
+ *  DESCRIPTION:
+ *     Same as Crc32_ComputeBuf(), but the buffer is split into one chunk
+ *     per thread (at least 4 MB each) that are checksummed by thread pool
+ *     workers and the calling thread, partial CRCs are merged with
+ *     Crc32_Combine(). If the pool can't be used everything is processed
+ *     by the calling thread. EXCEPTION_IN_PAGE_ERROR in a worker (buffer
+ *     is a view of a file that can't be read) is raised in the calling
+ *     thread.
+ *  ARGUMENTS:
+ *     inCrc32     - accumulated CRC-32 value, must be 0 on first call
+ *     buf         - buffer to compute CRC-32 value for
+ *     bufLen      - number of bytes in buffer
+ *     threadCount - maximum number of threads including the calling one,
+ *                   0 for the number of logical processors (max 64)
+ *  RETURNS:
+ *     crc32 - computed CRC-32 value
+ *  ERRORS:
+ *     (no errors are possible)
+ \*----------------------------------------------------------------------------*/
+
+unsigned long Crc32_ComputeBufParallel(unsigned long inCrc32, const void *buffer, size_t bufferSize, unsigned int threadCount)
+{
+    CRC32_JOB job;
+    unsigned long crc32 = inCrc32;
+    BOOL success;
+
+    if (threadCount == 1 || bufferSize < 2 * CRC32_PARALLEL_MIN_CHUNK)
+        return Crc32_ComputeBuf(inCrc32, buffer, bufferSize);
+
+    Crc32_JobInit(&job, threadCount);
+    success = Crc32_JobRun(&job, &crc32, buffer, bufferSize);
+    Crc32_JobClose(&job);
+
+    if (!success)
+        RaiseException(EXCEPTION_IN_PAGE_ERROR, 0, 0, NULL);
+    return crc32;
+}
+
+typedef BOOL (WINAPI *PFN_PREFETCHVIRTUALMEMORY)(HANDLE, ULONG_PTR, WIN32_MEMORY_RANGE_ENTRY *, ULONG);
+
+// PrefetchVirtualMemory is only present on Windows 8+, resolve it dynamically so the DLL still loads
+// on Windows 7 (files are read on demand there, without the readahead)
+static PFN_PREFETCHVIRTUALMEMORY g_PrefetchVirtualMemory;
+static INIT_ONCE g_PrefetchInit = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK Crc32_InitPrefetch(PINIT_ONCE initOnce, PVOID param, PVOID *context)
+{
+    HMODULE kernel32;
+
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(param);
+    UNREFERENCED_PARAMETER(context);
+
+    kernel32 = GetModuleHandle(L"kernel32.dll");
+    if (kernel32)
+        g_PrefetchVirtualMemory = (PFN_PREFETCHVIRTUALMEMORY) GetProcAddress(kernel32, "PrefetchVirtualMemory");
+    return TRUE;
+}
+
+// map the window of the file starting at 'position' (rounded down to the allocation granularity)
+// and start reading it in the background
+static DWORD Crc32_MapWindow(HANDLE mapping, UINT64 position, UINT64 end, DWORD granularity,
+                             BYTE **view, UINT64 *viewStart, SIZE_T *viewSize)
+{
+    WIN32_MEMORY_RANGE_ENTRY range;
+
+    *viewStart = position - position % granularity;
+    *viewSize = (SIZE_T) min(CRC32_FILE_WINDOW, end - *viewStart);
+    *view = (BYTE *) MapViewOfFile(mapping, FILE_MAP_READ, (DWORD) (*viewStart >> 32), (DWORD) *viewStart, *viewSize);
+    if (!*view)
+        return GetLastError();
+
+    // readahead hint, the CRC of the current window overlaps with the I/O
+    InitOnceExecuteOnce(&g_PrefetchInit, Crc32_InitPrefetch, NULL, NULL);
+    if (g_PrefetchVirtualMemory)
+    {
+        range.VirtualAddress = *view;
+        range.NumberOfBytes = *viewSize;
+        g_PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+    return ERROR_SUCCESS;
+}
+
+DWORD Crc32_ComputeFile(IN HANDLE file, IN UINT64 offset, IN UINT64 length, IN unsigned int threadCount,
+                        IN OUT unsigned long *crc32, OUT CRC32_FILE_STATS *stats OPTIONAL)
+{
+    LARGE_INTEGER fileSize, start, now, frequency;
+    SYSTEM_INFO systemInfo;
+    CRC32_JOB job;
+    HANDLE mapping = NULL;
+    BYTE *view = NULL;
+    BYTE *nextView = NULL;
+    UINT64 position, end, nextStart;
+    UINT64 viewStart = 0;
+    SIZE_T viewSize = 0, nextSize = 0;
+    unsigned long crc = *crc32;
+    DWORD status = ERROR_SUCCESS;
+
+    QueryPerformanceCounter(&start);
+
+    if (!GetFileSizeEx(file, &fileSize))
+        return GetLastError();
+
+    if (offset > (UINT64) fileSize.QuadPart)
+        return ERROR_INVALID_PARAMETER;
+
+    end = (UINT64) fileSize.QuadPart;
+    if (length != 0 && length < end - offset)
+        end = offset + length;
+
+    if (end > offset)
+    {
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping)
+            return GetLastError();
+
+        // workers are set up once and reused for every window
+        Crc32_JobInit(&job, threadCount);
+        GetSystemInfo(&systemInfo);
+        position = offset;
+        status = Crc32_MapWindow(mapping, position, end, systemInfo.dwAllocationGranularity, &view, &viewStart, &viewSize);
+
+        while (view)
+        {
+            // map the next window first so it's read while we compute this one
+            nextView = NULL;
+            nextStart = viewStart + viewSize;
+            if (nextStart < end)
+                status = Crc32_MapWindow(mapping, nextStart, end, systemInfo.dwAllocationGranularity, &nextView, &nextStart, &nextSize);
+
+            __try
+            {
+                if (!Crc32_JobRun(&job, &crc, view + (position - viewStart), (size_t) (viewStart + viewSize - position)))
+                    status = ERROR_READ_FAULT;
+            }
+            __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+            {
+                status = ERROR_READ_FAULT;
+            }
+
+            UnmapViewOfFile(view);
+            if (status != ERROR_SUCCESS)
+            {
+                if (nextView)
+                    UnmapViewOfFile(nextView);
+                break;
+            }
+
+            position = viewStart + viewSize;
+            view = nextView;
+            viewStart = nextStart;
+            viewSize = nextSize;
+        }
+
+        Crc32_JobClose(&job);
+        CloseHandle(mapping);
+        if (status != ERROR_SUCCESS)
+            return status;
+    }
+
+    *crc32 = crc;
+    if (stats)
+    {
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+        stats->Bytes = end - offset;
+        stats->TimeUs = (UINT64) (now.QuadPart - start.QuadPart) * 1000000 / (UINT64) frequency.QuadPart;
+        stats->BytesPerSecond = stats->TimeUs ? stats->Bytes * 1000000 / stats->TimeUs : 0;
+    }
+    return ERROR_SUCCESS;
+}
+
+DWORD Crc32_ComputeFileByName(IN const WCHAR *path, IN UINT64 offset, IN UINT64 length, IN unsigned int threadCount,
+                              IN OUT unsigned long *crc32, OUT CRC32_FILE_STATS *stats OPTIONAL)
+{
+    HANDLE file;
+    DWORD status;
+
+    file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return GetLastError();
+
+    status = Crc32_ComputeFile(file, offset, length, threadCount, crc32, stats);
+    CloseHandle(file);
+    return status;
+}
@@ -42,8 +42,294 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#    include <windows.h>
+#else
+#    include <pthread.h>
+#endif
+// CRC32_NO_PCLMUL builds the table code only (to test the slicing paths on x86)
+#if (defined(_M_X64) || defined(_M_IX86)) && !defined(CRC32_NO_PCLMUL)
+#    include <intrin.h>
+#    include <wmmintrin.h>
+#    define CRC32_PCLMUL
+#    define CRC32_TARGET_PCLMUL
+#elif (defined(__x86_64__) || defined(__i386__)) && !defined(CRC32_NO_PCLMUL)
+#    include <cpuid.h>
+#    include <wmmintrin.h>
+#    define CRC32_PCLMUL
+#    define CRC32_TARGET_PCLMUL __attribute__((target("pclmul,sse2")))
+#endif
 #include "crc32.h"
 
+static const unsigned long crcTable[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
+    0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
+    0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
+    0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
+    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
+    0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
+    0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
+    0xB6662D3D, 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F,
+    0x9FBFE4A5, 0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB,
+    0x086D3D2D, 0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA,
+    0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE,
+    0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A,
+    0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409,
+    0xCE61E49F, 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739,
+    0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
+    0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268,
+    0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0,
+    0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8,
+    0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF,
+    0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703,
+    0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7,
+    0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D, 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
+    0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE,
+    0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6,
+    0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D,
+    0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5,
+    0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605,
+    0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D };
+
+/*----------------------------------------------------------------------------*\
+ *  Slicing-by-8/16 tables: crcSliceTable[k][b] is the CRC of byte 'b'
+ *  followed by 'k' zero bytes, so 8 or 16 input bytes are folded into the
+ *  CRC with one table lookup each and no dependency between the lookups.
+ *  crcSliceTable[0] is crcTable. Built on first use (16 KB), together with
+ *  the CPU feature check for the carry-less multiply path below.
+ \*----------------------------------------------------------------------------*/
+
+#define CRC32_SLICES 16
+#define CRC32_SLICE8_MIN 64     // shorter buffers aren't worth touching the tables
+#define CRC32_SLICE16_MIN 1024  // slicing-by-16 needs twice the cache, pays off on long runs
+
+#define CRC32_POLY 0xEDB88320    // bit-reflected gzip polynomial
+
+static uint32_t crcSliceTable[CRC32_SLICES][256];
+static uint32_t crcX2nTable[32];  // x^(2^n) mod P, for Crc32_Combine
+#ifdef CRC32_PCLMUL
+static int crcHavePclmul;
+#endif
+#ifdef _WIN32
+static INIT_ONCE crcInit = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t crcInit = PTHREAD_ONCE_INIT;
+#endif
+
+// a * b mod P, polynomials are bit-reflected (x^0 is the top bit)
+static uint32_t Crc32_MultModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+static void Crc32_InitTables(void)
+{
+    uint32_t crc32;
+    int i, k;
+#ifdef CRC32_PCLMUL
+    unsigned int cpuInfo[4] = { 0 };
+#endif
+
+    for (i = 0; i < 256; i++)
+    {
+        crc32 = (uint32_t) crcTable[i];
+        crcSliceTable[0][i] = crc32;
+        for (k = 1; k < CRC32_SLICES; k++)
+        {
+            crc32 = (crc32 >> 8) ^ (uint32_t) crcTable[crc32 & 0xFF];
+            crcSliceTable[k][i] = crc32;
+        }
+    }
+
+    // x^1, then square
+    crcX2nTable[0] = 1u << 30;
+    for (k = 1; k < 32; k++)
+        crcX2nTable[k] = Crc32_MultModP(crcX2nTable[k - 1], crcX2nTable[k - 1]);
+
+#ifdef CRC32_PCLMUL
+    // leaf 1: ECX bit 1 is PCLMULQDQ, EDX bit 26 is SSE2
+#    ifdef _MSC_VER
+    __cpuid((int *) cpuInfo, 1);
+#    else
+    __get_cpuid(1, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3]);
+#    endif
+    crcHavePclmul = (cpuInfo[2] & (1u << 1)) && (cpuInfo[3] & (1u << 26));
+#endif
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK Crc32_InitOnce(PINIT_ONCE initOnce, PVOID parameter, PVOID *context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+
+    Crc32_InitTables();
+    return TRUE;
+}
+#endif
+
+static void Crc32_Init(void)
+{
+#ifdef _WIN32
+    InitOnceExecuteOnce(&crcInit, Crc32_InitOnce, NULL, NULL);
+#else
+    pthread_once(&crcInit, Crc32_InitTables);
+#endif
+}
+
+// little-endian load, all targets (Windows, x86 and ARM Linux) are little-endian
+static uint32_t Crc32_Load(const unsigned char *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// original byte-at-a-time loop, 'crc32' is not inverted
+static uint32_t Crc32_Bytes(uint32_t crc32, const unsigned char *byteBuf, size_t bufferSize)
+{
+    size_t i;
+
+    for (i = 0; i < bufferSize; i++)
+    {
+        crc32 = (crc32 >> 8) ^ (uint32_t) crcTable[(crc32 ^ byteBuf[i]) & 0xFF];
+    }
+    return crc32;
+}
+
+static uint32_t Crc32_Slice8(uint32_t crc32, const unsigned char *byteBuf, size_t bufferSize)
+{
+    uint32_t (*t)[256] = crcSliceTable;
+    uint32_t one, two;
+
+    for (; bufferSize >= 8; bufferSize -= 8, byteBuf += 8)
+    {
+        one = Crc32_Load(byteBuf) ^ crc32;
+        two = Crc32_Load(byteBuf + 4);
+        crc32 = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+                t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+    }
+    return Crc32_Bytes(crc32, byteBuf, bufferSize);
+}
+
+static uint32_t Crc32_Slice16(uint32_t crc32, const unsigned char *byteBuf, size_t bufferSize)
+{
+    uint32_t (*t)[256] = crcSliceTable;
+    uint32_t one, two, three, four;
+
+    for (; bufferSize >= 16; bufferSize -= 16, byteBuf += 16)
+    {
+        one = Crc32_Load(byteBuf) ^ crc32;
+        two = Crc32_Load(byteBuf + 4);
+        three = Crc32_Load(byteBuf + 8);
+        four = Crc32_Load(byteBuf + 12);
+        crc32 = t[15][one & 0xFF] ^ t[14][(one >> 8) & 0xFF] ^ t[13][(one >> 16) & 0xFF] ^ t[12][one >> 24] ^
+                t[11][two & 0xFF] ^ t[10][(two >> 8) & 0xFF] ^ t[9][(two >> 16) & 0xFF] ^ t[8][two >> 24] ^
+                t[7][three & 0xFF] ^ t[6][(three >> 8) & 0xFF] ^ t[5][(three >> 16) & 0xFF] ^ t[4][three >> 24] ^
+                t[3][four & 0xFF] ^ t[2][(four >> 8) & 0xFF] ^ t[1][(four >> 16) & 0xFF] ^ t[0][four >> 24];
+    }
+    return Crc32_Slice8(crc32, byteBuf, bufferSize);
+}
+
+#ifdef CRC32_PCLMUL
+/*----------------------------------------------------------------------------*\
+ *  Folding with carry-less multiplication, see Intel's "Fast CRC Computation
+ *  for Generic Polynomials Using PCLMULQDQ Instruction". Four 128-bit lanes
+ *  are folded 64 bytes at a time, then folded into one lane, reduced to 64
+ *  bits and Barrett-reduced to 32 bits. Constants are x^n mod P for the
+ *  bit-reflected gzip polynomial, P' is floor(x^64 / P).
+ *  'bufferSize' must be a multiple of 16, at least 64.
+ \*----------------------------------------------------------------------------*/
+
+CRC32_TARGET_PCLMUL
+static uint32_t Crc32_Pclmul(uint32_t crc32, const unsigned char *byteBuf, size_t bufferSize)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4); // x^(4*128+32), x^(4*128-32)
+    const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0); // x^(128+32), x^(128-32)
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163CD6124);            // x^64
+    const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641); // P', P
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) byteBuf), _mm_cvtsi32_si128((int) crc32));
+    x2 = _mm_loadu_si128((const __m128i *) (byteBuf + 16));
+    x3 = _mm_loadu_si128((const __m128i *) (byteBuf + 32));
+    x4 = _mm_loadu_si128((const __m128i *) (byteBuf + 48));
+    byteBuf += 64;
+    bufferSize -= 64;
+
+    // fold 4 lanes forward by 512 bits
+    for (; bufferSize >= 64; bufferSize -= 64, byteBuf += 64)
+    {
+        t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((const __m128i *) byteBuf));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128((const __m128i *) (byteBuf + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128((const __m128i *) (byteBuf + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128((const __m128i *) (byteBuf + 48)));
+    }
+
+    // fold 4 lanes into one, then the remaining 16-byte blocks
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), t1);
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), t1);
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), t1);
+    for (; bufferSize >= 16; bufferSize -= 16, byteBuf += 16)
+    {
+        t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11),
+                                         _mm_loadu_si128((const __m128i *) byteBuf)), t1);
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
 /*----------------------------------------------------------------------------*\
  *  NAME:
  *     Crc32_ComputeBuf() - computes the CRC-32 value of a memory buffer
@@ -52,6 +338,9 @@
  *     The 'inCrc32' gives a previously accumulated CRC-32 value to allow
  *     a CRC to be generated for multiple sequential buffer-fuls of data.
  *     The 'inCrc32' for the first buffer must be zero.
+ *     Long buffers are folded with PCLMULQDQ if the CPU has it, otherwise
+ *     processed 8 or 16 bytes at a time (slicing-by-8/16); the result
+ *     doesn't depend on the method.
  *  ARGUMENTS:
  *     inCrc32 - accumulated CRC-32 value, must be 0 on first call
  *     buf     - buffer to compute CRC-32 value for
@@ -64,58 +353,69 @@
 
 unsigned long Crc32_ComputeBuf(unsigned long inCrc32, const void *buffer, size_t bufferSize)
 {
-    static const unsigned long crcTable[256] = {
-        0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
-        0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
-        0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
-        0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-        0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
-        0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
-        0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
-        0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-        0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
-        0xB6662D3D, 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F,
-        0x9FBFE4A5, 0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB,
-        0x086D3D2D, 0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-        0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA,
-        0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE,
-        0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A,
-        0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-        0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409,
-        0xCE61E49F, 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
-        0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739,
-        0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
-        0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268,
-        0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0,
-        0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8,
-        0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-        0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF,
-        0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703,
-        0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7,
-        0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D, 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
-        0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE,
-        0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
-        0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6,
-        0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-        0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D,
-        0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5,
-        0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605,
-        0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-        0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D };
-    unsigned long crc32;
-    unsigned char *byteBuf;
-    size_t i;
+    uint32_t crc32;
+    const unsigned char *byteBuf;
+#ifdef CRC32_PCLMUL
+    size_t blocks;
+#endif
 
     /** accumulate crc32 for buffer **/
-    crc32 = inCrc32 ^ 0xFFFFFFFF;
-    byteBuf = (unsigned char*) buffer;
-    for (i = 0; i < bufferSize; i++)
+    crc32 = (uint32_t) inCrc32 ^ 0xFFFFFFFF;
+    byteBuf = (const unsigned char*) buffer;
+    if (bufferSize < CRC32_SLICE8_MIN)
+    {
+        crc32 = Crc32_Bytes(crc32, byteBuf, bufferSize);
+    }
+    else
     {
-        crc32 = (crc32 >> 8) ^ crcTable[(crc32 ^ byteBuf[i]) & 0xFF];
+        Crc32_Init();
+#ifdef CRC32_PCLMUL
+        if (crcHavePclmul)
+        {
+            blocks = bufferSize & ~(size_t) 15;
+            crc32 = Crc32_Pclmul(crc32, byteBuf, blocks);
+            return(Crc32_Bytes(crc32, byteBuf + blocks, bufferSize - blocks) ^ 0xFFFFFFFF);
+        }
+#endif
+        if (bufferSize < CRC32_SLICE16_MIN)
+            crc32 = Crc32_Slice8(crc32, byteBuf, bufferSize);
+        else
+            crc32 = Crc32_Slice16(crc32, byteBuf, bufferSize);
     }
     return(crc32 ^ 0xFFFFFFFF);
 }
 
+/*----------------------------------------------------------------------------*\
+ *  NAME:
+ *     Crc32_Combine() - combines CRC-32 values of two adjacent buffers
+ *  DESCRIPTION:
+ *     Computes the CRC-32 value of buffer A followed by buffer B from
+ *     the CRC-32 values of A and B: the CRC of A is shifted by 'lenB'
+ *     zero bytes (multiplied by x^(8*lenB) mod P in O(log lenB) steps).
+ *  ARGUMENTS:
+ *     crcA - CRC-32 value of the first buffer
+ *     crcB - CRC-32 value of the second buffer (with inCrc32 = 0)
+ *     lenB - length of the second buffer
+ *  RETURNS:
+ *     crc32 - CRC-32 value of both buffers
+ *  ERRORS:
+ *     (no errors are possible)
+ \*----------------------------------------------------------------------------*/
+
+unsigned long Crc32_Combine(unsigned long crcA, unsigned long crcB, unsigned long long lenB)
+{
+    uint32_t shift = 1u << 31; // x^0
+    int k = 3; // lenB is in bytes, x^(2^3) is one byte
+
+    Crc32_Init();
+    for (; lenB; lenB >>= 1, k++)
+    {
+        if (lenB & 1)
+            shift = Crc32_MultModP(crcX2nTable[k & 31], shift);
+    }
+    return Crc32_MultModP(shift, (uint32_t) crcA) ^ (uint32_t) crcB;
+}
+
 /*----------------------------------------------------------------------------*\
  *  END OF MODULE: crc32.c
  \*----------------------------------------------------------------------------*/
@@ -21,6 +21,9 @@
 
 #include <windows.h>
 
+// utf8-conv.c
+void ThreadConvertersFree(void);
+
 BOOL APIENTRY DllMain(HMODULE module, DWORD reasonForCall, void *reserved)
 {
     UNREFERENCED_PARAMETER(reserved);
@@ -31,6 +34,9 @@ BOOL APIENTRY DllMain(HMODULE module, DWORD reasonForCall, void *reserved)
         break;
 
     case DLL_PROCESS_DETACH:
+        // on process exit other threads are already gone, nothing to clean up
+        if (reserved == NULL)
+            ThreadConvertersFree();
         break;
     }
     return TRUE;
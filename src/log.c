@@ -483,9 +483,10 @@ static void _LogFormatUnlocked(IN int level, IN BOOL raw, IN const char *functio
         }
     }
 
-    if (ERROR_SUCCESS != ConvertUTF16ToUTF8(g_Buffer, g_BufferUtf8, &bufferSize))
+    // lossy: log unpaired surrogates (e.g. from a corrupted file name) as U+FFFD instead of dropping the message
+    if (ERROR_SUCCESS != ConvertUTF16ToUTF8Lossy(g_Buffer, wcslen(g_Buffer), g_BufferUtf8, RTL_NUMBER_OF(g_BufferUtf8), &bufferSize, NULL))
     {
-        fwprintf(stderr, L"_LogFormat: ConvertUTF16ToUTF8(buffer) failed: error %d\n", GetLastError());
+        fwprintf(stderr, L"_LogFormat: ConvertUTF16ToUTF8Lossy(buffer) failed: error %d\n", GetLastError());
         goto cleanup;
     }
 
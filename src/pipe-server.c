@@ -30,6 +30,13 @@
 
 #include "pipe-server.h"
 
+// Free write buffers kept for reuse by new clients.
+#define QPS_MAX_FREE_BUFFERS 16
+
+// Write buffers store each QpsWrite() with a header (multi-producer, timestamped), this is the most
+// it can add to a write, so a single write of InternalBufferSize bytes still fits.
+#define QPS_WRITE_OVERHEAD 32
+
 typedef struct _PIPE_CLIENT
 {
     LIST_ENTRY ListEntry;
@@ -40,6 +47,11 @@ typedef struct _PIPE_CLIENT
     CMQ_BUFFER *WriteBuffer;
     BOOL Disconnecting;
     CRITICAL_SECTION Lock;
+    // ReadBuffer is a single-producer/single-consumer queue: the reader thread is the only producer,
+    // ReadLock serializes application threads calling QpsRead for the same client.
+    // WriteBuffer is multi-producer, application threads call QpsWrite without locking
+    // and the writer thread is the only consumer.
+    CRITICAL_SECTION ReadLock;
     HANDLE ReaderThread;
     HANDLE WriterThread;
     LONG RefCount;
@@ -51,6 +63,10 @@ typedef struct _PIPE_SERVER
     WCHAR PipeName[256];
     DWORD PipeBufferSize;
     DWORD InternalBufferSize;
+    UINT64 SpillSize;
+    CMQ_POOL *WriteBufferPool;
+    DWORD WriteTtl;
+    BOOL LatencyStats;
     DWORD WriteTimeout;
     PSECURITY_ATTRIBUTES SecurityAttributes;
     LONGLONG NumberClients;
@@ -94,7 +110,7 @@ static void QpsDisconnectClientInternal(
 DWORD QpsCreate(
     IN  PWCHAR PipeName, // This is a client->server pipe name (clients write, server reads). server->client pipes have "-%PID%" appended.
     IN  DWORD PipeBufferSize, // Pipe read/write buffer size. Shouldn't be too big.
-    IN  DWORD InternalBufferSize, // Internal read/write buffer (per client).
+    IN  DWORD InternalBufferSize, // Internal read/write buffer limit (per client). Read buffer memory is allocated on demand, write buffers come from a pool.
     IN  DWORD WriteTimeout, // If a client doesn't read written data in this amount of milliseconds, it's disconnected.
     IN  QPS_CLIENT_CONNECTED ConnectCallback, // "Client connected" callback.
     IN  QPS_CLIENT_DISCONNECTED DisconnectCallback OPTIONAL, // "Client disconnected" callback.
@@ -116,6 +132,7 @@ DWORD QpsCreate(
     StringCbCopyW((*Server)->PipeName, sizeof((*Server)->PipeName), PipeName);
     (*Server)->PipeBufferSize = PipeBufferSize;
     (*Server)->InternalBufferSize = InternalBufferSize;
+    (*Server)->SpillSize = QPS_DEFAULT_SPILL_SIZE;
     (*Server)->WriteTimeout = WriteTimeout;
     (*Server)->SecurityAttributes = SecurityAttributes;
 
@@ -128,6 +145,11 @@ DWORD QpsCreate(
 
     InitializeCriticalSection(&(*Server)->Lock);
 
+    // client write buffers are fully allocated (multi-producer), recycle them across connections
+    (*Server)->WriteBufferPool = CmqCreatePool((UINT64) InternalBufferSize + QPS_WRITE_OVERHEAD, 0, 0, QPS_MAX_FREE_BUFFERS);
+    if ((*Server)->WriteBufferPool == NULL)
+        goto cleanup;
+
     (*Server)->AcceptConnections = TRUE;
 
     Status = ERROR_SUCCESS;
@@ -175,6 +197,16 @@ void QpsDestroy(
         QpsDisconnectClientInternal(Server, clientIds[clientCount], FALSE, FALSE);
     }
 
+    if (Server->WriteBufferPool)
+    {
+        CMQ_POOL_STATS poolStats;
+
+        CmqGetPoolStats(Server->WriteBufferPool, &poolStats);
+        LogDebug("write buffer pool: %llu slabs allocated, %llu reused, %llu released",
+                 poolStats.Allocated, poolStats.Reused, poolStats.Released);
+        CmqDestroyPool(Server->WriteBufferPool);
+    }
+
     DeleteCriticalSection(&Server->Lock);
     ZeroMemory(Server, sizeof(PIPE_SERVER));
     free(Server);
@@ -240,6 +272,51 @@ static PPIPE_CLIENT QpsGetClient(
     return QpsGetClientRaw(Server, ClientId, TRUE);
 }
 
+// Log buffer usage, so InternalBufferSize can be sized from real data.
+static void QpsLogBufferStats(
+    IN  PPIPE_CLIENT Client,
+    IN  CMQ_BUFFER *Buffer,
+    IN  PWCHAR Name
+    )
+{
+    CMQ_SPILL_STATS spillStats;
+    CMQ_LATENCY_STATS latencyStats;
+    CMQ_STATS stats;
+    WCHAR histogram[CMQ_STATS_BUCKETS * 21 + 1] = L"";
+    WCHAR readHistogram[CMQ_STATS_BUCKETS * 21 + 1] = L"";
+    WCHAR *end = histogram;
+    WCHAR *readEnd = readHistogram;
+    size_t remaining = ARRAYSIZE(histogram);
+    size_t readRemaining = ARRAYSIZE(readHistogram);
+    int i;
+
+    CmqGetStats(Buffer, &stats);
+    for (i = 0; i < CMQ_STATS_BUCKETS; i++)
+    {
+        StringCchPrintfExW(end, remaining, &end, &remaining, 0, L" %llu", stats.Histogram[i]);
+        StringCchPrintfExW(readEnd, readRemaining, &readEnd, &readRemaining, 0, L" %llu", stats.ReadHistogram[i]);
+    }
+
+    LogDebug("[%lld] %s buffer: size 0x%llx, in 0x%llx, out 0x%llx, high watermark 0x%llx, %llu failed adds, occupancy (10%% steps, spill) at adds:%s, at reads:%s",
+             Client->Id, Name, stats.Size, stats.BytesIn, stats.BytesOut, stats.HighWatermark, stats.FailedAdds, histogram, readHistogram);
+
+    if (CmqGetFlags(Buffer) & CMQ_FLAG_TIMESTAMPS)
+    {
+        CmqGetLatencyStats(Buffer, &latencyStats);
+        if (latencyStats.Chunks > 0)
+            LogDebug("[%lld] %s buffer: %llu chunks, queueing delay avg %llu us, max %llu us",
+                     Client->Id, Name, latencyStats.Chunks, latencyStats.TotalDelayUs / latencyStats.Chunks, latencyStats.MaxDelayUs);
+        if (latencyStats.DroppedChunks > 0)
+            LogInfo("[%lld] %s buffer: dropped %llu expired chunks, 0x%llx bytes",
+                    Client->Id, Name, latencyStats.DroppedChunks, latencyStats.DroppedBytes);
+    }
+
+    CmqGetSpillStats(Buffer, &spillStats);
+    if (spillStats.SpillCount > 0)
+        LogInfo("[%lld] %s buffer spilled %llu times, 0x%llx bytes, %llu ms",
+                Client->Id, Name, spillStats.SpillCount, spillStats.SpilledBytes, spillStats.SpillTimeMs);
+}
+
 // Release the client (decreases the client's refcount).
 // Server or client lock must *NOT* be held.
 static void QpsReleaseClient(
@@ -259,10 +336,13 @@ static void QpsReleaseClient(
         // Free client's data.
         // This should only occur on disconnection as reader/writer threads always have a ref to client's data.
         LogDebug("[%lld] freeing client data %p", Client->Id, Client);
+        QpsLogBufferStats(Client, Client->ReadBuffer, L"read");
+        QpsLogBufferStats(Client, Client->WriteBuffer, L"write");
         CmqDestroy(Client->ReadBuffer);
         CmqDestroy(Client->WriteBuffer);
 
         DeleteCriticalSection(&Client->Lock);
+        DeleteCriticalSection(&Client->ReadLock);
 
         RemoveEntryList(&Client->ListEntry);
 
@@ -293,26 +373,34 @@ static DWORD WINAPI QpsReaderThread(
     PIPE_SERVER server = param->Server;
     PPIPE_CLIENT client = QpsGetClient(server, param->ClientId);
     HANDLE pipe = client->ReadPipe;
-    PVOID buffer = malloc(server->PipeBufferSize);
+    CMQ_SPAN spans[2];
     DWORD transferred;
 
     LogVerbose("[%lld] (%p) start", client->Id, client);
-    if (!buffer)
-    {
-        LogError("no memory");
-        QpsReleaseClient(server, client);
-        QpsDisconnectClientInternal(server, param->ClientId, FALSE, TRUE);
-        free(param);
-        return 1;
-    }
 
     // This thread endlessly tries to read from the client's read pipe.
-    // Read data is enqueued into the internal buffer.
+    // Data is read directly into the internal buffer's storage.
+    // We're the only producer for the read buffer, no locking needed.
     while (TRUE)
     {
+        if (CmqReserve(client->ReadBuffer, server->PipeBufferSize, spans) == 0)
+        {
+            // both the buffer and its spill storage are full, stop reading until QpsRead catches up
+            LogWarning("[%lld] read buffer full, waiting", client->Id);
+            if (CmqWaitForSpace(client->ReadBuffer, 1, INFINITE) != ERROR_SUCCESS) // aborted on disconnect
+            {
+                LogDebug("[%lld] client is disconnecting, exiting", client->Id);
+                QpsReleaseClient(server, client);
+                free(param);
+                return 1;
+            }
+            continue;
+        }
+
+        // only fill the first span, the rest will be read in the next iteration
         LogVerbose("[%lld] reading...", client->Id);
         // reading will fail even if blocked when we call CancelIo() from QpsDisconnectClient
-        if (!ReadFile(pipe, buffer, server->PipeBufferSize, &transferred, NULL)) // this can block
+        if (!ReadFile(pipe, spans[0].Data, (DWORD)spans[0].Size, &transferred, NULL)) // this can block
         {
             // win_perror("ReadFile");
             LogWarning("[%lld] read failed", client->Id);
@@ -320,38 +408,24 @@ static DWORD WINAPI QpsReaderThread(
             QpsReleaseClient(server, client);
             QpsDisconnectClientInternal(server, param->ClientId, FALSE, TRUE);
             free(param);
-            free(buffer);
             return 1;
         }
-        // disconnect could happen after a successful read but before entering the client lock below
+        // disconnect could happen after a successful read
         if (client->Disconnecting)
         {
             LogDebug("[%lld] client is disconnecting, exiting", client->Id);
             QpsReleaseClient(server, client);
             free(param);
-            free(buffer);
             return 1;
         }
 
-        // we have some data from the pipe, add it to the read buffer
-        EnterCriticalSection(&client->Lock);
+        // we have some data from the pipe, make it visible in the read buffer
         LogVerbose("[%lld] read %lu 0x%lx", client->Id, transferred, transferred);
+        CmqCommit(client->ReadBuffer, transferred);
 
-        if (!CmqAddData(client->ReadBuffer, buffer, transferred))
-        {
-            // FIXME: block here until there's space
-            LeaveCriticalSection(&client->Lock);
-            LogError("[%lld] read buffer full", client->Id);
-            QpsReleaseClient(server, client);
-            QpsDisconnectClientInternal(server, param->ClientId, FALSE, TRUE);
-            free(param);
-            free(buffer);
-            return 1;
-        }
-        LeaveCriticalSection(&client->Lock);
-
+        // the consumer never modifies the storage and we're the only producer, so the data stays intact here
         if (param->Server->ReadCallback)
-            param->Server->ReadCallback(param->Server, client->Id, buffer, transferred, param->Server->UserContext);
+            param->Server->ReadCallback(param->Server, client->Id, spans[0].Data, transferred, param->Server->UserContext);
     }
 }
 
@@ -363,8 +437,10 @@ static DWORD WINAPI QpsWriterThread(
     PIPE_SERVER server = param->Server;
     PPIPE_CLIENT client = QpsGetClient(server, param->ClientId);
     HANDLE pipe = client->WritePipe;
-    PVOID data = malloc(server->InternalBufferSize);
+    PVOID data = malloc(server->PipeBufferSize);
+    CMQ_SPAN spans[2];
     UINT64 size;
+    int i;
 
     if (!data)
     {
@@ -376,13 +452,14 @@ static DWORD WINAPI QpsWriterThread(
     }
 
     // This thread endlessly tries to flush the client's write buffer to the client's write pipe.
+    // CmqPeek only returns (the rest of) the oldest QpsWrite() chunk: big chunks are written directly
+    // from the internal buffer's storage, small ones are gathered into 'data' to write many at once.
+    // We're the only consumer for the write buffer, no locking needed.
     while (TRUE)
     {
-        EnterCriticalSection(&client->Lock);
         // if the client is disconnecting, QpsWrite() calls will fail so no new data may be added to the write buffer
         if (client->Disconnecting)
         {
-            LeaveCriticalSection(&client->Lock);
             LogDebug("[%lld] client is disconnecting, exiting", client->Id);
             QpsReleaseClient(server, client);
             free(param);
@@ -390,25 +467,29 @@ static DWORD WINAPI QpsWriterThread(
             return 1;
         }
 
-        size = CmqGetUsedSize(client->WriteBuffer);
-        if (size > 0)
+        CmqDropExpired(client->WriteBuffer); // only if there's a TTL
+        size = CmqPeek(client->WriteBuffer, 0, spans);
+        if (size == 0)
         {
-            // there's data to write
-            if (!CmqGetData(client->WriteBuffer, data, &size, CMQ_NO_UNDERFLOW))
-            { // shouldn't happen
-                LeaveCriticalSection(&client->Lock);
-                LogError("CmqGetData(client->WriteBuffer) failed");
-                QpsReleaseClient(server, client);
-                QpsDisconnectClientInternal(server, param->ClientId, TRUE, FALSE);
-                free(param);
-                free(data);
-                return 1;
-            }
-            LeaveCriticalSection(&client->Lock);
+            CmqWaitForData(client->WriteBuffer, 1, INFINITE); // aborted on disconnect
+            continue;
+        }
+
+        if (size < server->PipeBufferSize)
+        {
+            size = server->PipeBufferSize;
+            CmqGetData(client->WriteBuffer, data, &size, CMQ_ALLOW_UNDERFLOW);
+            spans[0].Data = data;
+            spans[0].Size = size;
+            spans[1].Size = 0;
+        }
 
-            LogVerbose("[%lld] writing %lu 0x%lx", client->Id, size, size);
+        for (i = 0; i < 2 && spans[i].Size > 0; i++)
+        {
+            // there's data to write
+            LogVerbose("[%lld] writing %llu 0x%llx", client->Id, spans[i].Size, spans[i].Size);
             // writing will fail even if blocked when we call CancelIo() from QpsDisconnectClient
-            if (!QioWriteBuffer(pipe, data, (DWORD)size)) // this can block
+            if (!QioWriteBuffer(pipe, spans[i].Data, (DWORD)spans[i].Size)) // this can block
             {
                 // win_perror("QioWriteBuffer");
                 LogWarning("[%lld] write failed", client->Id);
@@ -419,11 +500,9 @@ static DWORD WINAPI QpsWriterThread(
                 return 1;
             }
         }
-        else
-            LeaveCriticalSection(&client->Lock);
 
-        if (size == 0)
-            Sleep(1);
+        if (spans[0].Data != data)
+            CmqConsume(client->WriteBuffer, size);
     }
 }
 
@@ -450,20 +529,27 @@ static DWORD QpsConnectClient(
     client->Id = ClientId;
 
     InitializeCriticalSection(&client->Lock);
+    InitializeCriticalSection(&client->ReadLock);
 
-    client->ReadBuffer = CmqCreate(Server->InternalBufferSize);
+    client->ReadBuffer = CmqCreateEx(Server->InternalBufferSize, CMQ_FLAG_ELASTIC);
     if (client->ReadBuffer == NULL)
     {
         LeaveCriticalSection(&Server->Lock);
         return ERROR_NOT_ENOUGH_MEMORY;
     }
+    CmqSetSpillSize(client->ReadBuffer, Server->SpillSize);
 
-    client->WriteBuffer = CmqCreate(Server->InternalBufferSize);
+    // timestamps cost a bigger write header and a clock read per write, only when needed
+    client->WriteBuffer = CmqCreateFromPool(Server->WriteBufferPool,
+                                            CMQ_FLAG_MPSC | ((Server->WriteTtl != 0 || Server->LatencyStats) ? CMQ_FLAG_TIMESTAMPS : 0));
     if (client->WriteBuffer == NULL)
     {
         LeaveCriticalSection(&Server->Lock);
         return ERROR_NOT_ENOUGH_MEMORY;
     }
+    CmqSetSpillSize(client->WriteBuffer, Server->SpillSize);
+    if (Server->WriteTtl != 0)
+        CmqSetTtl(client->WriteBuffer, Server->WriteTtl);
 
     client->WritePipe = WritePipe;
     client->ReadPipe = ReadPipe;
@@ -561,6 +647,10 @@ static void QpsDisconnectClientInternal(
     client->Disconnecting = TRUE;
     LogInfo("[%lld] (%p) disconnecting, WriterExiting %d, ReaderExiting %d", ClientId, client, WriterExiting, ReaderExiting);
 
+    // wake the writer thread and QpsRead callers
+    CmqAbortWaits(client->ReadBuffer);
+    CmqAbortWaits(client->WriteBuffer);
+
     if (!WriterExiting)
     {
         // wait for the writer thread to exit
@@ -614,6 +704,33 @@ static void QpsDisconnectClientInternal(
         Server->DisconnectCallback(Server, ClientId, Server->UserContext);
 }
 
+void QpsSetSpillSize(
+    IN  PIPE_SERVER Server,
+    IN  UINT64 SpillSize
+    )
+{
+    LogDebug("spill size 0x%llx", SpillSize);
+    Server->SpillSize = SpillSize;
+}
+
+void QpsSetWriteTtl(
+    IN  PIPE_SERVER Server,
+    IN  DWORD TtlMs
+    )
+{
+    LogDebug("write TTL %lu ms", TtlMs);
+    Server->WriteTtl = TtlMs;
+}
+
+void QpsSetLatencyStats(
+    IN  PIPE_SERVER Server,
+    IN  BOOL Enable
+    )
+{
+    LogDebug("latency stats %d", Enable);
+    Server->LatencyStats = Enable;
+}
+
 // Returns only on error. At that point the server state is undefined, call QpsDestroy().
 DWORD QpsMainLoop(
     PIPE_SERVER Server
@@ -706,6 +823,7 @@ DWORD QpsRead(
 {
     UINT64 size;
     BOOL ret;
+    DWORD status;
     PPIPE_CLIENT client = QpsGetClient(Server, ClientId);
 
     LogVerbose("[%lld] size %lu", ClientId, DataSize);
@@ -717,9 +835,9 @@ DWORD QpsRead(
     {
         // get data from the read buffer if available
         size = DataSize;
-        EnterCriticalSection(&client->Lock);
+        EnterCriticalSection(&client->ReadLock);
         ret = CmqGetData(client->ReadBuffer, Data, &size, CMQ_NO_UNDERFLOW);
-        LeaveCriticalSection(&client->Lock);
+        LeaveCriticalSection(&client->ReadLock);
 
         if (!ret)
         {
@@ -732,7 +850,13 @@ DWORD QpsRead(
                 return ERROR_BROKEN_PIPE;
             }
 
-            Sleep(1); // don't congest the lock
+            // aborted on disconnect, we'll catch that above
+            status = CmqWaitForData(client->ReadBuffer, DataSize, INFINITE);
+            if (status != ERROR_SUCCESS && status != ERROR_OPERATION_ABORTED)
+            {
+                QpsReleaseClient(Server, client);
+                return status;
+            }
         }
     } while (!ret);
 
@@ -764,9 +888,7 @@ DWORD QpsWrite(
 
     // add data to the write queue
     // it will be flushed to the client pipe by the background writer thread
-    EnterCriticalSection(&client->Lock);
     ret = CmqAddData(client->WriteBuffer, Data, DataSize);
-    LeaveCriticalSection(&client->Lock);
 
     if (!ret)
     {
@@ -791,9 +913,7 @@ DWORD QpsGetReadBufferSize(
     if (!client)
         return 0;
 
-    EnterCriticalSection(&client->Lock);
     queuedData = (DWORD)CmqGetUsedSize(client->ReadBuffer);
-    LeaveCriticalSection(&client->Lock);
     QpsReleaseClient(Server, client);
     return queuedData;
 }
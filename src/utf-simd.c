@@ -0,0 +1,890 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (c) Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// No Windows headers here, see utf-simd.h.
+
+#include <string.h>
+
+// UTF_NO_SIMD builds the portable code only (to test and measure it on x86)
+#if (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) && !defined(UTF_NO_SIMD)
+#    include <emmintrin.h>
+#    ifdef _MSC_VER
+#        include <intrin.h>
+#    endif
+#    define UTF_SSE2
+#endif
+
+#include "utf-simd.h"
+
+#define UTF_ASCII_BLOCK 16
+
+#ifdef UTF_SSE2
+// index of the lowest set bit, mask != 0
+static size_t UtfFirstSet(unsigned int mask)
+{
+    unsigned long index;
+
+#    ifdef _MSC_VER
+    _BitScanForward(&index, mask);
+#    else
+    index = (unsigned long) __builtin_ctz(mask);
+#    endif
+    return index;
+}
+#endif
+
+// Copy the longest run of ASCII that fits in the output, 16 characters at a time (the block
+// that ends the run is stored whole, the characters after the run are overwritten later).
+// Returns the number of characters converted.
+static size_t Utf8AsciiRun(const uint8_t *input, size_t inputLength, uint16_t *output, size_t outputSize)
+{
+    size_t count = 0;
+#ifdef UTF_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i block;
+    int mask;
+
+    while (inputLength - count >= UTF_ASCII_BLOCK && outputSize - count >= UTF_ASCII_BLOCK)
+    {
+        block = _mm_loadu_si128((const __m128i *) (input + count));
+        mask = _mm_movemask_epi8(block); // bytes with the top bit set
+
+        // zero-extend bytes to 16-bit units
+        _mm_storeu_si128((__m128i *) (output + count), _mm_unpacklo_epi8(block, zero));
+        _mm_storeu_si128((__m128i *) (output + count + 8), _mm_unpackhi_epi8(block, zero));
+        if (mask != 0)
+        {
+            count += UtfFirstSet((unsigned int) mask);
+            break;
+        }
+        count += UTF_ASCII_BLOCK;
+    }
+#else
+    uint64_t word;
+
+    while (inputLength - count >= 8 && outputSize - count >= 8)
+    {
+        memcpy(&word, input + count, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+            break;
+
+        output[count + 0] = input[count + 0];
+        output[count + 1] = input[count + 1];
+        output[count + 2] = input[count + 2];
+        output[count + 3] = input[count + 3];
+        output[count + 4] = input[count + 4];
+        output[count + 5] = input[count + 5];
+        output[count + 6] = input[count + 6];
+        output[count + 7] = input[count + 7];
+        count += 8;
+    }
+#endif
+    return count;
+}
+
+static size_t Utf16AsciiRun(const uint16_t *input, size_t inputLength, uint8_t *output, size_t outputSize)
+{
+    size_t count = 0;
+#ifdef UTF_SSE2
+    __m128i nonAscii = _mm_set1_epi16((short) 0xFF80);
+    __m128i zero = _mm_setzero_si128();
+    __m128i low, high;
+    int mask;
+
+    while (inputLength - count >= UTF_ASCII_BLOCK && outputSize - count >= UTF_ASCII_BLOCK)
+    {
+        low = _mm_loadu_si128((const __m128i *) (input + count));
+        high = _mm_loadu_si128((const __m128i *) (input + count + 8));
+        // units < 0x80, one bit each (packus alone can't tell, it saturates units >= 0x8000 to 0)
+        mask = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(_mm_and_si128(low, nonAscii), zero),
+                                                 _mm_cmpeq_epi16(_mm_and_si128(high, nonAscii), zero)));
+
+        _mm_storeu_si128((__m128i *) (output + count), _mm_packus_epi16(low, high));
+        if (mask != 0xFFFF)
+        {
+            count += UtfFirstSet(~(unsigned int) mask & 0xFFFF);
+            break;
+        }
+        count += UTF_ASCII_BLOCK;
+    }
+#else
+    uint64_t word1, word2;
+
+    while (inputLength - count >= 8 && outputSize - count >= 8)
+    {
+        memcpy(&word1, input + count, sizeof(word1));
+        memcpy(&word2, input + count + 4, sizeof(word2));
+        if ((word1 | word2) & 0xFF80FF80FF80FF80ULL)
+            break;
+
+        output[count + 0] = (uint8_t) input[count + 0];
+        output[count + 1] = (uint8_t) input[count + 1];
+        output[count + 2] = (uint8_t) input[count + 2];
+        output[count + 3] = (uint8_t) input[count + 3];
+        output[count + 4] = (uint8_t) input[count + 4];
+        output[count + 5] = (uint8_t) input[count + 5];
+        output[count + 6] = (uint8_t) input[count + 6];
+        output[count + 7] = (uint8_t) input[count + 7];
+        count += 8;
+    }
+#endif
+    return count;
+}
+
+// Length of the ASCII prefix, used by the counting passes.
+static size_t Utf8AsciiSpan(const uint8_t *input, size_t inputLength)
+{
+    size_t count = 0;
+#ifdef UTF_SSE2
+    while (inputLength - count >= UTF_ASCII_BLOCK &&
+           _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (input + count))) == 0)
+        count += UTF_ASCII_BLOCK;
+#endif
+    while (count < inputLength && input[count] < 0x80)
+        count++;
+    return count;
+}
+
+static size_t Utf16AsciiSpan(const uint16_t *input, size_t inputLength)
+{
+    size_t count = 0;
+#ifdef UTF_SSE2
+    __m128i nonAscii = _mm_set1_epi16((short) 0xFF80);
+    __m128i zero = _mm_setzero_si128();
+    __m128i units;
+
+    while (inputLength - count >= UTF_ASCII_BLOCK)
+    {
+        units = _mm_or_si128(_mm_loadu_si128((const __m128i *) (input + count)),
+                             _mm_loadu_si128((const __m128i *) (input + count + 8)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, nonAscii), zero)) != 0xFFFF)
+            break;
+        count += UTF_ASCII_BLOCK;
+    }
+#endif
+    while (count < inputLength && input[count] < 0x80)
+        count++;
+    return count;
+}
+
+/*
+ * Runs of 2-byte (U+0080..U+07FF) and 3-byte (U+0800..U+FFFF) characters, 8 at a time with SSE2.
+ * A block decodes or encodes 8 characters of the class of the first one in parallel, validates
+ * all lanes at once and takes the leading lanes that are valid, so a word of Cyrillic or a run
+ * of CJK costs one block and whatever ends it (a space, a 4-byte character, invalid input) goes
+ * through the scalar code. A block is only tried when the second character is of the same
+ * class, so a lone accented letter in ASCII text stays on the scalar path. The run goes on
+ * after a block that stops early: a single ASCII character between two runs (the space between
+ * two words, CJK text with ASCII commas) is copied in the loop instead of going back through
+ * the ASCII loop, longer ASCII ends the run. Lanes after the valid ones may write garbage to
+ * the output after what's taken, the callers only count what's taken.
+ */
+
+#define UTF_MULTI_BLOCK 8
+
+#ifdef UTF_SSE2
+// number of leading 16-bit lanes set in a _mm_movemask_epi8 result
+static size_t UtfLeadingLanes(int mask)
+{
+    unsigned int invalid = ~(unsigned int) mask & 0xFFFF;
+
+    if (invalid == 0)
+        return UTF_MULTI_BLOCK;
+    return UtfFirstSet(invalid) / 2;
+}
+
+static int UtfLoad32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return (int) value;
+}
+
+// Up to 8 two-byte sequences at input[0], 16 bytes readable. Output (if not NULL) needs 8 units.
+static size_t Utf8TwoByteBlock(const uint8_t *input, uint16_t *output)
+{
+    __m128i pairs = _mm_loadu_si128((const __m128i *) input);
+    __m128i lead = _mm_and_si128(pairs, _mm_set1_epi16(0x00FF));
+    __m128i cont = _mm_srli_epi16(pairs, 8);
+    __m128i valid;
+
+    // lead C2..DF (C0 and C1 would be overlong), continuation 80..BF
+    valid = _mm_and_si128(_mm_cmpgt_epi16(lead, _mm_set1_epi16(0xC1)), _mm_cmplt_epi16(lead, _mm_set1_epi16(0xE0)));
+    valid = _mm_and_si128(valid, _mm_cmpeq_epi16(_mm_and_si128(cont, _mm_set1_epi16(0xC0)), _mm_set1_epi16(0x80)));
+
+    if (output)
+    {
+        _mm_storeu_si128((__m128i *) output, _mm_or_si128(_mm_slli_epi16(_mm_and_si128(lead, _mm_set1_epi16(0x1F)), 6),
+                                                          _mm_and_si128(cont, _mm_set1_epi16(0x3F))));
+    }
+    return UtfLeadingLanes(_mm_movemask_epi8(valid));
+}
+
+// Decode 4 three-byte sequences, one per 32-bit lane (4th byte ignored).
+// Returns the code points minus 0x8000 (so they pack to 16 bits without saturating).
+static __m128i Utf8ThreeByteLanes(__m128i bytes, __m128i *valid)
+{
+    __m128i code;
+
+    code = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bytes, _mm_set1_epi32(0x0F)), 12),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(bytes, 2), _mm_set1_epi32(0x0FC0)),
+                                     _mm_and_si128(_mm_srli_epi32(bytes, 16), _mm_set1_epi32(0x3F))));
+
+    // lead E0..EF and two continuation bytes, not overlong (< U+0800), not a surrogate
+    *valid = _mm_cmpeq_epi32(_mm_and_si128(bytes, _mm_set1_epi32(0x00C0C0F0)), _mm_set1_epi32(0x008080E0));
+    *valid = _mm_and_si128(*valid, _mm_cmpgt_epi32(code, _mm_set1_epi32(0x07FF)));
+    *valid = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(code, _mm_set1_epi32(0xF800)), _mm_set1_epi32(0xD800)), *valid);
+    return _mm_sub_epi32(code, _mm_set1_epi32(0x8000));
+}
+
+// Up to 8 three-byte sequences at input[0], 24 bytes readable. Output (if not NULL) needs 8 units.
+static size_t Utf8ThreeByteBlock(const uint8_t *input, uint16_t *output)
+{
+    __m128i low, high, lowValid, highValid;
+
+    // the last load ends at the block's end
+    low = Utf8ThreeByteLanes(_mm_setr_epi32(UtfLoad32(input), UtfLoad32(input + 3), UtfLoad32(input + 6), UtfLoad32(input + 9)),
+                             &lowValid);
+    high = Utf8ThreeByteLanes(_mm_setr_epi32(UtfLoad32(input + 12), UtfLoad32(input + 15), UtfLoad32(input + 18),
+                                             (int) ((uint32_t) UtfLoad32(input + 20) >> 8)),
+                              &highValid);
+
+    if (output)
+    {
+        _mm_storeu_si128((__m128i *) output, _mm_xor_si128(_mm_packs_epi32(low, high), _mm_set1_epi16((short) 0x8000)));
+    }
+    return UtfLeadingLanes(_mm_movemask_epi8(_mm_packs_epi32(lowValid, highValid)));
+}
+
+// Up to 8 units of the class of input[0] (2- or 3-byte), 8 units readable. Writes at most
+// outputSize bytes (output NULL: count only). Returns the units taken, *outputLength the bytes.
+static size_t Utf16MultiByteBlock(const uint16_t *input, uint8_t *output, size_t outputSize, size_t *outputLength)
+{
+    __m128i units = _mm_loadu_si128((const __m128i *) input);
+    __m128i zero = _mm_setzero_si128();
+    __m128i top = _mm_and_si128(units, _mm_set1_epi16((short) 0xF800));
+    __m128i inClass, lead, cont, first, second, third;
+    uint32_t lanes[UTF_MULTI_BLOCK];
+    size_t count, i;
+
+    *outputLength = 0;
+    if (input[0] >= 0x80 && input[0] < 0x800 && input[1] >= 0x80 && input[1] < 0x800)
+    {
+        if (output && outputSize < 2 * UTF_MULTI_BLOCK)
+            return 0;
+
+        // U+0080..U+07FF: top 5 bits clear, not ASCII
+        inClass = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short) 0xFF80)), zero),
+                                   _mm_cmpeq_epi16(top, zero));
+        count = UtfLeadingLanes(_mm_movemask_epi8(inClass));
+        if (output)
+        {
+            lead = _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xC0));
+            cont = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            _mm_storeu_si128((__m128i *) output, _mm_or_si128(lead, _mm_slli_epi16(cont, 8)));
+        }
+        *outputLength = 2 * count;
+        return count;
+    }
+
+    if (input[0] >= 0x800 && (input[0] < 0xD800 || input[0] > 0xDFFF) && input[1] >= 0x800 && (input[1] < 0xD800 || input[1] > 0xDFFF))
+    {
+        // U+0800..U+FFFF: top 5 bits neither clear nor a surrogate
+        inClass = _mm_or_si128(_mm_cmpeq_epi16(top, zero), _mm_cmpeq_epi16(top, _mm_set1_epi16((short) 0xD800)));
+        count = UtfLeadingLanes(_mm_movemask_epi8(inClass) ^ 0xFFFF);
+        if (output)
+        {
+            // every lane is stored as 4 bytes, 3 apart
+            if (outputSize < 3 * count + 1)
+                count = outputSize > 0 ? (outputSize - 1) / 3 : 0;
+
+            first = _mm_or_si128(_mm_srli_epi16(units, 12), _mm_set1_epi16(0xE0));
+            second = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            third = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            first = _mm_or_si128(first, _mm_slli_epi16(second, 8));
+            _mm_storeu_si128((__m128i *) lanes, _mm_unpacklo_epi16(first, third));
+            _mm_storeu_si128((__m128i *) (lanes + 4), _mm_unpackhi_epi16(first, third));
+            for (i = 0; i < count; i++)
+                memcpy(output + 3 * i, &lanes[i], sizeof(lanes[i]));
+        }
+        *outputLength = 3 * count;
+        return count;
+    }
+
+    return 0;
+}
+#endif
+
+// Convert the longest run of 2- and 3-byte sequences that the blocks can take (output NULL:
+// count only). Returns the units written, *inputUsed the bytes taken.
+static size_t Utf8MultiByteRun(const uint8_t *input, size_t inputLength, uint16_t *output, size_t outputSize, size_t *inputUsed)
+{
+    size_t used = 0, count = 0;
+#ifdef UTF_SSE2
+    size_t units, bytes;
+    uint8_t lead;
+
+    while (!output || outputSize - count >= UTF_MULTI_BLOCK)
+    {
+        lead = input[used];
+        if (lead < 0x80)
+        {
+            // one ASCII character between two runs
+            if (used + 1 == inputLength || input[used + 1] < 0x80)
+                break;
+            if (output)
+                output[count] = lead;
+            units = 1;
+            bytes = 1;
+        }
+        else if (lead >= 0xC2 && lead <= 0xDF && inputLength - used >= 2 * UTF_MULTI_BLOCK && (input[used + 2] & 0xE0) == 0xC0)
+        {
+            units = Utf8TwoByteBlock(input + used, output ? output + count : NULL);
+            bytes = 2 * units;
+        }
+        else if (lead >= 0xE0 && lead <= 0xEF && inputLength - used >= 3 * UTF_MULTI_BLOCK && (input[used + 3] & 0xF0) == 0xE0)
+        {
+            units = Utf8ThreeByteBlock(input + used, output ? output + count : NULL);
+            bytes = 3 * units;
+        }
+        else
+        {
+            break;
+        }
+
+        if (units == 0)
+            break;
+        count += units;
+        used += bytes;
+        if (used == inputLength)
+            break;
+    }
+#else
+    (void) input;
+    (void) inputLength;
+    (void) output;
+    (void) outputSize;
+#endif
+    *inputUsed = used;
+    return count;
+}
+
+// Returns the units taken, *outputLength the bytes written (or counted if output is NULL).
+static size_t Utf16MultiByteRun(const uint16_t *input, size_t inputLength, uint8_t *output, size_t outputSize, size_t *outputLength)
+{
+    size_t count = 0, written = 0;
+#ifdef UTF_SSE2
+    size_t units, bytes;
+
+    while (inputLength - count >= UTF_MULTI_BLOCK)
+    {
+        if (input[count] < 0x80)
+        {
+            // one ASCII character between two runs
+            if (input[count + 1] < 0x80 || (output && written == outputSize))
+                break;
+            if (output)
+                output[written] = (uint8_t) input[count];
+            units = 1;
+            bytes = 1;
+        }
+        else
+        {
+            units = Utf16MultiByteBlock(input + count, output ? output + written : NULL, outputSize - written, &bytes);
+            if (units == 0)
+                break;
+        }
+        count += units;
+        written += bytes;
+    }
+#else
+    (void) input;
+    (void) inputLength;
+    (void) output;
+    (void) outputSize;
+#endif
+    *outputLength = written;
+    return count;
+}
+
+#define UTF8_INCOMPLETE ((size_t) -1)
+
+// Decode one multi-byte sequence starting at input[0] (>= 0x80), Unicode table 3-7.
+// Returns the sequence length and the code point, 0 if the sequence is malformed,
+// UTF8_INCOMPLETE if the input ends with a valid prefix of a sequence.
+static size_t Utf8DecodeSequence(const uint8_t *input, size_t inputLength, uint32_t *codePoint)
+{
+    uint8_t lead = input[0];
+    uint8_t secondMin = 0x80, secondMax = 0xBF; // valid range of the second byte
+    size_t length, i;
+    uint32_t value;
+
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        length = 2;
+        value = lead & 0x1F;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF)
+    {
+        length = 3;
+        value = lead & 0x0F;
+        if (lead == 0xE0)
+            secondMin = 0xA0; // overlong
+        else if (lead == 0xED)
+            secondMax = 0x9F; // surrogates
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        length = 4;
+        value = lead & 0x07;
+        if (lead == 0xF0)
+            secondMin = 0x90; // overlong
+        else if (lead == 0xF4)
+            secondMax = 0x8F; // above U+10FFFF
+    }
+    else
+    {
+        return 0; // continuation byte, overlong 2-byte lead or out of range
+    }
+
+    if (inputLength < 2)
+        return UTF8_INCOMPLETE;
+
+    if (input[1] < secondMin || input[1] > secondMax)
+        return 0;
+
+    value = (value << 6) | (input[1] & 0x3F);
+    for (i = 2; i < length; i++)
+    {
+        if (i == inputLength)
+            return UTF8_INCOMPLETE;
+        if ((input[i] & 0xC0) != 0x80)
+            return 0;
+        value = (value << 6) | (input[i] & 0x3F);
+    }
+
+    *codePoint = value;
+    return length;
+}
+
+// Length of the maximal subpart of an ill-formed sequence at input[0]: the longest valid prefix
+// of a sequence, at least 1. Lossy conversion replaces each one with a single U+FFFD (Unicode 3.9).
+static size_t Utf8InvalidLength(const uint8_t *input, size_t inputLength)
+{
+    uint32_t codePoint;
+    size_t length = 1;
+
+    // valid prefixes decode as incomplete
+    while (length < 3 && length < inputLength && Utf8DecodeSequence(input, length + 1, &codePoint) == UTF8_INCOMPLETE)
+        length++;
+
+    return length;
+}
+
+// Convert until the end of input, full output or an error. *inputUsed is where it stopped.
+// With allowIncomplete a truncated sequence at the end of the input isn't an error, conversion
+// stops before it (see Utf8DecoderConvert). With replacements (lossy mode) invalid input
+// is converted to U+FFFD and counted instead.
+static UTF_STATUS Utf8ToUtf16Core(const uint8_t *in, size_t inputLength, uint16_t *output, size_t outputSize,
+                                  int allowIncomplete, size_t *inputUsed, size_t *outputLength, size_t *replacements)
+{
+    size_t inPos = 0, outPos = 0;
+    size_t run, used, length;
+    size_t replaced = 0, invalid;
+    uint32_t codePoint;
+    UTF_STATUS status = UTF_OK;
+
+    while (inPos < inputLength)
+    {
+        run = Utf8AsciiRun(in + inPos, inputLength - inPos, output + outPos, outputSize - outPos);
+        inPos += run;
+        outPos += run;
+        if (inPos == inputLength)
+            break;
+
+        if (in[inPos] < 0x80)
+        {
+            if (outPos == outputSize)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            output[outPos++] = in[inPos++];
+            continue;
+        }
+
+        run = Utf8MultiByteRun(in + inPos, inputLength - inPos, output + outPos, outputSize - outPos, &used);
+        if (run > 0)
+        {
+            inPos += used;
+            outPos += run;
+            continue;
+        }
+
+        length = Utf8DecodeSequence(in + inPos, inputLength - inPos, &codePoint);
+        if (length == UTF8_INCOMPLETE && allowIncomplete)
+            break;
+
+        invalid = (length == 0 || length == UTF8_INCOMPLETE);
+        if (invalid)
+        {
+            if (!replacements)
+            {
+                status = UTF_INVALID_INPUT;
+                break;
+            }
+            length = Utf8InvalidLength(in + inPos, inputLength - inPos);
+            codePoint = 0xFFFD;
+        }
+
+        if (codePoint < 0x10000)
+        {
+            if (outPos == outputSize)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            output[outPos++] = (uint16_t) codePoint;
+        }
+        else
+        {
+            if (outputSize - outPos < 2)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            codePoint -= 0x10000;
+            output[outPos++] = (uint16_t) (0xD800 | (codePoint >> 10));
+            output[outPos++] = (uint16_t) (0xDC00 | (codePoint & 0x3FF));
+        }
+        inPos += length;
+        replaced += invalid;
+    }
+
+    if (replacements)
+        *replacements = replaced;
+    *inputUsed = inPos;
+    *outputLength = outPos;
+    return status;
+}
+
+UTF_STATUS Utf8ToUtf16(const char *input, size_t inputLength, uint16_t *output, size_t outputSize, size_t *outputLength)
+{
+    size_t inputUsed;
+
+    return Utf8ToUtf16Core((const uint8_t *) input, inputLength, output, outputSize, 0, &inputUsed, outputLength, NULL);
+}
+
+UTF_STATUS Utf8ToUtf16Lossy(const char *input, size_t inputLength, uint16_t *output, size_t outputSize, size_t *outputLength,
+                            size_t *replacements)
+{
+    size_t inputUsed;
+
+    return Utf8ToUtf16Core((const uint8_t *) input, inputLength, output, outputSize, 0, &inputUsed, outputLength, replacements);
+}
+
+// Replacements: see Utf8ToUtf16Core.
+static UTF_STATUS Utf16ToUtf8Core(const uint16_t *input, size_t inputLength, char *output, size_t outputSize,
+                                  size_t *outputLength, size_t *replacements)
+{
+    uint8_t *out = (uint8_t *) output;
+    size_t inPos = 0, outPos = 0;
+    size_t run, written, length;
+    size_t replaced = 0, invalid;
+    uint32_t codePoint;
+    UTF_STATUS status = UTF_OK;
+
+    while (inPos < inputLength)
+    {
+        run = Utf16AsciiRun(input + inPos, inputLength - inPos, out + outPos, outputSize - outPos);
+        inPos += run;
+        outPos += run;
+        if (inPos == inputLength)
+            break;
+
+        run = Utf16MultiByteRun(input + inPos, inputLength - inPos, out + outPos, outputSize - outPos, &written);
+        if (run > 0)
+        {
+            inPos += run;
+            outPos += written;
+            continue;
+        }
+
+        codePoint = input[inPos];
+        length = 1;
+        invalid = 0;
+        if (codePoint >= 0xD800 && codePoint <= 0xDFFF)
+        {
+            // high surrogate followed by a low one
+            if (codePoint > 0xDBFF || inputLength - inPos < 2 || input[inPos + 1] < 0xDC00 || input[inPos + 1] > 0xDFFF)
+            {
+                if (!replacements)
+                {
+                    status = UTF_INVALID_INPUT;
+                    break;
+                }
+                codePoint = 0xFFFD; // unpaired surrogate
+                invalid = 1;
+            }
+            else
+            {
+                codePoint = 0x10000 + (((codePoint & 0x3FF) << 10) | (input[inPos + 1] & 0x3FF));
+                length = 2;
+            }
+        }
+
+        if (codePoint < 0x80)
+        {
+            if (outputSize - outPos < 1)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            out[outPos++] = (uint8_t) codePoint;
+        }
+        else if (codePoint < 0x800)
+        {
+            if (outputSize - outPos < 2)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            out[outPos++] = (uint8_t) (0xC0 | (codePoint >> 6));
+            out[outPos++] = (uint8_t) (0x80 | (codePoint & 0x3F));
+        }
+        else if (codePoint < 0x10000)
+        {
+            if (outputSize - outPos < 3)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            out[outPos++] = (uint8_t) (0xE0 | (codePoint >> 12));
+            out[outPos++] = (uint8_t) (0x80 | ((codePoint >> 6) & 0x3F));
+            out[outPos++] = (uint8_t) (0x80 | (codePoint & 0x3F));
+        }
+        else
+        {
+            if (outputSize - outPos < 4)
+            {
+                status = UTF_BUFFER_TOO_SMALL;
+                break;
+            }
+            out[outPos++] = (uint8_t) (0xF0 | (codePoint >> 18));
+            out[outPos++] = (uint8_t) (0x80 | ((codePoint >> 12) & 0x3F));
+            out[outPos++] = (uint8_t) (0x80 | ((codePoint >> 6) & 0x3F));
+            out[outPos++] = (uint8_t) (0x80 | (codePoint & 0x3F));
+        }
+        inPos += length;
+        replaced += invalid;
+    }
+
+    if (replacements)
+        *replacements = replaced;
+    *outputLength = outPos;
+    return status;
+}
+
+UTF_STATUS Utf16ToUtf8(const uint16_t *input, size_t inputLength, char *output, size_t outputSize, size_t *outputLength)
+{
+    return Utf16ToUtf8Core(input, inputLength, output, outputSize, outputLength, NULL);
+}
+
+UTF_STATUS Utf16ToUtf8Lossy(const uint16_t *input, size_t inputLength, char *output, size_t outputSize, size_t *outputLength,
+                            size_t *replacements)
+{
+    return Utf16ToUtf8Core(input, inputLength, output, outputSize, outputLength, replacements);
+}
+
+UTF_STATUS Utf8ToUtf16Length(const char *input, size_t inputLength, size_t *outputLength)
+{
+    const uint8_t *in = (const uint8_t *) input;
+    size_t inPos = 0, count = 0;
+    size_t run, used, length;
+    uint32_t codePoint;
+    UTF_STATUS status = UTF_OK;
+
+    while (inPos < inputLength)
+    {
+        run = Utf8AsciiSpan(in + inPos, inputLength - inPos);
+        inPos += run;
+        count += run;
+        if (inPos == inputLength)
+            break;
+
+        run = Utf8MultiByteRun(in + inPos, inputLength - inPos, NULL, 0, &used);
+        if (run > 0)
+        {
+            inPos += used;
+            count += run;
+            continue;
+        }
+
+        length = Utf8DecodeSequence(in + inPos, inputLength - inPos, &codePoint);
+        if (length == 0 || length == UTF8_INCOMPLETE)
+        {
+            status = UTF_INVALID_INPUT;
+            break;
+        }
+
+        count += (codePoint < 0x10000) ? 1 : 2; // surrogate pair
+        inPos += length;
+    }
+
+    *outputLength = count;
+    return status;
+}
+
+UTF_STATUS Utf16ToUtf8Length(const uint16_t *input, size_t inputLength, size_t *outputLength)
+{
+    size_t inPos = 0, count = 0;
+    size_t run, bytes;
+    uint16_t unit;
+    UTF_STATUS status = UTF_OK;
+
+    while (inPos < inputLength)
+    {
+        run = Utf16AsciiSpan(input + inPos, inputLength - inPos);
+        inPos += run;
+        count += run;
+        if (inPos == inputLength)
+            break;
+
+        run = Utf16MultiByteRun(input + inPos, inputLength - inPos, NULL, 0, &bytes);
+        if (run > 0)
+        {
+            inPos += run;
+            count += bytes;
+            continue;
+        }
+
+        unit = input[inPos];
+        if (unit < 0x800)
+        {
+            count += 2;
+            inPos++;
+        }
+        else if (unit < 0xD800 || unit > 0xDFFF)
+        {
+            count += 3;
+            inPos++;
+        }
+        else if (unit <= 0xDBFF && inputLength - inPos >= 2 && input[inPos + 1] >= 0xDC00 && input[inPos + 1] <= 0xDFFF)
+        {
+            count += 4;
+            inPos += 2;
+        }
+        else
+        {
+            status = UTF_INVALID_INPUT;
+            break;
+        }
+    }
+
+    *outputLength = count;
+    return status;
+}
+
+void Utf8DecoderInit(UTF8_DECODER *decoder)
+{
+    decoder->PendingLength = 0;
+}
+
+UTF_STATUS Utf8DecoderConvert(UTF8_DECODER *decoder, const char *input, size_t inputLength,
+                              uint16_t *output, size_t outputSize, size_t *inputUsed, size_t *outputLength)
+{
+    const uint8_t *in = (const uint8_t *) input;
+    uint8_t sequence[4];
+    size_t take, length, used, written;
+    size_t inPos = 0, outPos = 0;
+    uint32_t codePoint;
+    UTF_STATUS status = UTF_OK;
+
+    // finish the sequence split by the previous chunk
+    if (decoder->PendingLength > 0)
+    {
+        take = sizeof(sequence) - decoder->PendingLength;
+        if (take > inputLength)
+            take = inputLength;
+        memcpy(sequence, decoder->Pending, decoder->PendingLength);
+        memcpy(sequence + decoder->PendingLength, in, take);
+
+        length = Utf8DecodeSequence(sequence, decoder->PendingLength + take, &codePoint);
+        if (length == UTF8_INCOMPLETE) // still not complete, this chunk was too short
+        {
+            memcpy(decoder->Pending + decoder->PendingLength, in, take);
+            decoder->PendingLength += (uint8_t) take;
+            inPos = take;
+            goto end;
+        }
+
+        if (length == 0)
+        {
+            status = UTF_INVALID_INPUT;
+            goto end;
+        }
+
+        if (outputSize < ((codePoint < 0x10000) ? 1u : 2u))
+        {
+            status = UTF_BUFFER_TOO_SMALL;
+            goto end;
+        }
+
+        if (codePoint < 0x10000)
+        {
+            output[outPos++] = (uint16_t) codePoint;
+        }
+        else
+        {
+            codePoint -= 0x10000;
+            output[outPos++] = (uint16_t) (0xD800 | (codePoint >> 10));
+            output[outPos++] = (uint16_t) (0xDC00 | (codePoint & 0x3FF));
+        }
+        inPos = length - decoder->PendingLength;
+        decoder->PendingLength = 0;
+    }
+
+    status = Utf8ToUtf16Core(in + inPos, inputLength - inPos, output + outPos, outputSize - outPos, 1, &used, &written, NULL);
+    inPos += used;
+    outPos += written;
+
+    // keep a truncated sequence at the end for the next chunk (it's shorter than 4 bytes)
+    if (status == UTF_OK && inPos < inputLength)
+    {
+        decoder->PendingLength = (uint8_t) (inputLength - inPos);
+        memcpy(decoder->Pending, in + inPos, decoder->PendingLength);
+        inPos = inputLength;
+    }
+
+end:
+    *inputUsed = inPos;
+    *outputLength = outPos;
+    return status;
+}
+
+UTF_STATUS Utf8DecoderFinish(UTF8_DECODER *decoder)
+{
+    UTF_STATUS status = (decoder->PendingLength > 0) ? UTF_INVALID_INPUT : UTF_OK;
+
+    decoder->PendingLength = 0;
+    return status;
+}
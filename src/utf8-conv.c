@@ -21,21 +21,222 @@
 
 #include <windows.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "utf8-conv.h"
 
-static char* g_Buffer = NULL;
-static WCHAR* g_BufferW = NULL;
+// Same error codes as MultiByteToWideChar/WideCharToMultiByte, also set as the last error
+// since callers may check GetLastError().
+static DWORD UtfStatusToWin32(UTF_STATUS utfStatus)
+{
+    DWORD status;
 
-DWORD ConvertUTF8ToUTF16(IN const char* inputUtf8, OUT WCHAR* outputUtf16, OUT size_t* cchOutput OPTIONAL)
+    switch (utfStatus)
+    {
+    case UTF_OK:
+        return ERROR_SUCCESS;
+    case UTF_INVALID_INPUT:
+        status = ERROR_NO_UNICODE_TRANSLATION;
+        break;
+    default:
+        status = ERROR_INSUFFICIENT_BUFFER;
+        break;
+    }
+
+    SetLastError(status);
+    return status;
+}
+
+DWORD ConvertUTF8ToUTF16Ex(IN const char *inputUtf8, IN size_t cchInput, OUT WCHAR *outputUtf16, IN size_t cchOutputSize,
+                           OUT size_t *cchOutput OPTIONAL)
+{
+    DWORD status;
+    size_t utf16_count;
+
+    status = UtfStatusToWin32(Utf8ToUtf16(inputUtf8, cchInput, (uint16_t*) outputUtf16, cchOutputSize, &utf16_count));
+    if (cchOutput)
+        *cchOutput = (status == ERROR_SUCCESS) ? utf16_count : 0;
+    return status;
+}
+
+DWORD ConvertUTF16ToUTF8Ex(IN const WCHAR *inputUtf16, IN size_t cchInput, OUT char *outputUtf8, IN size_t cchOutputSize,
+                           OUT size_t *cchOutput OPTIONAL)
+{
+    DWORD status;
+    size_t utf8_count;
+
+    status = UtfStatusToWin32(Utf16ToUtf8((const uint16_t*) inputUtf16, cchInput, outputUtf8, cchOutputSize, &utf8_count));
+    if (cchOutput)
+        *cchOutput = (status == ERROR_SUCCESS) ? utf8_count : 0;
+    return status;
+}
+
+DWORD ConvertUTF8ToUTF16Lossy(IN const char *inputUtf8, IN size_t cchInput, OUT WCHAR *outputUtf16, IN size_t cchOutputSize,
+                              OUT size_t *cchOutput OPTIONAL, OUT size_t *cReplacements OPTIONAL)
+{
+    DWORD status;
+    size_t utf16_count, replacements;
+
+    status = UtfStatusToWin32(Utf8ToUtf16Lossy(inputUtf8, cchInput, (uint16_t*) outputUtf16, cchOutputSize, &utf16_count,
+                                               &replacements));
+    if (cchOutput)
+        *cchOutput = (status == ERROR_SUCCESS) ? utf16_count : 0;
+    if (cReplacements)
+        *cReplacements = (status == ERROR_SUCCESS) ? replacements : 0;
+    return status;
+}
+
+DWORD ConvertUTF16ToUTF8Lossy(IN const WCHAR *inputUtf16, IN size_t cchInput, OUT char *outputUtf8, IN size_t cchOutputSize,
+                              OUT size_t *cchOutput OPTIONAL, OUT size_t *cReplacements OPTIONAL)
+{
+    DWORD status;
+    size_t utf8_count, replacements;
+
+    status = UtfStatusToWin32(Utf16ToUtf8Lossy((const uint16_t*) inputUtf16, cchInput, outputUtf8, cchOutputSize, &utf8_count,
+                                               &replacements));
+    if (cchOutput)
+        *cchOutput = (status == ERROR_SUCCESS) ? utf8_count : 0;
+    if (cReplacements)
+        *cReplacements = (status == ERROR_SUCCESS) ? replacements : 0;
+    return status;
+}
+
+DWORD ConvertUTF8ToUTF16Alloc(IN const char *inputUtf8, IN size_t cchInput, OUT WCHAR **outputUtf16, OUT size_t *cchOutput OPTIONAL)
+{
+    DWORD status;
+    size_t utf16_count;
+
+    *outputUtf16 = NULL;
+    if (cchOutput)
+        *cchOutput = 0;
+
+    status = UtfStatusToWin32(Utf8ToUtf16Length(inputUtf8, cchInput, &utf16_count));
+    if (status != ERROR_SUCCESS)
+        goto end;
+
+    *outputUtf16 = (WCHAR*) malloc((utf16_count + 1) * sizeof(WCHAR));
+    if (!*outputUtf16)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto end;
+    }
+
+    // already validated, can't fail
+    Utf8ToUtf16(inputUtf8, cchInput, (uint16_t*) *outputUtf16, utf16_count, &utf16_count);
+    (*outputUtf16)[utf16_count] = L'\0';
+    if (cchOutput)
+        *cchOutput = utf16_count;
+
+end:
+    return status;
+}
+
+DWORD ConvertUTF16ToUTF8Alloc(IN const WCHAR *inputUtf16, IN size_t cchInput, OUT char **outputUtf8, OUT size_t *cchOutput OPTIONAL)
+{
+    DWORD status;
+    size_t utf8_count;
+
+    *outputUtf8 = NULL;
+    if (cchOutput)
+        *cchOutput = 0;
+
+    status = UtfStatusToWin32(Utf16ToUtf8Length((const uint16_t*) inputUtf16, cchInput, &utf8_count));
+    if (status != ERROR_SUCCESS)
+        goto end;
+
+    *outputUtf8 = (char*) malloc(utf8_count + 1);
+    if (!*outputUtf8)
+    {
+        status = ERROR_OUTOFMEMORY;
+        goto end;
+    }
+
+    // already validated, can't fail
+    Utf16ToUtf8((const uint16_t*) inputUtf16, cchInput, *outputUtf8, utf8_count, &utf8_count);
+    (*outputUtf8)[utf8_count] = '\0';
+    if (cchOutput)
+        *cchOutput = utf8_count;
+
+end:
+    return status;
+}
+
+DWORD ConvertUTF8ToUTF16Chunk(IN OUT UTF8_DECODER *decoder, IN const char *inputUtf8, IN size_t cchInput,
+                              OUT WCHAR *outputUtf16, IN size_t cchOutputSize, OUT size_t *cchInputUsed, OUT size_t *cchOutput)
+{
+    return UtfStatusToWin32(Utf8DecoderConvert(decoder, inputUtf8, cchInput, (uint16_t*) outputUtf16, cchOutputSize,
+                                               cchInputUsed, cchOutput));
+}
+
+// Characters are converted into a stack buffer and copied to the reserved queue space:
+// a UTF-16 character may straddle the two spans.
+#define CMQ_CONVERT_CHUNK 1024
+
+DWORD ConvertUTF8ToUTF16Cmq(IN OUT UTF8_DECODER *decoder, IN const char *inputUtf8, IN size_t cchInput,
+                            IN CMQ_BUFFER *output, OUT size_t *cchInputUsed)
 {
+    WCHAR chunk[CMQ_CONVERT_CHUNK];
+    CMQ_SPAN spans[2];
+    UINT64 reserved;
+    size_t inputPos = 0;
+    size_t used, utf16_count, firstSize;
+    UTF_STATUS utfStatus = UTF_OK;
     DWORD status = ERROR_SUCCESS;
 
-    int utf16_count = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, inputUtf8, -1, outputUtf16,
-        CONVERT_MAX_BUFFER_LENGTH);
-    if (utf16_count == 0)
+    while (inputPos < cchInput)
+    {
+        reserved = CmqReserve(output, sizeof(chunk), spans);
+        if (reserved < sizeof(WCHAR))
+        {
+            status = UtfStatusToWin32(UTF_BUFFER_TOO_SMALL);
+            break;
+        }
+
+        utfStatus = Utf8DecoderConvert(decoder, inputUtf8 + inputPos, cchInput - inputPos,
+                                       (uint16_t*) chunk, (size_t) reserved / sizeof(WCHAR), &used, &utf16_count);
+        inputPos += used;
+
+        if (utf16_count > 0)
+        {
+            firstSize = min((size_t) spans[0].Size, utf16_count * sizeof(WCHAR));
+            memcpy(spans[0].Data, chunk, firstSize);
+            if (firstSize < utf16_count * sizeof(WCHAR))
+                memcpy(spans[1].Data, (BYTE*) chunk + firstSize, utf16_count * sizeof(WCHAR) - firstSize);
+            CmqCommit(output, utf16_count * sizeof(WCHAR));
+        }
+
+        // no progress: a surrogate pair doesn't fit
+        if (utfStatus == UTF_BUFFER_TOO_SMALL && utf16_count == 0)
+        {
+            status = UtfStatusToWin32(utfStatus);
+            break;
+        }
+
+        if (utfStatus == UTF_INVALID_INPUT)
+        {
+            status = UtfStatusToWin32(utfStatus);
+            break;
+        }
+    }
+
+    *cchInputUsed = inputPos;
+    return status;
+}
+
+DWORD ConvertUTF8ToUTF16Finish(IN OUT UTF8_DECODER *decoder)
+{
+    return UtfStatusToWin32(Utf8DecoderFinish(decoder));
+}
+
+DWORD ConvertUTF8ToUTF16(IN const char* inputUtf8, OUT WCHAR* outputUtf16, OUT size_t* cchOutput OPTIONAL)
+{
+    DWORD status;
+    size_t utf16_count;
+
+    // including the terminating NULL character
+    status = ConvertUTF8ToUTF16Ex(inputUtf8, strlen(inputUtf8) + 1, outputUtf16, CONVERT_MAX_BUFFER_LENGTH, &utf16_count);
+    if (status != ERROR_SUCCESS)
     {
-        status = GetLastError();
         if (cchOutput)
             *cchOutput = 0;
         goto end;
@@ -50,13 +251,12 @@ end:
 
 DWORD ConvertUTF16ToUTF8(IN const WCHAR* inputUtf16, OUT char* outputUtf8, OUT size_t* cchOutput OPTIONAL)
 {
-    DWORD status = ERROR_SUCCESS;
+    DWORD status;
+    size_t utf8_count;
 
-    int utf8_count = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, inputUtf16, -1, outputUtf8,
-        CONVERT_MAX_BUFFER_LENGTH, NULL, NULL);
-    if (utf8_count == 0)
+    status = ConvertUTF16ToUTF8Ex(inputUtf16, wcslen(inputUtf16) + 1, outputUtf8, CONVERT_MAX_BUFFER_LENGTH, &utf8_count);
+    if (status != ERROR_SUCCESS)
     {
-        status = GetLastError();
         if (cchOutput)
             *cchOutput = 0;
         goto end;
@@ -69,23 +269,51 @@ end:
     return status;
 }
 
-DWORD ConvertUTF8ToUTF16Static(IN const char *inputUtf8, OUT WCHAR **outputUtf16, OUT size_t *cchOutput OPTIONAL)
+// Lazily allocated output buffers, one per converter.
+struct _UTF_CONVERTER
+{
+    char *Buffer;
+    WCHAR *BufferW;
+};
+
+// Per-thread converters for the *Static functions. Fiber local storage because its callback
+// frees the converter when a thread exits (the DLL doesn't get DLL_THREAD_DETACH).
+static INIT_ONCE g_ThreadConverterInit = INIT_ONCE_STATIC_INIT;
+static DWORD g_ThreadConverterIndex = FLS_OUT_OF_INDEXES;
+
+UTF_CONVERTER *UtfConverterCreate(void)
+{
+    return (UTF_CONVERTER*) calloc(1, sizeof(UTF_CONVERTER));
+}
+
+void UtfConverterDestroy(IN UTF_CONVERTER *converter OPTIONAL)
+{
+    if (!converter)
+        return;
+
+    free(converter->Buffer);
+    free(converter->BufferW);
+    free(converter);
+}
+
+DWORD ConvertUTF8ToUTF16Context(IN UTF_CONVERTER *converter, IN const char *inputUtf8, OUT WCHAR **outputUtf16,
+                                OUT size_t *cchOutput OPTIONAL)
 {
     DWORD status = ERROR_SUCCESS;
 
-    if (!g_BufferW)
+    if (!converter->BufferW)
     {
-        g_BufferW = (WCHAR*) malloc(CONVERT_MAX_BUFFER_SIZE_UTF16);
-        if (!g_BufferW)
+        converter->BufferW = (WCHAR*) malloc(CONVERT_MAX_BUFFER_SIZE_UTF16);
+        if (!converter->BufferW)
         {
             status = ERROR_OUTOFMEMORY;
             goto end;
         }
     }
 
-    status = ConvertUTF8ToUTF16(inputUtf8, g_BufferW, cchOutput);
+    status = ConvertUTF8ToUTF16(inputUtf8, converter->BufferW, cchOutput);
     if (status == ERROR_SUCCESS)
-        *outputUtf16 = g_BufferW;
+        *outputUtf16 = converter->BufferW;
     else
         *outputUtf16 = NULL;
 
@@ -93,26 +321,105 @@ end:
     return status;
 }
 
-DWORD ConvertUTF16ToUTF8Static(IN const WCHAR *inputUtf16, OUT char **outputUtf8, OUT size_t *cchOutput OPTIONAL)
+DWORD ConvertUTF16ToUTF8Context(IN UTF_CONVERTER *converter, IN const WCHAR *inputUtf16, OUT char **outputUtf8,
+                                OUT size_t *cchOutput OPTIONAL)
 {
     DWORD status = ERROR_SUCCESS;
 
-    if (!g_Buffer)
+    if (!converter->Buffer)
     {
-        g_Buffer = (char*) malloc(CONVERT_MAX_BUFFER_SIZE_UTF8);
-        if (!g_Buffer)
+        converter->Buffer = (char*) malloc(CONVERT_MAX_BUFFER_SIZE_UTF8);
+        if (!converter->Buffer)
         {
             status = ERROR_OUTOFMEMORY;
             goto end;
         }
     }
 
-    status = ConvertUTF16ToUTF8(inputUtf16, g_Buffer, cchOutput);
+    status = ConvertUTF16ToUTF8(inputUtf16, converter->Buffer, cchOutput);
     if (status == ERROR_SUCCESS)
-        *outputUtf8 = g_Buffer;
+        *outputUtf8 = converter->Buffer;
     else
         *outputUtf8 = NULL;
 
 end:
     return status;
 }
+
+static VOID WINAPI ThreadConverterFree(PVOID converter)
+{
+    UtfConverterDestroy((UTF_CONVERTER*) converter);
+}
+
+static BOOL CALLBACK ThreadConverterInit(PINIT_ONCE initOnce, PVOID parameter, PVOID *context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+
+    g_ThreadConverterIndex = FlsAlloc(ThreadConverterFree);
+    return g_ThreadConverterIndex != FLS_OUT_OF_INDEXES;
+}
+
+// Converter of the calling thread, created on first use.
+static UTF_CONVERTER *GetThreadConverter(void)
+{
+    UTF_CONVERTER *converter;
+
+    if (!InitOnceExecuteOnce(&g_ThreadConverterInit, ThreadConverterInit, NULL, NULL))
+        return NULL;
+
+    converter = (UTF_CONVERTER*) FlsGetValue(g_ThreadConverterIndex);
+    if (converter)
+        return converter;
+
+    converter = UtfConverterCreate();
+    if (!converter)
+        return NULL;
+
+    if (!FlsSetValue(g_ThreadConverterIndex, converter))
+    {
+        UtfConverterDestroy(converter);
+        return NULL;
+    }
+
+    return converter;
+}
+
+// Called from DllMain on DLL_PROCESS_DETACH: the FLS callback lives in this module,
+// so the index must be released before the module is unloaded.
+void ThreadConvertersFree(void)
+{
+    if (g_ThreadConverterIndex == FLS_OUT_OF_INDEXES)
+        return;
+
+    // runs ThreadConverterFree for every thread that still holds a converter
+    FlsFree(g_ThreadConverterIndex);
+    g_ThreadConverterIndex = FLS_OUT_OF_INDEXES;
+}
+
+DWORD ConvertUTF8ToUTF16Static(IN const char *inputUtf8, OUT WCHAR **outputUtf16, OUT size_t *cchOutput OPTIONAL)
+{
+    UTF_CONVERTER *converter = GetThreadConverter();
+
+    if (!converter)
+    {
+        *outputUtf16 = NULL;
+        return ERROR_OUTOFMEMORY;
+    }
+
+    return ConvertUTF8ToUTF16Context(converter, inputUtf8, outputUtf16, cchOutput);
+}
+
+DWORD ConvertUTF16ToUTF8Static(IN const WCHAR *inputUtf16, OUT char **outputUtf8, OUT size_t *cchOutput OPTIONAL)
+{
+    UTF_CONVERTER *converter = GetThreadConverter();
+
+    if (!converter)
+    {
+        *outputUtf8 = NULL;
+        return ERROR_OUTOFMEMORY;
+    }
+
+    return ConvertUTF16ToUTF8Context(converter, inputUtf16, outputUtf8, cchOutput);
+}